@@ -24,6 +24,7 @@
 #include "freertos/event_groups.h"
 #include "esp_log.h"
 #include <string.h>
+#include <ctype.h>
 #include "driver/twai.h"
 #include "esp_timer.h"
 #include "esp_system.h" 
@@ -32,6 +33,7 @@
 #include "autopid.h"
 #include "expression_parser.h"
 #include "mqtt.h"
+#include "mqtt_lvc.h"
 #include "cJSON.h"
 #include "config_server.h"
 #include "autopid.h"
@@ -49,13 +51,14 @@
 #define ECU_CONNECTED_BIT			        BIT0
 #define AUTOPID_POLLING_DISABLED_BIT	    BIT1
 #define AUTOPID_REQUEST_BIT			        BIT2
+#define AUTOPID_MAX_MSGS                    16
 
-static char auto_pid_buf[BUFFER_SIZE];
 static QueueHandle_t autopidQueue;
 static char* device_id;
 static EventGroupHandle_t xautopid_event_group = NULL;
 static all_pids_t* all_pids = NULL;
 static response_t elm327_response;
+static pid_type_t autopid_prev_pid_type = PID_MAX;
 static autopid_value_t *autopid_values = NULL;
 static uint32_t autopid_values_count = 0;
 static SemaphoreHandle_t autopid_values_mutex = NULL;
@@ -193,19 +196,159 @@ static esp_err_t extract_signal_value(const uint8_t* data,
     return ESP_OK;
 }
 
-static void merge_response_frames(uint8_t* data, uint32_t length, uint8_t* merged_frame) {
-    // Initialize merged frame with first 7 bytes
-    for(int i = 0; i < 7; i++) {
-        merged_frame[i] = data[i];
+// Reassembled responses of the last native request, kept while the caller
+// holds elm327_lock()
+static uint8_t autopid_rx_buf[BUFFER_SIZE];
+static elm327_msg_t autopid_msgs[AUTOPID_MAX_MSGS];
+static int autopid_msg_count = 0;
+
+// Lays a message out the way the ELM327 text path printed its frames, the
+// PCI byte in front of each frame's data. Custom PID expressions index into
+// this layout. Returns the bytes written, whole frames only.
+static uint32_t autopid_frame_layout(const elm327_msg_t *msg, uint8_t *out, uint32_t size)
+{
+    uint32_t k = 0;
+    uint16_t pos = 0;
+    uint8_t sn = 1;
+
+    if (msg->length <= 7)
+    {
+        if (1 + msg->length > size)
+        {
+            return 0;
+        }
+        out[k++] = msg->length;
+        memcpy(&out[k], msg->data, msg->length);
+        return k + msg->length;
     }
-    
-    // Process subsequent frames
-    for(int frame = 7; frame < length; frame += 7) {
-        // Perform bitwise OR for each byte position
-        for(int byte = 0; byte < 7 && (frame + byte) < length; byte++) {
-            merged_frame[byte] |= data[frame + byte];
+
+    if (size < 8)
+    {
+        return 0;
+    }
+    out[k++] = 0x10 | (msg->length >> 8);
+    out[k++] = msg->length & 0xFF;
+    memcpy(&out[k], msg->data, 6);
+    k += 6;
+    pos = 6;
+
+    while (pos < msg->length)
+    {
+        uint16_t n = (msg->length - pos < 7) ? msg->length - pos : 7;
+
+        if (k + 1 + n > size)
+        {
+            break;
+        }
+        out[k++] = 0x20 | sn;
+        memcpy(&out[k], &msg->data[pos], n);
+        k += n;
+        pos += n;
+        sn = (sn + 1) & 0x0F;
+    }
+    return k;
+}
+
+// Requests cmd, e.g. "010C" or "2201011" with the expected frame count
+// appended, through the native elm327 API. The reassembled responses are
+// left in autopid_msgs. response->data gets them in frame layout, in the
+// order they completed, and priority_data points at the one from the
+// lowest ID. Commands that aren't hex still go through the text path.
+static esp_err_t autopid_request(const char *cmd, response_t *response)
+{
+    uint8_t payload[64];
+    char hex[2 * sizeof(payload) + 2];
+    size_t hex_len = 0;
+    uint8_t expected = 0;
+
+    autopid_msg_count = 0;
+    for (const char *c = cmd; *c != '\0' && *c != '\r'; c++)
+    {
+        if (*c == ' ')
+        {
+            continue;
+        }
+        if (!isxdigit((unsigned char)*c) || hex_len >= sizeof(hex) - 1)
+        {
+            hex_len = 0;
+            break;
+        }
+        hex[hex_len++] = *c;
+    }
+
+    if (hex_len < 2)
+    {
+        twai_message_t tx_msg;
+
+        if (elm327_process_cmd((uint8_t*)cmd, strlen(cmd), &tx_msg, &autopidQueue) != ESP_OK ||
+            xQueueReceive(autopidQueue, response, pdMS_TO_TICKS(1000)) != pdPASS)
+        {
+            return ESP_ERR_TIMEOUT;
+        }
+        return (strstr((char*)response->data, "error") == NULL) ? ESP_OK : ESP_ERR_NOT_FOUND;
+    }
+
+    // Odd length, the last digit is the number of frames to expect. Like
+    // elm327, only 1-9 count, anything else waits for the timeout.
+    if (hex_len % 2 == 1)
+    {
+        char digit = hex[--hex_len];
+
+        expected = (digit >= '1' && digit <= '9') ? (digit - '0') : 0;
+    }
+    for (size_t i = 0; i < hex_len; i += 2)
+    {
+        char byte_str[3] = {hex[i], hex[i + 1], 0};
+        payload[i / 2] = (uint8_t)strtol(byte_str, NULL, 16);
+    }
+
+    autopid_msg_count = elm327_request_native(0, 0, payload, hex_len / 2, expected,
+                                                autopid_rx_buf, sizeof(autopid_rx_buf), autopid_msgs, AUTOPID_MAX_MSGS);
+    if (autopid_msg_count <= 0)
+    {
+        esp_err_t err = (autopid_msg_count == 0) ? ESP_ERR_NOT_FOUND : ESP_FAIL;
+
+        autopid_msg_count = 0;
+        return err;
+    }
+
+    uint32_t k = 0;
+    uint32_t lowest_at = 0;
+    uint32_t lowest_len = 0;
+    int lowest = -1;
+    bool several_ids = false;
+
+    for (int i = 0; i < autopid_msg_count; i++)
+    {
+        uint32_t n = autopid_frame_layout(&autopid_msgs[i], &response->data[k], sizeof(response->data) - k);
+
+        if (autopid_msgs[i].id != autopid_msgs[0].id)
+        {
+            several_ids = true;
+        }
+        if (n != 0 && (lowest < 0 || autopid_msgs[i].id < autopid_msgs[lowest].id))
+        {
+            lowest = i;
+            lowest_at = k;
+            lowest_len = n;
         }
+        k += n;
+    }
+    response->length = k;
+
+    // Several ECUs answered, the lowest ID is preferred. With one ECU
+    // there is nothing to choose and expressions use the whole response.
+    if (several_ids && lowest >= 0)
+    {
+        response->priority_data = &response->data[lowest_at];
+        response->priority_data_len = (lowest_len > UINT8_MAX) ? UINT8_MAX : lowest_len;
     }
+    else
+    {
+        response->priority_data = NULL;
+        response->priority_data_len = 0;
+    }
+    return ESP_OK;
 }
 
 esp_err_t autopid_find_standard_pid(uint8_t protocol, char *available_pids, uint32_t available_pids_size) 
@@ -299,31 +442,31 @@ esp_err_t autopid_find_standard_pid(uint8_t protocol, char *available_pids, uint
     for (int i = 0; i < sizeof(pid_support_cmds)/sizeof(pid_support_cmds[0]); i++) {
         ESP_LOGI(TAG, "Processing PID support command: %s", pid_support_cmds[i]);
     DEBUG_LOGI(TAG, "Processing PID support command: %s", pid_support_cmds[i]);
-        if (elm327_process_cmd((uint8_t*)pid_support_cmds[i], strlen(pid_support_cmds[i]), &frame, &autopidQueue) != 0) {
-            ESP_LOGW(TAG, "Failed to process PID support command: %s", pid_support_cmds[i]);
-            DEBUG_LOGW(TAG, "Failed to process PID support command: %s", pid_support_cmds[i]);
-            continue;
-        }
-
-    if (xQueueReceive(autopidQueue, response, pdMS_TO_TICKS(1000)) == pdPASS) {
+    if (autopid_request(pid_support_cmds[i], response) == ESP_OK) {
         ESP_LOGI(TAG, "Raw response length: %lu", response->length);
     DEBUG_LOGI(TAG, "Raw response length: %lu", response->length);
         ESP_LOG_BUFFER_HEX(TAG, response->data, response->length);
 
 
-        // Skip mode byte (0x41) and PID byte
-        if (response->length >= 7) {
-            uint8_t merged_frame[7] = {0};
-            merge_response_frames(response->data, response->length, merged_frame);
-            
-            // Extract bitmap from merged frame
-            supported_pids = (merged_frame[3] << 24) | 
-                            (merged_frame[4] << 16) | 
-                            (merged_frame[5] << 8) | 
-                            merged_frame[6];
-            
-            ESP_LOGI(TAG, "Merged frame bitmap: 0x%08lx", supported_pids);
-            DEBUG_LOGI(TAG, "Merged frame bitmap: 0x%08lx", supported_pids);
+        // Every ECU that answered adds its PIDs: mode byte (0x41), PID byte
+        // and the 4 bitmap bytes
+        bool bitmap_found = false;
+        supported_pids = 0;
+        for (int m = 0; m < autopid_msg_count; m++) {
+            const uint8_t *msg = autopid_msgs[m].data;
+
+            if (autopid_msgs[m].length >= 6 && msg[0] == 0x41) {
+                supported_pids |= ((uint32_t)msg[2] << 24) | 
+                                ((uint32_t)msg[3] << 16) | 
+                                ((uint32_t)msg[4] << 8) | 
+                                msg[5];
+                bitmap_found = true;
+            }
+        }
+
+        if (bitmap_found) {
+            ESP_LOGI(TAG, "Merged bitmap: 0x%08lx", supported_pids);
+            DEBUG_LOGI(TAG, "Merged bitmap: 0x%08lx", supported_pids);
 
                 for (int bit = 0; bit < 32; bit++) {
                     if (supported_pids & (1 << (31 - bit))) {
@@ -367,8 +510,8 @@ esp_err_t autopid_find_standard_pid(uint8_t protocol, char *available_pids, uint
                     }
                 }
             } else {
-                ESP_LOGW(TAG, "Response length too short: %lu", response->length);
-                DEBUG_LOGW(TAG, "Response length too short: %lu", response->length);
+                ESP_LOGW(TAG, "No PID bitmap in response to %.4s", pid_support_cmds[i]);
+                DEBUG_LOGW(TAG, "No PID bitmap in response to %.4s", pid_support_cmds[i]);
             }
         } else {
             ESP_LOGW(TAG, "No response received for PID support command: %s", pid_support_cmds[i]);
@@ -587,6 +730,29 @@ char *autopid_data_read(void)
     return json_str;
 }
 
+// The rx topic is interned once the MQTT client is up
+static int16_t autopid_rx_topic_id(void)
+{
+    static int16_t topic_id = -1;
+
+    if (topic_id < 0) {
+        topic_id = mqtt_topic_intern(config_server_get_mqtt_rx_topic());
+    }
+    return topic_id;
+}
+
+// In dynamic publish mode, topics nobody subscribed to on the local broker
+// are not encoded or published at all
+static bool autopid_topic_wanted(int16_t topic_id)
+{
+    static int8_t dynamic = -1;
+
+    if (dynamic < 0) {
+        dynamic = (config_server_get_mqtt_publish_mode() == PUBLISH_MODE_DYNAMIC);
+    }
+    return !dynamic || mqtt_topic_wanted(topic_id);
+}
+
 void autopid_data_publish(void) {
     if (!all_pids || !all_pids->mutex) {
         ESP_LOGE(TAG, "Invalid all_pids or mutex");
@@ -594,6 +760,25 @@ void autopid_data_publish(void) {
         return;
     }
 
+    bool group = (all_pids->group_destination && strlen(all_pids->group_destination) > 0);
+    int16_t topic_id = group ? mqtt_topic_intern(all_pids->group_destination) : autopid_rx_topic_id();
+
+    if (!autopid_topic_wanted(topic_id)) {
+        // Keep the last value cache current for new subscribers
+        if (xSemaphoreTake(all_pids->mutex, portMAX_DELAY) == pdTRUE) {
+            for (uint32_t i = 0; i < all_pids->pid_count; i++) {
+                pid_data2_t *curr_pid = &all_pids->pids[i];
+                for (uint32_t j = 0; j < curr_pid->parameters_count; j++) {
+                    parameter_t *param = &curr_pid->parameters[j];
+                    mqtt_lvc_update(topic_id, param->name, param->value,
+                                    (param->sensor_type == BINARY_SENSOR) ? MQTT_LVC_BINARY : MQTT_LVC_NUMBER);
+                }
+            }
+            xSemaphoreGive(all_pids->mutex);
+        }
+        return;
+    }
+
     if (xSemaphoreTake(all_pids->mutex, portMAX_DELAY) == pdTRUE) {
         cJSON *root = cJSON_CreateObject();
         if (root) {
@@ -604,8 +789,10 @@ void autopid_data_publish(void) {
                     if (param->name && param->value != FLT_MAX) {
                         if (param->sensor_type == BINARY_SENSOR) {
                             cJSON_AddStringToObject(root, param->name, param->value > 0 ? "on" : "off");
+                            mqtt_lvc_update(topic_id, param->name, param->value, MQTT_LVC_BINARY);
                         } else {
                             cJSON_AddNumberToObject(root, param->name, param->value);
+                            mqtt_lvc_update(topic_id, param->name, param->value, MQTT_LVC_NUMBER);
                         }
                     }
                 }
@@ -615,13 +802,11 @@ void autopid_data_publish(void) {
                 limitJsonDecimalPrecision(root);
                 char *json_str = cJSON_PrintUnformatted(root);
                 if (json_str) {
-                    if(all_pids->group_destination && strlen(all_pids->group_destination) > 0)
-                    {
-                        mqtt_publish(all_pids->group_destination, json_str, 0, 0, 1);
+                    // Not retained, mqtt_lvc keeps the retained state
+                    mqtt_publish_id(topic_id, json_str, 0, 0, 0);
+                    if (group) {
                         ESP_LOGI(TAG, "Published to %s", all_pids->group_destination);
                         DEBUG_LOGI(TAG, "Published to %s", all_pids->group_destination);
-                    }else{
-                        mqtt_publish(config_server_get_mqtt_rx_topic(), json_str, 0, 0, 1);
                     }
                     free(json_str);
                 }
@@ -829,218 +1014,113 @@ char* autopid_get_config(void)
 //     }
 // }
 
-void parse_elm327_response(char *buffer, response_t *response) {
-    ESP_LOGI(TAG, "Starting to parse ELM327 response. Input buffer: %s", buffer);
-    
-    int k = 0;
-    int frame_count = 0;
-    char *frame;
-    char *data_start;
-    uint32_t lowest_header = UINT32_MAX;  // Initialize to maximum value
-    uint32_t highest_header = 0;          // Track highest header
-    uint32_t first_header = 0;
-    bool all_headers_same = true;
-    uint8_t *lowest_header_data = NULL;   // Store the actual data pointer
-    uint8_t lowest_header_length = 0;
-
-    frame = strtok(buffer, "\r\n");
-    ESP_LOGI(TAG, "First frame: %s", frame ? frame : "NULL");
-
-    while (frame != NULL) {
-        ESP_LOGD(TAG, "Processing frame %d: %s", frame_count + 1, frame);
-        frame_count++;
-
-        // Remove trailing '>' if present
-        size_t len = strlen(frame);
-        if (len > 0 && frame[len - 1] == '>') {
-            frame[len - 1] = '\0';
-            ESP_LOGV(TAG, "Removed trailing '>' from frame");
-        }
-
-        data_start = strchr(frame, ' ');
-        if (data_start != NULL) {
-            int header_length = data_start - frame;
-            char header_str[9] = {0};
-            strncpy(header_str, frame, header_length);
-            uint32_t current_header = strtoul(header_str, NULL, 16);
-            ESP_LOGD(TAG, "Frame %d header: 0x%lX (length: %d)", frame_count, current_header, header_length);
-            
-            // Track highest header
-            if (current_header > highest_header) {
-                ESP_LOGD(TAG, "New highest header found: 0x%lX (previous: 0x%lX)", current_header, highest_header);
-                highest_header = current_header;
-            }
-            
-            // Track first header and compare subsequent headers
-            if (frame_count == 1) {
-                first_header = current_header;
-                ESP_LOGD(TAG, "First header set to: 0x%lX", first_header);
-            } else if (current_header != first_header) {
-                all_headers_same = false;
-                ESP_LOGD(TAG, "Different header detected: 0x%lX != 0x%lX", current_header, first_header);
-            }
-
-            data_start++;
-
-            // Handle different header formats
-            switch (header_length) {
-                case 2: 
-                    data_start += 9;
-                    ESP_LOGV(TAG, "2-byte header format: Adjusted data_start by 9");
-                    break;
-                case 3:
-                case 8:
-                    ESP_LOGV(TAG, "%d-byte header format: No adjustment needed", header_length);
-                    break;
-                default:
-                    ESP_LOGW(TAG, "Unexpected header length: %d, skipping frame", header_length);
-                    frame = strtok(NULL, "\r\n");
-                    continue;
-            }
-
-            // Store start position for copying data
-            char *current_data_start = data_start;
-            int current_length = 0;
+// Replies of the ELM327 text path. PID requests go through the native API
+// in autopid_request(), only AT and other non-hex commands end up here, so
+// the reply itself isn't kept, only whether it failed.
+void autopid_parser(char *str, uint32_t len, QueueHandle_t *q)
+{
+    static response_t response;
+    if (str != NULL && strlen(str) != 0)
+    {
+        ESP_LOGI(TAG, "%s", str);
+    DEBUG_LOGI(TAG, "%s", str);
 
-            // Count data bytes in current frame
-            char *temp_data = data_start;
-            while (*temp_data != '\0') {
-                if (*temp_data == ' ') {
-                    temp_data++;
-                    continue;
-                }
-                if (strlen(temp_data) < 2) break;
-                current_length++;
-                temp_data += 2;
+        if (strchr(str, '>') != NULL) 
+        {
+            if(strstr(str, "NO DATA") == NULL && strstr(str, "ERROR") == NULL)
+            {
+                response.data[0] = '\0';
+                response.length = 0;
             }
-
-            // If this is the lowest header so far, store its data
-            if (current_header < lowest_header) {
-                ESP_LOGD(TAG, "New lowest header found: 0x%lX (previous: 0x%lX)", current_header, lowest_header);
-                lowest_header = current_header;
-                lowest_header_length = current_length;
-                
-                // Allocate space and copy data for lowest header frame
-                if (lowest_header_data == NULL) {
-                    lowest_header_data = (uint8_t*)malloc(current_length);
-                } else {
-                    lowest_header_data = (uint8_t*)realloc(lowest_header_data, current_length);
-                }
-                
-                // Parse and store the data bytes for this frame
-                int idx = 0;
-                while (*current_data_start != '\0') {
-                    if (*current_data_start == ' ') {
-                        current_data_start++;
-                        continue;
-                    }
-                    if (strlen(current_data_start) < 2) break;
-                    
-                    char byte_str[3] = {current_data_start[0], current_data_start[1], 0};
-                    lowest_header_data[idx++] = (unsigned char)strtol(byte_str, NULL, 16);
-                    current_data_start += 2;
-                }
-                ESP_LOGD(TAG, "Stored %d bytes from lowest header frame", idx);
+            else
+            {
+                sprintf((char*)response.data, "error");
+                response.length = strlen((char*)response.data);
+                ESP_LOGE(TAG, "Error response: %s", str);
+                DEBUG_LOGE(TAG, "Error response: %s", str);
             }
-
-            // Parse data bytes into main response buffer
-            ESP_LOGV(TAG, "Starting data byte parsing at position: %s", data_start);
-            while (*data_start != '\0') {
-                if (*data_start == ' ') {
-                    data_start++;
-                    continue;
-                }
-                if (strlen(data_start) < 2) {
-                    ESP_LOGW(TAG, "Incomplete byte at end of frame: %s", data_start);
-                    break;
-                }
-                
-                char byte_str[3] = {data_start[0], data_start[1], 0};
-                response->data[k] = (unsigned char)strtol(byte_str, NULL, 16);
-                ESP_LOGV(TAG, "Parsed byte %d: 0x%02X from %s", k, response->data[k], byte_str);
-                k++;
-                data_start += 2;
+            response.priority_data = NULL;
+            response.priority_data_len = 0;
+            if (xQueueSend(autopidQueue, &response, pdMS_TO_TICKS(1000)) != pdPASS)
+            {
+                ESP_LOGE(TAG, "Failed to send to queue");
+                DEBUG_LOGE(TAG, "Failed to send to queue");
             }
-        } else {
-            ESP_LOGW(TAG, "No space delimiter found in frame: %s", frame);
-        }
-        frame = strtok(NULL, "\r\n");
-    }
-
-    response->length = k;
-    
-    // Set priority data based on frame count and header comparison
-    if (frame_count <= 2 || all_headers_same) {
-        response->priority_data = NULL;
-        response->priority_data_len = 0;
-        if (lowest_header_data != NULL) {
-            free(lowest_header_data);
         }
-        ESP_LOGI(TAG, "Null priority data set - frames: %d, all headers same: %d", 
-                frame_count, all_headers_same);
-    } else {
-        response->priority_data = lowest_header_data;
-        response->priority_data_len = lowest_header_length;
-        ESP_LOGI(TAG, "Priority data set - length: %u, starting with byte: 0x%02X", 
-                response->priority_data_len, 
-                response->priority_data[0]);
     }
-    
-    ESP_LOGI(TAG, "Parsing complete. Headers - Lowest: 0x%lX, Highest: 0x%lX, Total frames: %d, Total bytes: %lu, Priority data length: %u",
-            lowest_header, highest_header, frame_count, response->length, response->priority_data_len);
 }
 
-static void append_to_buffer(char *buffer, const char *new_data) 
+// Last value sent for each ELM327 setting, so init strings only send the
+// settings that differ. Any AT command processed outside send_commands,
+// e.g. by another ELM327 client, bumps the elm327 config generation and
+// drops the whole shadow.
+typedef struct
 {
-    if (strlen(buffer) + strlen(new_data) < BUFFER_SIZE) 
-    {
-        strcat(buffer, new_data);
-    }
-    else
+    const char *key;
+    char value[20];
+    bool valid;
+}elm_setting_t;
+
+// Longest match first, like elm327_commands
+static elm_setting_t elm_shadow[] = {
+    {"fcsd"}, {"fcsh"}, {"fcsm"}, {"cra"}, {"cp"}, {"sh"}, {"sp"}, {"st"},
+    {"at"}, {"s"}, {"e"}, {"h"}, {"l"},
+};
+static uint32_t elm_shadow_gen = UINT32_MAX;
+static uint32_t elm_init_sent = 0;
+static uint32_t elm_init_skipped = 0;
+
+static void elm_shadow_invalidate(void)
+{
+    for (size_t i = 0; i < sizeof(elm_shadow) / sizeof(elm_shadow[0]); i++)
     {
-        ESP_LOGE(TAG, "Failed add data to buffer");
-    DEBUG_LOGE(TAG, "Failed add data to buffer");
+        elm_shadow[i].valid = false;
     }
 }
 
-void autopid_parser(char *str, uint32_t len, QueueHandle_t *q)
+// Normalizes cmd the way elm327_process_cmd does. Returns true when it sets
+// a tracked setting to the value it already has.
+static bool elm_shadow_is_current(const char *cmd, elm_setting_t **setting, char *norm, size_t norm_size)
 {
-    static response_t response;
-    if (str != NULL && strlen(str) != 0)
+    size_t n = 0;
+
+    *setting = NULL;
+    for (const char *c = cmd; *c != '\0' && *c != '\r' && n < norm_size - 1; c++)
     {
-        ESP_LOGI(TAG, "%s", str);
-    DEBUG_LOGI(TAG, "%s", str);
+        if (*c != ' ' && *c != '\n')
+        {
+            norm[n++] = tolower((unsigned char)*c);
+        }
+    }
+    norm[n] = '\0';
 
-        append_to_buffer(auto_pid_buf, str);
+    if (strncmp(norm, "at", 2) != 0)
+    {
+        return false;
+    }
+    if (strcmp(norm, "atz") == 0 || strcmp(norm, "atd") == 0 || strcmp(norm, "atws") == 0)
+    {
+        // Resets, every setting goes back to its default
+        elm_shadow_invalidate();
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(elm_shadow) / sizeof(elm_shadow[0]); i++)
+    {
+        size_t key_len = strlen(elm_shadow[i].key);
 
-        if (strchr(str, '>') != NULL) 
+        if (strncmp(&norm[2], elm_shadow[i].key, key_len) == 0)
         {
-            if(strstr(str, "NO DATA") == NULL && strstr(str, "ERROR") == NULL)
-            {
-                // Parse the accumulated buffer
-                parse_elm327_response(auto_pid_buf, &response);
-                if (xQueueSend(autopidQueue, &response, pdMS_TO_TICKS(1000)) != pdPASS)
-                {
-                    ESP_LOGE(TAG, "Failed to send to queue");
-                    DEBUG_LOGE(TAG, "Failed to send to queue");
-                }
-            }
-            else
+            const char *value = &norm[2 + key_len];
+
+            if (strlen(value) >= sizeof(elm_shadow[i].value))
             {
-                sprintf((char*)response.data, "error");
-                response.length = strlen((char*)response.data);
-                ESP_LOGE(TAG, "Error response: %s", auto_pid_buf);
-                DEBUG_LOGE(TAG, "Error response: %s", auto_pid_buf);
-                if (xQueueSend(autopidQueue, &response, pdMS_TO_TICKS(1000)) != pdPASS)
-                {
-                    ESP_LOGE(TAG, "Failed to send to queue");
-                    DEBUG_LOGE(TAG, "Failed to send to queue");
-                }
+                return false;
             }
-            // Clear the buffer after parsing
-            auto_pid_buf[0] = '\0';
+            *setting = &elm_shadow[i];
+            return elm_shadow[i].valid && strcmp(elm_shadow[i].value, value) == 0;
         }
     }
+    return false;
 }
 
 static void send_commands(char *commands, uint32_t delay_ms)
@@ -1048,24 +1128,47 @@ static void send_commands(char *commands, uint32_t delay_ms)
     char *cmd_start = commands;
     char *cmd_end;
     twai_message_t tx_msg;
+
+    if (elm327_get_config_gen() != elm_shadow_gen)
+    {
+        elm_shadow_invalidate();
+    }
     
     while ((cmd_end = strchr(cmd_start, '\r')) != NULL) 
     {
         size_t cmd_len = cmd_end - cmd_start + 1; // +1 to include '\r'
         char str_send[cmd_len + 1]; // +1 for null terminator
+        char norm[32];
+        elm_setting_t *setting;
+
         strncpy(str_send, cmd_start, cmd_len);
         str_send[cmd_len] = '\0'; // Null-terminate the command string
+        cmd_start = cmd_end + 1; // Move to the start of the next command
+
+        if (elm_shadow_is_current(str_send, &setting, norm, sizeof(norm)))
+        {
+            elm_init_skipped++;
+            continue;
+        }
+
         if ((strstr(str_send, "ath0") == NULL && strstr(str_send, "ATH0") == NULL && strstr(str_send, "at h0") == NULL && strstr(str_send, "AT H0") == NULL) &&
             (strstr(str_send, "ats0") == NULL && strstr(str_send, "ATS0") == NULL && strstr(str_send, "at s0") == NULL && strstr(str_send, "AT s0") == NULL) &&
             (strstr(str_send, "ate1") == NULL && strstr(str_send, "ATE1") == NULL && strstr(str_send, "at e1") == NULL && strstr(str_send, "AT E1") == NULL))
         {
             elm327_process_cmd((uint8_t *)str_send, cmd_len, &tx_msg, &autopidQueue);
             while ((xQueueReceive(autopidQueue, &elm327_response, pdMS_TO_TICKS(10)) == pdPASS));
+            elm_init_sent++;
+
+            if (setting != NULL)
+            {
+                strcpy(setting->value, &norm[2 + strlen(setting->key)]);
+                setting->valid = true;
+            }
         }
         
-        cmd_start = cmd_end + 1; // Move to the start of the next command
         vTaskDelay(pdMS_TO_TICKS(delay_ms));
     }
+    elm_shadow_gen = elm327_get_config_gen();
 }
 
 
@@ -1095,6 +1198,37 @@ static bool all_parameters_failed(all_pids_t* all_pids) {
 
 static void publish_parameter_mqtt(parameter_t *param) {
     if (!param) return;
+
+    if (param->destination_type != DEST_MQTT_TOPIC && param->destination_type != DEST_MQTT_WALLBOX) {
+        return;
+    }
+
+    int16_t topic_id;
+
+    if (param->destination && strlen(param->destination) > 0) {
+        if (!param->topic_cached) {
+            param->topic_id = mqtt_topic_intern(param->destination);
+            param->topic_cached = (param->topic_id >= 0);
+        }
+        topic_id = param->topic_id;
+    } else {
+        topic_id = autopid_rx_topic_id();
+    }
+
+    // Cached even when not published, for new subscribers and the retained snapshot
+    mqtt_lvc_update(topic_id, param->name, param->value,
+                    (param->destination_type == DEST_MQTT_WALLBOX) ? MQTT_LVC_PLAIN :
+                    (param->sensor_type == BINARY_SENSOR) ? MQTT_LVC_BINARY : MQTT_LVC_NUMBER);
+
+    if (!autopid_topic_wanted(topic_id)) {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+
+    if (!publish_policy_check(&param->policy, &param->pub_state, param->value, now)) {
+        return;
+    }
     
     char *payload = NULL;
     
@@ -1123,293 +1257,889 @@ static void publish_parameter_mqtt(parameter_t *param) {
     }
 
     if (payload) {
-        // Publish to specified destination or default topic
-        if (param->destination && strlen(param->destination) > 0) {
-            mqtt_publish(param->destination, payload, 0, 0, 1);
+        // Not retained, mqtt_lvc keeps the retained state
+        if (mqtt_publish_id(topic_id, payload, 0, 0, 0) == 0) {
+            publish_policy_commit(&param->pub_state, param->value, now);
+        }
+        if (topic_id != autopid_rx_topic_id()) {
             ESP_LOGI(TAG, "Published to %s", param->destination);
-        } else {
-            mqtt_publish(config_server_get_mqtt_rx_topic(), payload, 0, 0, 1);
         }
         free(payload);
     }
 }
 
 
-static void autopid_task(void *pvParameters)
+static bool autopid_pid_due(pid_data2_t *curr_pid)
 {
-    static char default_init[] = "ati\rate0\rath1\ratl0\rats1\ratsp6\ratst96\r";
-    wc_timer_t ecu_check_timer;
-    wc_timer_t group_cycle_timer;
-
-    ESP_LOGI(TAG, "Autopid Task Started");
-    DEBUG_LOGI(TAG, "Autopid Task Started");
-    
-    vTaskDelay(pdMS_TO_TICKS(100));
-    send_commands(default_init, 50);
-
-    while(config_server_mqtt_en_config() == 1 && !mqtt_connected())
+    for(uint32_t p = 0; p < curr_pid->parameters_count; p++)
     {
-        vTaskDelay(pdMS_TO_TICKS(2000));
+        if(wc_timer_is_expired(&curr_pid->parameters[p].timer))
+        {
+            return true;
+        }
     }
+    return false;
+}
 
-    // if(config_server_mqtt_en_config() == 1 && all_pids->ha_discovery_en)
-    // {
-    //     autopid_pub_discovery();
-    // }
-    if (!all_pids)
+// Re-arms a polled parameter and accounts for its lateness. The next
+// release stays on the period grid so the poll rate does not drift, unless
+// the deadline was missed.
+static void autopid_param_rearm(parameter_t *param)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t period_us = (int64_t)param->period * 1000;
+
+    if(param->timer != 0)
     {
-        ESP_LOGE(TAG, "all_pids is NULL");
-        return;
-    } 
+        int64_t late = now - param->timer;
 
-    // xSemaphoreTake(all_pids->mutex, portMAX_DELAY);
-    // uint32_t total_params = 0;
-    
-    // for (uint32_t i = 0; i < all_pids->pid_count; i++) 
-    // {
-    //     total_params += all_pids->pids[i].parameters_count;
-    // }
+        if(late / 1000 > param->late_max)
+        {
+            param->late_max = late / 1000;
+        }
+        if(period_us > 0 && late >= period_us)
+        {
+            param->missed++;
+        }
+    }
 
-    // bool *pid_failed = calloc(total_params, sizeof(bool));
-    // xSemaphoreGive(all_pids->mutex);
-    
-    if(strcmp("enable", all_pids->autopid_polling) == 0)
+    if(param->timer != 0 && now - param->timer < period_us)
     {
-        ESP_LOGI(TAG, "Autopid polling enabled");
-    DEBUG_LOGI(TAG, "Autopid polling enabled");
-        xEventGroupClearBits(xautopid_event_group, AUTOPID_POLLING_DISABLED_BIT);
+        param->timer += period_us;
     }
     else
     {
-        ESP_LOGI(TAG, "Autopid polling disabled");
-    DEBUG_LOGI(TAG, "Autopid polling disabled");
-        xEventGroupSetBits(xautopid_event_group, AUTOPID_POLLING_DISABLED_BIT);
+        param->timer = now + period_us;
     }
+}
 
-    ESP_LOGI(TAG, "Autopid Start loop");
-    DEBUG_LOGI(TAG, "Autopid Start loop");
-    ESP_LOGI(TAG, "Total PIDs: %lu", all_pids->pid_count);
-    DEBUG_LOGI(TAG, "Total PIDs: %lu", all_pids->pid_count);
+// Decodes a standard PID parameter from a single PID response laid out as
+// PCI, 0x41, PID, data bytes
+static void autopid_decode_std(parameter_t *param, const uint8_t *data, uint32_t length, bool publish)
+{
+    const std_pid_t* pid_info = get_pid_from_string(param->name);
+    if(pid_info)
+    {
+        ESP_LOGI(TAG, "Found PID info for: %s", param->name);
+        // Find matching parameter in pid_info
+        for(int p = 0; p < pid_info->num_params; p++)
+        {
+            // Match parameter name after the dash
+            const char* param_name = strchr(param->name, '-');
+            if(param_name && strcmp(param_name + 1, pid_info->params[p].name) == 0)
+            {
+                esp_err_t err;
+
+                ESP_LOGI(TAG, "Processing parameter: %s", pid_info->params[p].name);
+                err = extract_signal_value(
+                    data,                   // Your CAN response data buffer
+                    length,                 // Length of your CAN response data
+                    &pid_info->params[p],   // Parameter definition from pid_info
+                    &param->value           // Where to store the result
+                );
+
+                if (err != ESP_OK) {
+                    ESP_LOGE(TAG, "Failed to extract signal: %s", esp_err_to_name(err));
+                    break;
+                }
+                param->value = roundf(param->value * 100.0) / 100.0;
+                ESP_LOGI(TAG, "Parameter %s result: %.2f %s", 
+                                param->name, 
+                                param->value, 
+                                pid_info->params[p].unit);
+                if(publish)
+                {
+                    publish_parameter_mqtt(param);
+                }
+                break;
+            }
+        }
+    }
+}
 
-    while(1) 
+// Decodes one parameter from elm327_response. Parameters that are not due
+// only get their value refreshed, they are published on their own period.
+static void autopid_decode_parameter(pid_data2_t *curr_pid, parameter_t *param, bool publish)
+{
+    double result;
+
+    if(curr_pid->pid_type == PID_CUSTOM || curr_pid->pid_type == PID_SPECIFIC) 
+    {
+        if(param->expression && 
+        evaluate_expression((uint8_t*)param->expression, 
+                            elm327_response.data, 0, &result))
+        {
+            if (param->min != FLT_MAX && result < param->min) {
+                ESP_LOGW(TAG, "Parameter %s value %.2f below min %.2f - ignoring", 
+                        param->name, result, param->min);
+            } else if (param->max != FLT_MAX && result > param->max) {
+                ESP_LOGW(TAG, "Parameter %s value %.2f above max %.2f - ignoring", 
+                        param->name, result, param->max);
+            } else {
+                result = round(result * 100.0) / 100.0;
+                ESP_LOGI(TAG, "Parameter %s result: %.2f", 
+                        param->name, result);
+                param->value = result;
+                if(publish)
+                {
+                    publish_parameter_mqtt(param);
+                }
+            }
+        }
+    }
+    else if(curr_pid->pid_type == PID_STD) 
     {
-        static pid_type_t previous_pid_type = PID_MAX;
+        if(elm327_response.priority_data != NULL && elm327_response.priority_data != 0)
+        {
+            autopid_decode_std(param, elm327_response.priority_data, elm327_response.priority_data_len, publish);
+        }
+        else
+        {
+            autopid_decode_std(param, elm327_response.data, elm327_response.length, publish);
+        }
+    }
+}
 
-        dev_status_wait_for_bits(DEV_AWAKE_BIT, portMAX_DELAY);
+// Mode 01 accepts up to 6 PIDs in one request, "01" plus the PIDs fills the
+// 7 data bytes of a single frame
+#define STD_BATCH_MAX_PIDS      6
 
-        if (xEventGroupGetBits(xautopid_event_group) & AUTOPID_POLLING_DISABLED_BIT) 
+typedef struct
+{
+    uint8_t pid[STD_BATCH_MAX_PIDS];
+    uint8_t len[STD_BATCH_MAX_PIDS];
+    uint8_t count;
+    uint8_t data[STD_BATCH_MAX_PIDS][3 + 7];    // single PID response for autopid_decode_std
+    bool found[STD_BATCH_MAX_PIDS];
+}std_batch_t;
+
+// Response data bytes of a mode 01 PID, from the signal layout in
+// obd2_standard_pids.h. 0 when the layout doesn't give it, such PIDs are
+// always requested on their own.
+static uint8_t autopid_std_data_len(const std_pid_t *pid_info)
+{
+    uint8_t end = 0;
+
+    if(pid_info == NULL || pid_info->num_params == 0)
+    {
+        return 0;
+    }
+    for(int p = 0; p < pid_info->num_params; p++)
+    {
+        uint8_t start_byte = pid_info->params[p].bit_start / 8;
+        uint8_t last = start_byte + (pid_info->params[p].bit_length + 7) / 8;
+
+        if(start_byte < 3)
         {
-            xEventGroupWaitBits(xautopid_event_group, AUTOPID_REQUEST_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+            return 0;
+        }
+        if(last > end)
+        {
+            end = last;
         }
+    }
+    return (end - 3 <= 7) ? end - 3 : 0;
+}
 
-        elm327_lock();
-        xSemaphoreTake(all_pids->mutex, portMAX_DELAY);
-        
-        // Loop through all PIDs
-        for(uint32_t i = 0; i < all_pids->pid_count; i++) 
+static bool autopid_std_packable(pid_data2_t *a, pid_data2_t *b)
+{
+    if(b->pid_type != PID_STD || b->std_len == 0)
+    {
+        return false;
+    }
+    if(a->rxheader == NULL || b->rxheader == NULL)
+    {
+        return a->rxheader == b->rxheader;
+    }
+    return strcmp(a->rxheader, b->rxheader) == 0;
+}
+
+// Splits one reassembled "41 PID data PID data ..." message into single PID
+// responses. Returns false when the message can't be walked, i.e. a PID
+// length from the table is wrong.
+static bool autopid_std_batch_split(std_batch_t *batch, const uint8_t *msg, uint32_t length)
+{
+    uint32_t i = 1;
+
+    if(length == 0 || msg[0] != 0x41)
+    {
+        // Negative response or another service, nothing to take from it
+        return true;
+    }
+    while(i < length)
+    {
+        uint8_t n;
+
+        for(n = 0; n < batch->count && batch->pid[n] != msg[i]; n++);
+        if(n == batch->count || i + 1 + batch->len[n] > length)
         {
-            pid_data2_t *curr_pid = &all_pids->pids[i];
-            // Skip if PID type not enabled
-            if((curr_pid->pid_type == PID_STD && !all_pids->pid_std_en) ||
-            (curr_pid->pid_type == PID_CUSTOM && !all_pids->pid_custom_en) ||
-            (curr_pid->pid_type == PID_SPECIFIC && !all_pids->pid_specific_en))
+            return false;
+        }
+        // First ECU to answer wins, like a single request
+        if(!batch->found[n])
+        {
+            batch->data[n][0] = 2 + batch->len[n];
+            batch->data[n][1] = 0x41;
+            memcpy(&batch->data[n][2], &msg[i], 1 + batch->len[n]);
+            batch->found[n] = true;
+        }
+        i += 1 + batch->len[n];
+    }
+    return true;
+}
+
+// Splits every reassembled response of the last request
+static bool autopid_std_batch_demux(std_batch_t *batch)
+{
+    for(int m = 0; m < autopid_msg_count; m++)
+    {
+        if(!autopid_std_batch_split(batch, autopid_msgs[m].data, autopid_msgs[m].length))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Requests the due standard PIDs from all_pids->pids[first] on in one
+// mode 01 request. Returns false when fewer than two PIDs are due, or when
+// the response could not be split; the PIDs of that request are then
+// polled on their own from now on.
+static bool autopid_poll_std_batch(uint32_t first)
+{
+    pid_data2_t *first_pid = &all_pids->pids[first];
+    std_batch_t batch;
+    char cmd[2 + 2 * STD_BATCH_MAX_PIDS + 2] = "01";
+    bool response_ok = false;
+
+    memset(&batch, 0, sizeof(batch));
+    for(uint32_t i = first; i < all_pids->pid_count && batch.count < STD_BATCH_MAX_PIDS; i++)
+    {
+        pid_data2_t *curr_pid = &all_pids->pids[i];
+        uint8_t n;
+
+        if(!autopid_std_packable(first_pid, curr_pid) || !autopid_pid_due(curr_pid))
+        {
+            continue;
+        }
+        for(n = 0; n < batch.count && batch.pid[n] != curr_pid->std_pid; n++);
+        if(n == batch.count)
+        {
+            batch.pid[n] = curr_pid->std_pid;
+            batch.len[n] = curr_pid->std_len;
+            batch.count++;
+            sprintf(&cmd[strlen(cmd)], "%02X", curr_pid->std_pid);
+        }
+    }
+    if(batch.count < 2)
+    {
+        return false;
+    }
+    strcat(cmd, "\r");
+
+    ESP_LOGI(TAG, "Executing command: %s", cmd);
+    DEBUG_LOGI(TAG, "Executing command: %s", cmd);
+    if(autopid_request(cmd, &elm327_response) == ESP_OK)
+    {
+        if(!autopid_std_batch_demux(&batch))
+        {
+            ESP_LOGW(TAG, "Could not split the response to %s, requesting its PIDs one by one", cmd);
+            for(uint32_t i = first; i < all_pids->pid_count; i++)
             {
-                continue;
+                pid_data2_t *curr_pid = &all_pids->pids[i];
+
+                for(uint8_t n = 0; n < batch.count; n++)
+                {
+                    if(autopid_std_packable(first_pid, curr_pid) && curr_pid->std_pid == batch.pid[n])
+                    {
+                        curr_pid->std_len = 0;
+                    }
+                }
             }
+            return false;
+        }
+        response_ok = true;
+        xEventGroupSetBits(xautopid_event_group, ECU_CONNECTED_BIT);
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Failed to process command: %s", cmd);
+    }
+
+    // Every parameter of the requested PIDs is decoded, the due ones are
+    // published and re-armed
+    for(uint32_t i = 0; i < all_pids->pid_count; i++)
+    {
+        pid_data2_t *curr_pid = &all_pids->pids[i];
+        uint8_t n;
+
+        if(!autopid_std_packable(first_pid, curr_pid))
+        {
+            continue;
+        }
+        for(n = 0; n < batch.count && batch.pid[n] != curr_pid->std_pid; n++);
+        if(n == batch.count)
+        {
+            continue;
+        }
 
-            // Loop through parameters
-            for(uint32_t p = 0; p < curr_pid->parameters_count; p++) 
+        for(uint32_t p = 0; p < curr_pid->parameters_count; p++)
+        {
+            parameter_t *param = &curr_pid->parameters[p];
+            bool due = wc_timer_is_expired(&param->timer);
+
+            if(due)
+            {
+                autopid_param_rearm(param);
+                param->failed = !(response_ok && batch.found[n]);
+            }
+            if(response_ok && batch.found[n])
             {
-                parameter_t *param = &curr_pid->parameters[p];
+                autopid_decode_std(param, batch.data[n], batch.data[n][0] + 1, due);
+            }
+        }
+    }
+    return true;
+}
+
+// Polls one PID: one request when any of its parameters is due, all
+// parameters are decoded from the same response
+static void autopid_poll_pid(uint32_t i)
+{
+    pid_data2_t *curr_pid = &all_pids->pids[i];
+    bool response_ok = false;
+
+    // Skip if PID type not enabled
+    if((curr_pid->pid_type == PID_STD && !all_pids->pid_std_en) ||
+    (curr_pid->pid_type == PID_CUSTOM && !all_pids->pid_custom_en) ||
+    (curr_pid->pid_type == PID_SPECIFIC && !all_pids->pid_specific_en))
+    {
+        return;
+    }
+
+    if(!autopid_pid_due(curr_pid))
+    {
+        return;
+    }
+
+    // autopid_data_write
+    if(curr_pid->pid_type != autopid_prev_pid_type) {
+        // Send appropriate initialization based on new PID type
+        switch(curr_pid->pid_type) {
+            case PID_CUSTOM:
+                if(all_pids->custom_init && strlen(all_pids->custom_init) > 0) {
+                    ESP_LOGI(TAG, "Sending custom init: %s, length: %d", 
+                            all_pids->custom_init, strlen(all_pids->custom_init));
+    DEBUG_LOGI(TAG, "Sending custom init: %s, length: %d", 
+        all_pids->custom_init, strlen(all_pids->custom_init));
+                    send_commands(all_pids->custom_init, 2);
+                }
+                break;
                 
-                // Check parameter timer
-                if(wc_timer_is_expired(&param->timer)) 
-                {
-                    // autopid_data_write
-                    if(curr_pid->pid_type != previous_pid_type) {
-                        // Send appropriate initialization based on new PID type
-                        switch(curr_pid->pid_type) {
-                            case PID_CUSTOM:
-                                if(all_pids->custom_init && strlen(all_pids->custom_init) > 0) {
-                                    ESP_LOGI(TAG, "Sending custom init: %s, length: %d", 
-                                            all_pids->custom_init, strlen(all_pids->custom_init));
-                    DEBUG_LOGI(TAG, "Sending custom init: %s, length: %d", 
-                        all_pids->custom_init, strlen(all_pids->custom_init));
-                                    send_commands(all_pids->custom_init, 2);
-                                }
-                                break;
-                                
-                            case PID_STD:
-                                if(all_pids->standard_init && strlen(all_pids->standard_init) > 0) {
-                                    ESP_LOGI(TAG, "Sending standard init: %s, length: %d", 
-                                            all_pids->standard_init, strlen(all_pids->standard_init));
-                    DEBUG_LOGI(TAG, "Sending standard init: %s, length: %d", 
-                        all_pids->standard_init, strlen(all_pids->standard_init));
-                                    send_commands(all_pids->standard_init, 2);
-                                }
-                                break;
-                                
-                            case PID_SPECIFIC:
-                                if(all_pids->specific_init && strlen(all_pids->specific_init) > 0) {
-                                    ESP_LOGI(TAG, "Sending specific init: %s, length: %d", 
-                                            all_pids->specific_init, strlen(all_pids->specific_init));
-                    DEBUG_LOGI(TAG, "Sending specific init: %s, length: %d", 
-                        all_pids->specific_init, strlen(all_pids->specific_init));
-                                    send_commands(all_pids->specific_init, 2);
-                                }
-                                break;
-                                
-                            case PID_MAX:
-                                break;
-                        }
+            case PID_STD:
+                if(all_pids->standard_init && strlen(all_pids->standard_init) > 0) {
+                    ESP_LOGI(TAG, "Sending standard init: %s, length: %d", 
+                            all_pids->standard_init, strlen(all_pids->standard_init));
+    DEBUG_LOGI(TAG, "Sending standard init: %s, length: %d", 
+        all_pids->standard_init, strlen(all_pids->standard_init));
+                    send_commands(all_pids->standard_init, 2);
+                }
+                break;
+                
+            case PID_SPECIFIC:
+                if(all_pids->specific_init && strlen(all_pids->specific_init) > 0) {
+                    ESP_LOGI(TAG, "Sending specific init: %s, length: %d", 
+                            all_pids->specific_init, strlen(all_pids->specific_init));
+    DEBUG_LOGI(TAG, "Sending specific init: %s, length: %d", 
+        all_pids->specific_init, strlen(all_pids->specific_init));
+                    send_commands(all_pids->specific_init, 2);
+                }
+                break;
+                
+            case PID_MAX:
+                break;
+        }
 
-                        previous_pid_type = curr_pid->pid_type;
-                    }
+        autopid_prev_pid_type = curr_pid->pid_type;
+    }
 
-                    ESP_LOGI(TAG, "Processing parameter: %s", param->name);
-                    DEBUG_LOGI(TAG, "Processing parameter: %s", param->name);
-                    // Reset timer with parameter period
-                    wc_timer_set(&param->timer, param->period);
+    // Due standard PIDs are packed into one mode 01 request
+    if(curr_pid->pid_type == PID_STD && curr_pid->std_len > 0 && autopid_poll_std_batch(i))
+    {
+        return;
+    }
 
-                    if(curr_pid->cmd != NULL && strlen(curr_pid->cmd) > 0) 
-                    {
-                        twai_message_t tx_msg;
+    if(curr_pid->cmd != NULL && strlen(curr_pid->cmd) > 0) 
+    {
+    
+        if(curr_pid->pid_type == PID_CUSTOM || curr_pid->pid_type == PID_SPECIFIC) 
+        {
+            if(curr_pid->init != NULL && strlen(curr_pid->init) > 0)
+            {
+                send_commands(curr_pid->init, 2);
+            }
+        }
 
-                        if(curr_pid->pid_type == PID_CUSTOM || curr_pid->pid_type == PID_SPECIFIC) 
-                        {
-                            if(curr_pid->init != NULL && strlen(curr_pid->init) > 0)
-                            {
-                                send_commands(curr_pid->init, 2);
-                            }
-                        }
+        ESP_LOGI(TAG, "Executing command: %s", curr_pid->cmd);
+        DEBUG_LOGI(TAG, "Executing command: %s", curr_pid->cmd);
+        if(autopid_request(curr_pid->cmd, &elm327_response) == ESP_OK)
+        {
+            ESP_LOGI(TAG, "Response received, length: %lu", elm327_response.length);
+            DEBUG_LOGI(TAG, "Response received, length: %lu", elm327_response.length);
+            ESP_LOG_BUFFER_HEXDUMP(TAG, elm327_response.data, 1, ESP_LOG_INFO);
+            response_ok = true;
+            xEventGroupSetBits(xautopid_event_group, ECU_CONNECTED_BIT);
+        }
+        else 
+        {
+            ESP_LOGE(TAG, "Failed to process command: %s", curr_pid->cmd);
+        }
+    }
+    else 
+    {
+        ESP_LOGE(TAG, "Failed, cmd is NULL");
+    }
 
-                        ESP_LOGI(TAG, "Executing command: %s", curr_pid->cmd);
-                        DEBUG_LOGI(TAG, "Executing command: %s", curr_pid->cmd);
-                        if(elm327_process_cmd((uint8_t*)curr_pid->cmd, 
-                                            strlen(curr_pid->cmd), 
-                                            &tx_msg, 
-                                            &autopidQueue) == ESP_OK)
-                        {
-                            ESP_LOGI(TAG, "Command processed successfully");
-                            DEBUG_LOGI(TAG, "Command processed successfully");
-                            
-                            if(xQueueReceive(autopidQueue, &elm327_response, pdMS_TO_TICKS(1000)) == pdPASS)
-                            {
-                                ESP_LOGI(TAG, "Response received, length: %lu", elm327_response.length);
-                                DEBUG_LOGI(TAG, "Response received, length: %lu", elm327_response.length);
-                                ESP_LOG_BUFFER_HEXDUMP(TAG, elm327_response.data, 1, ESP_LOG_INFO);
-                                if(strstr((char*)elm327_response.data, "error") == NULL)
-                                {
-                                    double result;
+    // Loop through parameters
+    for(uint32_t p = 0; p < curr_pid->parameters_count; p++) 
+    {
+        parameter_t *param = &curr_pid->parameters[p];
+        bool due = wc_timer_is_expired(&param->timer);
 
-                                    param->failed = false;
+        if(due)
+        {
+            ESP_LOGI(TAG, "Processing parameter: %s", param->name);
+            DEBUG_LOGI(TAG, "Processing parameter: %s", param->name);
+                autopid_param_rearm(param);
+            param->failed = !response_ok;
+        }
 
-                                    ESP_LOGI(TAG, "Response received, length: %lu", elm327_response.length);
-                                    xEventGroupSetBits(xautopid_event_group, ECU_CONNECTED_BIT);
-                                    // Process response based on PID type
-                                    if(curr_pid->pid_type == PID_CUSTOM || curr_pid->pid_type == PID_SPECIFIC) 
-                                    {
-                                        ESP_LOGI(TAG, "Processing custom/specific PID");
-                                        if(param->expression && 
-                                        evaluate_expression((uint8_t*)param->expression, 
-                                                            elm327_response.data, 0, &result))
-                                        {
-                                            if (param->min != FLT_MAX && result < param->min) {
-                                                ESP_LOGW(TAG, "Parameter %s value %.2f below min %.2f - ignoring", 
-                                                        param->name, result, param->min);
-                                            } else if (param->max != FLT_MAX && result > param->max) {
-                                                ESP_LOGW(TAG, "Parameter %s value %.2f above max %.2f - ignoring", 
-                                                        param->name, result, param->max);
-                                            } else {
-                                                result = round(result * 100.0) / 100.0;
-                                                ESP_LOGI(TAG, "Parameter %s result: %.2f", 
-                                                        param->name, result);
-                                                param->value = result;
-                                                publish_parameter_mqtt(param);
-                                            }
-                                        }
-                                    }
-                                    else if(curr_pid->pid_type == PID_STD) 
-                                    {
-                                        ESP_LOGI(TAG, "Processing standard PID");
-                                        if(curr_pid->pid_type == PID_STD) 
-                                        {
-                                            const std_pid_t* pid_info = get_pid_from_string(param->name);
-                                            if(pid_info)
-                                            {
-                                                ESP_LOGI(TAG, "Found PID info for: %s", param->name);
-                                                // Find matching parameter in pid_info
-                                                for(int p = 0; p < pid_info->num_params; p++)
-                                                {
-                                                    // Match parameter name after the dash
-                                                    const char* param_name = strchr(param->name, '-');
-                                                    if(param_name && strcmp(param_name + 1, pid_info->params[p].name) == 0)
-                                                    {
-                                                        esp_err_t err = ESP_FAIL;
-
-                                                        ESP_LOGI(TAG, "Processing parameter: %s", pid_info->params[p].name);
-                                                        if(elm327_response.priority_data != NULL && elm327_response.priority_data != 0)
-                                                        {
-                                                            err = extract_signal_value(
-                                                                elm327_response.priority_data,           // Your CAN response data buffer
-                                                                elm327_response.priority_data_len,         // Length of your CAN response data
-                                                                &pid_info->params[p],    // Parameter definition from pid_info
-                                                                &param->value            // Where to store the result
-                                                            );
-                                                        }
-                                                        else
-                                                        {
-                                                            err = extract_signal_value(
-                                                                elm327_response.data,           // Your CAN response data buffer
-                                                                elm327_response.length,         // Length of your CAN response data
-                                                                &pid_info->params[p],    // Parameter definition from pid_info
-                                                                &param->value            // Where to store the result
-                                                            );
-                                                        }
- 
-                                                        if (err != ESP_OK) {
-                                                            ESP_LOGE(TAG, "Failed to extract signal: %s", esp_err_to_name(err));
-                                                            break;
-                                                        }
-                                                        param->value = roundf(param->value * 100.0) / 100.0;
-                                                        ESP_LOGI(TAG, "Parameter %s result: %.2f %s", 
-                                                                        param->name, 
-                                                                        param->value, 
-                                                                        pid_info->params[p].unit);
-                                                        param->value = roundf(param->value * 100.0) / 100.0;
-                                                        publish_parameter_mqtt(param);
-                                                        break;
-                                                    }
-                                                }
-                                            }
-                                        }
-                                    }
-                                }
-                                else
-                                {   
-                                    param->failed = true;
-                                    ESP_LOGE(TAG, "Failed to process command: %s", curr_pid->cmd);
-                                }
-                            }
-                            else
-                            {
-                                param->failed = true;
-                                ESP_LOGE(TAG, "Failed Queue Receive: curr_pid->cmd timeout");
-                            }
-                        }
-                        else 
-                        {
-                            ESP_LOGE(TAG, "Failed to process command: %s", curr_pid->cmd);
-                        }
-                    }
-                    else 
-                    {
-                        ESP_LOGE(TAG, "Failed, cmd is NULL");
-                    }
-                }
+        if(response_ok)
+        {
+            autopid_decode_parameter(curr_pid, param, due);
+        }
+    }
+}
+
+// Scheduler. A PID waits in sched_sleep keyed on its release time, the
+// earliest timer of its parameters. Once released it moves to the ready
+// queue of its priority class, keyed on its deadline: a parameter must be
+// polled before its next release. The highest class with a ready PID is
+// served first, earliest deadline first within a class.
+#define AUTOPID_SCHED_SLICE_US      250000  // elm327 is released this often for other users
+#define AUTOPID_SCHED_MAX_SLEEP_MS  50
+#define AUTOPID_SCHED_SWITCH_SLACK_US   30000   // about the cost of resending an init
+
+typedef struct
+{
+    int64_t key;
+    uint16_t pid;
+}sched_node_t;
+
+typedef struct
+{
+    sched_node_t *node;
+    uint16_t count;
+}sched_heap_t;
+
+static sched_heap_t sched_sleep;
+static sched_heap_t sched_ready[AUTOPID_PRIO_MAX];
+static int64_t sched_window_start = 0;
+static int64_t sched_window_used = 0;       // us of bus time in the current second
+static uint32_t sched_bus_ms = 0;           // bus time used in the last full second
+static uint32_t sched_polls = 0;
+static uint32_t sched_deferred = 0;
+static uint8_t sched_last_group = UINT8_MAX;
+
+static void sched_push(sched_heap_t *heap, int64_t key, uint16_t pid)
+{
+    uint16_t i = heap->count++;
+
+    while(i > 0 && heap->node[(i - 1) / 2].key > key)
+    {
+        heap->node[i] = heap->node[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->node[i].key = key;
+    heap->node[i].pid = pid;
+}
+
+static uint16_t sched_remove(sched_heap_t *heap, uint16_t i)
+{
+    uint16_t pid = heap->node[i].pid;
+    sched_node_t last = heap->node[--heap->count];
+
+    while(i > 0 && heap->node[(i - 1) / 2].key > last.key)
+    {
+        heap->node[i] = heap->node[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    while(2 * i + 1 < heap->count)
+    {
+        uint16_t child = 2 * i + 1;
+
+        if(child + 1 < heap->count && heap->node[child + 1].key < heap->node[child].key)
+        {
+            child++;
+        }
+        if(last.key <= heap->node[child].key)
+        {
+            break;
+        }
+        heap->node[i] = heap->node[child];
+        i = child;
+    }
+    heap->node[i] = last;
+    return pid;
+}
+
+static uint16_t sched_pop(sched_heap_t *heap)
+{
+    return sched_remove(heap, 0);
+}
+
+// Picks the earliest deadline of a ready queue, or a PID using the same
+// init as the last one when its deadline is at most
+// AUTOPID_SCHED_SWITCH_SLACK_US later, saving the header switch
+static uint16_t sched_pop_grouped(sched_heap_t *heap)
+{
+    for(uint16_t i = 1; i < heap->count; i++)
+    {
+        if(all_pids->pids[heap->node[i].pid].init_group == sched_last_group &&
+            heap->node[i].key <= heap->node[0].key + AUTOPID_SCHED_SWITCH_SLACK_US)
+        {
+            return sched_remove(heap, i);
+        }
+    }
+    return sched_pop(heap);
+}
+
+static int64_t autopid_pid_release(pid_data2_t *curr_pid)
+{
+    int64_t release = INT64_MAX;
+
+    for(uint32_t p = 0; p < curr_pid->parameters_count; p++)
+    {
+        if(curr_pid->parameters[p].timer < release)
+        {
+            release = curr_pid->parameters[p].timer;
+        }
+    }
+    return release;
+}
+
+static int64_t autopid_pid_deadline(pid_data2_t *curr_pid)
+{
+    int64_t deadline = INT64_MAX;
+
+    for(uint32_t p = 0; p < curr_pid->parameters_count; p++)
+    {
+        parameter_t *param = &curr_pid->parameters[p];
+        int64_t d = param->timer + (int64_t)param->period * 1000;
+
+        if(d < deadline)
+        {
+            deadline = d;
+        }
+    }
+    return deadline;
+}
+
+static void autopid_sched_free(void)
+{
+    free(sched_sleep.node);
+    sched_sleep.node = NULL;
+    for(uint8_t c = 0; c < AUTOPID_PRIO_MAX; c++)
+    {
+        free(sched_ready[c].node);
+        sched_ready[c].node = NULL;
+    }
+}
+
+static esp_err_t autopid_sched_init(void)
+{
+    // At least one node, calloc(0) may return NULL without PIDs configured
+    size_t nodes = (all_pids->pid_count != 0) ? all_pids->pid_count : 1;
+
+    sched_sleep.node = calloc(nodes, sizeof(sched_node_t));
+    if(sched_sleep.node == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    for(uint8_t c = 0; c < AUTOPID_PRIO_MAX; c++)
+    {
+        sched_ready[c].node = calloc(nodes, sizeof(sched_node_t));
+        if(sched_ready[c].node == NULL)
+        {
+            autopid_sched_free();
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    for(uint32_t i = 0; i < all_pids->pid_count; i++)
+    {
+        pid_data2_t *curr_pid = &all_pids->pids[i];
+
+        // PIDs sending the same init share a group, see sched_pop_grouped
+        curr_pid->init_group = (i < UINT8_MAX) ? i : UINT8_MAX - 1;
+        for(uint32_t j = 0; j < i && j < UINT8_MAX; j++)
+        {
+            pid_data2_t *prev = &all_pids->pids[j];
+
+            if(prev->pid_type == curr_pid->pid_type &&
+                ((prev->init == NULL && curr_pid->init == NULL) ||
+                (prev->init != NULL && curr_pid->init != NULL && strcmp(prev->init, curr_pid->init) == 0)))
+            {
+                curr_pid->init_group = prev->init_group;
+                break;
+            }
+        }
+
+        if((curr_pid->pid_type == PID_STD && !all_pids->pid_std_en) ||
+        (curr_pid->pid_type == PID_CUSTOM && !all_pids->pid_custom_en) ||
+        (curr_pid->pid_type == PID_SPECIFIC && !all_pids->pid_specific_en) ||
+        curr_pid->parameters_count == 0)
+        {
+            continue;
+        }
+
+        // A PID is served at the class of its most urgent parameter
+        curr_pid->priority = AUTOPID_PRIO_LOW;
+        for(uint32_t p = 0; p < curr_pid->parameters_count; p++)
+        {
+            if(curr_pid->parameters[p].priority < curr_pid->priority)
+            {
+                curr_pid->priority = curr_pid->parameters[p].priority;
+            }
+        }
+        sched_push(&sched_sleep, autopid_pid_release(curr_pid), i);
+    }
+    sched_window_start = esp_timer_get_time();
+    return ESP_OK;
+}
+
+// Polls released PIDs for up to one slice, caller holds elm327 and
+// all_pids->mutex. Returns the ms to wait before the next call.
+static uint32_t autopid_sched_run(void)
+{
+    int64_t start = esp_timer_get_time();
+    int64_t now = start;
+    int64_t wait;
+    bool deferred = false;
+
+    while(now - start < AUTOPID_SCHED_SLICE_US)
+    {
+        uint16_t pid;
+        int8_t c;
+        int64_t t0;
+
+        if(now - sched_window_start >= 1000000)
+        {
+            sched_bus_ms = sched_window_used / 1000;
+            sched_window_used = 0;
+            sched_window_start = now;
+        }
+
+        while(sched_sleep.count > 0 && sched_sleep.node[0].key <= now)
+        {
+            pid = sched_pop(&sched_sleep);
+            if(autopid_pid_due(&all_pids->pids[pid]))
+            {
+                sched_push(&sched_ready[all_pids->pids[pid].priority],
+                            autopid_pid_deadline(&all_pids->pids[pid]), pid);
+            }
+            else
+            {
+                // Re-armed by a packed mode 01 request
+                sched_push(&sched_sleep, autopid_pid_release(&all_pids->pids[pid]), pid);
             }
         }
 
+        // Over the bus budget only high priority PIDs are polled until the
+        // next window
+        deferred = false;
+        for(c = 0; c < AUTOPID_PRIO_MAX; c++)
+        {
+            if(sched_ready[c].count == 0)
+            {
+                continue;
+            }
+            if(c != AUTOPID_PRIO_HIGH && all_pids->bus_budget != 0 &&
+                sched_window_used >= (int64_t)all_pids->bus_budget * 1000)
+            {
+                deferred = true;
+                continue;
+            }
+            break;
+        }
+        if(c == AUTOPID_PRIO_MAX)
+        {
+            if(deferred)
+            {
+                sched_deferred++;
+            }
+            break;
+        }
+
+        pid = sched_pop_grouped(&sched_ready[c]);
+        if(autopid_pid_due(&all_pids->pids[pid]))
+        {
+            t0 = esp_timer_get_time();
+            autopid_poll_pid(pid);
+            sched_last_group = all_pids->pids[pid].init_group;
+            now = esp_timer_get_time();
+            sched_window_used += now - t0;
+            sched_polls++;
+        }
+        sched_push(&sched_sleep, autopid_pid_release(&all_pids->pids[pid]), pid);
+    }
+
+    for(uint8_t c = 0; c < AUTOPID_PRIO_MAX; c++)
+    {
+        if(sched_ready[c].count > 0 && !deferred)
+        {
+            return 1;
+        }
+    }
+    if(deferred)
+    {
+        wait = sched_window_start + 1000000 - now;
+    }
+    else
+    {
+        wait = (sched_sleep.count > 0) ? sched_sleep.node[0].key - now : INT64_MAX;
+    }
+    if(wait < 1000)
+    {
+        return 1;
+    }
+    return (wait / 1000 > AUTOPID_SCHED_MAX_SLEEP_MS) ? AUTOPID_SCHED_MAX_SLEEP_MS : wait / 1000;
+}
+
+// Scheduler diagnostics, the caller frees the returned string
+char *autopid_get_sched_stats(void)
+{
+    char *response_str;
+
+    if (!all_pids || !all_pids->mutex) {
+        return NULL;
+    }
+
+    cJSON *root = cJSON_CreateObject();
+    if (!root) {
+        return NULL;
+    }
+
+    xSemaphoreTake(all_pids->mutex, portMAX_DELAY);
+    cJSON_AddNumberToObject(root, "polls", sched_polls);
+    cJSON_AddNumberToObject(root, "bus_ms", sched_bus_ms);
+    cJSON_AddNumberToObject(root, "bus_budget", all_pids->bus_budget);
+    cJSON_AddNumberToObject(root, "deferred", sched_deferred);
+    cJSON_AddNumberToObject(root, "init_sent", elm_init_sent);
+    cJSON_AddNumberToObject(root, "init_skipped", elm_init_skipped);
+
+    cJSON *params = cJSON_AddObjectToObject(root, "params");
+    for (uint32_t i = 0; params && i < all_pids->pid_count; i++)
+    {
+        for (uint32_t j = 0; j < all_pids->pids[i].parameters_count; j++)
+        {
+            parameter_t *param = &all_pids->pids[i].parameters[j];
+
+            if (!param->name || param->timer == 0) continue;
+
+            cJSON *item = cJSON_AddObjectToObject(params, param->name);
+            if (item)
+            {
+                cJSON_AddNumberToObject(item, "missed", param->missed);
+                cJSON_AddNumberToObject(item, "late_max_ms", param->late_max);
+            }
+        }
+    }
+    xSemaphoreGive(all_pids->mutex);
+
+    response_str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return response_str;
+}
+
+static void autopid_task(void *pvParameters)
+{
+    static char default_init[] = "ati\rate0\rath1\ratl0\rats1\ratsp6\ratst96\r";
+    wc_timer_t ecu_check_timer;
+    wc_timer_t group_cycle_timer;
+    uint32_t sleep_ms;
+
+    ESP_LOGI(TAG, "Autopid Task Started");
+    DEBUG_LOGI(TAG, "Autopid Task Started");
+    
+    vTaskDelay(pdMS_TO_TICKS(100));
+    send_commands(default_init, 50);
+
+    while(config_server_mqtt_en_config() == 1 && !mqtt_connected())
+    {
+        vTaskDelay(pdMS_TO_TICKS(2000));
+    }
+
+    // if(config_server_mqtt_en_config() == 1 && all_pids->ha_discovery_en)
+    // {
+    //     autopid_pub_discovery();
+    // }
+    if (!all_pids)
+    {
+        ESP_LOGE(TAG, "all_pids is NULL");
+        return;
+    } 
+
+    // xSemaphoreTake(all_pids->mutex, portMAX_DELAY);
+    // uint32_t total_params = 0;
+    
+    // for (uint32_t i = 0; i < all_pids->pid_count; i++) 
+    // {
+    //     total_params += all_pids->pids[i].parameters_count;
+    // }
+
+    // bool *pid_failed = calloc(total_params, sizeof(bool));
+    // xSemaphoreGive(all_pids->mutex);
+    
+    if(strcmp("enable", all_pids->autopid_polling) == 0)
+    {
+        ESP_LOGI(TAG, "Autopid polling enabled");
+    DEBUG_LOGI(TAG, "Autopid polling enabled");
+        xEventGroupClearBits(xautopid_event_group, AUTOPID_POLLING_DISABLED_BIT);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Autopid polling disabled");
+    DEBUG_LOGI(TAG, "Autopid polling disabled");
+        xEventGroupSetBits(xautopid_event_group, AUTOPID_POLLING_DISABLED_BIT);
+    }
+
+    if (autopid_sched_init() != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to allocate the scheduler");
+        vTaskDelete(NULL);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Autopid Start loop");
+    DEBUG_LOGI(TAG, "Autopid Start loop");
+    ESP_LOGI(TAG, "Total PIDs: %lu", all_pids->pid_count);
+    DEBUG_LOGI(TAG, "Total PIDs: %lu", all_pids->pid_count);
+
+    while(1) 
+    {
+        dev_status_wait_for_bits(DEV_AWAKE_BIT, portMAX_DELAY);
+
+        if (xEventGroupGetBits(xautopid_event_group) & AUTOPID_POLLING_DISABLED_BIT) 
+        {
+            xEventGroupWaitBits(xautopid_event_group, AUTOPID_REQUEST_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+        }
+
+        elm327_lock();
+        xSemaphoreTake(all_pids->mutex, portMAX_DELAY);
+        
+        sleep_ms = autopid_sched_run();
+
         elm327_unlock();
         xSemaphoreGive(all_pids->mutex);
 
@@ -1419,7 +2149,7 @@ static void autopid_task(void *pvParameters)
             xEventGroupClearBits(xautopid_event_group, AUTOPID_REQUEST_BIT);
         }
 
-        vTaskDelay(pdMS_TO_TICKS(10));
+        vTaskDelay(pdMS_TO_TICKS(sleep_ms));
 
         if (strcmp("enable", all_pids->grouping) == 0 && all_pids->group_destination_type == DEST_MQTT_TOPIC && wc_timer_is_expired(&group_cycle_timer))
         {
@@ -1458,6 +2188,22 @@ cJSON* parse_json_file(FILE* f) {
     return root;
 }
 
+// "priority": "high", "normal" or "low", in the PID or parameter entry
+static autopid_prio_t autopid_parse_priority(const cJSON *item)
+{
+    const cJSON *priority_item = cJSON_GetObjectItem(item, "priority");
+
+    if (priority_item && priority_item->valuestring) {
+        if (strcmp(priority_item->valuestring, "high") == 0) {
+            return AUTOPID_PRIO_HIGH;
+        }
+        if (strcmp(priority_item->valuestring, "low") == 0) {
+            return AUTOPID_PRIO_LOW;
+        }
+    }
+    return AUTOPID_PRIO_NORMAL;
+}
+
 all_pids_t* load_all_pids(void){
     int total_pids = 0;
     int car_data_pids = 0;
@@ -1515,6 +2261,7 @@ all_pids_t* load_all_pids(void){
             cJSON* ecu_protocol_item = cJSON_GetObjectItem(root, "ecu_protocol");
             cJSON* ha_discovery_item = cJSON_GetObjectItem(root, "ha_discovery");
             cJSON* cycle_item = cJSON_GetObjectItem(root, "cycle");
+            cJSON* bus_budget_item = cJSON_GetObjectItem(root, "bus_budget");
             cJSON* standard_pids_item = cJSON_GetObjectItem(root, "standard_pids");
             cJSON* specific_pids_item = cJSON_GetObjectItem(root, "car_specific");
             cJSON* group_destination_item = cJSON_GetObjectItem(root, "destination");
@@ -1540,6 +2287,8 @@ all_pids_t* load_all_pids(void){
             all_pids->std_ecu_protocol = ecu_protocol_item ? strdup(ecu_protocol_item->valuestring) : NULL;
             all_pids->ha_discovery_en = ha_discovery_item ? (strcmp(ha_discovery_item->valuestring, "enable") == 0) : false;
             all_pids->cycle = cycle_item ? atoi(cycle_item->valuestring) : 10000;
+            all_pids->bus_budget = cJSON_IsNumber(bus_budget_item) ? bus_budget_item->valueint :
+                            (bus_budget_item && bus_budget_item->valuestring) ? atoi(bus_budget_item->valuestring) : 0;
             all_pids->pid_std_en = standard_pids_item ? (strcmp(standard_pids_item->valuestring, "enable") == 0) : false;
             all_pids->pid_specific_en = specific_pids_item ? (strcmp(specific_pids_item->valuestring, "enable") == 0) : false;
             all_pids->group_destination = group_destination_item ? strdup(group_destination_item->valuestring) : NULL;
@@ -1627,6 +2376,8 @@ all_pids_t* load_all_pids(void){
                             strdup(unit_item->valuestring) : strdup("none");
                         curr_pid->parameters->class = class_item && class_item->valuestring ? 
                             strdup(class_item->valuestring) : strdup("none");
+                        publish_policy_parse(&curr_pid->parameters->policy, pid);
+                        curr_pid->parameters->priority = autopid_parse_priority(pid);
                     }
                     
                     pid_index++;
@@ -1667,6 +2418,8 @@ all_pids_t* load_all_pids(void){
                         curr_pid->parameters->value = FLT_MAX;
                         curr_pid->parameters->sensor_type = sensor_type_item ? 
                             (strcmp(sensor_type_item->valuestring, "binary") == 0 ? BINARY_SENSOR : SENSOR) : SENSOR;
+                        publish_policy_parse(&curr_pid->parameters->policy, pid);
+                        curr_pid->parameters->priority = autopid_parse_priority(pid);
                             
                         curr_pid->rxheader = rxheader_item ? strdup(rxheader_item->valuestring) : NULL;
 
@@ -1726,6 +2479,8 @@ all_pids_t* load_all_pids(void){
                                         if(curr_pid->cmd) {
                                             sprintf(curr_pid->cmd, "01%s\r", pid_hex);
                                         }
+                                        curr_pid->std_pid = (uint8_t)strtol(pid_hex, NULL, 16);
+                                        curr_pid->std_len = autopid_std_data_len(pid_info);
                                     }
                                 }
                             }
@@ -1872,6 +2627,9 @@ all_pids_t* load_all_pids(void){
                                             strcmp(destination_type_item->valuestring, "MQTT_WallBox") == 0 ? DEST_MQTT_WALLBOX :
                                             DEST_DEFAULT) : DEST_DEFAULT;
 
+                                    publish_policy_parse(&curr_pid->parameters[param_index].policy, param);
+                                    curr_pid->parameters[param_index].priority = autopid_parse_priority(param);
+
                                     param_index++;
                                 }
                             }
@@ -21,6 +21,8 @@
 #ifndef __AUTO_PID_H__
 #define __AUTO_PID_H__
 
+#include "publish_policy.h"
+
 #define BUFFER_SIZE 1024
 #define QUEUE_SIZE 10
 
@@ -56,6 +58,14 @@ typedef enum
     DEST_MAX
 }destination_type_t;
 
+typedef enum
+{
+    AUTOPID_PRIO_HIGH = 0,
+    AUTOPID_PRIO_NORMAL,
+    AUTOPID_PRIO_LOW,
+    AUTOPID_PRIO_MAX
+}autopid_prio_t;
+
 typedef struct 
 {
     char *name;
@@ -71,6 +81,13 @@ typedef struct
     int64_t timer;
     float value;
     bool failed;
+    bool topic_cached;
+    int16_t topic_id;       // interned destination
+    publish_policy_t policy;
+    publish_state_t pub_state;
+    autopid_prio_t priority;
+    uint32_t missed;        // polls later than the next release
+    uint32_t late_max;      // ms
 }parameter_t;
 
 typedef struct 
@@ -82,6 +99,10 @@ typedef struct
     uint32_t parameters_count;
     pid_type_t pid_type;
     char* rxheader;
+    uint8_t std_pid;        // mode 01 PID, PID_STD only
+    uint8_t std_len;        // response data bytes, 0 when it is not packed with other PIDs
+    autopid_prio_t priority;
+    uint8_t init_group;     // PIDs with the same type and init
 }pid_data2_t;
 
 typedef struct 
@@ -103,6 +124,7 @@ typedef struct
     char* vehicle_model;
     bool ha_discovery_en;
     uint32_t cycle;     //To be removed when std pid gets its own period
+    uint32_t bus_budget;    // ms of polling per second for normal and low priority, 0 no limit
     SemaphoreHandle_t mutex;
 }all_pids_t;
 
@@ -126,6 +148,7 @@ void autopid_init(char* id);
 char *autopid_data_read(void);
 bool autopid_get_ecu_status(void);
 char* autopid_get_config(void);
+char *autopid_get_sched_stats(void);
 esp_err_t autopid_find_standard_pid(uint8_t protocol, char *available_pids, uint32_t available_pids_size) ;
 void autopid_request_data(void);
 #endif
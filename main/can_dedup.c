@@ -0,0 +1,156 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "config_server.h"
+#include "can_dedup.h"
+
+#define TAG                     __func__
+
+// Last payload per CAN ID, open addressing. Only the CAN RX task uses it.
+#define DEDUP_TABLE_SIZE        256         // power of two
+#define DEDUP_EMPTY             0xFFFFFFFFU
+#define DEDUP_KEY_EXTD          (1UL << 31)
+
+typedef struct
+{
+    uint32_t key;               // identifier | DEDUP_KEY_EXTD
+    uint32_t last_ms;
+    uint16_t suppressed;
+    uint8_t dlc;
+    uint8_t data[8];
+} dedup_entry_t;
+
+static dedup_entry_t *table = NULL;
+static uint32_t table_used = 0;
+static uint8_t outputs = 0;
+static uint32_t refresh_ms = 0;
+static uint32_t forwarded_count = 0;
+static uint32_t suppressed_count = 0;
+
+static inline uint32_t dedup_hash(uint32_t key)
+{
+    key ^= key >> 16;
+    key *= 0x45d9f3bU;
+    key ^= key >> 16;
+    return key & (DEDUP_TABLE_SIZE - 1);
+}
+
+static dedup_entry_t *dedup_lookup(uint32_t key, bool *created)
+{
+    uint32_t slot = dedup_hash(key);
+
+    *created = false;
+    for(uint32_t n = 0; n < DEDUP_TABLE_SIZE; n++)
+    {
+        dedup_entry_t *e = &table[slot];
+
+        if(e->key == key)
+        {
+            return e;
+        }
+        if(e->key == DEDUP_EMPTY)
+        {
+            if(table_used >= DEDUP_TABLE_SIZE * 3 / 4)
+            {
+                return NULL;
+            }
+            e->key = key;
+            table_used++;
+            *created = true;
+            return e;
+        }
+        slot = (slot + 1) & (DEDUP_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+void can_dedup_init(void)
+{
+    if(config_server_can_dedup_config() != 1)
+    {
+        return;
+    }
+
+    outputs = config_server_get_can_dedup_outputs();
+    refresh_ms = config_server_get_can_dedup_refresh();
+
+    table = (dedup_entry_t *)malloc(DEDUP_TABLE_SIZE * sizeof(dedup_entry_t));
+    if(table == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate the ID table");
+        outputs = 0;
+        return;
+    }
+    memset(table, 0xFF, DEDUP_TABLE_SIZE * sizeof(dedup_entry_t));
+    ESP_LOGI(TAG, "outputs: 0x%02x, refresh: %lu ms", outputs, refresh_ms);
+}
+
+// Returns the outputs that should get this frame. Deduplicated outputs only
+// get it when the payload changed or refresh_ms passed since the last one
+// they got; suppressed is set to the number of repeats held back before it.
+uint8_t can_dedup_check(const twai_message_t *frame, uint32_t now_ms, uint16_t *suppressed)
+{
+    uint8_t dlc = (frame->data_length_code > 8) ? 8 : frame->data_length_code;
+    dedup_entry_t *e;
+    bool created;
+
+    *suppressed = 0;
+    if(outputs == 0)
+    {
+        return CAN_DEDUP_ALL;
+    }
+
+    e = dedup_lookup(frame->identifier | (frame->extd ? DEDUP_KEY_EXTD : 0), &created);
+    if(e == NULL)
+    {
+        // Table full, forward everything for the IDs that didn't fit
+        return CAN_DEDUP_ALL;
+    }
+
+    if(!created && !frame->rtr && e->dlc == dlc && memcmp(e->data, frame->data, dlc) == 0 &&
+        (refresh_ms == 0 || (now_ms - e->last_ms) < refresh_ms))
+    {
+        if(e->suppressed < UINT16_MAX)
+        {
+            e->suppressed++;
+        }
+        suppressed_count++;
+        return CAN_DEDUP_ALL & ~outputs;
+    }
+
+    *suppressed = created ? 0 : e->suppressed;
+    e->suppressed = 0;
+    e->last_ms = now_ms;
+    e->dlc = dlc;
+    memcpy(e->data, frame->data, sizeof(e->data));
+    forwarded_count++;
+    return CAN_DEDUP_ALL;
+}
+
+void can_dedup_stats(uint32_t *forwarded, uint32_t *suppressed)
+{
+    *forwarded = forwarded_count;
+    *suppressed = suppressed_count;
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef __CAN_DEDUP_H__
+#define __CAN_DEDUP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/twai.h"
+
+// Outputs of the RX fan-out that can be deduplicated
+#define CAN_DEDUP_TCP           0x01
+#define CAN_DEDUP_WS            0x02
+#define CAN_DEDUP_MQTT          0x04
+#define CAN_DEDUP_BLE           0x08
+#define CAN_DEDUP_ALL           0x0F
+
+void can_dedup_init(void);
+uint8_t can_dedup_check(const twai_message_t *frame, uint32_t now_ms, uint16_t *suppressed);
+void can_dedup_stats(uint32_t *forwarded, uint32_t *suppressed);
+
+#endif
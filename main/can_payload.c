@@ -0,0 +1,1042 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "can_payload.h"
+
+// Worst case size of one encoded frame per format, and of its optional fields
+#define JSON_FRAME_MAX          96
+#define CBOR_FRAME_MAX          16
+#define MSGPACK_FRAME_MAX       17
+#define RECORD_TS_MAX           16
+#define SUPPRESSED_MAX          12
+#define HEADER_MAX              48      // map header up to the frame array, any format
+#define PAYLOAD_MAX_DEPTH       8
+#define CBOR_MAX_TAGS           4       // nested tags in front of one item
+
+static const uint16_t frame_max[MQTT_PAYLOAD_MAX] = {
+    [MQTT_PAYLOAD_JSON] = JSON_FRAME_MAX + 2,
+    [MQTT_PAYLOAD_CBOR] = CBOR_FRAME_MAX,
+    [MQTT_PAYLOAD_MSGPACK] = MSGPACK_FRAME_MAX,
+    [MQTT_PAYLOAD_BINARY] = CAN_PAYLOAD_BIN_RECORD_SIZE,
+};
+
+static void put_u8(can_payload_t *p, uint8_t v)
+{
+    if(p->len >= p->size)
+    {
+        p->overflow = true;
+        return;
+    }
+    p->buf[p->len++] = v;
+}
+
+static void put_bytes(can_payload_t *p, const uint8_t *v, size_t n)
+{
+    if(n > p->size - p->len)
+    {
+        p->overflow = true;
+        return;
+    }
+    memcpy(&p->buf[p->len], v, n);
+    p->len += n;
+}
+
+static void put_be16(can_payload_t *p, uint16_t v)
+{
+    put_u8(p, v >> 8);
+    put_u8(p, v);
+}
+
+static void put_be32(can_payload_t *p, uint32_t v)
+{
+    put_be16(p, v >> 16);
+    put_be16(p, v);
+}
+
+static void put_le16(can_payload_t *p, uint16_t v)
+{
+    put_u8(p, v);
+    put_u8(p, v >> 8);
+}
+
+static void put_le32(can_payload_t *p, uint32_t v)
+{
+    put_le16(p, v);
+    put_le16(p, v >> 16);
+}
+
+static void cbor_head(can_payload_t *p, uint8_t major, uint32_t v)
+{
+    major <<= 5;
+    if(v < 24)
+    {
+        put_u8(p, major | v);
+    }
+    else if(v <= 0xFF)
+    {
+        put_u8(p, major | 24);
+        put_u8(p, v);
+    }
+    else if(v <= 0xFFFF)
+    {
+        put_u8(p, major | 25);
+        put_be16(p, v);
+    }
+    else
+    {
+        put_u8(p, major | 26);
+        put_be32(p, v);
+    }
+}
+
+static void cbor_text(can_payload_t *p, const char *s)
+{
+    size_t n = strlen(s);
+    cbor_head(p, 3, n);
+    put_bytes(p, (const uint8_t *)s, n);
+}
+
+static void mpack_uint(can_payload_t *p, uint32_t v)
+{
+    if(v < 0x80)
+    {
+        put_u8(p, v);
+    }
+    else if(v <= 0xFF)
+    {
+        put_u8(p, 0xCC);
+        put_u8(p, v);
+    }
+    else if(v <= 0xFFFF)
+    {
+        put_u8(p, 0xCD);
+        put_be16(p, v);
+    }
+    else
+    {
+        put_u8(p, 0xCE);
+        put_be32(p, v);
+    }
+}
+
+static void mpack_str(can_payload_t *p, const char *s)
+{
+    size_t n = strlen(s);
+    put_u8(p, 0xA0 | n);
+    put_bytes(p, (const uint8_t *)s, n);
+}
+
+void can_payload_begin(can_payload_t *p, mqtt_payload_format_t format, uint8_t *buf, size_t size, bool tx, uint32_t ts)
+{
+    p->format = (format < MQTT_PAYLOAD_MAX) ? format : MQTT_PAYLOAD_JSON;
+    p->buf = buf;
+    p->size = size;
+    p->len = 0;
+    p->count = 0;
+    p->overflow = false;
+    p->record_ts = false;
+
+    switch(p->format)
+    {
+        case MQTT_PAYLOAD_CBOR:
+            cbor_head(p, 5, 4);
+            cbor_text(p, "bus");
+            cbor_head(p, 0, 0);
+            cbor_text(p, "type");
+            cbor_text(p, tx ? "tx" : "rx");
+            cbor_text(p, "ts");
+            cbor_head(p, 0, ts);
+            cbor_text(p, "frame");
+            // Array of 16 bit length, patched in can_payload_end
+            put_u8(p, (4 << 5) | 25);
+            p->count_pos = p->len;
+            put_be16(p, 0);
+            break;
+
+        case MQTT_PAYLOAD_MSGPACK:
+            put_u8(p, 0x84);
+            mpack_str(p, "bus");
+            mpack_uint(p, 0);
+            mpack_str(p, "type");
+            mpack_str(p, tx ? "tx" : "rx");
+            mpack_str(p, "ts");
+            mpack_uint(p, ts);
+            mpack_str(p, "frame");
+            put_u8(p, 0xDC);
+            p->count_pos = p->len;
+            put_be16(p, 0);
+            break;
+
+        case MQTT_PAYLOAD_BINARY:
+            put_u8(p, CAN_PAYLOAD_BIN_MAGIC);
+            put_u8(p, CAN_PAYLOAD_BIN_VERSION);
+            put_u8(p, tx ? 1 : 0);
+            p->count_pos = p->len;
+            put_le16(p, 0);
+            break;
+
+        default:
+            wc_json_init(&p->json, (char *)buf, size);
+            wc_json_raw(&p->json, "{\"bus\":\"0\",\"type\":\"", 19);
+            wc_json_str(&p->json, tx ? "tx" : "rx");
+            wc_json_raw(&p->json, "\",\"ts\":", 7);
+            wc_json_uint(&p->json, ts);
+            wc_json_raw(&p->json, ",\"frame\":[", 10);
+            break;
+    }
+}
+
+// Adds the receive timestamp to every frame, the binary format always has it
+void can_payload_record_ts(can_payload_t *p, bool enable)
+{
+    p->record_ts = enable;
+}
+
+bool can_payload_has_room(const can_payload_t *p)
+{
+    size_t used = (p->format == MQTT_PAYLOAD_JSON) ? p->json.len + 1 : p->len;
+    size_t need = frame_max[p->format] + (p->record_ts ? RECORD_TS_MAX : 0) +
+                    ((p->format != MQTT_PAYLOAD_BINARY) ? SUPPRESSED_MAX : 0);
+
+    return (p->count < UINT16_MAX) && ((p->size - used) >= need);
+}
+
+void can_payload_add(can_payload_t *p, const twai_message_t *frame, uint32_t timestamp)
+{
+    can_payload_add_suppressed(p, frame, timestamp, 0);
+}
+
+// Frames get the number of identical frames the dedup stage held back
+// before this one, as a "sup" field in JSON and as the fifth frame array
+// element in CBOR and MessagePack. The binary format has no room for it.
+void can_payload_add_suppressed(can_payload_t *p, const twai_message_t *frame, uint32_t timestamp, uint16_t suppressed)
+{
+    uint8_t dlc = (frame->data_length_code > 8) ? 8 : frame->data_length_code;
+    uint8_t flags = (frame->extd ? CAN_PAYLOAD_FLAG_EXTD : 0) | (frame->rtr ? CAN_PAYLOAD_FLAG_RTR : 0);
+    uint8_t elements = (suppressed != 0) ? 5 : (p->record_ts ? 4 : 3);
+    wc_json_t *jw = &p->json;
+
+    switch(p->format)
+    {
+        case MQTT_PAYLOAD_CBOR:
+            cbor_head(p, 4, elements);
+            cbor_head(p, 0, frame->identifier);
+            cbor_head(p, 0, flags);
+            cbor_head(p, 2, dlc);
+            put_bytes(p, frame->data, dlc);
+            if(p->record_ts)
+            {
+                cbor_head(p, 0, timestamp);
+            }
+            else if(elements > 4)
+            {
+                put_u8(p, 0xF6);
+            }
+            if(elements > 4)
+            {
+                cbor_head(p, 0, suppressed);
+            }
+            break;
+
+        case MQTT_PAYLOAD_MSGPACK:
+            put_u8(p, 0x90 | elements);
+            mpack_uint(p, frame->identifier);
+            mpack_uint(p, flags);
+            put_u8(p, 0xC4);
+            put_u8(p, dlc);
+            put_bytes(p, frame->data, dlc);
+            if(p->record_ts)
+            {
+                mpack_uint(p, timestamp);
+            }
+            else if(elements > 4)
+            {
+                put_u8(p, 0xC0);
+            }
+            if(elements > 4)
+            {
+                mpack_uint(p, suppressed);
+            }
+            break;
+
+        case MQTT_PAYLOAD_BINARY:
+            put_le32(p, timestamp);
+            put_le32(p, frame->identifier | (frame->extd ? CAN_PAYLOAD_BIN_EXTD_FLAG : 0) | (frame->rtr ? CAN_PAYLOAD_BIN_RTR_FLAG : 0));
+            put_u8(p, dlc);
+            put_bytes(p, frame->data, 8);
+            break;
+
+        default:
+            wc_json_raw(jw, "{\"id\":", 6);
+            wc_json_uint(jw, frame->identifier);
+            wc_json_raw(jw, ",\"dlc\":", 7);
+            wc_json_uint(jw, frame->data_length_code);
+            wc_json_raw(jw, ",\"rtr\":", 7);
+            wc_json_bool(jw, frame->rtr);
+            wc_json_raw(jw, ",\"extd\":", 8);
+            wc_json_bool(jw, frame->extd);
+            wc_json_raw(jw, ",\"data\":[", 9);
+            for(uint8_t i = 0; i < 8; i++)
+            {
+                wc_json_uint(jw, frame->data[i]);
+                wc_json_char(jw, (i < 7) ? ',' : ']');
+            }
+            if(p->record_ts)
+            {
+                wc_json_raw(jw, ",\"ts\":", 6);
+                wc_json_uint(jw, timestamp);
+            }
+            if(suppressed != 0)
+            {
+                wc_json_raw(jw, ",\"sup\":", 7);
+                wc_json_uint(jw, suppressed);
+            }
+            wc_json_raw(jw, "},", 2);
+            break;
+    }
+    p->count++;
+}
+
+// Smallest buffer that still holds the header and one frame with every
+// optional field, smaller buffers never accept a frame
+size_t can_payload_min_size(mqtt_payload_format_t format)
+{
+    format = (format < MQTT_PAYLOAD_MAX) ? format : MQTT_PAYLOAD_JSON;
+    return HEADER_MAX + frame_max[format] + RECORD_TS_MAX + SUPPRESSED_MAX + 2;
+}
+
+// Returns the payload length, 0 if the buffer overflowed
+size_t can_payload_end(can_payload_t *p)
+{
+    switch(p->format)
+    {
+        case MQTT_PAYLOAD_CBOR:
+        case MQTT_PAYLOAD_MSGPACK:
+            p->buf[p->count_pos] = p->count >> 8;
+            p->buf[p->count_pos + 1] = p->count;
+            break;
+
+        case MQTT_PAYLOAD_BINARY:
+            p->buf[p->count_pos] = p->count;
+            p->buf[p->count_pos + 1] = p->count >> 8;
+            break;
+
+        default:
+            wc_json_unterminate(&p->json, ',');
+            wc_json_raw(&p->json, "]}", 2);
+            p->len = p->json.len;
+            p->overflow = p->json.overflow;
+            break;
+    }
+
+    return p->overflow ? 0 : p->len;
+}
+
+mqtt_payload_format_t can_payload_detect(const uint8_t *data, size_t len)
+{
+    if(len == 0)
+    {
+        return MQTT_PAYLOAD_JSON;
+    }
+
+    if(data[0] == CAN_PAYLOAD_BIN_MAGIC)
+    {
+        return MQTT_PAYLOAD_BINARY;
+    }
+    // CBOR map
+    if(data[0] >= 0xA0 && data[0] <= 0xBB)
+    {
+        return MQTT_PAYLOAD_CBOR;
+    }
+    // MessagePack fixmap, map16, map32
+    if((data[0] >= 0x80 && data[0] <= 0x8F) || data[0] == 0xDE || data[0] == 0xDF)
+    {
+        return MQTT_PAYLOAD_MSGPACK;
+    }
+    return MQTT_PAYLOAD_JSON;
+}
+
+typedef enum
+{
+    TOK_UINT,
+    TOK_NINT,
+    TOK_BYTES,
+    TOK_TEXT,
+    TOK_ARRAY,
+    TOK_MAP,
+    TOK_OTHER,
+} tok_kind_t;
+
+typedef struct
+{
+    tok_kind_t kind;
+    uint64_t val;
+    const uint8_t *ptr;
+} tok_t;
+
+typedef struct reader
+{
+    const uint8_t *p;
+    const uint8_t *end;
+    bool (*next)(struct reader *r, tok_t *t);
+} reader_t;
+
+static bool rd_uint(reader_t *r, uint8_t n, uint64_t *v)
+{
+    if((size_t)(r->end - r->p) < n)
+    {
+        return false;
+    }
+    *v = 0;
+    for(uint8_t i = 0; i < n; i++)
+    {
+        *v = (*v << 8) | *r->p++;
+    }
+    return true;
+}
+
+// Strings and byte strings: the token points at the content, which is skipped
+static bool rd_content(reader_t *r, tok_t *t)
+{
+    if((uint64_t)(r->end - r->p) < t->val)
+    {
+        return false;
+    }
+    t->ptr = r->p;
+    r->p += t->val;
+    return true;
+}
+
+static bool cbor_next(reader_t *r, tok_t *t)
+{
+    static const tok_kind_t kinds[8] = {TOK_UINT, TOK_NINT, TOK_BYTES, TOK_TEXT, TOK_ARRAY, TOK_MAP, TOK_OTHER, TOK_OTHER};
+    uint8_t major;
+
+    // Tags are skipped, the tagged item follows them
+    for(uint8_t tags = 0; ; tags++)
+    {
+        if(r->p >= r->end || tags > CBOR_MAX_TAGS)
+        {
+            return false;
+        }
+
+        uint8_t ib = *r->p++;
+        uint8_t info = ib & 0x1F;
+
+        major = ib >> 5;
+        t->kind = kinds[major];
+        if(info < 24)
+        {
+            t->val = info;
+        }
+        else if(info <= 27)
+        {
+            if(!rd_uint(r, 1 << (info - 24), &t->val))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            // Indefinite lengths are not supported
+            return false;
+        }
+
+        if(major != 6)
+        {
+            break;
+        }
+    }
+
+    if(major == 7)
+    {
+        // Simple values and floats carry no content
+        t->val = 0;
+    }
+    else if(major == 2 || major == 3)
+    {
+        return rd_content(r, t);
+    }
+    return true;
+}
+
+static bool mpack_next(reader_t *r, tok_t *t)
+{
+    if(r->p >= r->end)
+    {
+        return false;
+    }
+
+    uint8_t b = *r->p++;
+
+    t->kind = TOK_OTHER;
+    t->val = 0;
+
+    if(b <= 0x7F)
+    {
+        t->kind = TOK_UINT;
+        t->val = b;
+    }
+    else if(b <= 0x8F)
+    {
+        t->kind = TOK_MAP;
+        t->val = b & 0x0F;
+    }
+    else if(b <= 0x9F)
+    {
+        t->kind = TOK_ARRAY;
+        t->val = b & 0x0F;
+    }
+    else if(b <= 0xBF)
+    {
+        t->kind = TOK_TEXT;
+        t->val = b & 0x1F;
+        return rd_content(r, t);
+    }
+    else if(b >= 0xE0)
+    {
+        t->kind = TOK_NINT;
+    }
+    else
+    {
+        switch(b)
+        {
+            case 0xC0: case 0xC2: case 0xC3:
+                return true;
+            case 0xC4: case 0xC5: case 0xC6:
+                t->kind = TOK_BYTES;
+                return rd_uint(r, 1 << (b - 0xC4), &t->val) && rd_content(r, t);
+            case 0xC7: case 0xC8: case 0xC9:
+                // ext: length, type, data
+                if(!rd_uint(r, 1 << (b - 0xC7), &t->val))
+                {
+                    return false;
+                }
+                t->val++;
+                return rd_content(r, t);
+            case 0xCA: case 0xCB:
+                t->val = (b == 0xCA) ? 4 : 8;
+                return rd_content(r, t);
+            case 0xCC: case 0xCD: case 0xCE: case 0xCF:
+                t->kind = TOK_UINT;
+                return rd_uint(r, 1 << (b - 0xCC), &t->val);
+            case 0xD0: case 0xD1: case 0xD2: case 0xD3:
+                t->kind = TOK_NINT;
+                t->val = 1 << (b - 0xD0);
+                return rd_content(r, t);
+            case 0xD4: case 0xD5: case 0xD6: case 0xD7: case 0xD8:
+                // fixext: type and 1 to 16 bytes
+                t->val = 1 + (1 << (b - 0xD4));
+                return rd_content(r, t);
+            case 0xD9: case 0xDA: case 0xDB:
+                t->kind = TOK_TEXT;
+                return rd_uint(r, 1 << (b - 0xD9), &t->val) && rd_content(r, t);
+            case 0xDC: case 0xDD:
+                t->kind = TOK_ARRAY;
+                return rd_uint(r, (b == 0xDC) ? 2 : 4, &t->val);
+            case 0xDE: case 0xDF:
+                t->kind = TOK_MAP;
+                return rd_uint(r, (b == 0xDE) ? 2 : 4, &t->val);
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool rd_skip(reader_t *r, uint8_t depth)
+{
+    tok_t t;
+
+    if(depth > PAYLOAD_MAX_DEPTH || !r->next(r, &t))
+    {
+        return false;
+    }
+
+    if(t.kind == TOK_ARRAY || t.kind == TOK_MAP)
+    {
+        uint64_t n = (t.kind == TOK_MAP) ? t.val * 2 : t.val;
+
+        for(uint64_t i = 0; i < n; i++)
+        {
+            if(!rd_skip(r, depth + 1))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static int rd_frames(reader_t *r, can_payload_frame_cb_t cb, void *arg)
+{
+    tok_t t;
+    int count = 0;
+
+    if(!r->next(r, &t) || t.kind != TOK_MAP)
+    {
+        return -1;
+    }
+
+    for(uint64_t pair = t.val; pair > 0; pair--)
+    {
+        tok_t key;
+
+        if(!r->next(r, &key))
+        {
+            return -1;
+        }
+
+        if(key.kind != TOK_TEXT || key.val != 5 || memcmp(key.ptr, "frame", 5) != 0)
+        {
+            if(!rd_skip(r, 1))
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        tok_t ary;
+        if(!r->next(r, &ary) || ary.kind != TOK_ARRAY)
+        {
+            return -1;
+        }
+
+        for(uint64_t i = 0; i < ary.val; i++)
+        {
+            tok_t f, id, flags, data;
+            twai_message_t frame = {0};
+
+            if(!r->next(r, &f) || f.kind != TOK_ARRAY || f.val < 3 ||
+                !r->next(r, &id) || id.kind != TOK_UINT ||
+                !r->next(r, &flags) || flags.kind != TOK_UINT ||
+                !r->next(r, &data) || data.kind != TOK_BYTES || data.val > 8)
+            {
+                return -1;
+            }
+
+            // Extra elements such as a timestamp are ignored
+            for(uint64_t x = 3; x < f.val; x++)
+            {
+                if(!rd_skip(r, 2))
+                {
+                    return -1;
+                }
+            }
+
+            frame.extd = (flags.val & CAN_PAYLOAD_FLAG_EXTD) ? 1 : 0;
+            frame.rtr = (flags.val & CAN_PAYLOAD_FLAG_RTR) ? 1 : 0;
+            frame.identifier = id.val & (frame.extd ? TWAI_EXTD_ID_MASK : TWAI_STD_ID_MASK);
+            frame.data_length_code = data.val;
+            memcpy(frame.data, data.ptr, data.val);
+            if(cb != NULL)
+            {
+                cb(&frame, arg);
+            }
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static int bin_frames(const uint8_t *data, size_t len, can_payload_frame_cb_t cb, void *arg)
+{
+    if(len < CAN_PAYLOAD_BIN_HEADER_SIZE || data[0] != CAN_PAYLOAD_BIN_MAGIC || data[1] != CAN_PAYLOAD_BIN_VERSION)
+    {
+        return -1;
+    }
+
+    uint16_t count = data[3] | (data[4] << 8);
+
+    if(len < CAN_PAYLOAD_BIN_HEADER_SIZE + (size_t)count * CAN_PAYLOAD_BIN_RECORD_SIZE)
+    {
+        return -1;
+    }
+
+    data += CAN_PAYLOAD_BIN_HEADER_SIZE;
+    for(uint16_t i = 0; i < count; i++, data += CAN_PAYLOAD_BIN_RECORD_SIZE)
+    {
+        twai_message_t frame = {0};
+        uint32_t id = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t)data[7] << 24);
+
+        frame.extd = (id & CAN_PAYLOAD_BIN_EXTD_FLAG) ? 1 : 0;
+        frame.rtr = (id & CAN_PAYLOAD_BIN_RTR_FLAG) ? 1 : 0;
+        frame.identifier = id & (frame.extd ? TWAI_EXTD_ID_MASK : TWAI_STD_ID_MASK);
+        frame.data_length_code = (data[8] > 8) ? 8 : data[8];
+        memcpy(frame.data, &data[9], 8);
+        if(cb != NULL)
+        {
+            cb(&frame, arg);
+        }
+    }
+
+    return count;
+}
+
+// JSON can/tx payloads are scanned in place, no DOM and no allocation:
+// {"bus":0,"type":"tx","frame":[{"id":..,"dlc":..,"rtr":..,"extd":..,"data":[..]}]}
+typedef struct
+{
+    const char *p;
+    const char *end;
+} jreader_t;
+
+static void js_ws(jreader_t *j)
+{
+    while(j->p < j->end && (*j->p == ' ' || *j->p == '\t' || *j->p == '\r' || *j->p == '\n'))
+    {
+        j->p++;
+    }
+}
+
+static bool js_peek(jreader_t *j, char c)
+{
+    js_ws(j);
+    return (j->p < j->end && *j->p == c);
+}
+
+static bool js_expect(jreader_t *j, char c)
+{
+    if(!js_peek(j, c))
+    {
+        return false;
+    }
+    j->p++;
+    return true;
+}
+
+// Points str at the raw content of a string, escapes are left in place
+static bool js_string(jreader_t *j, const char **str, size_t *len)
+{
+    if(!js_expect(j, '"'))
+    {
+        return false;
+    }
+
+    const char *start = j->p;
+
+    while(j->p < j->end && *j->p != '"')
+    {
+        j->p += (*j->p == '\\') ? 2 : 1;
+    }
+    if(j->p >= j->end)
+    {
+        return false;
+    }
+    *str = start;
+    *len = j->p++ - start;
+    return true;
+}
+
+static bool js_uint(jreader_t *j, uint32_t *v)
+{
+    uint64_t n = 0;
+
+    js_ws(j);
+    if(j->p >= j->end || *j->p < '0' || *j->p > '9')
+    {
+        return false;
+    }
+    while(j->p < j->end && *j->p >= '0' && *j->p <= '9')
+    {
+        n = n * 10 + (*j->p++ - '0');
+        if(n > UINT32_MAX)
+        {
+            return false;
+        }
+    }
+    *v = n;
+    return true;
+}
+
+static bool js_bool(jreader_t *j, bool *v)
+{
+    js_ws(j);
+    if(j->end - j->p >= 4 && memcmp(j->p, "true", 4) == 0)
+    {
+        j->p += 4;
+        *v = true;
+        return true;
+    }
+    if(j->end - j->p >= 5 && memcmp(j->p, "false", 5) == 0)
+    {
+        j->p += 5;
+        *v = false;
+        return true;
+    }
+    return false;
+}
+
+static bool js_skip(jreader_t *j, uint8_t depth)
+{
+    const char *s;
+    size_t n;
+
+    if(depth > PAYLOAD_MAX_DEPTH)
+    {
+        return false;
+    }
+
+    if(js_peek(j, '"'))
+    {
+        return js_string(j, &s, &n);
+    }
+
+    if(js_peek(j, '{') || js_peek(j, '['))
+    {
+        char close = (*j->p++ == '{') ? '}' : ']';
+
+        if(js_expect(j, close))
+        {
+            return true;
+        }
+        do
+        {
+            if(close == '}' && (!js_string(j, &s, &n) || !js_expect(j, ':')))
+            {
+                return false;
+            }
+            if(!js_skip(j, depth + 1))
+            {
+                return false;
+            }
+        } while(js_expect(j, ','));
+        return js_expect(j, close);
+    }
+
+    // Number or literal
+    const char *start = j->p;
+    while(j->p < j->end && *j->p != ',' && *j->p != '}' && *j->p != ']' &&
+            *j->p != ' ' && *j->p != '\t' && *j->p != '\r' && *j->p != '\n')
+    {
+        j->p++;
+    }
+    return j->p != start;
+}
+
+static bool js_key_is(const char *key, size_t len, const char *name)
+{
+    return (strlen(name) == len && memcmp(key, name, len) == 0);
+}
+
+// One frame object, "id" and "data" are required, "dlc" defaults to the
+// data length and "rtr"/"extd" to false
+static bool js_frame(jreader_t *j, twai_message_t *frame)
+{
+    bool has_id = false, has_data = false, has_dlc = false;
+    bool extd = false, rtr = false;
+    uint32_t id = 0, dlc = 0;
+
+    if(!js_expect(j, '{'))
+    {
+        return false;
+    }
+
+    if(!js_expect(j, '}'))
+    {
+        do
+        {
+            const char *key;
+            size_t len;
+            bool ok;
+
+            if(!js_string(j, &key, &len) || !js_expect(j, ':'))
+            {
+                return false;
+            }
+
+            if(js_key_is(key, len, "id"))
+            {
+                ok = has_id = js_uint(j, &id);
+            }
+            else if(js_key_is(key, len, "dlc"))
+            {
+                ok = has_dlc = js_uint(j, &dlc);
+            }
+            else if(js_key_is(key, len, "extd"))
+            {
+                ok = js_bool(j, &extd);
+            }
+            else if(js_key_is(key, len, "rtr"))
+            {
+                ok = js_bool(j, &rtr);
+            }
+            else if(js_key_is(key, len, "data"))
+            {
+                uint8_t n = 0;
+
+                ok = js_expect(j, '[');
+                if(ok && !js_expect(j, ']'))
+                {
+                    do
+                    {
+                        uint32_t byte;
+
+                        if(n >= 8 || !js_uint(j, &byte) || byte > 0xFF)
+                        {
+                            return false;
+                        }
+                        frame->data[n++] = byte;
+                    } while(js_expect(j, ','));
+                    ok = js_expect(j, ']');
+                }
+                has_data = ok;
+                frame->data_length_code = n;
+            }
+            else
+            {
+                ok = js_skip(j, 3);
+            }
+
+            if(!ok)
+            {
+                return false;
+            }
+        } while(js_expect(j, ','));
+
+        if(!js_expect(j, '}'))
+        {
+            return false;
+        }
+    }
+
+    if(!has_id || !has_data)
+    {
+        return false;
+    }
+
+    frame->extd = extd ? 1 : 0;
+    frame->rtr = rtr ? 1 : 0;
+    frame->identifier = id & (extd ? TWAI_EXTD_ID_MASK : TWAI_STD_ID_MASK);
+    if(has_dlc)
+    {
+        frame->data_length_code = (dlc > 8) ? 8 : dlc;
+    }
+    return true;
+}
+
+static int json_frames(const uint8_t *data, size_t len, can_payload_frame_cb_t cb, void *arg)
+{
+    jreader_t j = {.p = (const char *)data, .end = (const char *)data + len};
+    int count = 0;
+
+    if(!js_expect(&j, '{'))
+    {
+        return -1;
+    }
+    if(js_expect(&j, '}'))
+    {
+        return 0;
+    }
+
+    do
+    {
+        const char *key;
+        size_t key_len;
+
+        if(!js_string(&j, &key, &key_len) || !js_expect(&j, ':'))
+        {
+            return -1;
+        }
+
+        if(!js_key_is(key, key_len, "frame"))
+        {
+            if(!js_skip(&j, 1))
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        if(!js_expect(&j, '['))
+        {
+            return -1;
+        }
+        if(js_expect(&j, ']'))
+        {
+            continue;
+        }
+
+        do
+        {
+            twai_message_t frame = {0};
+
+            if(!js_frame(&j, &frame))
+            {
+                return -1;
+            }
+            if(cb != NULL)
+            {
+                cb(&frame, arg);
+            }
+            count++;
+        } while(js_expect(&j, ','));
+
+        if(!js_expect(&j, ']'))
+        {
+            return -1;
+        }
+    } while(js_expect(&j, ','));
+
+    return js_expect(&j, '}') ? count : -1;
+}
+
+// One decoding pass, cb NULL only validates the payload
+static int payload_frames(mqtt_payload_format_t format, const uint8_t *data, size_t len, can_payload_frame_cb_t cb, void *arg)
+{
+    reader_t r = {.p = data, .end = data + len};
+
+    switch(format)
+    {
+        case MQTT_PAYLOAD_CBOR:
+            r.next = cbor_next;
+            return rd_frames(&r, cb, arg);
+
+        case MQTT_PAYLOAD_MSGPACK:
+            r.next = mpack_next;
+            return rd_frames(&r, cb, arg);
+
+        case MQTT_PAYLOAD_BINARY:
+            return bin_frames(data, len, cb, arg);
+
+        case MQTT_PAYLOAD_JSON:
+            return json_frames(data, len, cb, arg);
+
+        default:
+            return -1;
+    }
+}
+
+// Calls cb for every frame of a can/tx payload, returns the frame count or
+// -1 on a malformed payload. The whole payload is validated first, so no
+// frame of a malformed payload is delivered.
+int can_payload_decode(mqtt_payload_format_t format, const uint8_t *data, size_t len, can_payload_frame_cb_t cb, void *arg)
+{
+    if(payload_frames(format, data, len, NULL, arg) < 0)
+    {
+        return -1;
+    }
+    return payload_frames(format, data, len, cb, arg);
+}
@@ -0,0 +1,77 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __CAN_PAYLOAD_H__
+#define __CAN_PAYLOAD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "driver/twai.h"
+#include "config_server.h"
+#include "wc_json.h"
+
+// Packed binary format, all fields little endian:
+//   header: 'W', version, type (0 rx, 1 tx), frame count (u16)
+//   record: timestamp ms (u32), id (u32, bit31 extd, bit30 rtr), dlc (u8), data[8]
+#define CAN_PAYLOAD_BIN_MAGIC           'W'
+#define CAN_PAYLOAD_BIN_VERSION         1
+#define CAN_PAYLOAD_BIN_HEADER_SIZE     5
+#define CAN_PAYLOAD_BIN_RECORD_SIZE     17
+#define CAN_PAYLOAD_BIN_EXTD_FLAG       (1UL << 31)
+#define CAN_PAYLOAD_BIN_RTR_FLAG        (1UL << 30)
+
+// CBOR and MessagePack carry the JSON layout as a map, each frame is
+// encoded as the array [id, flags, data] with flags bit0 extd, bit1 rtr
+// and data a byte string of dlc bytes. With per record timestamps the
+// frame array gets a fourth element, the JSON frame object a "ts" field.
+// A dedup suppressed count is the fifth element, the fourth is then null
+// without per record timestamps, and "sup" in JSON.
+#define CAN_PAYLOAD_FLAG_EXTD           0x01
+#define CAN_PAYLOAD_FLAG_RTR            0x02
+
+typedef struct
+{
+    mqtt_payload_format_t format;
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    size_t count_pos;
+    uint16_t count;
+    bool overflow;
+    bool record_ts;
+    wc_json_t json;
+} can_payload_t;
+
+typedef void (*can_payload_frame_cb_t)(const twai_message_t *frame, void *arg);
+
+void can_payload_begin(can_payload_t *p, mqtt_payload_format_t format, uint8_t *buf, size_t size, bool tx, uint32_t ts);
+void can_payload_record_ts(can_payload_t *p, bool enable);
+bool can_payload_has_room(const can_payload_t *p);
+void can_payload_add(can_payload_t *p, const twai_message_t *frame, uint32_t timestamp);
+void can_payload_add_suppressed(can_payload_t *p, const twai_message_t *frame, uint32_t timestamp, uint16_t suppressed);
+size_t can_payload_end(can_payload_t *p);
+size_t can_payload_min_size(mqtt_payload_format_t format);
+
+mqtt_payload_format_t can_payload_detect(const uint8_t *data, size_t len);
+int can_payload_decode(mqtt_payload_format_t format, const uint8_t *data, size_t len, can_payload_frame_cb_t cb, void *arg);
+
+#endif
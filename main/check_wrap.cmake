@@ -0,0 +1,54 @@
+# Checks the Mosquitto functions main hooks with -Wl,--wrap. The linker only
+# redirects references that cross object files, so a wrapped function must
+# be called from another object of the archive and never from its own, or
+# the hook is skipped and the counters in mqtt_broker.c drift.
+#
+# cmake -DNM=.. -DOBJDUMP=.. -DAR=.. -DARCHIVE=.. -DSYMBOLS=a,b -DWORK_DIR=.. -P check_wrap.cmake
+
+string(REPLACE "," ";" SYMBOLS "${SYMBOLS}")
+get_filename_component(archive_name "${ARCHIVE}" NAME)
+
+execute_process(COMMAND "${NM}" -A "${ARCHIVE}"
+                OUTPUT_VARIABLE nm_out
+                RESULT_VARIABLE rc)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${NM} failed on ${ARCHIVE}")
+endif()
+string(REPLACE "\n" ";" nm_lines "${nm_out}")
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+foreach(sym ${SYMBOLS})
+    set(member "")
+    set(callers "")
+
+    # Lines are archive:member:[value] type name
+    foreach(line ${nm_lines})
+        if(line MATCHES "^[^:]+:([^:]+):.* [TW] ${sym}$")
+            set(member "${CMAKE_MATCH_1}")
+        elseif(line MATCHES "^[^:]+:([^:]+):.* U ${sym}$")
+            list(APPEND callers "${CMAKE_MATCH_1}")
+        endif()
+    endforeach()
+
+    if(member STREQUAL "")
+        message(FATAL_ERROR "--wrap=${sym}: not defined in ${archive_name}")
+    endif()
+    if(NOT callers)
+        message(FATAL_ERROR "--wrap=${sym}: not called from another object of ${archive_name}, the hook would never run")
+    endif()
+
+    execute_process(COMMAND "${AR}" x "${ARCHIVE}" "${member}"
+                    WORKING_DIRECTORY "${WORK_DIR}"
+                    RESULT_VARIABLE rc)
+    execute_process(COMMAND "${OBJDUMP}" -r "${WORK_DIR}/${member}"
+                    OUTPUT_VARIABLE reloc_out
+                    RESULT_VARIABLE rc2)
+    if(NOT rc EQUAL 0 OR NOT rc2 EQUAL 0)
+        message(FATAL_ERROR "--wrap=${sym}: can't read relocations of ${member}")
+    endif()
+    if(reloc_out MATCHES "R_[A-Za-z0-9_]+[ \t]+${sym}([+-][^\n]*)?\n")
+        message(FATAL_ERROR "--wrap=${sym}: also called inside ${member}, those calls skip the hook")
+    endif()
+endforeach()
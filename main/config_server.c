@@ -49,6 +49,7 @@
 #include <stdlib.h>
 #include "ver.h"
 #include "vehicle_detect.h"
+#include "mqtt_broker.h"
 
 #include <esp_wifi.h>
 #include <esp_event.h>
@@ -74,6 +75,7 @@
 #include "autopid.h"
 #include "wc_mdns.h"
 #include "hw_config.h"
+#include "can_dedup.h"
 
 #define WIFI_CONNECTED_BIT			BIT0
 #define WS_CONNECTED_BIT			BIT1
@@ -110,7 +112,7 @@ static char can_datarate_str[11][7] = {
 								"1000K",
 };
 
-const char device_config_default[] = "{\"wifi_mode\":\"AP\",\"ap_ch\":\"6\",\"sta_ssid\":\"MeatPi\",\"sta_pass\":\"TomatoSauce\",\"sta_security\":\"wpa3\",\"can_datarate\":\"500K\",\"can_mode\":\"normal\",\"port_type\":\"tcp\",\"port\":\"3333\",\"ap_pass\":\"@meatpi#\",\"protocol\":\"slcan\",\"ble_pass\":\"123456\",\"ble_status\":\"disable\",\"sleep_status\":\"disable\",\"sleep_volt\":\"13.1\",\"wakeup_volt\":\"13.5\",\"batt_alert\":\"disable\",\"batt_alert_ssid\":\"MeatPi\",\"batt_alert_pass\":\"TomatoSauce\",\"batt_alert_volt\":\"11.0\",\"batt_alert_protocol\":\"mqtt\",\"batt_alert_url\":\"mqtt://mqtt.eclipseprojects.io\",\"batt_alert_port\":\"1883\",\"batt_alert_topic\":\"CAR1/voltage\",\"batt_mqtt_user\":\"meatpi\",\"batt_mqtt_pass\":\"meatpi\",\"batt_alert_time\":\"1\",\"mqtt_en\":\"disable\",\"mqtt_elm327_log\":\"disable\",\"mqtt_url\":\"mqtt://127.0.0.1\",\"mqtt_port\":\"1883\",\"mqtt_user\":\"meatpi\",\"mqtt_pass\":\"meatpi\",\"keep_alive\":\"30\",\"mqtt_tx_topic\":\"wican/%s/can/tx\",\"mqtt_rx_topic\":\"wican/%s/can/rx\",\"mqtt_status_topic\":\"wican/%s/can/status\",\"mqtt_broker_en\":\"disable\",\"mqtt_broker_port\":\"1883\"}";
+const char device_config_default[] = "{\"wifi_mode\":\"AP\",\"ap_ch\":\"6\",\"sta_ssid\":\"MeatPi\",\"sta_pass\":\"TomatoSauce\",\"sta_security\":\"wpa3\",\"can_datarate\":\"500K\",\"can_mode\":\"normal\",\"port_type\":\"tcp\",\"port\":\"3333\",\"ap_pass\":\"@meatpi#\",\"protocol\":\"slcan\",\"ble_pass\":\"123456\",\"ble_status\":\"disable\",\"sleep_status\":\"disable\",\"sleep_volt\":\"13.1\",\"wakeup_volt\":\"13.5\",\"batt_alert\":\"disable\",\"batt_alert_ssid\":\"MeatPi\",\"batt_alert_pass\":\"TomatoSauce\",\"batt_alert_volt\":\"11.0\",\"batt_alert_protocol\":\"mqtt\",\"batt_alert_url\":\"mqtt://mqtt.eclipseprojects.io\",\"batt_alert_port\":\"1883\",\"batt_alert_topic\":\"CAR1/voltage\",\"batt_mqtt_user\":\"meatpi\",\"batt_mqtt_pass\":\"meatpi\",\"batt_alert_time\":\"1\",\"mqtt_en\":\"disable\",\"mqtt_elm327_log\":\"disable\",\"mqtt_url\":\"mqtt://127.0.0.1\",\"mqtt_port\":\"1883\",\"mqtt_user\":\"meatpi\",\"mqtt_pass\":\"meatpi\",\"keep_alive\":\"30\",\"mqtt_tx_topic\":\"wican/%s/can/tx\",\"mqtt_rx_topic\":\"wican/%s/can/rx\",\"mqtt_status_topic\":\"wican/%s/can/status\",\"mqtt_broker_en\":\"disable\",\"mqtt_broker_port\":\"1883\",\"mqtt_payload_format\":\"json\",\"mqtt_outbox_en\":\"disable\",\"mqtt_outbox_frames\":\"disable\",\"mqtt_outbox_size\":\"64\",\"mqtt_outbox_rate\":\"100\",\"mqtt_protocol\":\"3.1.1\",\"mqtt_msg_expiry\":\"60\",\"mqtt_rx_batch_frames\":\"0\",\"mqtt_rx_batch_bytes\":\"0\",\"mqtt_rx_linger_ms\":\"0\",\"can_dedup\":\"disable\",\"can_dedup_refresh\":\"1000\",\"can_dedup_outputs\":\"tcp,ws,mqtt,ble\",\"can_dedup_count\":\"disable\",\"mqtt_publish_mode\":\"hybrid\",\"mqtt_broker_max_clients\":\"8\",\"mqtt_broker_max_queued\":\"100\",\"mqtt_broker_max_queued_kb\":\"32\",\"mqtt_broker_max_retained\":\"64\",\"mqtt_broker_heap_reserve_kb\":\"0\",\"mqtt_bridge_en\":\"disable\",\"mqtt_bridge_url\":\"mqtt://mqtt.eclipseprojects.io\",\"mqtt_bridge_port\":\"1883\",\"mqtt_bridge_user\":\"\",\"mqtt_bridge_topics\":\"wican/+/can/rx\",\"mqtt_bridge_topic\":\"\",\"mqtt_bridge_interval\":\"5000\",\"mqtt_bridge_queue_kb\":\"16\",\"mqtt_bridge_pass\":\"\",\"mqtt_lvc_retain\":\"60\"}";
 static device_config_t device_config;
 TimerHandle_t xrestartTimer;
 
@@ -349,7 +351,7 @@ static esp_err_t store_config_handler(httpd_req_t *req)
         return ESP_FAIL; // Invalid content length
     }
 
-    buf = (char *)malloc(buf_size);
+    buf = (char *)malloc(buf_size + 1);
     if (!buf)
     {
         return ESP_ERR_NO_MEM; // Memory allocation failure
@@ -369,22 +371,64 @@ static esp_err_t store_config_handler(httpd_req_t *req)
         free(buf);
         return ESP_FAIL;
     }
+    buf[ret] = 0;
+
+    cJSON *root = cJSON_Parse(buf);
+    if (root == NULL)
+    {
+        free(buf);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid JSON");
+        return ESP_FAIL;
+    }
+
+    // The page only sends the keys it knows about, keys set through the API
+    // or by newer firmware must survive a save from an older page
+    char *cfg = NULL;
+    cJSON *file_root = cJSON_Parse(device_config_file);
+    if (file_root != NULL)
+    {
+        cJSON *item;
+
+        cJSON_ArrayForEach(item, root)
+        {
+            cJSON *copy = cJSON_Duplicate(item, true);
+
+            if (copy == NULL)
+            {
+                continue;
+            }
+            cJSON_DeleteItemFromObject(file_root, item->string);
+            cJSON_AddItemToObject(file_root, item->string, copy);
+        }
+        cfg = cJSON_PrintUnformatted(file_root);
+        cJSON_Delete(file_root);
+    }
+    cJSON_Delete(root);
 
     FILE *f = fopen(FS_MOUNT_POINT"/config.json", "w");
     if (f)
     {
-        // Write the received data into the file
-        fwrite(buf, 1, buf_size, f);
+        // Write the merged config, or the received data if the stored one is unreadable
+        if (cfg != NULL)
+        {
+            fputs(cfg, f);
+        }
+        else
+        {
+            fwrite(buf, 1, ret, f);
+        }
         fclose(f);
     }
     else
     {
         // Handle file open error
+        free(cfg);
         free(buf);
         return ESP_FAIL;
     }
 
     // Free dynamically allocated memory
+    free(cfg);
     free(buf);
 
     const char *resp_str = "Configuration saved! Rebooting...";
@@ -856,6 +900,35 @@ static esp_err_t check_status_handler(httpd_req_t *req)
 	cJSON_AddStringToObject(root, "mqtt_status_topic", device_config.mqtt_status_topic);
 	cJSON_AddStringToObject(root, "mqtt_broker_en", device_config.mqtt_broker_en);
 	cJSON_AddStringToObject(root, "mqtt_broker_port", device_config.mqtt_broker_port);
+	cJSON_AddStringToObject(root, "mqtt_payload_format", device_config.mqtt_payload_format);
+	cJSON_AddStringToObject(root, "mqtt_outbox_en", device_config.mqtt_outbox_en);
+	cJSON_AddStringToObject(root, "mqtt_outbox_frames", device_config.mqtt_outbox_frames);
+	cJSON_AddStringToObject(root, "mqtt_outbox_size", device_config.mqtt_outbox_size);
+	cJSON_AddStringToObject(root, "mqtt_outbox_rate", device_config.mqtt_outbox_rate);
+	cJSON_AddStringToObject(root, "mqtt_protocol", device_config.mqtt_protocol);
+	cJSON_AddStringToObject(root, "mqtt_msg_expiry", device_config.mqtt_msg_expiry);
+	cJSON_AddStringToObject(root, "mqtt_rx_batch_frames", device_config.mqtt_rx_batch_frames);
+	cJSON_AddStringToObject(root, "mqtt_rx_batch_bytes", device_config.mqtt_rx_batch_bytes);
+	cJSON_AddStringToObject(root, "mqtt_rx_linger_ms", device_config.mqtt_rx_linger_ms);
+	cJSON_AddStringToObject(root, "can_dedup", device_config.can_dedup);
+	cJSON_AddStringToObject(root, "can_dedup_refresh", device_config.can_dedup_refresh);
+	cJSON_AddStringToObject(root, "can_dedup_outputs", device_config.can_dedup_outputs);
+	cJSON_AddStringToObject(root, "can_dedup_count", device_config.can_dedup_count);
+	cJSON_AddStringToObject(root, "mqtt_publish_mode", device_config.mqtt_publish_mode);
+	cJSON_AddStringToObject(root, "mqtt_broker_max_clients", device_config.mqtt_broker_max_clients);
+	cJSON_AddStringToObject(root, "mqtt_broker_max_queued", device_config.mqtt_broker_max_queued);
+	cJSON_AddStringToObject(root, "mqtt_broker_max_queued_kb", device_config.mqtt_broker_max_queued_kb);
+	cJSON_AddStringToObject(root, "mqtt_broker_max_retained", device_config.mqtt_broker_max_retained);
+	cJSON_AddStringToObject(root, "mqtt_broker_heap_reserve_kb", device_config.mqtt_broker_heap_reserve_kb);
+	cJSON_AddStringToObject(root, "mqtt_bridge_en", device_config.mqtt_bridge_en);
+	cJSON_AddStringToObject(root, "mqtt_bridge_url", device_config.mqtt_bridge_url);
+	cJSON_AddStringToObject(root, "mqtt_bridge_port", device_config.mqtt_bridge_port);
+	cJSON_AddStringToObject(root, "mqtt_bridge_user", device_config.mqtt_bridge_user);
+	cJSON_AddStringToObject(root, "mqtt_bridge_topics", device_config.mqtt_bridge_topics);
+	cJSON_AddStringToObject(root, "mqtt_bridge_topic", device_config.mqtt_bridge_topic);
+	cJSON_AddStringToObject(root, "mqtt_bridge_interval", device_config.mqtt_bridge_interval);
+	cJSON_AddStringToObject(root, "mqtt_bridge_queue_kb", device_config.mqtt_bridge_queue_kb);
+	cJSON_AddStringToObject(root, "mqtt_lvc_retain", device_config.mqtt_lvc_retain);
 	cJSON_AddStringToObject(root, "device_id", device_id);
 	cJSON_AddStringToObject(root, "sta_security", device_config.sta_security);
 	
@@ -1487,6 +1560,149 @@ static esp_err_t vehicle_detect_result_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+static esp_err_t mqtt_broker_stats_handler(httpd_req_t *req)
+{
+    char *resp = malloc(1024);
+
+    if (resp == NULL) {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    if (mqtt_broker_get_stats_json(resp, 1024) < 0) {
+        strcpy(resp, "{\"error\": \"Too many clients\"}");
+        httpd_resp_set_status(req, "500 Internal Server Error");
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+    free(resp);
+
+    return ESP_OK;
+}
+
+// Broker settings that can change without a reboot. The limits apply to the
+// running broker, a new port restarts it.
+static esp_err_t mqtt_broker_config_handler(httpd_req_t *req)
+{
+    static const struct {
+        const char *key;
+        char *value;
+        size_t size;
+    } broker_keys[] = {
+        {"mqtt_broker_port", device_config.mqtt_broker_port, sizeof(device_config.mqtt_broker_port)},
+        {"mqtt_broker_max_clients", device_config.mqtt_broker_max_clients, sizeof(device_config.mqtt_broker_max_clients)},
+        {"mqtt_broker_max_queued", device_config.mqtt_broker_max_queued, sizeof(device_config.mqtt_broker_max_queued)},
+        {"mqtt_broker_max_queued_kb", device_config.mqtt_broker_max_queued_kb, sizeof(device_config.mqtt_broker_max_queued_kb)},
+        {"mqtt_broker_max_retained", device_config.mqtt_broker_max_retained, sizeof(device_config.mqtt_broker_max_retained)},
+        {"mqtt_broker_heap_reserve_kb", device_config.mqtt_broker_heap_reserve_kb, sizeof(device_config.mqtt_broker_heap_reserve_kb)},
+    };
+    char buf[512];
+    const char *error = NULL;
+    cJSON *root = NULL, *file_root = NULL;
+    int ret;
+
+    if (req->content_len <= 0 || req->content_len >= sizeof(buf)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid content length");
+        return ESP_FAIL;
+    }
+
+    ret = httpd_req_recv(req, buf, req->content_len);
+    if (ret <= 0) {
+        return ESP_FAIL;
+    }
+    buf[ret] = 0;
+
+    root = cJSON_Parse(buf);
+    if (root == NULL) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid JSON");
+        return ESP_FAIL;
+    }
+
+    // Validate everything before changing anything
+    for (size_t i = 0; i < sizeof(broker_keys) / sizeof(broker_keys[0]); i++) {
+        cJSON *key = cJSON_GetObjectItem(root, broker_keys[i].key);
+        unsigned long value;
+        char *end;
+
+        if (key == NULL) {
+            continue;
+        }
+        if (!cJSON_IsString(key) || key->valuestring[0] == 0 || strlen(key->valuestring) >= broker_keys[i].size) {
+            error = broker_keys[i].key;
+            break;
+        }
+        value = strtoul(key->valuestring, &end, 10);
+        if (*end != 0 || (broker_keys[i].value == device_config.mqtt_broker_port && (value < 1 || value > 65535))) {
+            error = broker_keys[i].key;
+            break;
+        }
+    }
+
+    if (error != NULL) {
+        cJSON_Delete(root);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, error);
+        return ESP_FAIL;
+    }
+
+    file_root = cJSON_Parse(device_config_file);
+    for (size_t i = 0; i < sizeof(broker_keys) / sizeof(broker_keys[0]); i++) {
+        cJSON *key = cJSON_GetObjectItem(root, broker_keys[i].key);
+
+        if (key == NULL) {
+            continue;
+        }
+        strcpy(broker_keys[i].value, key->valuestring);
+        if (file_root != NULL) {
+            cJSON_DeleteItemFromObject(file_root, broker_keys[i].key);
+            cJSON_AddStringToObject(file_root, broker_keys[i].key, key->valuestring);
+        }
+    }
+    cJSON_Delete(root);
+
+    if (file_root != NULL) {
+        char *cfg = cJSON_PrintUnformatted(file_root);
+
+        cJSON_Delete(file_root);
+        if (cfg != NULL) {
+            FILE *f = fopen(FS_MOUNT_POINT"/config.json", "w");
+            if (f != NULL) {
+                fputs(cfg, f);
+                fclose(f);
+            }
+            free(device_config_file);
+            device_config_file = cfg;
+        }
+    }
+
+    mqtt_broker_limits_t limits;
+    config_server_get_mqtt_broker_limits(&limits);
+    mqtt_broker_set_limits(&limits);
+
+    ret = 0;
+    uint16_t port = (uint16_t)config_server_get_mqtt_broker_port();
+    if (mqtt_broker_is_running() && port != mqtt_broker_get_port()) {
+        ret = mqtt_broker_restart(port);
+    }
+
+    root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "status", (ret == 0) ? "ok" : "error");
+    cJSON_AddBoolToObject(root, "running", mqtt_broker_is_running());
+    cJSON_AddNumberToObject(root, "port", mqtt_broker_get_port());
+    if (ret != 0) {
+        httpd_resp_set_status(req, "500 Internal Server Error");
+    }
+
+    const char *resp = cJSON_PrintUnformatted(root);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+
+    free((void *)resp);
+    cJSON_Delete(root);
+
+    return ESP_OK;
+}
+
 static const httpd_uri_t index_uri = {
     .uri       = "/",
     .method    = HTTP_GET,
@@ -1643,6 +1859,20 @@ static const httpd_uri_t vehicle_detect_result = {
     .user_ctx  = NULL
 };
 
+static const httpd_uri_t mqtt_broker_stats = {
+    .uri       = "/api/mqtt/broker",
+    .method    = HTTP_GET,
+    .handler   = mqtt_broker_stats_handler,
+    .user_ctx  = NULL
+};
+
+static const httpd_uri_t mqtt_broker_config = {
+    .uri       = "/api/mqtt/broker",
+    .method    = HTTP_POST,
+    .handler   = mqtt_broker_config_handler,
+    .user_ctx  = NULL
+};
+
 static void config_server_load_cfg(char *cfg)
 {
 	cJSON * root, *key = 0;
@@ -2073,185 +2303,605 @@ static void config_server_load_cfg(char *cfg)
 	//*****
 
 	//*****
-	key = cJSON_GetObjectItem(root,"wakeup_volt");
-	if(key == 0)
+	key = cJSON_GetObjectItem(root,"mqtt_payload_format");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_payload_format)))
 	{
-		strcpy(device_config.wakeup_volt, "13.5");
+		strcpy(device_config.mqtt_payload_format, "json");
 	}
 	else
 	{
-		strcpy(device_config.wakeup_volt, key->valuestring);
+		strcpy(device_config.mqtt_payload_format, key->valuestring);
 	}
 
-	ESP_LOGE(TAG, "device_config.wakeup_volt: %s", device_config.wakeup_volt);
+	ESP_LOGE(TAG, "device_config.mqtt_payload_format: %s", device_config.mqtt_payload_format);
 	//*****
-	
+
 	//*****
-	key = cJSON_GetObjectItem(root,"sleep_time");
-	if(key == 0)
+	key = cJSON_GetObjectItem(root,"mqtt_outbox_en");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_outbox_en)))
 	{
-		strcpy(device_config.sleep_time, "2");
+		strcpy(device_config.mqtt_outbox_en, "disable");
 	}
 	else
 	{
-		uint32_t sleep_time = atoi(device_config.sleep_time);
+		strcpy(device_config.mqtt_outbox_en, key->valuestring);
+	}
 
-		if(sleep_time > 30 && sleep_time < 1)
-		{
-			strcpy(device_config.sleep_time, "2");
-		}
+	ESP_LOGE(TAG, "device_config.mqtt_outbox_en: %s", device_config.mqtt_outbox_en);
+	//*****
 
-		strcpy(device_config.sleep_time, key->valuestring);
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_outbox_frames");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_outbox_frames)))
+	{
+		strcpy(device_config.mqtt_outbox_frames, "disable");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_outbox_frames, key->valuestring);
 	}
 
-	ESP_LOGE(TAG, "device_config.sleep_time: %s", device_config.sleep_time);
+	ESP_LOGE(TAG, "device_config.mqtt_outbox_frames: %s", device_config.mqtt_outbox_frames);
 	//*****
 
 	//*****
-	key = cJSON_GetObjectItem(root,"sta_security");
-	if(key == 0)
+	key = cJSON_GetObjectItem(root,"mqtt_outbox_size");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_outbox_size)))
 	{
-		strcpy(device_config.sta_security, "wpa3");
+		strcpy(device_config.mqtt_outbox_size, "64");
 	}
 	else
 	{
-		strcpy(device_config.sta_security, key->valuestring);
+		strcpy(device_config.mqtt_outbox_size, key->valuestring);
 	}
 
-	ESP_LOGE(TAG, "device_config.sta_security: %s", device_config.wakeup_volt);
+	ESP_LOGE(TAG, "device_config.mqtt_outbox_size: %s", device_config.mqtt_outbox_size);
 	//*****
 
 	//*****
-	key = cJSON_GetObjectItem(root,"ap_auto_disable");
-	if(key == 0)
+	key = cJSON_GetObjectItem(root,"mqtt_outbox_rate");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_outbox_rate)))
 	{
-		strcpy(device_config.ap_auto_disable, "disable");
+		strcpy(device_config.mqtt_outbox_rate, "100");
 	}
 	else
 	{
-		strcpy(device_config.ap_auto_disable, key->valuestring);
+		strcpy(device_config.mqtt_outbox_rate, key->valuestring);
 	}
 
-	ESP_LOGE(TAG, "device_config.ap_auto_disable: %s", device_config.ap_auto_disable);
-	//*****	
+	ESP_LOGE(TAG, "device_config.mqtt_outbox_rate: %s", device_config.mqtt_outbox_rate);
+	//*****
 
 	//*****
-	key = cJSON_GetObjectItem(root,"keep_alive");
-	if(key == 0)
+	key = cJSON_GetObjectItem(root,"mqtt_protocol");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_protocol)))
 	{
-		strcpy(device_config.keep_alive, "30");
+		strcpy(device_config.mqtt_protocol, "3.1.1");
 	}
 	else
 	{
-		uint32_t keep_alive = atoi(device_config.keep_alive);
+		strcpy(device_config.mqtt_protocol, key->valuestring);
+	}
 
-		if(keep_alive > 120 && keep_alive < 1)
-		{
-			strcpy(device_config.keep_alive, "30");
-		}
+	ESP_LOGE(TAG, "device_config.mqtt_protocol: %s", device_config.mqtt_protocol);
+	//*****
 
-		strcpy(device_config.keep_alive, key->valuestring);
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_msg_expiry");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_msg_expiry)))
+	{
+		strcpy(device_config.mqtt_msg_expiry, "60");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_msg_expiry, key->valuestring);
 	}
 
-	ESP_LOGE(TAG, "device_config.keep_alive: %s", device_config.keep_alive);
+	ESP_LOGE(TAG, "device_config.mqtt_msg_expiry: %s", device_config.mqtt_msg_expiry);
 	//*****
 
-	cJSON_Delete(root);
-	return;
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_rx_batch_frames");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_rx_batch_frames)))
+	{
+		strcpy(device_config.mqtt_rx_batch_frames, "0");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_rx_batch_frames, key->valuestring);
+	}
 
+	ESP_LOGE(TAG, "device_config.mqtt_rx_batch_frames: %s", device_config.mqtt_rx_batch_frames);
+	//*****
 
-config_error:
-    // Check if destination file exists before renaming
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_rx_batch_bytes");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_rx_batch_bytes)))
+	{
+		strcpy(device_config.mqtt_rx_batch_bytes, "0");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_rx_batch_bytes, key->valuestring);
+	}
 
-    if (stat(FS_MOUNT_POINT"/config.json", &st) == 0)
-    {
-    	ESP_LOGE(TAG, "config.json file error, restoring default");
-        // Delete it if it exists
-        unlink(FS_MOUNT_POINT"/config.json");
-		FILE* f = fopen(FS_MOUNT_POINT"/config.json", "w");
-		// sprintf(device_config_default, device_id, device_id);
-		fprintf(f, device_config_default, (char*)device_id, (char*)device_id, (char*)device_id);
-		fclose(f);
-		vTaskDelay(3000 / portTICK_PERIOD_MS);
-		esp_restart();
-    }
-	cJSON_Delete(root);
-}
+	ESP_LOGE(TAG, "device_config.mqtt_rx_batch_bytes: %s", device_config.mqtt_rx_batch_bytes);
+	//*****
 
-void config_server_wifi_connected(bool flag)
-{
-	if(flag)
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_rx_linger_ms");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_rx_linger_ms)))
 	{
-		xEventGroupSetBits( xServerEventGroup, WIFI_CONNECTED_BIT );
+		strcpy(device_config.mqtt_rx_linger_ms, "0");
 	}
 	else
 	{
-		xEventGroupClearBits( xServerEventGroup, WIFI_CONNECTED_BIT );
+		strcpy(device_config.mqtt_rx_linger_ms, key->valuestring);
 	}
-}
-//
-//bool config_server_get_wifi_connected(void)
-//{
-//	EventBits_t uxBits;
-//	if(xServerEventGroup != NULL)
-//	{
-//		uxBits = xEventGroupGetBits(xServerEventGroup);
-//
-//		return (uxBits & WIFI_CONNECTED_BIT)?1:0;
-//	}
-//	else return 0;
-//}
-
-void config_server_set_sta_ip(char* ip)
-{
-	xQueueOverwrite(xip_Queue, ip);
-}
-void config_server_get_sta_ip(char* ip)
-{
-	xQueuePeek(xip_Queue, ip, 0);
-}
 
-void vrestartTimerCallback( TimerHandle_t xTimer )
-{
-//	vTaskDelay(1000 / portTICK_PERIOD_MS);
-	esp_restart();
-}
+	ESP_LOGE(TAG, "device_config.mqtt_rx_linger_ms: %s", device_config.mqtt_rx_linger_ms);
+	//*****
 
+	//*****
+	key = cJSON_GetObjectItem(root,"can_dedup");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.can_dedup)))
+	{
+		strcpy(device_config.can_dedup, "disable");
+	}
+	else
+	{
+		strcpy(device_config.can_dedup, key->valuestring);
+	}
 
-//static char* device_config = NULL;
-static uint8_t esp_spiffs_flag = 0;
-static httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-static httpd_handle_t config_server_init(void)
-{
-//	const char* base_path = "/"; //useless?
-//
-//    if (server_data)
-//    {
-//        ESP_LOGE(TAG, "File server already started");
-//        return ESP_ERR_INVALID_STATE;
-//    }
-//
-//    /* Allocate memory for server data */
-//    server_data = calloc(1, sizeof(struct file_server_data));
-//    if (!server_data)
-//    {
-//        ESP_LOGE(TAG, "Failed to allocate memory for server data");
-//        return ESP_ERR_NO_MEM;
-//    }
-//
-//    strlcpy(server_data->base_path, base_path,
-//            sizeof(server_data->base_path));
+	ESP_LOGE(TAG, "device_config.can_dedup: %s", device_config.can_dedup);
+	//*****
 
-    config.lru_purge_enable = true;
+	//*****
+	key = cJSON_GetObjectItem(root,"can_dedup_refresh");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.can_dedup_refresh)))
+	{
+		strcpy(device_config.can_dedup_refresh, "1000");
+	}
+	else
+	{
+		strcpy(device_config.can_dedup_refresh, key->valuestring);
+	}
 
-    if(xServerEventGroup == NULL)
-    {
-    	xServerEventGroup = xEventGroupCreate();
-    	config_server_wifi_connected(0);
-    }
+	ESP_LOGE(TAG, "device_config.can_dedup_refresh: %s", device_config.can_dedup_refresh);
+	//*****
 
-    if(xip_Queue == NULL)
-    {
+	//*****
+	key = cJSON_GetObjectItem(root,"can_dedup_outputs");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.can_dedup_outputs)))
+	{
+		strcpy(device_config.can_dedup_outputs, "tcp,ws,mqtt,ble");
+	}
+	else
+	{
+		strcpy(device_config.can_dedup_outputs, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.can_dedup_outputs: %s", device_config.can_dedup_outputs);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"can_dedup_count");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.can_dedup_count)))
+	{
+		strcpy(device_config.can_dedup_count, "disable");
+	}
+	else
+	{
+		strcpy(device_config.can_dedup_count, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.can_dedup_count: %s", device_config.can_dedup_count);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_publish_mode");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_publish_mode)))
+	{
+		strcpy(device_config.mqtt_publish_mode, "hybrid");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_publish_mode, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_publish_mode: %s", device_config.mqtt_publish_mode);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_broker_max_clients");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_broker_max_clients)))
+	{
+		strcpy(device_config.mqtt_broker_max_clients, "8");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_broker_max_clients, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_broker_max_clients: %s", device_config.mqtt_broker_max_clients);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_broker_max_queued");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_broker_max_queued)))
+	{
+		strcpy(device_config.mqtt_broker_max_queued, "100");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_broker_max_queued, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_broker_max_queued: %s", device_config.mqtt_broker_max_queued);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_broker_max_queued_kb");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_broker_max_queued_kb)))
+	{
+		strcpy(device_config.mqtt_broker_max_queued_kb, "32");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_broker_max_queued_kb, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_broker_max_queued_kb: %s", device_config.mqtt_broker_max_queued_kb);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_broker_max_retained");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_broker_max_retained)))
+	{
+		strcpy(device_config.mqtt_broker_max_retained, "64");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_broker_max_retained, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_broker_max_retained: %s", device_config.mqtt_broker_max_retained);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_broker_heap_reserve_kb");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_broker_heap_reserve_kb)))
+	{
+		strcpy(device_config.mqtt_broker_heap_reserve_kb, "0");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_broker_heap_reserve_kb, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_broker_heap_reserve_kb: %s", device_config.mqtt_broker_heap_reserve_kb);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_bridge_en");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_bridge_en)))
+	{
+		strcpy(device_config.mqtt_bridge_en, "disable");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_bridge_en, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_bridge_en: %s", device_config.mqtt_bridge_en);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_bridge_url");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_bridge_url)))
+	{
+		strcpy(device_config.mqtt_bridge_url, "mqtt://mqtt.eclipseprojects.io");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_bridge_url, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_bridge_url: %s", device_config.mqtt_bridge_url);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_bridge_port");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_bridge_port)))
+	{
+		strcpy(device_config.mqtt_bridge_port, "1883");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_bridge_port, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_bridge_port: %s", device_config.mqtt_bridge_port);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_bridge_user");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_bridge_user)))
+	{
+		strcpy(device_config.mqtt_bridge_user, "");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_bridge_user, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_bridge_user: %s", device_config.mqtt_bridge_user);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_bridge_topics");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_bridge_topics)))
+	{
+		strcpy(device_config.mqtt_bridge_topics, "wican/+/can/rx");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_bridge_topics, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_bridge_topics: %s", device_config.mqtt_bridge_topics);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_bridge_topic");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_bridge_topic)))
+	{
+		strcpy(device_config.mqtt_bridge_topic, "");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_bridge_topic, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_bridge_topic: %s", device_config.mqtt_bridge_topic);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_bridge_interval");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_bridge_interval)))
+	{
+		strcpy(device_config.mqtt_bridge_interval, "5000");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_bridge_interval, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_bridge_interval: %s", device_config.mqtt_bridge_interval);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_bridge_queue_kb");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_bridge_queue_kb)))
+	{
+		strcpy(device_config.mqtt_bridge_queue_kb, "16");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_bridge_queue_kb, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_bridge_queue_kb: %s", device_config.mqtt_bridge_queue_kb);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_bridge_pass");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_bridge_pass)))
+	{
+		strcpy(device_config.mqtt_bridge_pass, "");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_bridge_pass, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_bridge_pass: %s", device_config.mqtt_bridge_pass);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"mqtt_lvc_retain");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_lvc_retain)))
+	{
+		strcpy(device_config.mqtt_lvc_retain, "60");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_lvc_retain, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_lvc_retain: %s", device_config.mqtt_lvc_retain);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"wakeup_volt");
+	if(key == 0)
+	{
+		strcpy(device_config.wakeup_volt, "13.5");
+	}
+	else
+	{
+		strcpy(device_config.wakeup_volt, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.wakeup_volt: %s", device_config.wakeup_volt);
+	//*****
+	
+	//*****
+	key = cJSON_GetObjectItem(root,"sleep_time");
+	if(key == 0)
+	{
+		strcpy(device_config.sleep_time, "2");
+	}
+	else
+	{
+		uint32_t sleep_time = atoi(device_config.sleep_time);
+
+		if(sleep_time > 30 && sleep_time < 1)
+		{
+			strcpy(device_config.sleep_time, "2");
+		}
+
+		strcpy(device_config.sleep_time, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.sleep_time: %s", device_config.sleep_time);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"sta_security");
+	if(key == 0)
+	{
+		strcpy(device_config.sta_security, "wpa3");
+	}
+	else
+	{
+		strcpy(device_config.sta_security, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.sta_security: %s", device_config.wakeup_volt);
+	//*****
+
+	//*****
+	key = cJSON_GetObjectItem(root,"ap_auto_disable");
+	if(key == 0)
+	{
+		strcpy(device_config.ap_auto_disable, "disable");
+	}
+	else
+	{
+		strcpy(device_config.ap_auto_disable, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.ap_auto_disable: %s", device_config.ap_auto_disable);
+	//*****	
+
+	//*****
+	key = cJSON_GetObjectItem(root,"keep_alive");
+	if(key == 0)
+	{
+		strcpy(device_config.keep_alive, "30");
+	}
+	else
+	{
+		uint32_t keep_alive = atoi(device_config.keep_alive);
+
+		if(keep_alive > 120 && keep_alive < 1)
+		{
+			strcpy(device_config.keep_alive, "30");
+		}
+
+		strcpy(device_config.keep_alive, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.keep_alive: %s", device_config.keep_alive);
+	//*****
+
+	cJSON_Delete(root);
+	return;
+
+
+config_error:
+    // Check if destination file exists before renaming
+
+    if (stat(FS_MOUNT_POINT"/config.json", &st) == 0)
+    {
+    	ESP_LOGE(TAG, "config.json file error, restoring default");
+        // Delete it if it exists
+        unlink(FS_MOUNT_POINT"/config.json");
+		FILE* f = fopen(FS_MOUNT_POINT"/config.json", "w");
+		// sprintf(device_config_default, device_id, device_id);
+		fprintf(f, device_config_default, (char*)device_id, (char*)device_id, (char*)device_id);
+		fclose(f);
+		vTaskDelay(3000 / portTICK_PERIOD_MS);
+		esp_restart();
+    }
+	cJSON_Delete(root);
+}
+
+void config_server_wifi_connected(bool flag)
+{
+	if(flag)
+	{
+		xEventGroupSetBits( xServerEventGroup, WIFI_CONNECTED_BIT );
+	}
+	else
+	{
+		xEventGroupClearBits( xServerEventGroup, WIFI_CONNECTED_BIT );
+	}
+}
+//
+//bool config_server_get_wifi_connected(void)
+//{
+//	EventBits_t uxBits;
+//	if(xServerEventGroup != NULL)
+//	{
+//		uxBits = xEventGroupGetBits(xServerEventGroup);
+//
+//		return (uxBits & WIFI_CONNECTED_BIT)?1:0;
+//	}
+//	else return 0;
+//}
+
+void config_server_set_sta_ip(char* ip)
+{
+	xQueueOverwrite(xip_Queue, ip);
+}
+void config_server_get_sta_ip(char* ip)
+{
+	xQueuePeek(xip_Queue, ip, 0);
+}
+
+void vrestartTimerCallback( TimerHandle_t xTimer )
+{
+//	vTaskDelay(1000 / portTICK_PERIOD_MS);
+	esp_restart();
+}
+
+
+//static char* device_config = NULL;
+static uint8_t esp_spiffs_flag = 0;
+static httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+static httpd_handle_t config_server_init(void)
+{
+//	const char* base_path = "/"; //useless?
+//
+//    if (server_data)
+//    {
+//        ESP_LOGE(TAG, "File server already started");
+//        return ESP_ERR_INVALID_STATE;
+//    }
+//
+//    /* Allocate memory for server data */
+//    server_data = calloc(1, sizeof(struct file_server_data));
+//    if (!server_data)
+//    {
+//        ESP_LOGE(TAG, "Failed to allocate memory for server data");
+//        return ESP_ERR_NO_MEM;
+//    }
+//
+//    strlcpy(server_data->base_path, base_path,
+//            sizeof(server_data->base_path));
+
+    config.lru_purge_enable = true;
+
+    if(xServerEventGroup == NULL)
+    {
+    	xServerEventGroup = xEventGroupCreate();
+    	config_server_wifi_connected(0);
+    }
+
+    if(xip_Queue == NULL)
+    {
     	xip_Queue = xQueueCreate(1, 20);
     }
 
@@ -2362,7 +3012,7 @@ static httpd_handle_t config_server_init(void)
                        );
 
     // Start the httpd server
-	config.max_uri_handlers = 21;
+	config.max_uri_handlers = 23;
 	config.stack_size = 5120;
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
     if (httpd_start(&server, &config) == ESP_OK)
@@ -2390,6 +3040,8 @@ static httpd_handle_t config_server_init(void)
 		httpd_register_uri_handler(server, &uri_vehicle_detect_start);
 		httpd_register_uri_handler(server, &vehicle_detect_status);
 		httpd_register_uri_handler(server, &vehicle_detect_result);
+		httpd_register_uri_handler(server, &mqtt_broker_stats);
+		httpd_register_uri_handler(server, &mqtt_broker_config);
         #if CONFIG_EXAMPLE_BASIC_AUTH
         httpd_register_basic_auth(server);
         #endif
@@ -2852,3 +3504,281 @@ int32_t config_server_get_mqtt_broker_port(void)
 	return 1883; // Default MQTT port
 }
 
+mqtt_payload_format_t config_server_get_mqtt_payload_format(void)
+{
+	if(strcmp(device_config.mqtt_payload_format, "cbor") == 0)
+	{
+		return MQTT_PAYLOAD_CBOR;
+	}
+	else if(strcmp(device_config.mqtt_payload_format, "msgpack") == 0)
+	{
+		return MQTT_PAYLOAD_MSGPACK;
+	}
+	else if(strcmp(device_config.mqtt_payload_format, "binary") == 0)
+	{
+		return MQTT_PAYLOAD_BINARY;
+	}
+	return MQTT_PAYLOAD_JSON;
+}
+
+int8_t config_server_mqtt_outbox_en_config(void)
+{
+	if(strcmp(device_config.mqtt_outbox_en, "enable") == 0)
+	{
+		return 1;
+	}
+	else if(strcmp(device_config.mqtt_outbox_en, "disable") == 0)
+	{
+		return 0;
+	}
+	return -1;
+}
+
+int8_t config_server_mqtt_outbox_frames_config(void)
+{
+	if(strcmp(device_config.mqtt_outbox_frames, "enable") == 0)
+	{
+		return 1;
+	}
+	else if(strcmp(device_config.mqtt_outbox_frames, "disable") == 0)
+	{
+		return 0;
+	}
+	return -1;
+}
+
+// Flash budget for spilled records in bytes, the setting is in KB
+uint32_t config_server_get_mqtt_outbox_size(void)
+{
+	int size_kb = atoi(device_config.mqtt_outbox_size);
+
+	if(size_kb >= 0 && size_kb <= 200)
+	{
+		return size_kb * 1024;
+	}
+	return 64 * 1024;
+}
+
+// Replay rate cap in records per second
+uint32_t config_server_get_mqtt_outbox_rate(void)
+{
+	int rate = atoi(device_config.mqtt_outbox_rate);
+
+	if(rate > 0)
+	{
+		return rate;
+	}
+	return 100;
+}
+
+int8_t config_server_mqtt_v5_config(void)
+{
+	if(strcmp(device_config.mqtt_protocol, "5") == 0)
+	{
+		return 1;
+	}
+	else if(strcmp(device_config.mqtt_protocol, "3.1.1") == 0)
+	{
+		return 0;
+	}
+	return -1;
+}
+
+uint32_t config_server_get_mqtt_msg_expiry(void)
+{
+	int expiry = atoi(device_config.mqtt_msg_expiry);
+
+	if(expiry > 0)
+	{
+		return expiry;
+	}
+	return 0;
+}
+
+static uint32_t config_server_get_uint(const char *str)
+{
+	int v = atoi(str);
+
+	return (v > 0) ? (uint32_t)v : 0;
+}
+
+uint32_t config_server_get_mqtt_rx_batch_frames(void)
+{
+	return config_server_get_uint(device_config.mqtt_rx_batch_frames);
+}
+
+uint32_t config_server_get_mqtt_rx_batch_bytes(void)
+{
+	return config_server_get_uint(device_config.mqtt_rx_batch_bytes);
+}
+
+uint32_t config_server_get_mqtt_rx_linger_ms(void)
+{
+	return config_server_get_uint(device_config.mqtt_rx_linger_ms);
+}
+
+int8_t config_server_can_dedup_config(void)
+{
+	if(strcmp(device_config.can_dedup, "enable") == 0)
+	{
+		return 1;
+	}
+	else if(strcmp(device_config.can_dedup, "disable") == 0)
+	{
+		return 0;
+	}
+	return -1;
+}
+
+uint32_t config_server_get_can_dedup_refresh(void)
+{
+	return config_server_get_uint(device_config.can_dedup_refresh);
+}
+
+// Comma separated list of "tcp", "ws", "mqtt" and "ble"
+uint8_t config_server_get_can_dedup_outputs(void)
+{
+	uint8_t mask = 0;
+
+	if(strstr(device_config.can_dedup_outputs, "tcp") != NULL)
+	{
+		mask |= CAN_DEDUP_TCP;
+	}
+	if(strstr(device_config.can_dedup_outputs, "ws") != NULL)
+	{
+		mask |= CAN_DEDUP_WS;
+	}
+	if(strstr(device_config.can_dedup_outputs, "mqtt") != NULL)
+	{
+		mask |= CAN_DEDUP_MQTT;
+	}
+	if(strstr(device_config.can_dedup_outputs, "ble") != NULL)
+	{
+		mask |= CAN_DEDUP_BLE;
+	}
+	return mask;
+}
+
+int8_t config_server_can_dedup_count_config(void)
+{
+	if(strcmp(device_config.can_dedup_count, "enable") == 0)
+	{
+		return 1;
+	}
+	else if(strcmp(device_config.can_dedup_count, "disable") == 0)
+	{
+		return 0;
+	}
+	return -1;
+}
+
+mqtt_publish_mode_t config_server_get_mqtt_publish_mode(void)
+{
+	if(strcmp(device_config.mqtt_publish_mode, "static") == 0)
+	{
+		return PUBLISH_MODE_STATIC;
+	}
+	else if(strcmp(device_config.mqtt_publish_mode, "dynamic") == 0)
+	{
+		return PUBLISH_MODE_DYNAMIC;
+	}
+	return PUBLISH_MODE_HYBRID;
+}
+
+uint32_t config_server_get_mqtt_broker_max_clients(void)
+{
+	return config_server_get_uint(device_config.mqtt_broker_max_clients);
+}
+
+uint32_t config_server_get_mqtt_broker_max_queued(void)
+{
+	return config_server_get_uint(device_config.mqtt_broker_max_queued);
+}
+
+uint32_t config_server_get_mqtt_broker_max_queued_kb(void)
+{
+	return config_server_get_uint(device_config.mqtt_broker_max_queued_kb);
+}
+
+uint32_t config_server_get_mqtt_broker_max_retained(void)
+{
+	return config_server_get_uint(device_config.mqtt_broker_max_retained);
+}
+
+uint32_t config_server_get_mqtt_broker_heap_reserve_kb(void)
+{
+	return config_server_get_uint(device_config.mqtt_broker_heap_reserve_kb);
+}
+
+void config_server_get_mqtt_broker_limits(mqtt_broker_limits_t *limits)
+{
+	limits->max_clients = config_server_get_mqtt_broker_max_clients();
+	limits->max_queued_msgs = config_server_get_mqtt_broker_max_queued();
+	limits->max_queued_bytes = config_server_get_mqtt_broker_max_queued_kb() * 1024;
+	limits->max_retained = config_server_get_mqtt_broker_max_retained();
+	limits->heap_reserve = config_server_get_mqtt_broker_heap_reserve_kb() * 1024;
+}
+
+int8_t config_server_mqtt_bridge_en_config(void)
+{
+	if(strcmp(device_config.mqtt_bridge_en, "enable") == 0)
+	{
+		return 1;
+	}
+	else if(strcmp(device_config.mqtt_bridge_en, "disable") == 0)
+	{
+		return 0;
+	}
+	return -1;
+}
+
+char *config_server_get_mqtt_bridge_url(void)
+{
+	return device_config.mqtt_bridge_url;
+}
+
+int32_t config_server_get_mqtt_bridge_port(void)
+{
+	int port_val = atoi(device_config.mqtt_bridge_port);
+
+	if(port_val > 0 && port_val <= 65535)
+	{
+		return port_val;
+	}
+	return -1;
+}
+
+char *config_server_get_mqtt_bridge_user(void)
+{
+	return device_config.mqtt_bridge_user;
+}
+
+char *config_server_get_mqtt_bridge_pass(void)
+{
+	return device_config.mqtt_bridge_pass;
+}
+
+char *config_server_get_mqtt_bridge_topics(void)
+{
+	return device_config.mqtt_bridge_topics;
+}
+
+char *config_server_get_mqtt_bridge_topic(void)
+{
+	return device_config.mqtt_bridge_topic;
+}
+
+uint32_t config_server_get_mqtt_bridge_interval(void)
+{
+	return config_server_get_uint(device_config.mqtt_bridge_interval);
+}
+
+uint32_t config_server_get_mqtt_bridge_queue_kb(void)
+{
+	return config_server_get_uint(device_config.mqtt_bridge_queue_kb);
+}
+
+uint32_t config_server_get_mqtt_lvc_retain(void)
+{
+	return config_server_get_uint(device_config.mqtt_lvc_retain);
+}
@@ -23,6 +23,7 @@
 #pragma once
 #include "esp_tls_crypto.h"
 #include <esp_http_server.h>
+#include "mqtt_broker.h"
 
 #define AP_MODE				0
 #define APSTA_MODE			1
@@ -65,6 +66,14 @@ typedef enum {
 	PUBLISH_MODE_HYBRID = 2    // Both (default/recommended)
 } mqtt_publish_mode_t;
 
+typedef enum {
+	MQTT_PAYLOAD_JSON = 0,
+	MQTT_PAYLOAD_CBOR = 1,
+	MQTT_PAYLOAD_MSGPACK = 2,
+	MQTT_PAYLOAD_BINARY = 3,
+	MQTT_PAYLOAD_MAX
+} mqtt_payload_format_t;
+
 typedef struct _device_config
 {
 	char wifi_mode[65];
@@ -111,7 +120,36 @@ typedef struct _device_config
 	char mqtt_status_topic[64];
 	char mqtt_broker_en[10];
 	char mqtt_broker_port[32];
-	uint8_t mqtt_publish_mode;  // mqtt_publish_mode_t
+	char mqtt_payload_format[10];
+	char mqtt_outbox_en[10];
+	char mqtt_outbox_frames[10];
+	char mqtt_outbox_size[10];
+	char mqtt_outbox_rate[10];
+	char mqtt_protocol[8];
+	char mqtt_msg_expiry[8];
+	char mqtt_rx_batch_frames[8];
+	char mqtt_rx_batch_bytes[8];
+	char mqtt_rx_linger_ms[8];
+	char can_dedup[10];
+	char can_dedup_refresh[8];
+	char can_dedup_outputs[24];
+	char can_dedup_count[10];
+	char mqtt_publish_mode[10];
+	char mqtt_broker_max_clients[6];
+	char mqtt_broker_max_queued[8];
+	char mqtt_broker_max_queued_kb[8];
+	char mqtt_broker_max_retained[8];
+	char mqtt_broker_heap_reserve_kb[8];
+	char mqtt_bridge_en[10];
+	char mqtt_bridge_url[256];
+	char mqtt_bridge_port[8];
+	char mqtt_bridge_user[64];
+	char mqtt_bridge_topics[128];
+	char mqtt_bridge_topic[64];
+	char mqtt_bridge_interval[8];
+	char mqtt_bridge_queue_kb[8];
+	char mqtt_bridge_pass[64];
+	char mqtt_lvc_retain[8];
 }device_config_t;
 
 
@@ -171,3 +209,34 @@ int8_t config_server_get_ap_auto_disable(void);
 int8_t config_server_get_keep_alive(uint32_t *keep_alive);
 int8_t config_server_mqtt_broker_en_config(void);
 int32_t config_server_get_mqtt_broker_port(void);
+mqtt_payload_format_t config_server_get_mqtt_payload_format(void);
+int8_t config_server_mqtt_outbox_en_config(void);
+int8_t config_server_mqtt_outbox_frames_config(void);
+uint32_t config_server_get_mqtt_outbox_size(void);
+uint32_t config_server_get_mqtt_outbox_rate(void);
+int8_t config_server_mqtt_v5_config(void);
+uint32_t config_server_get_mqtt_msg_expiry(void);
+uint32_t config_server_get_mqtt_rx_batch_frames(void);
+uint32_t config_server_get_mqtt_rx_batch_bytes(void);
+uint32_t config_server_get_mqtt_rx_linger_ms(void);
+int8_t config_server_can_dedup_config(void);
+uint32_t config_server_get_can_dedup_refresh(void);
+uint8_t config_server_get_can_dedup_outputs(void);
+int8_t config_server_can_dedup_count_config(void);
+mqtt_publish_mode_t config_server_get_mqtt_publish_mode(void);
+uint32_t config_server_get_mqtt_broker_max_clients(void);
+uint32_t config_server_get_mqtt_broker_max_queued(void);
+uint32_t config_server_get_mqtt_broker_max_queued_kb(void);
+uint32_t config_server_get_mqtt_broker_max_retained(void);
+uint32_t config_server_get_mqtt_broker_heap_reserve_kb(void);
+void config_server_get_mqtt_broker_limits(mqtt_broker_limits_t *limits);
+int8_t config_server_mqtt_bridge_en_config(void);
+char *config_server_get_mqtt_bridge_url(void);
+int32_t config_server_get_mqtt_bridge_port(void);
+char *config_server_get_mqtt_bridge_user(void);
+char *config_server_get_mqtt_bridge_pass(void);
+char *config_server_get_mqtt_bridge_topics(void);
+char *config_server_get_mqtt_bridge_topic(void);
+uint32_t config_server_get_mqtt_bridge_interval(void);
+uint32_t config_server_get_mqtt_bridge_queue_kb(void);
+uint32_t config_server_get_mqtt_lvc_retain(void);
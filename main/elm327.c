@@ -36,6 +36,7 @@
 #include "std_pid.h"
 #include "sleep_mode.h"
 #include "elm327.h"
+#include "isotp.h"
 
 #define TAG 		__func__
 
@@ -50,6 +51,10 @@
 uint8_t service_09_rsp_len[] = {1, 1, 4, 1, 255, 1, 255, 1, 1, 1, 4, 1}; //255 unknow
 
 #define ELM327_READY_TO_RECEIVE_CAN			BIT0
+// Consecutive frames an ECU sends per flow control, below the CAN receive queue size
+#define ELM327_FC_BLOCK_SIZE				16
+// Longest request a client can type, a command line holds up to 127 hex digits
+#define ELM327_MAX_REQUEST					63
 
 static EventGroupHandle_t elm327_event_group = NULL;
 static QueueHandle_t *can_rx_queue = NULL;
@@ -89,6 +94,10 @@ typedef struct __xelm327_config
 
 static _xelm327_config_t elm327_config;
 static SemaphoreHandle_t elm327_mutex = NULL;
+// Counts processed AT commands, lets a client notice that the settings may
+// have been changed by another one
+static uint32_t elm327_config_gen = 0;
+static isotp_t elm327_isotp;
 
 static void elm327_set_default_config(bool reset_protocol)
 {
@@ -651,14 +660,9 @@ static uint8_t elm327_should_receive(twai_message_t *rx_frame)
 	}
 }
 
-static void elm327_send_flow_control_frame(twai_message_t *first_frame)
+// Flow control frames go to the ECU that sent the first frame
+static uint32_t elm327_fc_identifier(twai_message_t *first_frame)
 {
-	twai_message_t txframe;
-	uint8_t source_ecu;
-
-	// Use the same size id as the first frame
-	txframe.extd = first_frame->extd;
-
 	if (first_frame->extd)
 	{
 		if (elm327_config.fc_mode == 0 || elm327_config.fc_mode == 2)
@@ -670,14 +674,11 @@ static void elm327_send_flow_control_frame(twai_message_t *first_frame)
 			// - a physical type (DA) as opposed to a functional type
 			// - the source_ecu as the destination
 			// - ourselves (F1) as the source
-			source_ecu = 0xFF & first_frame->identifier;
-			txframe.identifier = 0x18DA00F1 | (source_ecu << 8);
-		}
-		else
-		{
-			// fc_mode 1: use the configured header
-			txframe.identifier = elm327_config.fc_header;
+			uint8_t source_ecu = 0xFF & first_frame->identifier;
+			return 0x18DA00F1 | (source_ecu << 8);
 		}
+		// fc_mode 1: use the configured header
+		return elm327_config.fc_header;
 	}
 	else
 	{
@@ -689,68 +690,407 @@ static void elm327_send_flow_control_frame(twai_message_t *first_frame)
 			// 7E, this 4th bit indicates wether a message is being sent to or
 			// received from an ECU identified by the last 3 bits.
 			// For example 0x7E8 becomes 0x7E0 and 0x7EF becomes 0x7E7
-			txframe.identifier = first_frame->identifier & 0xFF7;
-		}
-		else
-		{
-			// fc_mode 1: use the configured header
-			txframe.identifier = elm327_config.fc_header & TWAI_STD_ID_MASK;;
+			return first_frame->identifier & 0xFF7;
 		}
+		// fc_mode 1: use the configured header
+		return elm327_config.fc_header & TWAI_STD_ID_MASK;
 	}
+}
 
-	txframe.rtr = 0;
+// The ECU a segmented request is addressed to answers, and sends its flow
+// control, on this identifier
+static uint32_t elm327_response_identifier(twai_message_t *txframe, uint32_t rx_id)
+{
+	uint32_t id = txframe->identifier;
 
-	// Initialize the data
-	memset(txframe.data, 0xAA, 8);
+	if (rx_id != 0)
+	{
+		return rx_id;
+	}
+	if (elm327_config.rx_address_is_set)
+	{
+		return elm327_config.rx_address;
+	}
+	if (txframe->extd)
+	{
+		// 18DA10F1 is answered by 18DAF110
+		return (id & 0xFFFF0000) | ((id & 0xFF) << 8) | ((id >> 8) & 0xFF);
+	}
+	// 7E0 is answered by 7E8
+	return id + 8;
+}
 
-	if (elm327_config.fc_mode == 0)
+// Sets the flow control we send to ECUs
+static void elm327_set_fc_params(void)
+{
+	if (elm327_config.fc_mode == 0 || elm327_config.fc_data_length < 3)
 	{
-		// data[0] & 0xF0 == 0x30 identifies it as a flow control frame,
-		// data[0] & 0X0F is the flow status:
-		// - 0 tells the ECU we are ready to receive more frames
-		// - 1 tells the ECU to wait
-		// - 2 tells the ECU we are overloaded and it should abort
-		txframe.data[0] = 0x30;
-		// Block Size:
-		// - 0 means send all of the frames
-		// - greater than 0 means send this number of frames then wait for a flow control ACK
-		txframe.data[1] = 0x00;
-		// Separation time in ms. There are also special values for large separation times.
-		// The spec indicates this is supposed to be the time from when the last bit of the
-		// last frame was sent to when the first bit of the next frame. However the spec
-		// notes that some ECUs will implement this as the time from first bit to first bit
+		// Block Size: the number of consecutive frames the ECU sends before
+		// waiting for the next flow control. Keeping a block smaller than
+		// the CAN receive queue lets the separation time be 0, the ECU
+		// sends as fast as it can and waits whenever we fall behind.
 		//
-		// Note: this value of 10ms is just a guess. Some docs have 20ms in their examples.
-		// When carscanner sets the flow control data it uses a value 0ms.
-		txframe.data[2] = 10;
+		// Separation time in ms. There are also special values for large
+		// separation times.
+		elm327_isotp.fc_bs = ELM327_FC_BLOCK_SIZE;
+		elm327_isotp.fc_stmin = 0;
 	}
 	else
 	{
 		// mode 1 or 2: use the data set by the client
-		memcpy(txframe.data, elm327_config.fc_data, elm327_config.fc_data_length);
+		elm327_isotp.fc_bs = elm327_config.fc_data[1];
+		elm327_isotp.fc_stmin = elm327_config.fc_data[2];
 	}
+}
+
+static int elm327_isotp_send(uint32_t id, bool extd, const uint8_t *data, uint8_t len, void *ctx)
+{
+	twai_message_t txframe;
 
-	// CAN frames always have a data length code of 8
-	txframe.data_length_code = 8;
-	txframe.self = 0;
+	memset(&txframe, 0, sizeof(txframe));
+	txframe.identifier = id;
+	txframe.extd = extd;
+	txframe.data_length_code = len;
+	memcpy(txframe.data, data, len);
 
 	if( elm327_can_log != NULL)
 	{
 		elm327_can_log(&txframe, ELM327_CAN_TX);
 	}
-	
-	can_send(&txframe, 1);
+	return (can_send(&txframe, 1) == ESP_OK) ? 0 : -1;
+}
+
+typedef void (*elm327_rx_cb_t)(twai_message_t *rx_frame, uint8_t data_length, isotp_link_t *link,
+								isotp_status_t status, void *ctx);
+
+// Storage for reassembled responses. Every single or first frame takes the
+// next free part of buf, so responses of several ECUs can interleave.
+typedef struct
+{
+	uint8_t *buf;
+	uint16_t size;
+	uint16_t used;
+}elm327_rx_store_t;
+
+typedef struct
+{
+	char *rsp;
+	QueueHandle_t *queue;
+}elm327_text_ctx_t;
+
+typedef struct
+{
+	elm327_rx_store_t store;
+	elm327_msg_t *msgs;
+	uint8_t max_msgs;
+	uint8_t count;
+}elm327_native_ctx_t;
+
+// Sends payload with txframe's identifier, segmented when it doesn't fit a
+// single frame, and hands every response frame to rx_cb, with the number
+// of data bytes after the PCI byte, until expected_rsp frames were
+// received or the ATST timeout expired. rx_id 0 uses the ATCRA receive
+// filter. Multi-frame responses are flow controlled by the ISO-TP engine,
+// which also drops consecutive frames that are out of sequence. With a
+// store, the engine reassembles the responses into it and rx_cb sees
+// ISOTP_DONE with the link holding a complete message.
+static uint8_t elm327_transfer(twai_message_t *txframe, const uint8_t *payload, uint16_t len,
+								uint8_t expected_rsp, uint32_t rx_id, elm327_rx_store_t *store,
+								elm327_rx_cb_t rx_cb, void *ctx)
+{
+	twai_message_t rx_frame;
+	isotp_link_t *tx_link;
+	isotp_status_t status;
+
+	while( xQueueReceive(*can_rx_queue, ( void * ) &rx_frame, pdMS_TO_TICKS(1)) == pdPASS );
+	can_flush_rx();
+
+	isotp_reset(&elm327_isotp);
+	elm327_set_fc_params();
+	tx_link = isotp_open(&elm327_isotp, txframe->identifier,
+							(len > 7) ? elm327_response_identifier(txframe, rx_id) : 0,
+							txframe->extd, NULL, 0);
+
+	int64_t txtime = esp_timer_get_time();
+	status = isotp_send(&elm327_isotp, tx_link, payload, len, txtime);
+	if(status != ISOTP_OK && status != ISOTP_DONE)
+	{
+		ESP_LOGE(TAG, "Failed to send request: %d", status);
+		return 0;
+	}
+	xEventGroupSetBits(elm327_event_group, ELM327_READY_TO_RECEIVE_CAN);
+
+	// ATST is in steps of 4.096 ms
+	int64_t timeout_us = elm327_config.req_timeout*4096;
+	int64_t now_us = txtime;
+	int64_t rsp_deadline_us = now_us + timeout_us;
+	uint8_t timeout_flag = 0;
+	uint8_t number_of_rsp = 0;
+	ESP_LOGW(TAG, "req_expected_rsp: %u", expected_rsp);
+	while(timeout_flag == 0)
+	{
+		int64_t wake_us = isotp_poll(&elm327_isotp, now_us);
+
+		if(tx_link->tx_state != ISOTP_IDLE)
+		{
+			// The response timeout starts once the whole request is sent
+			rsp_deadline_us = now_us + timeout_us;
+		}
+		else if(tx_link->tx_status != ISOTP_DONE)
+		{
+			ESP_LOGW(TAG, "Request aborted: %d", tx_link->tx_status);
+			break;
+		}
+		if(now_us >= rsp_deadline_us)
+		{
+			break;
+		}
+		if(wake_us > rsp_deadline_us)
+		{
+			wake_us = rsp_deadline_us;
+		}
+
+		if( xQueueReceive(*can_rx_queue, ( void * ) &rx_frame, pdMS_TO_TICKS((wake_us - now_us + 999)/1000)) == pdPASS &&
+			((rx_id == 0) ? elm327_should_receive(&rx_frame) : (rx_frame.identifier == rx_id)))
+		{
+			now_us = esp_timer_get_time();
+			if( elm327_can_log != NULL)
+			{
+				elm327_can_log(&rx_frame, ELM327_CAN_RX);
+			}
+
+			// Every responding ECU gets its own channel, keyed by its identifier
+			isotp_link_t *link = isotp_find(&elm327_isotp, rx_frame.identifier, rx_frame.extd);
+			if(link == NULL)
+			{
+				link = isotp_open(&elm327_isotp, elm327_fc_identifier(&rx_frame), rx_frame.identifier,
+									rx_frame.extd, NULL, 0);
+			}
+
+			// Identify what kind of frame this is.
+			int rx_frame_data_length = 0;
+			uint8_t frame_type = rx_frame.data[0] & 0xF0;
+
+			if(link != NULL && store != NULL && (frame_type == 0x00 || frame_type == 0x10))
+			{
+				// A new message goes to the free part of the store
+				isotp_open(&elm327_isotp, link->tx_id, link->rx_id, link->extd,
+							store->buf + store->used, store->size - store->used);
+			}
+			status = (link != NULL) ? isotp_on_frame(&elm327_isotp, link, rx_frame.data, rx_frame.data_length_code, now_us) : ISOTP_OK;
+			if(link != NULL && store != NULL &&
+				((frame_type == 0x00 && status == ISOTP_DONE) || (frame_type == 0x10 && status == ISOTP_OK)))
+			{
+				// Taken until the transfer ends, also when the message is not completed
+				store->used += link->rx_len;
+			}
+
+			if (frame_type == 0x30 && status != ISOTP_IGNORED)
+			{
+				// Flow control for our request, the engine sends the rest of it
+				continue;
+			}
+			else if (status != ISOTP_OK && status != ISOTP_DONE && status != ISOTP_ERR_SEND && frame_type != 0x30)
+			{
+				ESP_LOGW(TAG, "Dropped frame %08lX %02X: %d", rx_frame.identifier, rx_frame.data[0], status);
+				continue;
+			}
+
+			//reset timeout after response is received
+			rsp_deadline_us = now_us + timeout_us;
+			number_of_rsp++;
+
+			if (frame_type == 0x10)
+			{
+				// This is a first frame
+				// Length of the full data is:
+				//   ((0x0F & data[0]) << 8 | data[1])
+				//
+				// For now, we say the data length is 7 so the second part
+				// of the data length (data[1]) is sent plus the 6 bytes of
+				// actual data.
+				//
+				// TODO: if elm327_config.show_header is disabled then we
+				// should send the length of the full data on its own line
+				// and then send `0: [6 bytes of data]` on the next line for
+				// the first frame
+				rx_frame_data_length = 7;
+			}
+			else if (frame_type == 0x20)
+			{
+				// This is a consecutive frame
+				// Sequence index of the frame is 0x0F & data[0]
+				// From the examples in the ELM327 docs the final consecutive frame includes
+				// any padding bytes.
+				// TODO: if elm327_config.show_header is disabled then we should add a prefix to the
+				// printed line: `[sequence index]: [7 bytes of data]`.
+				rx_frame_data_length = 7;
+			}
+			else if (frame_type == 0x30)
+			{
+				// This is a flow control frame from an ECU that isn't
+				// receiving a request from us, just send all the bytes to
+				// the client
+				rx_frame_data_length = 7;
+			}
+			else
+			{
+				// This is a single frame
+				rx_frame_data_length = rx_frame.data[0];
+			}
+
+			// If this is a first frame, consecutive frame, or flow control frame the PCI (rx_frame.data[0]) will
+			// not be a valid length without some processing, so just print all 7 bytes
+			if(rx_frame_data_length > 7) rx_frame_data_length = 7;
+
+			rx_cb(&rx_frame, rx_frame_data_length, link, status, ctx);
+
+			if(expected_rsp != 0xFF)
+			{
+				if(expected_rsp == number_of_rsp)
+				{
+					timeout_flag = 1;
+					break;
+				}
+			}
+		}
+		now_us = esp_timer_get_time();
+	}
+	xEventGroupClearBits(elm327_event_group, ELM327_READY_TO_RECEIVE_CAN);
+	ESP_LOGW(TAG, "Response time: %" PRIu32, (uint32_t)((esp_timer_get_time() - txtime)/1000));
+
+	return number_of_rsp;
+}
+
+// Prints a response frame the way an ELM327 does
+static void elm327_text_rx(twai_message_t *rx_frame, uint8_t data_length, isotp_link_t *link,
+							isotp_status_t status, void *ctx)
+{
+	elm327_text_ctx_t *text = (elm327_text_ctx_t *)ctx;
+	char *rsp = text->rsp;
+	char tmp[10];
+
+	memset(tmp, 0, sizeof(tmp));
+
+	// Based on the "CAF0 AND CAF1" section of the ELM doc, if headers are shown
+	// the PCI byte(s) (usually just data[0]) should be printed.
+	if(elm327_config.show_header)
+	{
+		if(rx_frame->extd == 0)
+		{
+			sprintf((char*)rsp, "%03lX", rx_frame->identifier&0xFFF);
+		}
+		else
+		{
+			sprintf((char*)rsp, "%08lX", rx_frame->identifier&TWAI_EXTD_ID_MASK);
+		}
+		if(elm327_config.space_print)
+		{
+			strcat((char*)rsp, (char*)" ");
+		}
+		sprintf((char*)tmp, "%02X", rx_frame->data[0]);
+		strcat((char*)rsp, (char*)tmp);
+	}
+
+//	ESP_LOGI(TAG, "ELM327 send 1: %s", rsp);
+
+	for (int i = 0; i < data_length; i++)
+	{
+		if(elm327_config.space_print)
+		{
+			sprintf((char*)tmp, " %02X", rx_frame->data[1+i]);
+		}
+		else
+		{
+			sprintf((char*)tmp, "%02X", rx_frame->data[1+i]);
+		}
+		
+		strcat((char*)rsp, (char*)tmp);
+	}
+
+	strcat((char*)rsp, "\r");
+	ESP_LOGW(TAG, "ELM327 send: %s", rsp);
+//	ESP_LOG_BUFFER_HEX(TAG, rsp, strlen(rsp));
+	elm327_response(rsp, 0, text->queue);
+	memset(rsp, 0, strlen(rsp));
+//	strcat((char*)rsp, "\r");
+}
+
+static void elm327_native_rx(twai_message_t *rx_frame, uint8_t data_length, isotp_link_t *link,
+							isotp_status_t status, void *ctx)
+{
+	elm327_native_ctx_t *native = (elm327_native_ctx_t *)ctx;
+
+	if(status == ISOTP_DONE && link != NULL && link->rx_buf != NULL && native->count < native->max_msgs)
+	{
+		elm327_msg_t *msg = &native->msgs[native->count++];
+
+		msg->id = rx_frame->identifier;
+		msg->length = link->rx_len;
+		msg->data = link->rx_buf;
+	}
+}
+
+static bool elm327_protocol_is_can(void)
+{
+	return (elm327_config.protocol == '6') || (elm327_config.protocol == '8') ||
+			(elm327_config.protocol == '7') || (elm327_config.protocol == '9');
+}
+
+static void elm327_fill_request(twai_message_t *txframe, uint32_t tx_id)
+{
+	txframe->identifier = (tx_id != 0) ? tx_id : elm327_get_identifier();
+	txframe->extd = elm327_config.protocol == '7' || elm327_config.protocol == '9';
+
+	txframe->rtr = 0;
+	// Pad the data
+	memset(txframe->data, 0xAA, 8);
+
+	// CAN frames always have a data length code of 8, this is different than the
+	// PCI byte (txframe->data[0])
+	txframe->data_length_code = 8;
+	txframe->self = 0;
+}
+
+int elm327_request_native(uint32_t tx_id, uint32_t rx_id, const uint8_t *payload, uint16_t len, uint8_t expected,
+							uint8_t *buf, uint16_t buf_size, elm327_msg_t *msgs, uint8_t max_msgs)
+{
+	twai_message_t txframe;
+	elm327_native_ctx_t native = {
+		.store = {
+			.buf = buf,
+			.size = buf_size,
+			.used = 0,
+		},
+		.msgs = msgs,
+		.max_msgs = max_msgs,
+		.count = 0,
+	};
+
+	if(!elm327_protocol_is_can() || len == 0 || len > ISOTP_MAX_LEN)
+	{
+		return -1;
+	}
+
+	elm327_fill_request(&txframe, tx_id);
+	elm327_transfer(&txframe, payload, len, (expected == 0) ? 0xFF : expected, rx_id, &native.store, elm327_native_rx, &native);
+	return native.count;
 }
 
 static int8_t elm327_request(char *cmd, char *rsp, QueueHandle_t *queue)
 {
 	twai_message_t txframe;
 	uint8_t cmd_data_length;
+	uint8_t payload[ELM327_MAX_REQUEST];
+	elm327_text_ctx_t text = {
+		.rsp = rsp,
+		.queue = queue,
+	};
 
 	ESP_LOGI(TAG, "PID req, cmd_buffer: %s", cmd);
 	ESP_LOG_BUFFER_HEX(TAG, cmd, strlen(cmd));
 
-	if((elm327_config.protocol != '6') && (elm327_config.protocol != '8') && (elm327_config.protocol != '7') && (elm327_config.protocol != '9'))
+	if(!elm327_protocol_is_can())
 	{
 		if(elm327_config.protocol == '1' || elm327_config.protocol == '2')
 		{
@@ -766,21 +1106,7 @@ static int8_t elm327_request(char *cmd, char *rsp, QueueHandle_t *queue)
 		return 0;
 	}
 
-	twai_message_t rx_frame;
-
-	txframe.identifier = elm327_get_identifier();
-	txframe.extd = elm327_config.protocol == '7' || elm327_config.protocol == '9';
-
-	txframe.rtr = 0;
-	// Pad the data
-	txframe.data[0] = 0xAA;
-	txframe.data[1] = 0xAA;
-	txframe.data[2] = 0xAA;
-	txframe.data[3] = 0xAA;
-	txframe.data[4] = 0xAA;
-	txframe.data[5] = 0xAA;
-	txframe.data[6] = 0xAA;
-	txframe.data[7] = 0xAA;
+	elm327_fill_request(&txframe, 0);
 
 	uint8_t req_expected_rsp = 0xFF;
 
@@ -803,9 +1129,9 @@ static int8_t elm327_request(char *cmd, char *rsp, QueueHandle_t *queue)
 	}
 
 	cmd_data_length = strlen(cmd)/2;
-	if(cmd_data_length > 7)
+	if(cmd_data_length == 0 || cmd_data_length > sizeof(payload))
 	{
-		// commands can't be longer than 7 bytes unless flow control is used
+		// Longer requests are sent as several frames with flow control
 		// FIXME: this should use the linefeed setting and match the number of
 		// `\r`s that are normally sent.
 		strcat(rsp, "?\r>");
@@ -813,192 +1139,9 @@ static int8_t elm327_request(char *cmd, char *rsp, QueueHandle_t *queue)
 		return 0;
 	}
 
-	txframe.data[0] = cmd_data_length;
-	elm327_fill_data_from_hex_str(cmd, &txframe.data[1], cmd_data_length);
-
-	// CAN frames always have a data length code of 8, this is different than the
-	// PCI byte (txframe.data[0])
-	txframe.data_length_code = 8;
-	txframe.self = 0;
-
-	// if(txframe.extd == 0)
-	// {
-	// 	ESP_LOGI(TAG, "sending %03X", txframe.identifier&0xFFF);
-	// }
-	// else
-	// {
-	// 	ESP_LOGI(TAG, "sending %08X", txframe.identifier&TWAI_EXTD_ID_MASK);
-	// }
-	// ESP_LOG_BUFFER_HEX(TAG, txframe.data, 8);
-	if( elm327_can_log != NULL)
-	{
-		elm327_can_log(&txframe, ELM327_CAN_TX);
-	}
-	while( xQueueReceive(*can_rx_queue, ( void * ) &rx_frame, pdMS_TO_TICKS(1)) == pdPASS );
-	can_flush_rx();
-	can_send(&txframe, 1);
-	xEventGroupSetBits(elm327_event_group, ELM327_READY_TO_RECEIVE_CAN);
+	elm327_fill_data_from_hex_str(cmd, payload, cmd_data_length);
 
-	TickType_t xtimeout = (elm327_config.req_timeout*4.096) / portTICK_PERIOD_MS;
-	TickType_t xwait_time;
-	int64_t txtime = esp_timer_get_time();
-	uint8_t timeout_flag = 0;
-	uint8_t rsp_found = 0;
-	uint8_t number_of_rsp = 0;
-	char tmp[10];
-	xwait_time = xtimeout;
-	memset(tmp, 0, sizeof(tmp));
-	ESP_LOGW(TAG, "req_expected_rsp: %u", req_expected_rsp);
-	while(timeout_flag == 0)
-	{
-		if( xQueueReceive(*can_rx_queue, ( void * ) &rx_frame, xwait_time) == pdPASS )
-		{
-			xwait_time = xtimeout;
-			// if(rx_frame.extd == 0)
-			// {
-			// 	ESP_LOGI(TAG, "received %03X %02X", rx_frame.identifier&0xFFF,rx_frame.data[0]);
-			// }
-			// else
-			// {
-			// 	ESP_LOGI(TAG, "received %08X %02X", rx_frame.identifier&TWAI_EXTD_ID_MASK,rx_frame.data[0]);
-			// }
-
-			if(elm327_should_receive(&rx_frame))
-			{
-				if( elm327_can_log != NULL)
-				{
-					elm327_can_log(&rx_frame, ELM327_CAN_RX);
-				}
-				//reset timeout after response is received
-				rsp_found = 1;
-				number_of_rsp++;
-
-				// Identify what kind of frame this is.
-				int rx_frame_data_length = 0;
-				uint8_t frame_type = rx_frame.data[0] & 0xF0;
-				if (frame_type == 0x10)
-				{
-					// This is a first frame
-					// Send a flow control response so we can get the remaining frames
-					elm327_send_flow_control_frame(&rx_frame);
-					// Length of the full data is:
-					//   ((0x0F & data[0]) << 8 | data[1])
-					//
-					// For now, we say the data length is 7 so the second part
-					// of the data length (data[1]) is sent plus the 6 bytes of
-					// actual data.
-					//
-					// TODO: if elm327_config.show_header is disabled then we
-					// should send the length of the full data on its own line
-					// and then send `0: [6 bytes of data]` on the next line for
-					// the first frame
-					rx_frame_data_length = 7;
-				}
-				else if (frame_type == 0x20)
-				{
-					// This is a consecutive frame
-					// Sequence index of the frame is 0x0F & data[0]
-					// From the examples in the ELM327 docs the final consecutive frame includes
-					// any padding bytes. In theory we could be smarter and figure out how many
-					// of the total bytes we've received and then not print the padding bytes.
-					// However this is complex since the frames might come in out of order and
-					// there might be more than 15 of them.
-					// TODO: if elm327_config.show_header is disabled then we should add a prefix to the
-					// printed line: `[sequence index]: [7 bytes of data]`.
-					rx_frame_data_length = 7;
-				}
-				else if (frame_type == 0x30)
-				{
-					// This is a flow control frame from an ECU
-					//
-					// TODO: if we start supporting sending more than 7 bytes of
-					// data. We'll have to send first frames ourselves, and
-					// we'll need to handle receiving flow control frames from
-					// ECUs. In the meantime if we get one just send all the
-					// bytes to the client
-					rx_frame_data_length = 7;
-				}
-				else
-				{
-					// This is a single frame
-					rx_frame_data_length = rx_frame.data[0];
-				}
-
-				// Based on the "CAF0 AND CAF1" section of the ELM doc, if headers are shown
-				// the PCI byte(s) (usually just data[0]) should be printed.
-				if(elm327_config.show_header)
-				{
-					if(rx_frame.extd == 0)
-					{
-						sprintf((char*)rsp, "%03lX", rx_frame.identifier&0xFFF);
-					}
-					else
-					{
-						sprintf((char*)rsp, "%08lX", rx_frame.identifier&TWAI_EXTD_ID_MASK);
-					}
-					if(elm327_config.space_print)
-					{
-						strcat((char*)rsp, (char*)" ");
-					}
-					sprintf((char*)tmp, "%02X", rx_frame.data[0]);
-					strcat((char*)rsp, (char*)tmp);
-				}
-
-//				ESP_LOGI(TAG, "ELM327 send 1: %s", rsp);
-
-				// If this is a first frame, consecutive frame, or flow control frame the PCI (rx_frame.data[0]) will
-				// not be a valid length without some processing, so just print all 7 bytes
-				if(rx_frame_data_length > 7) rx_frame_data_length = 7;
-
-				for (int i = 0; i < rx_frame_data_length; i++)
-				{
-					if(elm327_config.space_print)
-					{
-						sprintf((char*)tmp, " %02X", rx_frame.data[1+i]);
-					}
-					else
-					{
-						sprintf((char*)tmp, "%02X", rx_frame.data[1+i]);
-					}
-					
-					strcat((char*)rsp, (char*)tmp);
-				}
-
-				strcat((char*)rsp, "\r");
-				ESP_LOGW(TAG, "ELM327 send: %s", rsp);
-//				ESP_LOG_BUFFER_HEX(TAG, rsp, strlen(rsp));
-				elm327_response(rsp, 0, queue);
-				memset(rsp, 0, strlen(rsp));
-//				strcat((char*)rsp, "\r");
-				if(req_expected_rsp != 0xFF)
-				{
-					if(req_expected_rsp == number_of_rsp)
-					{
-						timeout_flag = 1;
-						break;
-					}
-				}
-			}
-			else
-			{
-				xwait_time -= (((esp_timer_get_time() - txtime)/1000)/portTICK_PERIOD_MS);
-				ESP_LOGI(TAG, "xwait_time: %lu" , xwait_time);
-				if(xwait_time > (elm327_config.req_timeout*4.096))
-				{
-					xwait_time = 0;
-					timeout_flag = 1;
-				}
-			}
-		}
-		else
-		{
-			timeout_flag = 1;
-		}
-	}
-	xEventGroupClearBits(elm327_event_group, ELM327_READY_TO_RECEIVE_CAN);
-	ESP_LOGW(TAG, "Response time: %" PRIu32, (uint32_t)((esp_timer_get_time() - txtime)/1000));
-
-	if(rsp_found == 0)
+	if(elm327_transfer(&txframe, payload, cmd_data_length, req_expected_rsp, 0, NULL, elm327_text_rx, &text) == 0)
 	{
 		strcat((char*)rsp, "NO DATA\r\r>");
 	}
@@ -1040,6 +1183,11 @@ const xelm327_cmd_t elm327_commands[] = {
 											{NULL, NULL},
 									};
 
+uint32_t elm327_get_config_gen(void)
+{
+	return elm327_config_gen;
+}
+
 void elm327_lock(void)
 {
 	xSemaphoreTake(elm327_mutex, pdMS_TO_TICKS(portMAX_DELAY));
@@ -1071,6 +1219,7 @@ int8_t elm327_process_cmd(uint8_t *buf, uint8_t len, twai_message_t *frame, Queu
 
 			if(!strncmp(cmd_buffer, "at", 2))
 			{
+				elm327_config_gen++;
 				for(int j = 0; elm327_commands[j].command != NULL; j++)
 				{
 					if(!strncmp(&cmd_buffer[2], elm327_commands[j].command, strlen(elm327_commands[j].command)))
@@ -1190,6 +1339,7 @@ void elm327_init(void (*send_to_host)(char*, uint32_t, QueueHandle_t *q), QueueH
     }
 	
 	elm327_set_default_config(true);
+	isotp_init(&elm327_isotp, elm327_isotp_send, NULL);
 	elm327_response = send_to_host;
 	can_rx_queue = rx_queue;
 	elm327_can_log = can_log;
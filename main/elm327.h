@@ -25,6 +25,15 @@
 #define ELM327_CAN_RX   0x01
 #define ELM327_CAN_TX   0x02
 
+// A reassembled response of a native request, data points into the buffer
+// passed to elm327_request_native()
+typedef struct
+{
+	uint32_t id;
+	uint16_t length;
+	uint8_t *data;
+}elm327_msg_t;
+
 void elm327_init(void (*send_to_host)(char*, uint32_t, QueueHandle_t *q), QueueHandle_t *rx_queue, void (*can_log)(twai_message_t* frame, uint8_t type));
 int8_t elm327_process_cmd(uint8_t *buf, uint8_t len, twai_message_t *frame, QueueHandle_t *q);
 char elm327_get_current_protocol(void);
@@ -33,4 +42,7 @@ void elm327_unlock(void);
 uint32_t elm327_get_identifier(void);
 uint32_t elm327_get_rx_address(void);
 uint8_t elm327_ready_to_receive(void);
+uint32_t elm327_get_config_gen(void);
+int elm327_request_native(uint32_t tx_id, uint32_t rx_id, const uint8_t *payload, uint16_t len, uint8_t expected,
+							uint8_t *buf, uint16_t buf_size, elm327_msg_t *msgs, uint8_t max_msgs);
 #endif
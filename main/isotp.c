@@ -0,0 +1,443 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+#include "isotp.h"
+
+#define ISOTP_PCI_SF            0x0
+#define ISOTP_PCI_FF            0x1
+#define ISOTP_PCI_CF            0x2
+#define ISOTP_PCI_FC            0x3
+
+#define ISOTP_FS_CTS            0x0
+#define ISOTP_FS_WAIT           0x1
+#define ISOTP_FS_OVFLW          0x2
+
+#define ISOTP_FRAME_SIZE        8
+
+void isotp_init(isotp_t *isotp, isotp_send_t send, void *ctx)
+{
+    memset(isotp, 0, sizeof(isotp_t));
+    isotp->send = send;
+    isotp->ctx = ctx;
+    isotp->fc_bs = 0;
+    isotp->fc_stmin = 0;
+    isotp->pad = 0xAA;
+    isotp->wft_max = 10;
+    isotp->n_bs_us = 1000000;
+    isotp->n_cr_us = 1000000;
+}
+
+void isotp_reset(isotp_t *isotp)
+{
+    memset(isotp->links, 0, sizeof(isotp->links));
+}
+
+isotp_link_t *isotp_open(isotp_t *isotp, uint32_t tx_id, uint32_t rx_id, bool extd,
+                            uint8_t *rx_buf, uint16_t rx_size)
+{
+    isotp_link_t *free_link = NULL;
+
+    for (int i = 0; i < ISOTP_MAX_LINKS; i++)
+    {
+        isotp_link_t *link = &isotp->links[i];
+
+        if (link->in_use)
+        {
+            if (link->tx_id == tx_id && link->rx_id == rx_id && link->extd == extd)
+            {
+                link->rx_buf = rx_buf;
+                link->rx_size = rx_size;
+                return link;
+            }
+        }
+        else if (free_link == NULL)
+        {
+            free_link = link;
+        }
+    }
+
+    if (free_link != NULL)
+    {
+        memset(free_link, 0, sizeof(isotp_link_t));
+        free_link->tx_id = tx_id;
+        free_link->rx_id = rx_id;
+        free_link->extd = extd;
+        free_link->rx_buf = rx_buf;
+        free_link->rx_size = rx_size;
+        free_link->in_use = true;
+    }
+    return free_link;
+}
+
+isotp_link_t *isotp_find(isotp_t *isotp, uint32_t rx_id, bool extd)
+{
+    for (int i = 0; i < ISOTP_MAX_LINKS; i++)
+    {
+        isotp_link_t *link = &isotp->links[i];
+
+        if (link->in_use && link->rx_id == rx_id && link->extd == extd)
+        {
+            return link;
+        }
+    }
+    return NULL;
+}
+
+void isotp_close(isotp_link_t *link)
+{
+    link->in_use = false;
+}
+
+static isotp_status_t isotp_send_frame(isotp_t *isotp, isotp_link_t *link, uint8_t *frame, uint8_t len)
+{
+    // Classic CAN frames are always padded to 8 bytes
+    memset(&frame[len], isotp->pad, ISOTP_FRAME_SIZE - len);
+    if (isotp->send(link->tx_id, link->extd, frame, ISOTP_FRAME_SIZE, isotp->ctx) != 0)
+    {
+        return ISOTP_ERR_SEND;
+    }
+    return ISOTP_OK;
+}
+
+static isotp_status_t isotp_send_fc(isotp_t *isotp, isotp_link_t *link, uint8_t flow_status)
+{
+    uint8_t frame[ISOTP_FRAME_SIZE];
+
+    frame[0] = (ISOTP_PCI_FC << 4) | flow_status;
+    frame[1] = isotp->fc_bs;
+    frame[2] = isotp->fc_stmin;
+    return isotp_send_frame(isotp, link, frame, 3);
+}
+
+// STmin 0x00-0x7F is in ms, 0xF1-0xF9 in 100 us steps, anything else is
+// reserved and read as the longest valid value
+static uint32_t isotp_stmin_us(uint8_t stmin)
+{
+    if (stmin <= 0x7F)
+    {
+        return stmin * 1000;
+    }
+    if (stmin >= 0xF1 && stmin <= 0xF9)
+    {
+        return (stmin - 0xF0) * 100;
+    }
+    return 127000;
+}
+
+static isotp_status_t isotp_tx_end(isotp_link_t *link, isotp_status_t status)
+{
+    link->tx_state = ISOTP_IDLE;
+    link->tx_status = status;
+    return status;
+}
+
+static isotp_status_t isotp_rx_end(isotp_link_t *link, isotp_status_t status)
+{
+    link->rx_state = ISOTP_IDLE;
+    link->rx_status = status;
+    return status;
+}
+
+// Sends every consecutive frame that is due, stopping at the end of a
+// block or when STmin has to pass before the next one
+static isotp_status_t isotp_tx_pump(isotp_t *isotp, isotp_link_t *link, int64_t now_us)
+{
+    while (link->tx_state == ISOTP_TX_SENDING && now_us >= link->tx_due_us)
+    {
+        uint8_t frame[ISOTP_FRAME_SIZE];
+        uint16_t n = link->tx_len - link->tx_pos;
+
+        if (n > 7)
+        {
+            n = 7;
+        }
+        frame[0] = (ISOTP_PCI_CF << 4) | link->tx_sn;
+        memcpy(&frame[1], &link->tx_buf[link->tx_pos], n);
+        if (isotp_send_frame(isotp, link, frame, 1 + n) != ISOTP_OK)
+        {
+            return isotp_tx_end(link, ISOTP_ERR_SEND);
+        }
+        link->tx_pos += n;
+        link->tx_sn = (link->tx_sn + 1) & 0x0F;
+
+        if (link->tx_pos >= link->tx_len)
+        {
+            return isotp_tx_end(link, ISOTP_DONE);
+        }
+        if (link->tx_bs != 0 && ++link->tx_block >= link->tx_bs)
+        {
+            link->tx_block = 0;
+            link->tx_state = ISOTP_TX_WAIT_FC;
+            link->tx_due_us = now_us + isotp->n_bs_us;
+            break;
+        }
+        link->tx_due_us = now_us + link->tx_stmin_us;
+    }
+    return ISOTP_OK;
+}
+
+isotp_status_t isotp_send(isotp_t *isotp, isotp_link_t *link, const uint8_t *data, uint16_t len, int64_t now_us)
+{
+    uint8_t frame[ISOTP_FRAME_SIZE];
+
+    if (link->tx_state != ISOTP_IDLE)
+    {
+        return ISOTP_ERR_BUSY;
+    }
+    if (len == 0 || len > ISOTP_MAX_LEN)
+    {
+        return ISOTP_ERR_LEN;
+    }
+
+    if (len <= 7)
+    {
+        frame[0] = (ISOTP_PCI_SF << 4) | len;
+        memcpy(&frame[1], data, len);
+        return isotp_tx_end(link, (isotp_send_frame(isotp, link, frame, 1 + len) == ISOTP_OK) ? ISOTP_DONE : ISOTP_ERR_SEND);
+    }
+
+    frame[0] = (ISOTP_PCI_FF << 4) | (len >> 8);
+    frame[1] = len & 0xFF;
+    memcpy(&frame[2], data, 6);
+    if (isotp_send_frame(isotp, link, frame, ISOTP_FRAME_SIZE) != ISOTP_OK)
+    {
+        return isotp_tx_end(link, ISOTP_ERR_SEND);
+    }
+
+    // The data must stay valid until the transfer ends
+    link->tx_buf = data;
+    link->tx_len = len;
+    link->tx_pos = 6;
+    link->tx_sn = 1;
+    link->tx_block = 0;
+    link->tx_waits = 0;
+    link->tx_state = ISOTP_TX_WAIT_FC;
+    link->tx_status = ISOTP_OK;
+    link->tx_due_us = now_us + isotp->n_bs_us;
+    return ISOTP_OK;
+}
+
+static void isotp_rx_store(isotp_link_t *link, const uint8_t *data, uint32_t n)
+{
+    if (link->rx_pos + n > link->rx_len)
+    {
+        // The last CF is padded
+        n = link->rx_len - link->rx_pos;
+    }
+    if (link->rx_buf != NULL)
+    {
+        memcpy(&link->rx_buf[link->rx_pos], data, n);
+    }
+    link->rx_pos += n;
+}
+
+static isotp_status_t isotp_on_flow_control(isotp_t *isotp, isotp_link_t *link, const uint8_t *data, uint8_t len, int64_t now_us)
+{
+    if (link->tx_state != ISOTP_TX_WAIT_FC)
+    {
+        return ISOTP_IGNORED;
+    }
+    if (len < 3)
+    {
+        return isotp_tx_end(link, ISOTP_ERR_LEN);
+    }
+
+    switch (data[0] & 0x0F)
+    {
+        case ISOTP_FS_CTS:
+            link->tx_bs = data[1];
+            link->tx_stmin_us = isotp_stmin_us(data[2]);
+            link->tx_block = 0;
+            link->tx_waits = 0;
+            link->tx_state = ISOTP_TX_SENDING;
+            // The first CF after a flow control doesn't wait for STmin
+            link->tx_due_us = now_us;
+            return isotp_tx_pump(isotp, link, now_us);
+
+        case ISOTP_FS_WAIT:
+            if (++link->tx_waits > isotp->wft_max)
+            {
+                return isotp_tx_end(link, ISOTP_ERR_WFT);
+            }
+            link->tx_due_us = now_us + isotp->n_bs_us;
+            return ISOTP_OK;
+
+        case ISOTP_FS_OVFLW:
+            return isotp_tx_end(link, ISOTP_ERR_OVERFLOW);
+
+        default:
+            return isotp_tx_end(link, ISOTP_ERR_LEN);
+    }
+}
+
+isotp_status_t isotp_on_frame(isotp_t *isotp, isotp_link_t *link, const uint8_t *data, uint8_t len, int64_t now_us)
+{
+    uint32_t msg_len;
+    uint8_t header;
+
+    if (len == 0)
+    {
+        return ISOTP_ERR_LEN;
+    }
+
+    switch (data[0] >> 4)
+    {
+        case ISOTP_PCI_SF:
+            // A new message also ends a reception in progress
+            msg_len = data[0] & 0x0F;
+            if (msg_len == 0 || msg_len > len - 1u)
+            {
+                return ISOTP_ERR_LEN;
+            }
+            if (link->rx_buf != NULL && msg_len > link->rx_size)
+            {
+                return isotp_rx_end(link, ISOTP_ERR_OVERFLOW);
+            }
+            link->rx_len = msg_len;
+            link->rx_pos = 0;
+            isotp_rx_store(link, &data[1], msg_len);
+            return isotp_rx_end(link, ISOTP_DONE);
+
+        case ISOTP_PCI_FF:
+            if (len < ISOTP_FRAME_SIZE)
+            {
+                return ISOTP_ERR_LEN;
+            }
+            msg_len = ((data[0] & 0x0F) << 8) | data[1];
+            header = 2;
+            if (msg_len == 0)
+            {
+                // Lengths above 4095 are escaped into 32 bits
+                msg_len = ((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) |
+                            ((uint32_t)data[4] << 8) | data[5];
+                header = 6;
+            }
+            if (msg_len < ISOTP_FRAME_SIZE)
+            {
+                return ISOTP_ERR_LEN;
+            }
+            if (link->rx_buf != NULL && msg_len > link->rx_size)
+            {
+                isotp_send_fc(isotp, link, ISOTP_FS_OVFLW);
+                return isotp_rx_end(link, ISOTP_ERR_OVERFLOW);
+            }
+            link->rx_len = msg_len;
+            link->rx_pos = 0;
+            isotp_rx_store(link, &data[header], ISOTP_FRAME_SIZE - header);
+            link->rx_sn = 1;
+            link->rx_block = 0;
+            link->rx_state = ISOTP_RX_RECEIVING;
+            link->rx_status = ISOTP_OK;
+            link->rx_due_us = now_us + isotp->n_cr_us;
+            if (isotp_send_fc(isotp, link, ISOTP_FS_CTS) != ISOTP_OK)
+            {
+                return isotp_rx_end(link, ISOTP_ERR_SEND);
+            }
+            return ISOTP_OK;
+
+        case ISOTP_PCI_CF:
+            if (link->rx_state != ISOTP_RX_RECEIVING)
+            {
+                return ISOTP_IGNORED;
+            }
+            if ((data[0] & 0x0F) != link->rx_sn)
+            {
+                return isotp_rx_end(link, ISOTP_ERR_SEQ);
+            }
+            isotp_rx_store(link, &data[1], len - 1);
+            link->rx_sn = (link->rx_sn + 1) & 0x0F;
+            if (link->rx_pos >= link->rx_len)
+            {
+                return isotp_rx_end(link, ISOTP_DONE);
+            }
+            link->rx_due_us = now_us + isotp->n_cr_us;
+            if (isotp->fc_bs != 0 && ++link->rx_block >= isotp->fc_bs)
+            {
+                link->rx_block = 0;
+                if (isotp_send_fc(isotp, link, ISOTP_FS_CTS) != ISOTP_OK)
+                {
+                    return isotp_rx_end(link, ISOTP_ERR_SEND);
+                }
+            }
+            return ISOTP_OK;
+
+        case ISOTP_PCI_FC:
+            return isotp_on_flow_control(isotp, link, data, len, now_us);
+
+        default:
+            return ISOTP_IGNORED;
+    }
+}
+
+// Runs the STmin pacing and the N_Bs/N_Cr timeouts of every link. Returns
+// when it next needs to run, ISOTP_NO_DEADLINE if nothing is pending.
+int64_t isotp_poll(isotp_t *isotp, int64_t now_us)
+{
+    int64_t next_us = ISOTP_NO_DEADLINE;
+
+    for (int i = 0; i < ISOTP_MAX_LINKS; i++)
+    {
+        isotp_link_t *link = &isotp->links[i];
+
+        if (!link->in_use)
+        {
+            continue;
+        }
+
+        if (link->tx_state == ISOTP_TX_WAIT_FC && now_us >= link->tx_due_us)
+        {
+            isotp_tx_end(link, ISOTP_ERR_TIMEOUT_BS);
+        }
+        isotp_tx_pump(isotp, link, now_us);
+        if (link->tx_state != ISOTP_IDLE && link->tx_due_us < next_us)
+        {
+            next_us = link->tx_due_us;
+        }
+
+        if (link->rx_state == ISOTP_RX_RECEIVING)
+        {
+            if (now_us >= link->rx_due_us)
+            {
+                isotp_rx_end(link, ISOTP_ERR_TIMEOUT_CR);
+            }
+            else if (link->rx_due_us < next_us)
+            {
+                next_us = link->rx_due_us;
+            }
+        }
+    }
+    return next_us;
+}
+
+bool isotp_busy(const isotp_t *isotp)
+{
+    for (int i = 0; i < ISOTP_MAX_LINKS; i++)
+    {
+        const isotp_link_t *link = &isotp->links[i];
+
+        if (link->in_use && (link->tx_state != ISOTP_IDLE || link->rx_state != ISOTP_IDLE))
+        {
+            return true;
+        }
+    }
+    return false;
+}
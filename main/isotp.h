@@ -0,0 +1,119 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef __ISOTP_H__
+#define __ISOTP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ISO 15765-2 transport over classic CAN, normal addressing, 11 or 29 bit.
+// The engine has no OS or driver dependency: frames go out through the
+// send callback, received frames are fed in with isotp_on_frame() and
+// timers run off the timestamps passed in, so it also runs on a host.
+#define ISOTP_MAX_LINKS         10
+#define ISOTP_MAX_LEN           4095
+#define ISOTP_NO_DEADLINE       INT64_MAX
+
+typedef enum
+{
+    ISOTP_OK = 0,               // frame consumed, transfer in progress
+    ISOTP_DONE,                 // frame completed a transfer
+    ISOTP_IGNORED,              // not expected on this link, e.g. a stray CF
+    ISOTP_ERR_SEQ,              // wrong CF sequence number, reception aborted
+    ISOTP_ERR_OVERFLOW,         // message too long for the buffer, or FC overflow
+    ISOTP_ERR_TIMEOUT_BS,       // no flow control from the receiver in time
+    ISOTP_ERR_TIMEOUT_CR,       // no consecutive frame from the sender in time
+    ISOTP_ERR_WFT,              // too many flow control waits
+    ISOTP_ERR_BUSY,             // link is already sending
+    ISOTP_ERR_LEN,              // bad message length, frame length or flow status
+    ISOTP_ERR_SEND,             // the send callback failed
+} isotp_status_t;
+
+typedef enum
+{
+    ISOTP_IDLE = 0,
+    ISOTP_TX_WAIT_FC,
+    ISOTP_TX_SENDING,
+    ISOTP_RX_RECEIVING,
+} isotp_state_t;
+
+// Returns 0 when the frame was queued for sending
+typedef int (*isotp_send_t)(uint32_t id, bool extd, const uint8_t *data, uint8_t len, void *ctx);
+
+// One address pair: frames are sent with tx_id (requests and our flow
+// control) and received with rx_id (responses and their flow control)
+typedef struct
+{
+    uint32_t tx_id;
+    uint32_t rx_id;
+    bool extd;
+    bool in_use;
+
+    isotp_state_t tx_state;
+    isotp_status_t tx_status;
+    const uint8_t *tx_buf;
+    uint16_t tx_len;
+    uint16_t tx_pos;
+    uint8_t tx_sn;
+    uint8_t tx_bs;              // block size from the receiver, 0 is unlimited
+    uint8_t tx_block;           // CFs sent in the current block
+    uint8_t tx_waits;
+    uint32_t tx_stmin_us;
+    int64_t tx_due_us;          // next CF, or the N_Bs timeout in WAIT_FC
+
+    isotp_state_t rx_state;
+    isotp_status_t rx_status;
+    uint8_t *rx_buf;            // NULL checks the transfer without storing it
+    uint16_t rx_size;
+    uint32_t rx_len;
+    uint32_t rx_pos;
+    uint8_t rx_sn;
+    uint8_t rx_block;
+    int64_t rx_due_us;          // N_Cr timeout
+}isotp_link_t;
+
+typedef struct
+{
+    isotp_link_t links[ISOTP_MAX_LINKS];
+    isotp_send_t send;
+    void *ctx;
+    uint8_t fc_bs;              // flow control we send as a receiver
+    uint8_t fc_stmin;
+    uint8_t pad;
+    uint8_t wft_max;
+    uint32_t n_bs_us;
+    uint32_t n_cr_us;
+}isotp_t;
+
+void isotp_init(isotp_t *isotp, isotp_send_t send, void *ctx);
+void isotp_reset(isotp_t *isotp);
+isotp_link_t *isotp_open(isotp_t *isotp, uint32_t tx_id, uint32_t rx_id, bool extd,
+                            uint8_t *rx_buf, uint16_t rx_size);
+isotp_link_t *isotp_find(isotp_t *isotp, uint32_t rx_id, bool extd);
+void isotp_close(isotp_link_t *link);
+isotp_status_t isotp_send(isotp_t *isotp, isotp_link_t *link, const uint8_t *data, uint16_t len, int64_t now_us);
+isotp_status_t isotp_on_frame(isotp_t *isotp, isotp_link_t *link, const uint8_t *data, uint8_t len, int64_t now_us);
+int64_t isotp_poll(isotp_t *isotp, int64_t now_us);
+bool isotp_busy(const isotp_t *isotp);
+
+#endif
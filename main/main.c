@@ -50,6 +50,8 @@
 #include "wc_uart.h"
 #include "elm327.h"
 #include "mqtt.h"
+#include "mqtt_outbox.h"
+#include "can_dedup.h"
 #include "mqtt_broker.h"
 #include "vehicle_detect.h"
 #include "esp_mac.h"
@@ -87,27 +89,7 @@ static bool dbg_net_ready(void) { return wifi_network_is_connected(); }
 
 static void log_can_to_mqtt(twai_message_t *frame, uint8_t type)
 {
-	static mqtt_can_message_t mqtt_msg;
-
-	mqtt_msg.frame.extd = frame->extd;
-	mqtt_msg.frame.rtr = frame->rtr;
-	mqtt_msg.frame.ss = frame->ss;
-	mqtt_msg.frame.self = frame->self;
-	mqtt_msg.frame.dlc_non_comp = frame->dlc_non_comp;
-	mqtt_msg.frame.identifier = frame->identifier;
-	mqtt_msg.frame.data_length_code = frame->data_length_code;
-
-	mqtt_msg.frame.data[0] = frame->data[0];
-	mqtt_msg.frame.data[1] = frame->data[1];
-	mqtt_msg.frame.data[2] = frame->data[2];
-	mqtt_msg.frame.data[3] = frame->data[3];
-	mqtt_msg.frame.data[4] = frame->data[4];
-	mqtt_msg.frame.data[5] = frame->data[5];
-	mqtt_msg.frame.data[6] = frame->data[6];
-	mqtt_msg.frame.data[7] = frame->data[7];
-
-	mqtt_msg.type = type;
-	xQueueSend( xmsg_mqtt_rx_queue, ( void * ) &mqtt_msg, pdMS_TO_TICKS(0) );
+	mqtt_forward_can_frame(frame, type, 0);
 }
 static void process_led(bool state)
 {
@@ -308,7 +290,10 @@ static void can_rx_task(void *pvParameters)
 
         	process_led(1);
 
-        	if(config_server_ws_connected())
+        	uint16_t suppressed;
+        	uint8_t outputs = can_dedup_check(&rx_msg, (uint32_t)(esp_timer_get_time() / 1000), &suppressed);
+
+        	if((outputs & CAN_DEDUP_WS) && config_server_ws_connected())
         	{
         		ucTCP_TX_Buffer.usLen = slcan_parse_frame(ucTCP_TX_Buffer.ucElement, &rx_msg);
 				if(config_server_ws_connected())
@@ -345,13 +330,16 @@ static void can_rx_task(void *pvParameters)
 
 				if(ucTCP_TX_Buffer.usLen != 0)
 				{
-					if(tcp_port_open())
+					if(tcp_port_open() && (outputs & CAN_DEDUP_TCP))
 					{
 						xQueueSend( xMsg_Tx_Queue, ( void * ) &ucTCP_TX_Buffer, pdMS_TO_TICKS(0) );
 					}
 					if(ble_connected())
 					{
-						xQueueSend( xmsg_ble_tx_queue, ( void * ) &ucTCP_TX_Buffer, pdMS_TO_TICKS(0) );
+						if(outputs & CAN_DEDUP_BLE)
+						{
+							xQueueSend( xmsg_ble_tx_queue, ( void * ) &ucTCP_TX_Buffer, pdMS_TO_TICKS(0) );
+						}
 					}
 					else if(project_hardware_rev == WICAN_USB_V100)
 					{
@@ -362,30 +350,12 @@ static void can_rx_task(void *pvParameters)
 					}
 				}
 			}
-			if(mqtt_connected())
+			// While offline frames still go to MQTT when the outbox buffers them
+			if(mqtt_connected() || mqtt_outbox_enabled())
 			{
-				static mqtt_can_message_t mqtt_rx_msg;
-				if(mqtt_elm327_log_en == 0)
+				if(mqtt_elm327_log_en == 0 && (outputs & CAN_DEDUP_MQTT))
 				{
-					mqtt_rx_msg.frame.extd = rx_msg.extd;
-					mqtt_rx_msg.frame.rtr = rx_msg.rtr;
-					mqtt_rx_msg.frame.ss = rx_msg.ss;
-					mqtt_rx_msg.frame.self = rx_msg.self;
-					mqtt_rx_msg.frame.dlc_non_comp = rx_msg.dlc_non_comp;
-					mqtt_rx_msg.frame.identifier = rx_msg.identifier;
-					mqtt_rx_msg.frame.data_length_code = rx_msg.data_length_code;
-
-					mqtt_rx_msg.frame.data[0] = rx_msg.data[0];
-					mqtt_rx_msg.frame.data[1] = rx_msg.data[1];
-					mqtt_rx_msg.frame.data[2] = rx_msg.data[2];
-					mqtt_rx_msg.frame.data[3] = rx_msg.data[3];
-					mqtt_rx_msg.frame.data[4] = rx_msg.data[4];
-					mqtt_rx_msg.frame.data[5] = rx_msg.data[5];
-					mqtt_rx_msg.frame.data[6] = rx_msg.data[6];
-					mqtt_rx_msg.frame.data[7] = rx_msg.data[7];
-
-					mqtt_rx_msg.type = MQTT_CAN;
-					xQueueSend( xmsg_mqtt_rx_queue, ( void * ) &mqtt_rx_msg, pdMS_TO_TICKS(0) );
+					mqtt_forward_can_frame(&rx_msg, MQTT_CAN, suppressed);
 				}
 			}
         }
@@ -438,6 +408,7 @@ void app_main(void)
             derived_mac_addr[3], derived_mac_addr[4], derived_mac_addr[5]);
 	
 	config_server_start(&xmsg_ws_tx_queue, &xMsg_Rx_Queue, CONNECTED_LED_GPIO_NUM, (char*)&uid[0]);
+	can_dedup_init();
 	slcan_init(&send_to_host);
 
 	int8_t can_datarate = config_server_get_can_rate();
@@ -515,7 +486,7 @@ void app_main(void)
 	if(config_server_mqtt_en_config())
 	{
 		can_set_bitrate(can_datarate);
-		xmsg_mqtt_rx_queue = xQueueCreate(32, sizeof(mqtt_can_message_t) );
+		xmsg_mqtt_rx_queue = xQueueCreate(MQTT_RX_QUEUE_SIZE, sizeof(mqtt_can_message_t) );
 		can_enable();
 		mqtt_init((char*)&uid[0], CONNECTED_LED_GPIO_NUM, &xmsg_mqtt_rx_queue);
 	}
@@ -535,8 +506,12 @@ void app_main(void)
 	if(config_server_mqtt_broker_en_config())
 	{
 		int32_t broker_port = config_server_get_mqtt_broker_port();
+		mqtt_broker_limits_t broker_limits;
+
+		config_server_get_mqtt_broker_limits(&broker_limits);
 		ESP_LOGI(TAG, "Initializing MQTT broker on port %d", (int)broker_port);
 
+		mqtt_broker_set_limits(&broker_limits);
 		if(mqtt_broker_init((uint16_t)broker_port) == 0)
 		{
 			ESP_LOGI(TAG, "MQTT broker initialized successfully");
@@ -23,6 +23,7 @@
 #include  "freertos/queue.h"
 #include "freertos/event_groups.h"
 #include "freertos/semphr.h"
+#include "freertos/ringbuf.h"
 #include "esp_wifi.h"
 #include "esp_system.h"
 #include "esp_event.h"
@@ -63,6 +64,14 @@
 #include "expression_parser.h"
 #include "autopid.h"
 #include "dev_status.h"
+#include "can_payload.h"
+#include "mqtt_outbox.h"
+#include "publish_policy.h"
+#include "mqtt_rawfwd.h"
+#include "can_dedup.h"
+#include "mqtt_broker.h"
+#include "mqtt_bridge.h"
+#include "mqtt_lvc.h"
 
 #define TAG 		__func__
 // #define TAG 		"MQTT_CLIENT"
@@ -74,6 +83,10 @@ static EventGroupHandle_t s_mqtt_event_group = NULL;
 #define MQTT_CONNECTED_BIT 			BIT0
 #define PUB_SUCCESS_BIT     		BIT1
 static esp_mqtt_client_handle_t client = NULL;
+// Local broker mode publishes and receives through the broker task directly,
+// no client is created and nothing goes over the loopback socket
+static bool mqtt_local = false;
+static uint8_t mqtt_local_tx_en = 0;
 static char *device_id;
 static char mqtt_sub_topic[128];
 static char mqtt_status_topic[128];
@@ -85,11 +98,89 @@ static QueueHandle_t *xmqtt_tx_queue;
 static uint8_t mqtt_elm327_log = 0;
 static SemaphoreHandle_t xmqtt_semaphore;
 
+// Publisher stage: callers copy messages into the ring buffer, mqtt_pub_task
+// hands them to the client so a slow broker never blocks the producers.
+#define MQTT_PUB_RINGBUF_SIZE       (1024*12)
+
+// The topic string follows the header when the topic table is full
+typedef struct
+{
+    int16_t topic_id;           // -1 when the topic follows the header
+    uint16_t topic_len;         // including the terminating 0
+    uint8_t qos;
+    uint8_t retain;
+    uint32_t len;
+    uint32_t outbox_seq;        // outbox replays only, see mqtt_outbox_publish
+} mqtt_pub_hdr_t;
+
+static RingbufHandle_t mqtt_pub_ringbuf = NULL;
+static char *mqtt_topics[MQTT_MAX_TOPICS];
+static uint32_t mqtt_topic_hash[MQTT_MAX_TOPICS];
+static volatile uint16_t mqtt_topic_count = 0;
+
+// Subscriber-aware publishing with the local broker: one bit per interned
+// topic, rebuilt in the broker task when the subscription set changes and
+// read lock free by the producers
+static uint8_t mqtt_stream_gated = 0;
+static volatile uint32_t mqtt_wanted_bits[(MQTT_MAX_TOPICS + 31) / 32];
+static uint32_t mqtt_wanted_gen = 0;
+static volatile uint16_t mqtt_wanted_count = 0;
+static portMUX_TYPE mqtt_wanted_lock = portMUX_INITIALIZER_UNLOCKED;
+static int16_t mqtt_rx_topic_id = -1;
+static int16_t mqtt_elm327_topic_id = -1;
+static volatile uint32_t mqtt_rx_unsubscribed = 0;
+static portMUX_TYPE mqtt_pub_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t mqtt_pub_backlog = 0;
+static uint32_t mqtt_pub_dropped = 0;
+static uint32_t mqtt_pub_sent = 0;
+// mqtt_pub_task reports the fate of each outbox replay here
+static SemaphoreHandle_t mqtt_outbox_ack = NULL;
+static volatile uint32_t mqtt_outbox_acked_seq = 0;
+static volatile bool mqtt_outbox_ack_ok = false;
+static uint32_t mqtt_outbox_sent_seq = 0;
+static int mqtt_outbox_publish(int16_t topic_id, const char *data, int len);
+static mqtt_payload_format_t mqtt_payload_format = MQTT_PAYLOAD_JSON;
+static uint8_t mqtt_outbox_frames = 0;
+static uint32_t mqtt_outbox_rate = 100;
+
+// Raw can/rx batching: a message is published once it holds rx_batch_frames
+// frames or rx_batch_bytes bytes, or rx_linger_us after its first frame
+static uint32_t mqtt_rx_batch_frames = 0;
+static uint32_t mqtt_rx_batch_bytes = 0;
+static int64_t mqtt_rx_linger_us = 0;
+static volatile uint32_t mqtt_rx_queue_dropped = 0;
+static uint8_t mqtt_dedup_count = 0;
+static uint32_t mqtt_rx_batches = 0;
+static uint32_t mqtt_rx_batch_total = 0;
+static uint32_t mqtt_rx_batch_max = 0;
+static esp_mqtt_client_config_t mqtt_cfg;
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+// MQTT 5: topics that keep being published get a topic alias, after the
+// first publish on a connection only the 2 byte alias is sent. Aliases are
+// per connection so mqtt_pub_task forgets what it sent when mqtt5_conn_gen
+// changes. Mosquitto allows 10 aliases by default, a broker that allows
+// fewer rejects the property and we lower the limit.
+#define MQTT5_ALIAS_MAX             10
+#define MQTT5_ALIAS_MIN_PUBLISHES   8
+static volatile bool mqtt5_active = false;
+static volatile uint32_t mqtt5_conn_gen = 0;
+static uint16_t mqtt5_alias_max = MQTT5_ALIAS_MAX;
+static uint16_t mqtt5_alias_count = 0;
+static uint16_t mqtt5_topic_alias[MQTT_MAX_TOPICS];
+static uint16_t mqtt5_topic_publishes[MQTT_MAX_TOPICS];
+static bool mqtt5_alias_sent[MQTT_MAX_TOPICS];
+static const char *mqtt5_content_type[MQTT_MAX_TOPICS];
+static uint32_t mqtt5_expiry = 0;
+static mqtt5_user_property_handle_t mqtt5_user_property = NULL;
+static esp_mqtt5_publish_property_config_t mqtt5_pub_property;
+#endif
+
 
 typedef struct 
 {
     uint32_t can_id;
-    char name[16];
+    char name[32];
 	int32_t pid;
     int32_t pidi;
     uint32_t start_bit;
@@ -97,10 +188,43 @@ typedef struct
     char expression[32];
     uint32_t cycle;
 	int64_t logtime;
+    uint32_t order;
+    uint8_t pid_check;
+    uint8_t pid_index;
+    uint8_t pid_value;
+    uint8_t topic;
+    uint8_t dirty;              // 1 waiting for the batch, 2 in the object being built
+    double last_value;
+    int64_t dirty_time;
+    publish_policy_t policy;
+    publish_state_t pub_state;
 } CANFilter;
 
+// One entry per distinct CAN ID, pointing at the contiguous run of filters
+// (sorted by CAN ID) that decode signals from that ID.
+typedef struct
+{
+    uint32_t can_id;
+    uint32_t start;
+    uint32_t count;
+} canflt_group_t;
+
 static CANFilter *mqtt_canflt_values = NULL;
 static uint32_t mqtt_canflt_size = 0;
+static canflt_group_t *mqtt_canflt_index = NULL;
+static uint32_t mqtt_canflt_index_mask = 0;
+
+// Signal batching, configured by "batch_ms" in the filter file. Topic 0 is
+// the rx topic, filters can select another one with "Topic".
+#define MQTT_CANFLT_MAX_TOPICS      8
+static char mqtt_canflt_topics[MQTT_CANFLT_MAX_TOPICS][64];
+static int16_t mqtt_canflt_topic_ids[MQTT_CANFLT_MAX_TOPICS];
+static uint32_t mqtt_canflt_topic_hash[MQTT_CANFLT_MAX_TOPICS];
+static uint8_t mqtt_canflt_topic_count = 1;
+static int64_t mqtt_canflt_batch_us = 0;
+static int64_t mqtt_canflt_next_flush = 0;
+static uint32_t mqtt_canflt_dirty = 0;
+static char *mqtt_canflt_batch_buf = NULL;
 
 
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
@@ -120,9 +244,14 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 			
             esp_mqtt_client_subscribe(client, mqtt_cmd_topic, 0);
 			gpio_set_level(mqtt_led, 0);
-			esp_mqtt_client_publish(client, mqtt_status_topic, "{\"status\": \"online\"}", 0, 0, 1);
-
+#ifdef CONFIG_MQTT_PROTOCOL_5
+            mqtt5_conn_gen++;
+#endif
             xEventGroupSetBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
+            // Through the publisher so it is the only task setting publish properties
+			mqtt_publish(mqtt_status_topic, "{\"status\": \"online\"}", 0, 0, 1);
+            // The broker may have lost retained state while we were away
+            mqtt_lvc_mark_all();
 			break;
 		case MQTT_EVENT_DISCONNECTED:
 			ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
@@ -148,6 +277,19 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 			break;
 		case MQTT_EVENT_ERROR:
 			ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
+#ifdef CONFIG_MQTT_PROTOCOL_5
+            // 3.1.1 brokers answer a v5 CONNECT with "unacceptable protocol
+            // version" (0x01), v5 brokers that disabled it with 0x84
+            if(mqtt5_active && event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED &&
+                (event->error_handle->connect_return_code == MQTT_CONNECTION_REFUSE_PROTOCOL ||
+                event->error_handle->connect_return_code == 0x84))
+            {
+                ESP_LOGW(TAG, "Broker refused MQTT 5, falling back to 3.1.1");
+                mqtt5_active = false;
+                mqtt_cfg.session.protocol_ver = MQTT_PROTOCOL_V_3_1_1;
+                esp_mqtt_set_config(client, &mqtt_cfg);
+            }
+#endif
 	//        if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
 	//            log_error_if_nonzero("reported from esp-tls", event->error_handle->esp_tls_last_esp_err);
 	//            log_error_if_nonzero("reported from tls stack", event->error_handle->esp_tls_stack_err);
@@ -171,98 +313,98 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 //															 	    id:0x7E0                                          PID: 47 or0x2F
 //get fuel level send: {"bus":0,"type":"tx","ts":35519,"frame":[{"id":2016,"dlc":8,"rtr":false,"extd":false,"data":[2,1,47,170,170,170,170,170]}]}
 
-static void mqtt_parse_data(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
+// can/tx frames are decoded straight into a batch (no cJSON, no heap) and
+// handed to the driver together. Only the MQTT client task (the broker task
+// in local mode) uses the batch.
+#define MQTT_TX_BATCH_SIZE          32
+static twai_message_t mqtt_tx_batch[MQTT_TX_BATCH_SIZE];
+static uint8_t mqtt_tx_batch_count = 0;
+static int64_t mqtt_tx_send_us = 0;
+static uint32_t mqtt_tx_msgs = 0;
+static uint32_t mqtt_tx_frames = 0;
+static uint32_t mqtt_tx_rejects = 0;
+static uint32_t mqtt_tx_dropped = 0;
+static uint32_t mqtt_tx_parse_us = 0;
+static uint32_t mqtt_tx_parse_max_us = 0;
+
+static void mqtt_tx_flush(void)
 {
-    twai_message_t can_frame;
-    cJSON *root = NULL;
-    cJSON *frame = NULL;
-    esp_mqtt_event_handle_t event = event_data;
-    
-    if ((mqtt_elm327_log == 0) && strncmp(event->topic, mqtt_sub_topic, strlen(mqtt_sub_topic)) == 0)
+    int64_t start = esp_timer_get_time();
+
+    if(mqtt_tx_batch_count == 0)
     {
-        root = cJSON_Parse(event->data);
+        return;
+    }
 
-        if (root == NULL)
+    can_enable();
+    for(uint8_t i = 0; i < mqtt_tx_batch_count; i++)
+    {
+        if(can_send(&mqtt_tx_batch[i], 1) == ESP_OK)
         {
-            ESP_LOGE(TAG, "Failed to parse JSON data");
-            goto end;
+            mqtt_tx_frames++;
         }
-
-        cJSON *frame_ary = cJSON_GetObjectItem(root, "frame");
-
-        if (frame_ary == NULL || !cJSON_IsArray(frame_ary))
+        else
         {
-            ESP_LOGE(TAG, "Missing 'frame' object in JSON");
-            goto end;
+            mqtt_tx_dropped++;
         }
+    }
+    mqtt_tx_batch_count = 0;
+    mqtt_tx_send_us += esp_timer_get_time() - start;
+}
 
-        for (int i = 0; i < cJSON_GetArraySize(frame_ary); i++)
-        {
-            frame = cJSON_GetArrayItem(frame_ary, i);
-
-            if (frame == NULL)
-            {
-                ESP_LOGE(TAG, "Error parsing JSON frame");
-                goto end;
-            }
-
-            cJSON *frame_data = cJSON_GetObjectItem(frame, "data");
-
-            if (frame_data == NULL || !cJSON_IsArray(frame_data))
-            {
-                ESP_LOGE(TAG, "Missing or invalid 'data' array in JSON");
-                goto end;
-            }
-
-            cJSON *frame_id = cJSON_GetObjectItem(frame, "id");
-            if (frame_id == NULL || !cJSON_IsNumber(frame_id))
-            {
-                ESP_LOGE(TAG, "Missing or invalid 'id' value in JSON");
-                goto end;
-            }
-
-            cJSON *frame_dlc = cJSON_GetObjectItem(frame, "dlc");
-            if (frame_dlc == NULL || !cJSON_IsNumber(frame_dlc))
-            {
-                ESP_LOGE(TAG, "Missing or invalid 'dlc' value in JSON");
-                goto end;
-            }
+static void mqtt_send_frame(const twai_message_t *frame, void *arg)
+{
+    twai_message_t *can_frame = &mqtt_tx_batch[mqtt_tx_batch_count++];
 
-            cJSON *frame_extd = cJSON_GetObjectItem(frame, "extd");
-            if (frame_extd == NULL || !cJSON_IsBool(frame_extd))
-            {
-                ESP_LOGE(TAG, "Missing or invalid 'extd' value in JSON");
-                goto end;
-            }
+    *can_frame = *frame;
+    can_frame->self = 0;
+    if(mqtt_tx_batch_count == MQTT_TX_BATCH_SIZE)
+    {
+        mqtt_tx_flush();
+    }
+}
 
-            cJSON *frame_rtr = cJSON_GetObjectItem(frame, "rtr");
-            if (frame_rtr == NULL || !cJSON_IsBool(frame_rtr))
-            {
-                ESP_LOGE(TAG, "Missing or invalid 'rtr' value in JSON");
-                goto end;
-            }
+static void mqtt_tx_decode(const uint8_t *data, size_t len)
+{
+    mqtt_payload_format_t format = can_payload_detect(data, len);
+    int64_t start = esp_timer_get_time();
+    uint32_t parse_us;
+    int count;
+
+    mqtt_tx_send_us = 0;
+    count = can_payload_decode(format, data, len, mqtt_send_frame, NULL);
+    // Parse time excludes the time spent handing full batches to the driver
+    parse_us = esp_timer_get_time() - start - mqtt_tx_send_us;
+    mqtt_tx_flush();
+
+    mqtt_tx_msgs++;
+    mqtt_tx_parse_us = parse_us;
+    if(parse_us > mqtt_tx_parse_max_us)
+    {
+        mqtt_tx_parse_max_us = parse_us;
+    }
 
-            can_frame.identifier = cJSON_IsTrue(frame_extd) ? (frame_id->valueint & TWAI_EXTD_ID_MASK) : (frame_id->valueint & TWAI_STD_ID_MASK);
-            can_frame.data_length_code = (frame_dlc->valueint > 8) ? 8 : frame_dlc->valueint;
-            can_frame.extd = cJSON_IsTrue(frame_extd) ? 1 : 0;
-            can_frame.rtr = cJSON_IsTrue(frame_rtr) ? 1 : 0;
+    if(count < 0)
+    {
+        mqtt_tx_rejects++;
+        ESP_LOGE(TAG, "Failed to parse %d payload", format);
+    }
+}
 
-            // ESP_LOGI(TAG, "frame_id: %d, frame_dlc: %d", can_frame.identifier, can_frame.data_length_code);
+// Handles a complete message on the tx or cmd topic, from the client or the local broker
+static void mqtt_handle_message(const char *topic, const char *data, int len)
+{
+    cJSON *root = NULL;
 
-            for (int j = 0; j < cJSON_GetArraySize(frame_data); j++)
-            {
-                can_frame.data[j] = cJSON_GetArrayItem(frame_data, j)->valueint;
-            }
-            can_frame.self = 0;
-            can_enable();
-            can_send(&can_frame, 1);
-        }
+    if ((mqtt_elm327_log == 0) && strncmp(topic, mqtt_sub_topic, strlen(mqtt_sub_topic)) == 0)
+    {
+        mqtt_tx_decode((const uint8_t *)data, len);
     }
-    else if (strncmp(event->topic, mqtt_cmd_topic, strlen(mqtt_cmd_topic)) == 0)
+    else if (strncmp(topic, mqtt_cmd_topic, strlen(mqtt_cmd_topic)) == 0)
     {
         static char cmd_response[32] = {0};
 
-        root = cJSON_Parse(event->data);
+        root = cJSON_ParseWithLength(data, len);
 
         if (root == NULL)
         {
@@ -298,6 +440,57 @@ static void mqtt_parse_data(void *handler_args, esp_event_base_t base, int32_t e
         {
             autopid_request_data();
         }
+        else if(strcmp(cmd->valuestring, "get_mqtt_stats") == 0)
+        {
+            char stats[1024];
+            uint32_t backlog, dropped, sent;
+            mqtt_rawfwd_stats_t raw;
+            uint32_t dedup_fwd, dedup_sup;
+            mqtt_bridge_stats_t bridge;
+            uint32_t lvc_entries, lvc_retained;
+            int len;
+
+            mqtt_publisher_stats(&backlog, &dropped, &sent);
+            mqtt_rawfwd_get_stats(&raw);
+            can_dedup_stats(&dedup_fwd, &dedup_sup);
+            mqtt_bridge_get_stats(&bridge);
+            mqtt_lvc_get_stats(&lvc_entries, &lvc_retained);
+            len = snprintf(stats, sizeof(stats), "{\"backlog\": %lu, \"dropped\": %lu, \"sent\": %lu, "
+                            "\"tx_msgs\": %lu, \"tx_frames\": %lu, \"tx_rejects\": %lu, \"tx_dropped\": %lu, "
+                            "\"tx_parse_us\": %lu, \"tx_parse_max_us\": %lu, "
+                            "\"rx_batches\": %lu, \"rx_frames\": %lu, \"rx_batch_max\": %lu, \"rx_queue_dropped\": %lu, "
+                            "\"raw_passed\": %lu, \"raw_denied\": %lu, \"raw_rate_limited\": %lu, \"raw_unchanged\": %lu, "
+                            "\"dedup_forwarded\": %lu, \"dedup_suppressed\": %lu, \"rx_unsubscribed\": %lu, "
+                            "\"bridge_connected\": %s, \"bridge_batches\": %lu, \"bridge_sent\": %lu, "
+                            "\"bridge_dropped\": %lu, \"bridge_skipped\": %lu, \"bridge_queued\": %lu, "
+                            "\"lvc_entries\": %lu, \"lvc_retained\": %lu}",
+                            backlog, dropped, sent, mqtt_tx_msgs, mqtt_tx_frames, mqtt_tx_rejects, mqtt_tx_dropped,
+                            mqtt_tx_parse_us, mqtt_tx_parse_max_us,
+                            mqtt_rx_batches, mqtt_rx_batch_total, mqtt_rx_batch_max, mqtt_rx_queue_dropped,
+                            raw.passed, raw.denied, raw.rate_limited, raw.unchanged,
+                            dedup_fwd, dedup_sup, mqtt_rx_unsubscribed,
+                            bridge.connected ? "true" : "false", bridge.batches, bridge.sent,
+                            bridge.dropped, bridge.skipped, bridge.queued,
+                            lvc_entries, lvc_retained);
+            if(len < 0 || (size_t)len >= sizeof(stats))
+            {
+                ESP_LOGE(TAG, "get_mqtt_stats response does not fit %u bytes", (unsigned)sizeof(stats));
+            }
+            else
+            {
+                mqtt_publish(mqtt_rsp_topic, stats, len, 0, 0);
+            }
+        }
+        else if(strcmp(cmd->valuestring, "get_autopid_stats") == 0)
+        {
+            char *stats = autopid_get_sched_stats();
+
+            if(stats != NULL)
+            {
+                mqtt_publish(mqtt_rsp_topic, stats, strlen(stats), 0, 0);
+                free(stats);
+            }
+        }
         else
         {
             ESP_LOGW(TAG, "Unknown command received: %s", cmd->valuestring);
@@ -311,6 +504,76 @@ end:
     }
 }
 
+static void mqtt_parse_data(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+    esp_mqtt_event_handle_t event = event_data;
+
+    // Payloads larger than the client buffer arrive in pieces
+    if(event->current_data_offset != 0 || event->data_len != event->total_data_len)
+    {
+        if(event->current_data_offset == 0 && (mqtt_elm327_log == 0) &&
+            strncmp(event->topic, mqtt_sub_topic, strlen(mqtt_sub_topic)) == 0)
+        {
+            mqtt_tx_msgs++;
+            mqtt_tx_rejects++;
+            ESP_LOGE(TAG, "TX payload too large: %d", event->total_data_len);
+        }
+        return;
+    }
+    mqtt_handle_message(event->topic, event->data, event->data_len);
+}
+
+// Runs in the broker task for every message a local client publishes
+static void mqtt_local_message(const char *topic, const char *data, int len)
+{
+    if(strncmp(topic, mqtt_sub_topic, strlen(mqtt_sub_topic)) == 0 && !mqtt_local_tx_en)
+    {
+        return;
+    }
+    mqtt_handle_message(topic, data, len);
+}
+
+// Runs when the local broker starts or stops, it is restarted without a
+// reboot to change its port. Retained messages don't survive a restart.
+static void mqtt_local_broker_state(bool running)
+{
+    if(running)
+    {
+        gpio_set_level(mqtt_led, 0);
+        xEventGroupSetBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
+        mqtt_publish(mqtt_status_topic, "{\"status\": \"online\"}", 0, 0, 1);
+        mqtt_lvc_mark_all();
+    }
+    else
+    {
+        xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
+        gpio_set_level(mqtt_led, 1);
+    }
+}
+
+// Runs in the broker task when a local client subscribes. Every topic the
+// filter covers sends its cached values to that client at once, instead of
+// it waiting for the next decode or polling cycle. Other subscribers don't
+// see them again.
+static void mqtt_local_subscribed(const char *client_id, const char *filter)
+{
+    static char snapshot[1024];
+    uint16_t count = mqtt_topic_count;
+
+    for(uint16_t i = 0; i < count; i++)
+    {
+        if(mqtt_broker_topic_matches(filter, mqtt_topics[i]))
+        {
+            int len = mqtt_lvc_snapshot(i, snapshot, sizeof(snapshot));
+
+            if(len > 0)
+            {
+                mqtt_broker_publish_to(client_id, mqtt_topics[i], snapshot, len);
+            }
+        }
+    }
+}
+
 int mqtt_connected(void)
 {
 	EventBits_t uxBits;
@@ -323,51 +586,515 @@ int mqtt_connected(void)
 	else return 0;
 }
 
-static int8_t mqtt_canflt_find_id(uint32_t id, uint8_t start_index)
+// Hands a received frame to mqtt_task, never blocks the caller
+bool mqtt_forward_can_frame(const twai_message_t *frame, uint8_t type, uint16_t suppressed)
 {
-	if(mqtt_canflt_size == 0)
+    mqtt_can_message_t msg;
+
+    if(xmqtt_tx_queue == NULL || *xmqtt_tx_queue == NULL)
+    {
+        return false;
+    }
+
+    msg.type = type;
+    msg.timestamp = (uint32_t)(esp_timer_get_time() / 1000);
+    msg.suppressed = suppressed;
+
+    // Nobody listens on the raw or elm327 topic, skip queueing and encoding
+    if(mqtt_stream_gated && ((type == MQTT_CAN && mqtt_canflt_size == 0 && !mqtt_topic_wanted(mqtt_rx_topic_id)) ||
+        (type != MQTT_CAN && !mqtt_topic_wanted(mqtt_elm327_topic_id))))
+    {
+        mqtt_rx_unsubscribed++;
+        return false;
+    }
+
+    // Raw forwarding policy, decoded signals need every frame of their IDs
+    if(type == MQTT_CAN && mqtt_canflt_size == 0 && !mqtt_rawfwd_check(frame, msg.timestamp))
+    {
+        return false;
+    }
+    msg.frame = *frame;
+
+    if(xQueueSend(*xmqtt_tx_queue, ( void * ) &msg, 0) != pdTRUE)
+    {
+        mqtt_rx_queue_dropped++;
+        return false;
+    }
+    return true;
+}
+
+// Queues a frame the raw forwarding policy held back until the end of its
+// rate interval
+static void mqtt_rawfwd_release(const twai_message_t *frame, uint32_t timestamp, void *arg)
+{
+    mqtt_can_message_t msg = {.type = MQTT_CAN, .timestamp = timestamp, .suppressed = 0};
+
+    msg.frame = *frame;
+    if(xQueueSend(*xmqtt_tx_queue, ( void * ) &msg, 0) != pdTRUE)
+    {
+        mqtt_rx_queue_dropped++;
+    }
+}
+
+static inline uint32_t mqtt_canflt_hash(uint32_t id)
+{
+    id ^= id >> 16;
+    id *= 0x45d9f3bU;
+    id ^= id >> 16;
+    return id;
+}
+
+static const canflt_group_t *mqtt_canflt_find_id(uint32_t id)
+{
+	if(mqtt_canflt_index == NULL)
 	{
-		return -1;
+		return NULL;
 	}
-	for(uint32_t i = start_index; i < mqtt_canflt_size; i++)
+
+	uint32_t slot = mqtt_canflt_hash(id) & mqtt_canflt_index_mask;
+
+	while(mqtt_canflt_index[slot].count != 0)
 	{
-		if(mqtt_canflt_values[i].can_id == id)
+		if(mqtt_canflt_index[slot].can_id == id)
 		{
-			return i;
+			return &mqtt_canflt_index[slot];
 		}
+		slot = (slot + 1) & mqtt_canflt_index_mask;
 	}
 
-	return -1;
+	return NULL;
+}
+
+static int mqtt_canflt_compare(const void *a, const void *b)
+{
+    const CANFilter *fa = (const CANFilter *)a;
+    const CANFilter *fb = (const CANFilter *)b;
+
+    if(fa->can_id != fb->can_id)
+    {
+        return (fa->can_id < fb->can_id) ? -1 : 1;
+    }
+    // Keep the order of the filter file for signals on the same ID
+    return (fa->order < fb->order) ? -1 : (fa->order > fb->order);
 }
 
-#define JSON_BUF_SIZE		2048
+static void mqtt_canflt_build_index(void)
+{
+    uint32_t groups = 0;
+    uint32_t slots = 4;
+
+    if(mqtt_canflt_size == 0)
+    {
+        return;
+    }
+
+    qsort(mqtt_canflt_values, mqtt_canflt_size, sizeof(CANFilter), mqtt_canflt_compare);
+
+    for(uint32_t i = 0; i < mqtt_canflt_size; i++)
+    {
+        if(i == 0 || mqtt_canflt_values[i].can_id != mqtt_canflt_values[i - 1].can_id)
+        {
+            groups++;
+        }
+    }
+
+    // Keep the load factor at or below 50%
+    while(slots < groups * 2)
+    {
+        slots <<= 1;
+    }
+
+    mqtt_canflt_index = (canflt_group_t *)calloc(slots, sizeof(canflt_group_t));
+    if(mqtt_canflt_index == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate filter index (%lu slots)", slots);
+        free(mqtt_canflt_values);
+        mqtt_canflt_values = NULL;
+        mqtt_canflt_size = 0;
+        return;
+    }
+    mqtt_canflt_index_mask = slots - 1;
+
+    for(uint32_t i = 0; i < mqtt_canflt_size; )
+    {
+        uint32_t start = i;
+        uint32_t id = mqtt_canflt_values[i].can_id;
+
+        while(i < mqtt_canflt_size && mqtt_canflt_values[i].can_id == id)
+        {
+            i++;
+        }
+
+        uint32_t slot = mqtt_canflt_hash(id) & mqtt_canflt_index_mask;
+        while(mqtt_canflt_index[slot].count != 0)
+        {
+            slot = (slot + 1) & mqtt_canflt_index_mask;
+        }
+        mqtt_canflt_index[slot].can_id = id;
+        mqtt_canflt_index[slot].start = start;
+        mqtt_canflt_index[slot].count = i - start;
+    }
+
+    ESP_LOGI(TAG, "CAN filter index: %lu signals, %lu IDs, %lu slots", mqtt_canflt_size, groups, slots);
+}
+
+static uint8_t mqtt_canflt_topic_id(const char *topic)
+{
+    for(uint8_t i = 0; i < mqtt_canflt_topic_count; i++)
+    {
+        if(strcmp(mqtt_canflt_topics[i], topic) == 0)
+        {
+            return i;
+        }
+    }
+
+    if(mqtt_canflt_topic_count >= MQTT_CANFLT_MAX_TOPICS || strlen(topic) >= sizeof(mqtt_canflt_topics[0]))
+    {
+        ESP_LOGW(TAG, "Can't add topic %s, using %s", topic, mqtt_canflt_topics[0]);
+        return 0;
+    }
+
+    strcpy(mqtt_canflt_topics[mqtt_canflt_topic_count], topic);
+    return mqtt_canflt_topic_count++;
+}
+
+// Commits the publish policy of the signals in the object just handed to
+// mqtt_publish_id, or keeps them for the next window when it was refused
+static void mqtt_canflt_batch_done(uint8_t topic, bool queued)
+{
+    for(uint32_t n = 0; n < mqtt_canflt_size; n++)
+    {
+        CANFilter *flt = &mqtt_canflt_values[n];
+
+        if(flt->dirty != 2 || flt->topic != topic)
+        {
+            continue;
+        }
+
+        if(queued)
+        {
+            publish_policy_commit(&flt->pub_state, flt->last_value, flt->dirty_time);
+            flt->dirty = 0;
+        }
+        else
+        {
+            flt->dirty = 1;
+            mqtt_canflt_dirty++;
+        }
+    }
+}
+
+// Publish the latest value of every signal decoded since the last window,
+// one JSON object per topic. Objects that don't fit the MQTT buffer are split.
+static void mqtt_canflt_batch_flush(void)
+{
+    const size_t buf_size = MQTT_TX_RX_BUF_SIZE - 1;
+    int64_t now = esp_timer_get_time();
+
+    if(mqtt_canflt_batch_buf == NULL || now < mqtt_canflt_next_flush)
+    {
+        return;
+    }
+    mqtt_canflt_next_flush = now + mqtt_canflt_batch_us;
+
+    // Values are kept while offline, last value wins
+    if(mqtt_canflt_dirty == 0 || !mqtt_connected())
+    {
+        return;
+    }
+    mqtt_canflt_dirty = 0;
+
+    for(uint8_t t = 0; t < mqtt_canflt_topic_count; t++)
+    {
+        size_t len = 0;
+
+        for(uint32_t n = 0; n < mqtt_canflt_size; n++)
+        {
+            CANFilter *flt = &mqtt_canflt_values[n];
+
+            if(!flt->dirty || flt->topic != t)
+            {
+                continue;
+            }
+
+            int w = snprintf(mqtt_canflt_batch_buf + len, buf_size - len, "%c\"%s\": %lf", (len == 0) ? '{' : ',', flt->name, flt->last_value);
+            if(w > 0 && len != 0 && (len + w + 2) > buf_size)
+            {
+                strcpy(mqtt_canflt_batch_buf + len, "}");
+                mqtt_canflt_batch_done(t, mqtt_publish_id(mqtt_canflt_topic_ids[t], mqtt_canflt_batch_buf, 0, 0, 0) == 0);
+                len = 0;
+                w = snprintf(mqtt_canflt_batch_buf, buf_size, "{\"%s\": %lf", flt->name, flt->last_value);
+            }
+            if(w > 0 && (len + w + 2) <= buf_size)
+            {
+                len += w;
+                flt->dirty = 2;
+            }
+            else
+            {
+                // Doesn't fit the buffer on its own
+                flt->dirty = 0;
+            }
+        }
+
+        if(len != 0)
+        {
+            strcpy(mqtt_canflt_batch_buf + len, "}");
+            mqtt_canflt_batch_done(t, mqtt_publish_id(mqtt_canflt_topic_ids[t], mqtt_canflt_batch_buf, 0, 0, 0) == 0);
+        }
+    }
+}
+
+// Queues, buffers or batches a value. The publish policy state is committed
+// once the value was queued for the broker or the outbox, for batched values
+// when the batch is.
+static void mqtt_canflt_output(CANFilter *flt, double value, uint32_t timestamp, int64_t now, char *buf)
+{
+    if(!mqtt_connected())
+    {
+        mqtt_outbox_rec_t rec = {.type = MQTT_OUTBOX_SIGNAL, .boot = mqtt_outbox_boot(),
+                                    .topic = mqtt_canflt_topic_hash[flt->topic], .timestamp = timestamp};
+
+        memcpy(rec.signal.name, flt->name, sizeof(rec.signal.name));
+        rec.signal.value = value;
+        mqtt_outbox_push(&rec);
+        if(mqtt_outbox_enabled())
+        {
+            publish_policy_commit(&flt->pub_state, value, now);
+        }
+    }
+    else if(mqtt_canflt_batch_buf != NULL)
+    {
+        if(flt->dirty == 0)
+        {
+            mqtt_canflt_dirty++;
+        }
+        flt->last_value = value;
+        flt->dirty_time = now;
+        flt->dirty = 1;
+    }
+    else
+    {
+        sprintf(buf, "{\"%s\": %lf}", flt->name, value);
+
+        if(mqtt_publish_id(mqtt_canflt_topic_ids[flt->topic], buf, 0, 0, 0) == 0)
+        {
+            publish_policy_commit(&flt->pub_state, value, now);
+        }
+    }
+}
+
+#define MQTT_OUTBOX_BATCH       32
+// Publishes the oldest buffered records, limited to mqtt_outbox_rate records
+// per second. Signals go out as a JSON array on their topic, tagged with the
+// boot their timestamps are relative to. Frames go out in the configured
+// payload format with per frame timestamps, frames from a previous boot
+// without them. Records whose topic is no longer configured are dropped.
+// One batch is in flight at a time, its records are consumed once
+// mqtt_pub_task reports it was handed to the client.
+static void mqtt_outbox_replay(char *buf, size_t buf_size)
+{
+    static mqtt_outbox_rec_t recs[MQTT_OUTBOX_BATCH];
+    static int64_t last_refill = 0;
+    static uint32_t tokens = 0;
+    static int inflight = 0;
+    int64_t now = esp_timer_get_time();
+    int n, used = 0;
+    int topic = -1;
+
+    if(inflight != 0)
+    {
+        if(xSemaphoreTake(mqtt_outbox_ack, 0) != pdTRUE || mqtt_outbox_acked_seq != mqtt_outbox_sent_seq)
+        {
+            return;
+        }
+        // A batch the client refused stays in the outbox and is replayed again
+        if(mqtt_outbox_ack_ok)
+        {
+            mqtt_outbox_consume(inflight);
+            tokens -= inflight;
+        }
+        inflight = 0;
+    }
+
+    if(mqtt_outbox_pending() == 0)
+    {
+        last_refill = now;
+        tokens = 0;
+        return;
+    }
+
+    uint64_t refill = ((uint64_t)(now - last_refill) * mqtt_outbox_rate) / 1000000;
+    if(refill != 0)
+    {
+        tokens = ((tokens + refill) > mqtt_outbox_rate) ? mqtt_outbox_rate : (tokens + refill);
+        last_refill = now;
+    }
+
+    n = mqtt_outbox_peek(recs, (tokens < MQTT_OUTBOX_BATCH) ? tokens : MQTT_OUTBOX_BATCH);
+    if(n <= 0)
+    {
+        return;
+    }
+
+    for(uint8_t i = 0; i < mqtt_canflt_topic_count; i++)
+    {
+        if(mqtt_canflt_topic_hash[i] == recs[0].topic)
+        {
+            topic = i;
+            break;
+        }
+    }
+
+    // One publish covers records of the same kind, topic and boot
+    for(used = 1; used < n && recs[used].type == recs[0].type && recs[used].topic == recs[0].topic &&
+                    recs[used].boot == recs[0].boot; used++);
+    n = used;
+
+    if(topic < 0)
+    {
+        ESP_LOGW(TAG, "Dropping %d outbox records, topic no longer configured", n);
+        mqtt_outbox_consume(n);
+        tokens -= n;
+        return;
+    }
+
+    if(recs[0].type == MQTT_OUTBOX_SIGNAL)
+    {
+        size_t len = 0;
+
+        for(used = 0; used < n; used++)
+        {
+            int w = snprintf(buf + len, buf_size - len, "%c{\"boot\":%u,\"ts\":%lu,\"%.*s\":%lf}", (used == 0) ? '[' : ',',
+                                recs[used].boot, recs[used].timestamp, (int)sizeof(recs[used].signal.name),
+                                recs[used].signal.name, recs[used].signal.value);
+            if(w <= 0 || (len + w + 2) > buf_size)
+            {
+                break;
+            }
+            len += w;
+        }
+
+        if(used == 0)
+        {
+            // Can't happen with the MQTT buffer size, drop the record
+            mqtt_outbox_consume(1);
+            return;
+        }
+        strcpy(buf + len, "]");
+        if(mqtt_outbox_publish(mqtt_canflt_topic_ids[topic], buf, len + 1) < 0)
+        {
+            return;
+        }
+    }
+    else
+    {
+        can_payload_t payload;
+        size_t len;
+        bool this_boot = (recs[0].boot == mqtt_outbox_boot());
+
+        // Timestamps from a previous boot can't be placed on this boot's clock
+        can_payload_begin(&payload, mqtt_payload_format, (uint8_t *)buf, buf_size, false,
+                            this_boot ? (recs[0].timestamp % 60000) : ((now / 1000) % 60000));
+        can_payload_record_ts(&payload, this_boot);
+
+        for(used = 0; used < n && can_payload_has_room(&payload); used++)
+        {
+            twai_message_t frame = {0};
+
+            frame.identifier = recs[used].frame.id;
+            frame.extd = (recs[used].frame.flags & MQTT_OUTBOX_FLAG_EXTD) ? 1 : 0;
+            frame.rtr = (recs[used].frame.flags & MQTT_OUTBOX_FLAG_RTR) ? 1 : 0;
+            frame.data_length_code = recs[used].frame.dlc;
+            memcpy(frame.data, recs[used].frame.data, sizeof(frame.data));
+            can_payload_add(&payload, &frame, recs[used].timestamp);
+        }
+        len = can_payload_end(&payload);
+
+        if(len == 0)
+        {
+            mqtt_outbox_consume(used);
+            tokens -= used;
+            return;
+        }
+        if(mqtt_outbox_publish(mqtt_canflt_topic_ids[topic], buf, len) < 0)
+        {
+            return;
+        }
+    }
+
+    inflight = used;
+}
+
+// Raw frame batches may fill the whole MQTT buffer
+#define JSON_BUF_SIZE		(MQTT_TX_RX_BUF_SIZE - 1)
 static void mqtt_task(void *pvParameters)
 {
 	static char json_buffer[JSON_BUF_SIZE] = {0};
-	static char tmp[150];
+	can_payload_t payload;
+	size_t payload_len;
 	mqtt_can_message_t tx_frame;
 	static char mqtt_topic[64];
     static char mqtt_elm327_topic[64];
 	static uint64_t can_data = 0;
+    bool online;
+    int16_t mqtt_topic_id;
 
 	// sprintf(mqtt_topic, "wican/%s/can/rx", device_id);
     strcpy(mqtt_topic, config_server_get_mqtt_rx_topic());
     sprintf(mqtt_elm327_topic, "wican/%s/elm327", device_id);
+    mqtt_topic_id = mqtt_topic_intern(mqtt_topic);
+    mqtt_elm327_topic_id = mqtt_topic_intern(mqtt_elm327_topic);
 
 	while(!wifi_network_is_connected())
 	{
 		vTaskDelay(pdMS_TO_TICKS(1000));
 	}
 
-	esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
-	esp_mqtt_client_register_event(client, MQTT_EVENT_DATA, mqtt_parse_data, NULL);
-	esp_mqtt_client_start(client);
+    // The local broker reports itself through mqtt_local_broker_state()
+    if(!mqtt_local)
+    {
+        esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+        esp_mqtt_client_register_event(client, MQTT_EVENT_DATA, mqtt_parse_data, NULL);
+        esp_mqtt_client_start(client);
+    }
 
 	while(1)
 	{
-		xQueuePeek(*xmqtt_tx_queue, ( void * ) &tx_frame, portMAX_DELAY);
+        TickType_t wait = portMAX_DELAY;
+        uint32_t held_ms;
+
+        if(mqtt_canflt_batch_buf != NULL)
+        {
+            int64_t remain = mqtt_canflt_next_flush - esp_timer_get_time();
+            wait = (remain > 0) ? (pdMS_TO_TICKS(remain / 1000) + 1) : 0;
+        }
+
+        // Rate capped raw IDs, their latest frame goes out at the end of the interval
+        held_ms = mqtt_rawfwd_flush((uint32_t)(esp_timer_get_time() / 1000), mqtt_rawfwd_release, NULL);
+        if(held_ms != UINT32_MAX && wait > pdMS_TO_TICKS(held_ms) + 1)
+        {
+            wait = pdMS_TO_TICKS(held_ms) + 1;
+        }
+
+        // Keep replaying the outbox while the bus is quiet
+        if(mqtt_outbox_pending() != 0 && mqtt_connected() && wait > pdMS_TO_TICKS(20))
+        {
+            wait = pdMS_TO_TICKS(20);
+        }
+
+		if(xQueuePeek(*xmqtt_tx_queue, ( void * ) &tx_frame, wait) != pdTRUE)
+        {
+            mqtt_canflt_batch_flush();
+            if(mqtt_connected())
+            {
+                mqtt_outbox_replay(json_buffer, sizeof(json_buffer));
+            }
+            continue;
+        }
         dev_status_wait_for_bits(DEV_AWAKE_BIT, portMAX_DELAY);
-		if(mqtt_connected())
+        online = mqtt_connected();
+		if(online || mqtt_outbox_enabled())
 		{
 			json_buffer[0] = 0;
             
@@ -375,115 +1102,150 @@ static void mqtt_task(void *pvParameters)
             {
                 if(mqtt_canflt_size != 0)
                 {
-                    uint8_t start_index = 0;
-                    int8_t found_index = -1;
+                    const canflt_group_t *group;
                     static uint64_t value = 0;
                     static double expression_result = 0;
                     
                     xQueueReceive(*xmqtt_tx_queue, ( void * ) &tx_frame, 0);
 
-                    while ((found_index = mqtt_canflt_find_id(tx_frame.frame.identifier, start_index)) != -1)
+                    group = mqtt_canflt_find_id(tx_frame.frame.identifier);
+                    if(group != NULL)
                     {
-                        
-
-                        // Check if expecting PID
-                        if(mqtt_canflt_values[found_index].pid != -1)
-                        {
-                            if(mqtt_canflt_values[found_index].pid != tx_frame.frame.data[mqtt_canflt_values[found_index].pidi])
-                            {
-                                start_index = found_index + 1;
-                                continue;
-                            }
-                        }
+                        int64_t now = esp_timer_get_time();
 
-                        if(esp_timer_get_time() - mqtt_canflt_values[found_index].logtime < (mqtt_canflt_values[found_index].cycle*1000))
-                        {
-                            break;
-                        }
-                        mqtt_canflt_values[found_index].logtime = esp_timer_get_time();
+                        can_data = 0;
                         for (uint8_t i = 0; i < 8; i++) 
                         {
                             can_data = (can_data << 8) | tx_frame.frame.data[i];
                         }
 
-                        uint64_t start_bit = 64 - mqtt_canflt_values[found_index].start_bit - mqtt_canflt_values[found_index].bit_length;
-                        uint64_t bit_length = mqtt_canflt_values[found_index].bit_length;
+                        for(uint32_t n = group->start; n < group->start + group->count; n++)
+                        {
+                            CANFilter *flt = &mqtt_canflt_values[n];
+
+                            // Check if expecting PID
+                            if(flt->pid_check && (flt->pid_index > 7 || flt->pid_value != tx_frame.frame.data[flt->pid_index]))
+                            {
+                                continue;
+                            }
+
+                            if(now - flt->logtime < ((int64_t)flt->cycle*1000))
+                            {
+                                continue;
+                            }
+                            flt->logtime = now;
 
-                        uint64_t mask = ((1ULL << bit_length) - 1ULL) << start_bit;
+                            uint64_t start_bit = 64 - flt->start_bit - flt->bit_length;
+                            uint64_t bit_length = flt->bit_length;
 
-                        value = (can_data & mask) >> start_bit;
+                            uint64_t mask = ((bit_length >= 64) ? ~0ULL : ((1ULL << bit_length) - 1ULL)) << start_bit;
 
+                            value = (can_data & mask) >> start_bit;
 
+                            ESP_LOGD(TAG, "can_data: %llx, mask: %llx, value: %llx", can_data, mask, value);
 
-                        ESP_LOGI(TAG, "-----------");
-                        ESP_LOGI(TAG, "can_data: %llx, mask: %llx, value: %llx\r\n", can_data, mask, value);
+                            if(evaluate_expression((uint8_t *)flt->expression, (uint8_t *)tx_frame.frame.data, (double)value, &expression_result) )
+                            {
+                                ESP_LOGD(TAG, "Expression result: %lf", expression_result);
 
-                        if(evaluate_expression((uint8_t *)mqtt_canflt_values[found_index].expression, (uint8_t *)tx_frame.frame.data, (double)value, &expression_result) )
-                        {
-                            ESP_LOGI(TAG, "Expression result: %lf", expression_result);
+                                // Cached even when not published, for new subscribers and the retained snapshot
+                                mqtt_lvc_update(mqtt_canflt_topic_ids[flt->topic], flt->name, expression_result, MQTT_LVC_NUMBER);
 
-                            sprintf(json_buffer, "{\"%s\": %lf}", mqtt_canflt_values[found_index].name, expression_result);
+                                if(mqtt_stream_gated && !mqtt_topic_wanted(mqtt_canflt_topic_ids[flt->topic]))
+                                {
+                                    continue;
+                                }
 
-                            mqtt_publish(mqtt_topic, json_buffer, 0, 0, 0);
-                        }
-                        else
-                        {
-                            ESP_LOGE(TAG, "evaluate_expression error");
+                                if(publish_policy_check(&flt->policy, &flt->pub_state, expression_result, now))
+                                {
+                                    mqtt_canflt_output(flt, expression_result, tx_frame.timestamp, now, json_buffer);
+                                }
+                            }
+                            else
+                            {
+                                ESP_LOGE(TAG, "evaluate_expression error");
+                            }
                         }
-
-                        start_index = found_index + 1;
                     }
+                    mqtt_canflt_batch_flush();
                 }
-                else if(config_server_mqtt_rx_en_config())
+                else if(config_server_mqtt_rx_en_config() && online)
                 {
-                    sprintf(json_buffer, "{\"bus\":\"0\",\"type\":\"rx\",\"ts\":%lu,\"frame\":[", (pdTICKS_TO_MS(xTaskGetTickCount())%60000));
+                    size_t batch_size = sizeof(json_buffer);
+                    int64_t deadline = esp_timer_get_time() + mqtt_rx_linger_us;
+
+                    if(mqtt_rx_batch_bytes != 0 && mqtt_rx_batch_bytes < batch_size)
+                    {
+                        batch_size = mqtt_rx_batch_bytes;
+                    }
+                    can_payload_begin(&payload, mqtt_payload_format, (uint8_t *)json_buffer, batch_size, false, pdTICKS_TO_MS(xTaskGetTickCount())%60000);
 
-                    if(strlen(json_buffer) < (sizeof(json_buffer) -128))
+                    // Only dequeue a frame once it is known to fit
+                    while(can_payload_has_room(&payload) &&
+                            (mqtt_rx_batch_frames == 0 || payload.count < mqtt_rx_batch_frames))
                     {
-                        while(xQueuePeek(*xmqtt_tx_queue, ( void * ) &tx_frame, 0) == pdTRUE)
+                        int64_t remain = deadline - esp_timer_get_time();
+                        TickType_t linger = (remain > 0) ? pdMS_TO_TICKS(remain / 1000) : 0;
+
+                        if(xQueuePeek(*xmqtt_tx_queue, ( void * ) &tx_frame, linger) != pdTRUE || tx_frame.type != MQTT_CAN)
                         {
-                            xQueueReceive(*xmqtt_tx_queue, ( void * ) &tx_frame, 0);
-                            sprintf(tmp, "{\"id\":%lu,\"dlc\":%u,\"rtr\":%s,\"extd\":%s,\"data\":[%u,%u,%u,%u,%u,%u,%u,%u]},",tx_frame.frame.identifier, tx_frame.frame.data_length_code, tx_frame.frame.rtr?"true":"false",
-                                                                                                                        tx_frame.frame.extd?"true":"false",tx_frame.frame.data[0], tx_frame.frame.data[1], tx_frame.frame.data[2], tx_frame.frame.data[3],
-                                                                                                                        tx_frame.frame.data[4], tx_frame.frame.data[5], tx_frame.frame.data[6], tx_frame.frame.data[7]);
-                            strcat((char*)json_buffer, (char*)tmp);
+                            break;
+                        }
+                        xQueueReceive(*xmqtt_tx_queue, ( void * ) &tx_frame, 0);
+                        can_payload_add_suppressed(&payload, &tx_frame.frame, tx_frame.timestamp, mqtt_dedup_count ? tx_frame.suppressed : 0);
+                    }
+                    payload_len = can_payload_end(&payload);
 
-                            if(strlen(json_buffer) > (JSON_BUF_SIZE - 100))
-                            {
-                                break;
-                            }
+                    if(payload_len != 0)
+                    {
+                        mqtt_rx_batches++;
+                        mqtt_rx_batch_total += payload.count;
+                        if(payload.count > mqtt_rx_batch_max)
+                        {
+                            mqtt_rx_batch_max = payload.count;
                         }
-                        json_buffer[strlen(json_buffer)-1] = 0;
+                        mqtt_publish_id(mqtt_topic_id, json_buffer, payload_len, 0, 0);
                     }
-                    strcat((char*)json_buffer, "]}");
-                    
-                    mqtt_publish(mqtt_topic, json_buffer, 0, 0, 0);
+                }
+                else if(config_server_mqtt_rx_en_config() && mqtt_outbox_frames)
+                {
+                    while(xQueueReceive(*xmqtt_tx_queue, ( void * ) &tx_frame, 0) == pdTRUE)
+                    {
+                        mqtt_outbox_rec_t rec = {.type = MQTT_OUTBOX_FRAME, .boot = mqtt_outbox_boot(),
+                                                    .topic = mqtt_canflt_topic_hash[0], .timestamp = tx_frame.timestamp};
+
+                        rec.frame.id = tx_frame.frame.identifier;
+                        rec.frame.flags = (tx_frame.frame.extd ? MQTT_OUTBOX_FLAG_EXTD : 0) | (tx_frame.frame.rtr ? MQTT_OUTBOX_FLAG_RTR : 0);
+                        rec.frame.dlc = tx_frame.frame.data_length_code;
+                        memcpy(rec.frame.data, tx_frame.frame.data, sizeof(rec.frame.data));
+                        mqtt_outbox_push(&rec);
+                    }
+                }
+                else
+                {
+                    xQueueReceive(*xmqtt_tx_queue, ( void * ) &tx_frame, 0);
                 }
             }
             else
             {
                 xQueueReceive(*xmqtt_tx_queue, ( void * ) &tx_frame, 0);
-                if(tx_frame.type == MQTT_RX)
-                {
-                    sprintf(json_buffer, "{\"bus\":\"0\",\"type\":\"rx\",\"ts\":%lu,\"frame\":[", (pdTICKS_TO_MS(xTaskGetTickCount())%60000));
-                    ESP_LOGI(TAG, "tx_frame.type: MQTT_RX");
-                }
-                else if(tx_frame.type == MQTT_TX)
+                if(online)
                 {
-                    sprintf(json_buffer, "{\"bus\":\"0\",\"type\":\"tx\",\"ts\":%lu,\"frame\":[", (pdTICKS_TO_MS(xTaskGetTickCount())%60000));
-                    ESP_LOGI(TAG, "tx_frame.type: MQTT_TX");
+                    can_payload_begin(&payload, mqtt_payload_format, (uint8_t *)json_buffer, sizeof(json_buffer), (tx_frame.type == MQTT_TX), pdTICKS_TO_MS(xTaskGetTickCount())%60000);
+                    can_payload_add(&payload, &tx_frame.frame, tx_frame.timestamp);
+                    payload_len = can_payload_end(&payload);
+
+                    if(payload_len != 0)
+                    {
+                        mqtt_publish_id(mqtt_elm327_topic_id, json_buffer, payload_len, 0, 0);
+                    }
                 }
-                
-                sprintf(tmp, "{\"id\":%lu,\"dlc\":%u,\"rtr\":%s,\"extd\":%s,\"data\":[%u,%u,%u,%u,%u,%u,%u,%u]},",tx_frame.frame.identifier, tx_frame.frame.data_length_code, tx_frame.frame.rtr?"true":"false",
-                                                                                                            tx_frame.frame.extd?"true":"false",tx_frame.frame.data[0], tx_frame.frame.data[1], tx_frame.frame.data[2], tx_frame.frame.data[3],
-                                                                                                            tx_frame.frame.data[4], tx_frame.frame.data[5], tx_frame.frame.data[6], tx_frame.frame.data[7]);
-                strcat((char*)json_buffer, (char*)tmp);
-                json_buffer[strlen(json_buffer)-1] = 0;
-                strcat((char*)json_buffer, "]}");
-
-                mqtt_publish(mqtt_elm327_topic, json_buffer, 0, 0, 0);
             }
 
+            if(online)
+            {
+                mqtt_outbox_replay(json_buffer, sizeof(json_buffer));
+            }
 		}
 		else
 		{
@@ -497,6 +1259,9 @@ static void mqtt_load_filter(void)
 {
     char *canflt_json = config_server_get_mqtt_canflt();
 
+    strncpy(mqtt_canflt_topics[0], config_server_get_mqtt_rx_topic(), sizeof(mqtt_canflt_topics[0]) - 1);
+    mqtt_canflt_topic_count = 1;
+
     cJSON *root = cJSON_Parse(canflt_json);
     ESP_LOGW(TAG, "mqtt_load_filter start");
 
@@ -506,6 +1271,14 @@ static void mqtt_load_filter(void)
         return;
     }
 
+    mqtt_rawfwd_load(cJSON_GetObjectItem(root, "raw_fwd"));
+
+    cJSON *batch_ms = cJSON_GetObjectItem(root, "batch_ms");
+    if(cJSON_IsNumber(batch_ms) && batch_ms->valuedouble > 0)
+    {
+        mqtt_canflt_batch_us = (int64_t)batch_ms->valuedouble * 1000;
+    }
+
     cJSON *can_flt = cJSON_GetObjectItem(root, "can_flt");
 
     if (can_flt == NULL || !cJSON_IsArray(can_flt)) 
@@ -547,6 +1320,7 @@ static void mqtt_load_filter(void)
         cJSON *bit_length = cJSON_GetObjectItem(item, "BitLength");
         cJSON *expression = cJSON_GetObjectItem(item, "Expression");
         cJSON *cycle = cJSON_GetObjectItem(item, "Cycle");
+        cJSON *topic = cJSON_GetObjectItem(item, "Topic");
 
         //if pidi is null set it to default 2
         if(pidi == NULL)
@@ -558,7 +1332,8 @@ static void mqtt_load_filter(void)
             cJSON_IsNumber(start_bit) && cJSON_IsNumber(bit_length) && cJSON_IsString(expression) && cJSON_IsNumber(cycle)) 
         {
             mqtt_canflt_values[i].can_id = (uint32_t)can_id->valuedouble;
-            strncpy(mqtt_canflt_values[i].name, name->valuestring, sizeof(mqtt_canflt_values[i].name));
+            strncpy(mqtt_canflt_values[i].name, name->valuestring, sizeof(mqtt_canflt_values[i].name) - 1);
+            mqtt_canflt_values[i].name[sizeof(mqtt_canflt_values[i].name) - 1] = 0;
             mqtt_canflt_values[i].pid = (int32_t)pid->valuedouble;  // Set 'pid' field
             mqtt_canflt_values[i].pidi = (int32_t)pidi->valuedouble;
             mqtt_canflt_values[i].start_bit = (uint32_t)start_bit->valuedouble;
@@ -566,6 +1341,22 @@ static void mqtt_load_filter(void)
             strncpy(mqtt_canflt_values[i].expression, expression->valuestring, sizeof(mqtt_canflt_values[i].expression));
             mqtt_canflt_values[i].cycle = (uint32_t)cycle->valuedouble;
             mqtt_canflt_values[i].logtime = 0;
+            mqtt_canflt_values[i].order = i;
+            // Resolve the PID match once, an out of range index never matches
+            mqtt_canflt_values[i].pid_check = (mqtt_canflt_values[i].pid != -1);
+            mqtt_canflt_values[i].pid_index = (mqtt_canflt_values[i].pidi >= 0 && mqtt_canflt_values[i].pidi < 8) ? (uint8_t)mqtt_canflt_values[i].pidi : 0xFF;
+            mqtt_canflt_values[i].pid_value = (uint8_t)mqtt_canflt_values[i].pid;
+            if(mqtt_canflt_values[i].pid_check && (mqtt_canflt_values[i].pid < 0 || mqtt_canflt_values[i].pid > 0xFF))
+            {
+                // A PID is one byte, the filter would match the low byte only
+                ESP_LOGE(TAG, "CAN Filter %lu: PID %ld out of range, filter disabled", i, mqtt_canflt_values[i].pid);
+                mqtt_canflt_values[i].pid_index = 0xFF;
+            }
+            mqtt_canflt_values[i].topic = (cJSON_IsString(topic) && strlen(topic->valuestring) > 0) ? mqtt_canflt_topic_id(topic->valuestring) : 0;
+            mqtt_canflt_values[i].dirty = 0;
+            mqtt_canflt_values[i].last_value = 0;
+            publish_policy_parse(&mqtt_canflt_values[i].policy, item);
+            memset(&mqtt_canflt_values[i].pub_state, 0, sizeof(publish_state_t));
 
             ESP_LOGI(TAG, "Loaded CAN Filter %lu: CAN ID=%lu, PID=%ld, PIDIndex=%ld, Name=%s, Start Bit=%lu, Bit Length=%lu, Expression=%s, Cycle=%lu",
                      i, mqtt_canflt_values[i].can_id, mqtt_canflt_values[i].pid, mqtt_canflt_values[i].pidi, mqtt_canflt_values[i].name,
@@ -583,30 +1374,414 @@ static void mqtt_load_filter(void)
     }
 
     cJSON_Delete(root);
+    mqtt_canflt_build_index();
+
+    if(mqtt_canflt_size != 0 && mqtt_canflt_batch_us != 0)
+    {
+        mqtt_canflt_batch_buf = (char *)malloc(MQTT_TX_RX_BUF_SIZE);
+        if(mqtt_canflt_batch_buf == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to allocate batch buffer, publishing per signal");
+        }
+        else
+        {
+            ESP_LOGI(TAG, "Batching signals every %lld ms", mqtt_canflt_batch_us / 1000);
+        }
+    }
 }
 
-void mqtt_publish(char *topic, char *data, int len, int qos, int retain)
+static uint32_t mqtt_topic_hash_str(const char *topic)
 {
-    int data_len = len;
+    // FNV-1a
+    uint32_t h = 2166136261U;
 
-    if( (config_server_mqtt_en_config() == 1) && mqtt_connected() && (xSemaphoreTake( xmqtt_semaphore, pdMS_TO_TICKS(2000) ) == pdTRUE) )
+    while(*topic)
     {
-        if(len == 0)
+        h = (h ^ (uint8_t)*topic++) * 16777619U;
+    }
+    return h;
+}
+
+// Returns a stable id for the topic string, -1 when the table is full.
+// Lookups are lock free, the table only ever grows.
+int16_t mqtt_topic_intern(const char *topic)
+{
+    uint32_t h = mqtt_topic_hash_str(topic);
+    int16_t id = -1;
+
+    for(uint16_t i = 0; i < mqtt_topic_count; i++)
+    {
+        if(mqtt_topic_hash[i] == h && strcmp(mqtt_topics[i], topic) == 0)
+        {
+            return i;
+        }
+    }
+
+    if(xmqtt_semaphore == NULL || xSemaphoreTake(xmqtt_semaphore, portMAX_DELAY) != pdTRUE)
+    {
+        return -1;
+    }
+
+    // Another task may have added it meanwhile
+    for(uint16_t i = 0; i < mqtt_topic_count; i++)
+    {
+        if(mqtt_topic_hash[i] == h && strcmp(mqtt_topics[i], topic) == 0)
         {
-            data_len = strlen(data);
+            id = i;
+            break;
         }
+    }
 
-        if(data_len < MQTT_TX_RX_BUF_SIZE)
+    if(id == -1 && mqtt_topic_count < MQTT_MAX_TOPICS)
+    {
+        char *copy = strdup(topic);
+
+        if(copy != NULL)
         {
-            esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+            id = mqtt_topic_count;
+            mqtt_topics[id] = copy;
+            mqtt_topic_hash[id] = h;
+            mqtt_topic_count = id + 1;
         }
-        else
+    }
+    xSemaphoreGive(xmqtt_semaphore);
+
+    if(id == -1)
+    {
+        ESP_LOGW(TAG, "Topic table full, %s is published without an id", topic);
+    }
+    return id;
+}
+
+// Broker task, on every loop pass. Matches the interned topics again when
+// the subscription set changed or topics were added, then publishes the
+// new bitmap in one short critical section.
+static void mqtt_wanted_rebuild(void)
+{
+    uint32_t bits[(MQTT_MAX_TOPICS + 31) / 32] = {0};
+    uint32_t gen = mqtt_broker_sub_generation();
+    uint16_t count = mqtt_topic_count;
+
+    if(gen == mqtt_wanted_gen && count == mqtt_wanted_count)
+    {
+        return;
+    }
+
+    for(uint16_t i = 0; i < count; i++)
+    {
+        if(mqtt_broker_has_subscribers(mqtt_topics[i]))
+        {
+            bits[i / 32] |= (1UL << (i % 32));
+        }
+    }
+
+    portENTER_CRITICAL(&mqtt_wanted_lock);
+    for(uint8_t w = 0; w < sizeof(bits) / sizeof(bits[0]); w++)
+    {
+        mqtt_wanted_bits[w] = bits[w];
+    }
+    mqtt_wanted_count = count;
+    portEXIT_CRITICAL(&mqtt_wanted_lock);
+    mqtt_wanted_gen = gen;
+}
+
+// True when the local broker has a subscriber for the topic or the topic is
+// bridged upstream, always true with an external broker. Lock free, topics
+// added since the last rebuild count as wanted until the broker's next pass.
+bool mqtt_topic_wanted(int16_t topic_id)
+{
+    if(!mqtt_local || topic_id < 0 || topic_id >= mqtt_wanted_count)
+    {
+        return true;
+    }
+
+    return ((mqtt_wanted_bits[topic_id / 32] >> (topic_id % 32)) & 1) ||
+            mqtt_bridge_wants(topic_id, mqtt_topics[topic_id]);
+}
+
+static void mqtt_pub_count(uint32_t *counter, int32_t delta)
+{
+    portENTER_CRITICAL(&mqtt_pub_stats_lock);
+    *counter += delta;
+    portEXIT_CRITICAL(&mqtt_pub_stats_lock);
+}
+
+// Copies the message into the ring buffer, topic is NULL for interned topics
+static int mqtt_pub_enqueue(mqtt_pub_hdr_t *hdr, const char *topic, const char *data, int len)
+{
+    static const char* error_msg = "{\"error\": \"Data length exceeds the data size\"}";
+    void *item = NULL;
+
+    if( (config_server_mqtt_en_config() != 1) || !mqtt_connected() || mqtt_pub_ringbuf == NULL)
+    {
+        return -1;
+    }
+
+    hdr->topic_len = (topic != NULL) ? (strlen(topic) + 1) : 0;
+    hdr->len = (len == 0) ? strlen(data) : len;
+    if(hdr->len >= MQTT_TX_RX_BUF_SIZE)
+    {
+        data = error_msg;
+        hdr->len = strlen(error_msg);
+        hdr->retain = 0;
+    }
+
+    if(xRingbufferSendAcquire(mqtt_pub_ringbuf, &item, sizeof(*hdr) + hdr->topic_len + hdr->len, 0) != pdTRUE)
+    {
+        mqtt_pub_count(&mqtt_pub_dropped, 1);
+        return -1;
+    }
+    memcpy(item, hdr, sizeof(*hdr));
+    if(topic != NULL)
+    {
+        memcpy((uint8_t *)item + sizeof(*hdr), topic, hdr->topic_len);
+    }
+    memcpy((uint8_t *)item + sizeof(*hdr) + hdr->topic_len, data, hdr->len);
+    mqtt_pub_count(&mqtt_pub_backlog, 1);
+    xRingbufferSendComplete(mqtt_pub_ringbuf, item);
+
+    return 0;
+}
+
+// Queues a message for the publisher task, returns 0 when queued and -1
+// when it was dropped (not connected, too big or backlog full)
+int mqtt_publish_id(int16_t topic_id, const char *data, int len, int qos, int retain)
+{
+    mqtt_pub_hdr_t hdr = {.topic_id = topic_id, .qos = qos, .retain = retain};
+
+    if(topic_id < 0 || topic_id >= mqtt_topic_count)
+    {
+        return -1;
+    }
+    return mqtt_pub_enqueue(&hdr, NULL, data, len);
+}
+
+int mqtt_publish(char *topic, char *data, int len, int qos, int retain)
+{
+    int16_t topic_id = mqtt_topic_intern(topic);
+    mqtt_pub_hdr_t hdr = {.topic_id = -1, .qos = qos, .retain = retain};
+
+    if(topic_id >= 0)
+    {
+        return mqtt_publish_id(topic_id, data, len, qos, retain);
+    }
+    // Topic table full, the topic travels with the message
+    return mqtt_pub_enqueue(&hdr, topic, data, len);
+}
+
+// Queues a batch of outbox records for mqtt_pub_task without waiting for it.
+// mqtt_pub_task acks the batch with mqtt_outbox_sent_seq once it was handed
+// to the client or refused.
+static int mqtt_outbox_publish(int16_t topic_id, const char *data, int len)
+{
+    mqtt_pub_hdr_t hdr = {.topic_id = topic_id, .qos = 1, .retain = 0};
+
+    if(topic_id < 0 || topic_id >= mqtt_topic_count)
+    {
+        return -1;
+    }
+
+    hdr.outbox_seq = (mqtt_outbox_sent_seq + 1 == 0) ? 1 : (mqtt_outbox_sent_seq + 1);
+    xSemaphoreTake(mqtt_outbox_ack, 0);
+    if(mqtt_pub_enqueue(&hdr, NULL, data, len) != 0)
+    {
+        return -1;
+    }
+    mqtt_outbox_sent_seq = hdr.outbox_seq;
+    return 0;
+}
+
+void mqtt_publisher_stats(uint32_t *backlog, uint32_t *dropped, uint32_t *sent)
+{
+    portENTER_CRITICAL(&mqtt_pub_stats_lock);
+    *backlog = mqtt_pub_backlog;
+    *dropped = mqtt_pub_dropped;
+    *sent = mqtt_pub_sent;
+    portEXIT_CRITICAL(&mqtt_pub_stats_lock);
+}
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+static void mqtt5_set_content_type(int16_t topic_id, const char *content_type)
+{
+    if(topic_id >= 0 && topic_id < MQTT_MAX_TOPICS)
+    {
+        mqtt5_content_type[topic_id] = content_type;
+    }
+}
+
+// Sets the publish properties for one message and publishes it. Only
+// mqtt_pub_task calls this, the client keeps a pointer to the properties.
+static int mqtt5_publish(const mqtt_pub_hdr_t *hdr, const char *name, const char *data)
+{
+    static uint32_t conn_gen = 0;
+    const char *topic = name;
+    const char *content_type = (hdr->topic_id >= 0) ? mqtt5_content_type[hdr->topic_id] : NULL;
+    uint16_t alias = 0;
+    bool use_alias = false;
+    int msg_id;
+
+    if(conn_gen != mqtt5_conn_gen)
+    {
+        conn_gen = mqtt5_conn_gen;
+        memset(mqtt5_alias_sent, 0, sizeof(mqtt5_alias_sent));
+    }
+
+    memset(&mqtt5_pub_property, 0, sizeof(mqtt5_pub_property));
+    mqtt5_pub_property.content_type = content_type;
+    mqtt5_pub_property.payload_format_indicator = (content_type != NULL && strcmp(content_type, "application/json") == 0);
+    mqtt5_pub_property.user_property = mqtt5_user_property;
+
+    // QoS 1/2 messages may be retransmitted on a later connection, they
+    // always carry the full topic and never expire
+    if(hdr->qos == 0 && !hdr->retain)
+    {
+        mqtt5_pub_property.message_expiry_interval = mqtt5_expiry;
+    }
+
+    // Only interned topics get an alias
+    if(hdr->qos == 0 && hdr->topic_id >= 0)
+    {
+        alias = mqtt5_topic_alias[hdr->topic_id];
+        if(alias == 0 && mqtt5_alias_count < mqtt5_alias_max &&
+            ++mqtt5_topic_publishes[hdr->topic_id] >= MQTT5_ALIAS_MIN_PUBLISHES)
+        {
+            alias = ++mqtt5_alias_count;
+            mqtt5_topic_alias[hdr->topic_id] = alias;
+        }
+
+        if(alias != 0 && alias <= mqtt5_alias_max)
+        {
+            use_alias = true;
+            mqtt5_pub_property.topic_alias = alias;
+            if(mqtt5_alias_sent[hdr->topic_id])
+            {
+                topic = "";
+            }
+        }
+    }
+
+    if(esp_mqtt5_client_set_publish_property(client, &mqtt5_pub_property) != ESP_OK)
+    {
+        if(!use_alias)
+        {
+            return -1;
+        }
+        // Alias above the broker's Topic Alias Maximum
+        ESP_LOGW(TAG, "Broker refused topic alias %u", alias);
+        mqtt5_alias_max = alias - 1;
+        mqtt5_pub_property.topic_alias = 0;
+        topic = name;
+        use_alias = false;
+        if(esp_mqtt5_client_set_publish_property(client, &mqtt5_pub_property) != ESP_OK)
+        {
+            return -1;
+        }
+    }
+
+    if(hdr->qos > 0)
+    {
+        msg_id = esp_mqtt_client_enqueue(client, topic, data, hdr->len, hdr->qos, hdr->retain, true);
+    }
+    else
+    {
+        msg_id = esp_mqtt_client_publish(client, topic, data, hdr->len, 0, hdr->retain);
+    }
+
+    if(use_alias)
+    {
+        // The broker may never have seen the alias mapping, the next
+        // publish carries the full topic again and this one goes without
+        mqtt5_alias_sent[hdr->topic_id] = (msg_id >= 0);
+        if(msg_id < 0)
+        {
+            mqtt5_pub_property.topic_alias = 0;
+            if(esp_mqtt5_client_set_publish_property(client, &mqtt5_pub_property) != ESP_OK)
+            {
+                return -1;
+            }
+            msg_id = esp_mqtt_client_publish(client, name, data, hdr->len, 0, hdr->retain);
+        }
+    }
+    return msg_id;
+}
+#endif
+
+// Retries while the broker queue is full, the broker task drains it on every loop pass
+static int mqtt_local_publish(const mqtt_pub_hdr_t *hdr, const char *topic, const char *data)
+{
+    for(uint8_t retry = 0; retry < 20; retry++)
+    {
+        int ret = mqtt_broker_publish(topic, data, hdr->len, hdr->qos, hdr->retain);
+
+        if(ret != MQTT_BROKER_BUSY)
+        {
+            return ret;
+        }
+        vTaskDelay(1);
+    }
+    return -1;
+}
+
+static void mqtt_pub_task(void *pvParameters)
+{
+    size_t size;
+
+    while(1)
+    {
+        uint8_t *item = (uint8_t *)xRingbufferReceive(mqtt_pub_ringbuf, &size, portMAX_DELAY);
+
+        // Drain everything queued before waiting again
+        while(item != NULL)
         {
-            static const char* error_msg = "{\"error\": \"Data length exceeds the data size\"}";
-            esp_mqtt_client_publish(client, topic, error_msg, strlen(error_msg), qos, 0);
+            mqtt_pub_hdr_t hdr;
+            const char *topic;
+            const char *data;
+            int msg_id = -1;
+
+            memcpy(&hdr, item, sizeof(hdr));
+            topic = (hdr.topic_id >= 0) ? mqtt_topics[hdr.topic_id] : (const char *)item + sizeof(hdr);
+            data = (const char *)item + sizeof(hdr) + hdr.topic_len;
+            if(mqtt_bridge_enabled())
+            {
+                mqtt_bridge_offer(hdr.topic_id, topic, data, hdr.len);
+            }
+            if(mqtt_connected())
+            {
+                if(mqtt_local)
+                {
+                    msg_id = mqtt_local_publish(&hdr, topic, data);
+                }
+                else
+#ifdef CONFIG_MQTT_PROTOCOL_5
+                if(mqtt5_active)
+                {
+                    msg_id = mqtt5_publish(&hdr, topic, data);
+                }
+                else
+#endif
+                // QoS 1/2 go to the client outbox and are sent from its task
+                if(hdr.qos > 0)
+                {
+                    msg_id = esp_mqtt_client_enqueue(client, topic, data, hdr.len, hdr.qos, hdr.retain, true);
+                }
+                else
+                {
+                    msg_id = esp_mqtt_client_publish(client, topic, data, hdr.len, 0, hdr.retain);
+                }
+            }
+            mqtt_pub_count((msg_id < 0) ? &mqtt_pub_dropped : &mqtt_pub_sent, 1);
+
+            if(hdr.outbox_seq != 0)
+            {
+                mqtt_outbox_ack_ok = (msg_id >= 0);
+                mqtt_outbox_acked_seq = hdr.outbox_seq;
+                xSemaphoreGive(mqtt_outbox_ack);
+            }
+
+            mqtt_pub_count(&mqtt_pub_backlog, -1);
+            vRingbufferReturnItem(mqtt_pub_ringbuf, item);
+            item = (uint8_t *)xRingbufferReceive(mqtt_pub_ringbuf, &size, 0);
         }
-        
-        xSemaphoreGive( xmqtt_semaphore );
     }
 }
 
@@ -614,16 +1789,16 @@ void mqtt_init(char* id, uint8_t connected_led, QueueHandle_t *xtx_queue)
 {
     xmqtt_semaphore = xSemaphoreCreateMutex();
 
-    // Check if local broker is enabled - if so, connect to localhost
+    // With the local broker enabled, messages are handed to it directly
     const char* mqtt_uri;
     int32_t mqtt_port;
 
     if(config_server_mqtt_broker_en_config() == 1)
     {
-        // Connect to local broker
-        mqtt_uri = "mqtt://127.0.0.1";
+        mqtt_local = true;
+        mqtt_uri = "local";
         mqtt_port = config_server_get_mqtt_broker_port();
-        ESP_LOGI(TAG, "Connecting to local MQTT broker on port %d", (int)mqtt_port);
+        ESP_LOGI(TAG, "Publishing directly to the local MQTT broker");
     }
     else
     {
@@ -633,8 +1808,8 @@ void mqtt_init(char* id, uint8_t connected_led, QueueHandle_t *xtx_queue)
         ESP_LOGI(TAG, "Connecting to external MQTT broker: %s:%d", mqtt_uri, (int)mqtt_port);
     }
 
-    esp_mqtt_client_config_t mqtt_cfg = {
-		// .session.protocol_ver = MQTT_PROTOCOL_V_5,
+    mqtt_cfg = (esp_mqtt_client_config_t){
+		.session.protocol_ver = MQTT_PROTOCOL_V_3_1_1,
 		.broker.address.uri = mqtt_uri,
 		.broker.address.port = mqtt_port,
 		.credentials.username = config_server_get_mqtt_user(),
@@ -670,9 +1845,98 @@ void mqtt_init(char* id, uint8_t connected_led, QueueHandle_t *xtx_queue)
     sprintf(mqtt_rsp_topic, "wican/%s/cmd",device_id);
     ESP_LOGI(TAG, "device_id: %s, mqtt_cfg.uri: %s", device_id, mqtt_cfg.broker.address.uri);
     mqtt_elm327_log = config_server_mqtt_elm327_log();
+    mqtt_payload_format = config_server_get_mqtt_payload_format();
+    if(config_server_mqtt_outbox_en_config() == 1 && mqtt_outbox_init(config_server_get_mqtt_outbox_size()) == ESP_OK)
+    {
+        mqtt_outbox_frames = (config_server_mqtt_outbox_frames_config() == 1);
+        mqtt_outbox_rate = config_server_get_mqtt_outbox_rate();
+    }
+    mqtt_rx_batch_frames = config_server_get_mqtt_rx_batch_frames();
+    mqtt_rx_batch_bytes = config_server_get_mqtt_rx_batch_bytes();
+    if(mqtt_rx_batch_bytes != 0 && mqtt_rx_batch_bytes < can_payload_min_size(mqtt_payload_format))
+    {
+        // Smaller batches would never take a frame and stall can/rx
+        mqtt_rx_batch_bytes = can_payload_min_size(mqtt_payload_format);
+        ESP_LOGW(TAG, "mqtt_rx_batch_bytes too small, using %lu", mqtt_rx_batch_bytes);
+    }
+    mqtt_rx_linger_us = (int64_t)config_server_get_mqtt_rx_linger_ms() * 1000;
+    mqtt_dedup_count = (config_server_can_dedup_count_config() == 1);
+    mqtt_lvc_init(config_server_get_mqtt_lvc_retain());
+    if(config_server_mqtt_broker_en_config() == 1 && config_server_mqtt_bridge_en_config() == 1)
+    {
+        mqtt_bridge_init(device_id);
+    }
 	mqtt_load_filter();
+    for(uint8_t i = 0; i < mqtt_canflt_topic_count; i++)
+    {
+        mqtt_canflt_topic_ids[i] = mqtt_topic_intern(mqtt_canflt_topics[i]);
+        mqtt_canflt_topic_hash[i] = mqtt_outbox_topic_hash(mqtt_canflt_topics[i]);
+    }
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if(!mqtt_local && config_server_mqtt_v5_config() == 1)
+    {
+        static esp_mqtt5_user_property_item_t user_property[] = {
+            {"device", NULL},
+            {"fw", GIT_SHA},
+        };
+
+        static const char *content_type[MQTT_PAYLOAD_MAX] = {
+            "application/json", "application/cbor", "application/msgpack", "application/octet-stream"
+        };
+        char elm327_topic[64];
+
+        // The rx topic carries decoded signals when a filter is loaded
+        if(mqtt_canflt_size != 0)
+        {
+            for(uint8_t i = 0; i < mqtt_canflt_topic_count; i++)
+            {
+                mqtt5_set_content_type(mqtt_canflt_topic_ids[i], content_type[MQTT_PAYLOAD_JSON]);
+            }
+        }
+        else
+        {
+            mqtt5_set_content_type(mqtt_topic_intern(config_server_get_mqtt_rx_topic()), content_type[mqtt_payload_format]);
+        }
+        sprintf(elm327_topic, "wican/%s/elm327", device_id);
+        mqtt5_set_content_type(mqtt_topic_intern(elm327_topic), content_type[mqtt_payload_format]);
+        user_property[0].value = device_id;
+        esp_mqtt5_client_set_user_property(&mqtt5_user_property, user_property, sizeof(user_property) / sizeof(user_property[0]));
+        mqtt5_expiry = config_server_get_mqtt_msg_expiry();
+        mqtt_cfg.session.protocol_ver = MQTT_PROTOCOL_V_5;
+        mqtt5_active = true;
+        ESP_LOGI(TAG, "MQTT 5, message expiry: %lu s", mqtt5_expiry);
+    }
+#endif
     s_mqtt_event_group = xEventGroupCreate();
-    client = esp_mqtt_client_init(&mqtt_cfg);
+    if(mqtt_local)
+    {
+        char elm327_topic[64];
+
+        mqtt_local_tx_en = (config_server_mqtt_tx_en_config() == 1);
+        mqtt_broker_set_message_cb(mqtt_local_message);
+        mqtt_broker_set_state_cb(mqtt_local_broker_state);
+        mqtt_broker_set_subscribe_cb(mqtt_local_subscribed);
+        mqtt_broker_set_tick_cb(mqtt_wanted_rebuild);
+        mqtt_stream_gated = (config_server_get_mqtt_publish_mode() != PUBLISH_MODE_STATIC);
+        sprintf(elm327_topic, "wican/%s/elm327", device_id);
+        mqtt_rx_topic_id = mqtt_topic_intern(config_server_get_mqtt_rx_topic());
+        mqtt_elm327_topic_id = mqtt_topic_intern(elm327_topic);
+    }
+    else
+    {
+        client = esp_mqtt_client_init(&mqtt_cfg);
+    }
+
+    mqtt_outbox_ack = xSemaphoreCreateBinary();
+    mqtt_pub_ringbuf = xRingbufferCreate(MQTT_PUB_RINGBUF_SIZE, RINGBUF_TYPE_NOSPLIT);
+    if(mqtt_pub_ringbuf == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create publisher buffer");
+    }
+    else
+    {
+        xTaskCreate(mqtt_pub_task, "mqtt_pub_task", 1024*3, NULL, 5, NULL);
+    }
 
     xTaskCreate(mqtt_task, "mqtt_task", 1024*5, (void*)AF_INET, 5, NULL);
 }
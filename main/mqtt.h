@@ -28,13 +28,26 @@
 #define MQTT_RX         ELM327_CAN_RX
 #define MQTT_TX         ELM327_CAN_TX
 
+// Deep enough to hold a full linger window of raw frames at high bus load
+#define MQTT_RX_QUEUE_SIZE      256
+
+// Size of the topic table, ids from mqtt_topic_intern() are below it
+#define MQTT_MAX_TOPICS         64
+
 typedef struct
 {
     uint8_t type;
+    uint32_t timestamp;     // ms since boot
+    uint16_t suppressed;    // identical frames held back by can_dedup
     twai_message_t frame;
 }mqtt_can_message_t;
 
 void mqtt_init(char* id, uint8_t connected_led, QueueHandle_t *xtx_queue);
 int mqtt_connected(void);
-void mqtt_publish(char *topic, char *data, int len, int qos, int retain);
+int mqtt_publish(char *topic, char *data, int len, int qos, int retain);
+int16_t mqtt_topic_intern(const char *topic);
+int mqtt_publish_id(int16_t topic_id, const char *data, int len, int qos, int retain);
+void mqtt_publisher_stats(uint32_t *backlog, uint32_t *dropped, uint32_t *sent);
+bool mqtt_forward_can_frame(const twai_message_t *frame, uint8_t type, uint16_t suppressed);
+bool mqtt_topic_wanted(int16_t topic_id);
 #endif
@@ -0,0 +1,421 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/ringbuf.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+#include "config_server.h"
+#include "wifi_network.h"
+#include "mqtt.h"
+#include "mqtt_broker.h"
+#include "wc_json.h"
+#include "mqtt_bridge.h"
+
+#define TAG                     __func__
+
+// Selected local topics are forwarded upstream as one batch per interval.
+// Only the latest payload of each topic goes into a batch, so a topic
+// published at 10 Hz costs the uplink one entry per interval. Batches wait
+// in a RAM queue while the station link or the upstream broker is down.
+#define BRIDGE_MAX_FILTERS      8
+#define BRIDGE_MAX_PAYLOAD      1024
+#define BRIDGE_BATCH_SIZE       4096
+#define BRIDGE_MIN_INTERVAL_MS  500
+// Queued batches sent per interval, so a reconnect doesn't flood the uplink
+#define BRIDGE_BACKLOG_BURST    4
+
+#define BRIDGE_TOPIC_UNKNOWN    0
+#define BRIDGE_TOPIC_ON         1
+#define BRIDGE_TOPIC_OFF        2
+
+typedef struct
+{
+    char *data;
+    uint16_t len;
+    uint16_t size;
+    bool dirty;
+    bool json;
+} bridge_slot_t;
+
+static bool bridge_enabled = false;
+static volatile bool bridge_connected = false;
+static esp_mqtt_client_handle_t bridge_client = NULL;
+static SemaphoreHandle_t bridge_mutex = NULL;
+static RingbufHandle_t bridge_queue = NULL;
+static uint32_t bridge_interval_ms;
+
+static char bridge_filter_buf[128];
+static char *bridge_filters[BRIDGE_MAX_FILTERS];
+static uint8_t bridge_filter_count = 0;
+static char bridge_topic[96];
+static char bridge_prefix[48];
+static size_t bridge_prefix_len = 0;
+
+static uint8_t bridge_match[MQTT_MAX_TOPICS];
+static const char *bridge_names[MQTT_MAX_TOPICS];
+static bridge_slot_t bridge_slots[MQTT_MAX_TOPICS];
+static char *bridge_batch = NULL;
+static void *bridge_held = NULL;
+static size_t bridge_held_size = 0;
+static mqtt_bridge_stats_t bridge_stats;
+
+static void mqtt_bridge_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+    switch((esp_mqtt_event_id_t)event_id)
+    {
+        case MQTT_EVENT_CONNECTED:
+            ESP_LOGI(TAG, "Bridge connected");
+            bridge_connected = true;
+            break;
+
+        case MQTT_EVENT_DISCONNECTED:
+            ESP_LOGI(TAG, "Bridge disconnected");
+            bridge_connected = false;
+            break;
+
+        default:
+            break;
+    }
+}
+
+bool mqtt_bridge_enabled(void)
+{
+    return bridge_enabled;
+}
+
+// Caches the filter match per topic id, topic names never change once interned
+bool mqtt_bridge_wants(int16_t topic_id, const char *topic)
+{
+    if(!bridge_enabled || topic_id < 0 || topic_id >= MQTT_MAX_TOPICS)
+    {
+        return false;
+    }
+
+    if(bridge_match[topic_id] == BRIDGE_TOPIC_UNKNOWN)
+    {
+        uint8_t match = BRIDGE_TOPIC_OFF;
+
+        for(uint8_t i = 0; i < bridge_filter_count; i++)
+        {
+            if(mqtt_broker_topic_matches(bridge_filters[i], topic))
+            {
+                match = BRIDGE_TOPIC_ON;
+                break;
+            }
+        }
+        bridge_match[topic_id] = match;
+    }
+
+    return (bridge_match[topic_id] == BRIDGE_TOPIC_ON);
+}
+
+// Called from the MQTT publisher task for every local publish
+void mqtt_bridge_offer(int16_t topic_id, const char *topic, const char *data, int len)
+{
+    bridge_slot_t *slot;
+
+    if(!mqtt_bridge_wants(topic_id, topic))
+    {
+        return;
+    }
+
+    if(len <= 0 || len > BRIDGE_MAX_PAYLOAD)
+    {
+        bridge_stats.skipped++;
+        return;
+    }
+
+    slot = &bridge_slots[topic_id];
+    xSemaphoreTake(bridge_mutex, portMAX_DELAY);
+    if(len > slot->size)
+    {
+        char *data_new = realloc(slot->data, len);
+
+        if(data_new == NULL)
+        {
+            xSemaphoreGive(bridge_mutex);
+            bridge_stats.skipped++;
+            return;
+        }
+        slot->data = data_new;
+        slot->size = len;
+    }
+    memcpy(slot->data, data, len);
+    slot->len = len;
+    slot->dirty = true;
+    // Batches embed JSON payloads as they are, others as base64
+    slot->json = (data[0] == '{' || data[0] == '[');
+    bridge_names[topic_id] = topic;
+    xSemaphoreGive(bridge_mutex);
+}
+
+static void mqtt_bridge_enqueue(const char *batch, size_t len)
+{
+    // Full queue: drop the oldest batch, the newest values matter most
+    while(xRingbufferSend(bridge_queue, batch, len, 0) != pdTRUE)
+    {
+        size_t size;
+        void *oldest = xRingbufferReceive(bridge_queue, &size, 0);
+
+        bridge_stats.dropped++;
+        if(oldest == NULL)
+        {
+            return;
+        }
+        vRingbufferReturnItem(bridge_queue, oldest);
+        bridge_stats.queued--;
+    }
+    bridge_stats.queued++;
+    bridge_stats.batches++;
+}
+
+static void mqtt_bridge_base64(wc_json_t *w, const uint8_t *data, size_t len)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    for(size_t i = 0; i < len && !w->overflow; i += 3)
+    {
+        uint32_t v = ((uint32_t)data[i] << 16) | ((i + 1 < len) ? (data[i + 1] << 8) : 0) | ((i + 2 < len) ? data[i + 2] : 0);
+        char out[4] = {table[(v >> 18) & 0x3F], table[(v >> 12) & 0x3F],
+                        (i + 1 < len) ? table[(v >> 6) & 0x3F] : '=', (i + 2 < len) ? table[v & 0x3F] : '='};
+
+        wc_json_raw(w, out, 4);
+    }
+}
+
+// {"ts": <ms since boot>, "msgs": {"can/rx": {...}, "can/rx": {"b64": "..."}}},
+// topic names without the "wican/<device id>/" prefix. Payloads that aren't
+// JSON, e.g. CBOR or binary frames, are wrapped in a "b64" object.
+static void mqtt_bridge_flush(void)
+{
+    wc_json_t w;
+    bool empty = true;
+
+    // Keep room for the closing braces
+    wc_json_init(&w, bridge_batch, BRIDGE_BATCH_SIZE - 2);
+    wc_json_str(&w, "{\"ts\": ");
+    wc_json_uint(&w, (uint32_t)(esp_timer_get_time() / 1000));
+    wc_json_str(&w, ", \"msgs\": {");
+
+    xSemaphoreTake(bridge_mutex, portMAX_DELAY);
+    for(uint8_t i = 0; i < MQTT_MAX_TOPICS; i++)
+    {
+        bridge_slot_t *slot = &bridge_slots[i];
+        const char *name = bridge_names[i];
+        size_t mark = w.len;
+
+        if(!slot->dirty)
+        {
+            continue;
+        }
+
+        if(strncmp(name, bridge_prefix, bridge_prefix_len) == 0)
+        {
+            name += bridge_prefix_len;
+        }
+        if(!empty)
+        {
+            wc_json_str(&w, ", ");
+        }
+        wc_json_quoted(&w, name);
+        wc_json_str(&w, ": ");
+        if(slot->json)
+        {
+            wc_json_raw(&w, slot->data, slot->len);
+        }
+        else
+        {
+            wc_json_str(&w, "{\"b64\": \"");
+            mqtt_bridge_base64(&w, (const uint8_t *)slot->data, slot->len);
+            wc_json_str(&w, "\"}");
+        }
+
+        if(w.overflow)
+        {
+            // Batch full, the rest go out with the next one
+            w.len = mark;
+            w.buf[mark] = 0;
+            w.overflow = false;
+            break;
+        }
+        slot->dirty = false;
+        empty = false;
+    }
+    xSemaphoreGive(bridge_mutex);
+
+    if(empty)
+    {
+        return;
+    }
+
+    w.size += 2;
+    wc_json_str(&w, "}}");
+    mqtt_bridge_enqueue(w.buf, w.len);
+}
+
+static void mqtt_bridge_send(void)
+{
+    for(uint8_t i = 0; i < BRIDGE_BACKLOG_BURST && bridge_connected; i++)
+    {
+        if(bridge_held == NULL)
+        {
+            bridge_held = xRingbufferReceive(bridge_queue, &bridge_held_size, 0);
+            if(bridge_held == NULL)
+            {
+                return;
+            }
+        }
+
+        // QoS 1, the client keeps it until the upstream broker acknowledges it
+        if(esp_mqtt_client_publish(bridge_client, bridge_topic, (const char *)bridge_held, bridge_held_size, 1, 0) < 0)
+        {
+            return;
+        }
+
+        vRingbufferReturnItem(bridge_queue, bridge_held);
+        bridge_held = NULL;
+        bridge_stats.queued--;
+        bridge_stats.sent++;
+    }
+}
+
+static void mqtt_bridge_task(void *pvParameters)
+{
+    // Batches are collected and queued from the start, they are sent once
+    // the station link is up
+    while(!wifi_network_is_connected())
+    {
+        vTaskDelay(pdMS_TO_TICKS(bridge_interval_ms));
+        mqtt_bridge_flush();
+    }
+    esp_mqtt_client_start(bridge_client);
+
+    while(1)
+    {
+        vTaskDelay(pdMS_TO_TICKS(bridge_interval_ms));
+        mqtt_bridge_flush();
+        mqtt_bridge_send();
+    }
+}
+
+void mqtt_bridge_get_stats(mqtt_bridge_stats_t *stats)
+{
+    *stats = bridge_stats;
+    stats->connected = bridge_connected;
+}
+
+// The configured topic is not a format string, only the first literal %s is
+// replaced by the device ID and any other % is kept as it is
+static void mqtt_bridge_topic_expand(char *topic, size_t size, const char *pattern, const char *device_id)
+{
+    const char *token = strstr(pattern, "%s");
+
+    if(token == NULL)
+    {
+        strlcpy(topic, pattern, size);
+    }
+    else
+    {
+        snprintf(topic, size, "%.*s%s%s", (int)(token - pattern), pattern, device_id, token + 2);
+    }
+}
+
+esp_err_t mqtt_bridge_init(const char *device_id)
+{
+    char *save = NULL;
+    char *filter;
+    uint32_t queue_size = config_server_get_mqtt_bridge_queue_kb() * 1024;
+    int32_t port = config_server_get_mqtt_bridge_port();
+
+    strlcpy(bridge_filter_buf, config_server_get_mqtt_bridge_topics(), sizeof(bridge_filter_buf));
+    for(filter = strtok_r(bridge_filter_buf, ", ", &save); filter != NULL && bridge_filter_count < BRIDGE_MAX_FILTERS;
+        filter = strtok_r(NULL, ", ", &save))
+    {
+        bridge_filters[bridge_filter_count++] = filter;
+    }
+    if(bridge_filter_count == 0)
+    {
+        ESP_LOGW(TAG, "No bridge topics configured");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if(config_server_get_mqtt_bridge_topic()[0] == 0)
+    {
+        snprintf(bridge_topic, sizeof(bridge_topic), "wican/%s/bridge", device_id);
+    }
+    else
+    {
+        mqtt_bridge_topic_expand(bridge_topic, sizeof(bridge_topic), config_server_get_mqtt_bridge_topic(), device_id);
+    }
+    snprintf(bridge_prefix, sizeof(bridge_prefix), "wican/%s/", device_id);
+    bridge_prefix_len = strlen(bridge_prefix);
+
+    bridge_interval_ms = config_server_get_mqtt_bridge_interval();
+    if(bridge_interval_ms < BRIDGE_MIN_INTERVAL_MS)
+    {
+        bridge_interval_ms = BRIDGE_MIN_INTERVAL_MS;
+    }
+    if(queue_size < 2 * BRIDGE_BATCH_SIZE)
+    {
+        queue_size = 2 * BRIDGE_BATCH_SIZE;
+    }
+
+    bridge_batch = malloc(BRIDGE_BATCH_SIZE);
+    bridge_mutex = xSemaphoreCreateMutex();
+    bridge_queue = xRingbufferCreate(queue_size, RINGBUF_TYPE_NOSPLIT);
+    if(bridge_batch == NULL || bridge_mutex == NULL || bridge_queue == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate bridge buffers");
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_mqtt_client_config_t mqtt_cfg = {
+        .broker.address.uri = config_server_get_mqtt_bridge_url(),
+        .broker.address.port = (port > 0) ? port : 1883,
+        .credentials.username = (config_server_get_mqtt_bridge_user()[0] != 0) ? config_server_get_mqtt_bridge_user() : NULL,
+        .credentials.authentication.password = (config_server_get_mqtt_bridge_pass()[0] != 0) ? config_server_get_mqtt_bridge_pass() : NULL,
+        .session.keepalive = 60,
+        .network.reconnect_timeout_ms = 10000,
+        .buffer.size = 1024,
+        .buffer.out_size = BRIDGE_BATCH_SIZE + 256,
+    };
+
+    bridge_client = esp_mqtt_client_init(&mqtt_cfg);
+    if(bridge_client == NULL)
+    {
+        return ESP_FAIL;
+    }
+    esp_mqtt_client_register_event(bridge_client, ESP_EVENT_ANY_ID, mqtt_bridge_event_handler, NULL);
+
+    bridge_enabled = true;
+    xTaskCreate(mqtt_bridge_task, "mqtt_bridge", 1024*4, NULL, 4, NULL);
+    ESP_LOGI(TAG, "Bridging %u topic filter(s) to %s every %" PRIu32 " ms", bridge_filter_count, bridge_topic, bridge_interval_ms);
+
+    return ESP_OK;
+}
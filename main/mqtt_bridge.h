@@ -0,0 +1,46 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef __MQTT_BRIDGE_H__
+#define __MQTT_BRIDGE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+typedef struct
+{
+    bool connected;
+    uint32_t batches;       // batches built
+    uint32_t sent;          // batches accepted by the upstream client
+    uint32_t dropped;       // oldest batches dropped while the queue was full
+    uint32_t skipped;       // payloads not bridged: not JSON or too large
+    uint32_t queued;        // batches waiting for the upstream broker
+} mqtt_bridge_stats_t;
+
+esp_err_t mqtt_bridge_init(const char *device_id);
+bool mqtt_bridge_enabled(void);
+bool mqtt_bridge_wants(int16_t topic_id, const char *topic);
+void mqtt_bridge_offer(int16_t topic_id, const char *topic, const char *data, int len);
+void mqtt_bridge_get_stats(mqtt_bridge_stats_t *stats);
+
+#endif
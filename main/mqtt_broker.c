@@ -19,17 +19,569 @@
  */
 
 #include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <sys/types.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/ringbuf.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
 #include "mosq_broker.h"
+#include "mosquitto_broker.h"
+#include "mosquitto_plugin.h"
 #include "mqtt_broker.h"
+#include "wc_json.h"
 
 static const char *TAG = "mqtt_broker";
 
 static TaskHandle_t broker_task_handle = NULL;
 static bool broker_running = false;
 static uint16_t broker_port = 1883;
+static mqtt_broker_message_cb_t broker_message_cb = NULL;
+static mqtt_broker_state_cb_t broker_state_cb = NULL;
+static mqtt_broker_subscribe_cb_t broker_subscribe_cb = NULL;
+static mqtt_broker_tick_cb_t broker_tick_cb = NULL;
+static SemaphoreHandle_t broker_stopped_sem = NULL;
+static esp_timer_handle_t broker_ready_timer = NULL;
+
+// In-process publishes. Mosquitto is single threaded, so other tasks only
+// copy messages into this ring buffer and the broker task hands them to
+// Mosquitto from its plugin tick, once per loop pass.
+#define BROKER_PUB_RINGBUF_SIZE     (1024*12)
+
+typedef struct
+{
+    uint8_t qos;
+    uint8_t retain;
+    uint16_t topic_len;             // including the terminating 0
+    uint16_t client_len;            // same, 0 when published to every subscriber
+    uint32_t len;
+} broker_pub_hdr_t;
+
+static RingbufHandle_t broker_pub_ringbuf = NULL;
+
+// Mosquitto polls its sockets every 100 ms, so a stop request is seen
+// within one pass. Its cleanup then closes every socket and frees the
+// client contexts, retained messages and listeners.
+#define BROKER_STOP_TIMEOUT_MS      1000
+// Time for the broker to open its listener and enter its loop
+#define BROKER_READY_DELAY_US       (1000 * 1000LL)
+
+// Client traffic is counted by wrapping Mosquitto's ACL check, which the
+// broker calls for every publish in (write), every delivery (read) and every
+// (un)subscribe, and context__disconnect(). See the --wrap flags in
+// CMakeLists.txt, the build checks Mosquitto only calls the wrapped functions
+// across objects. Clients are tracked from their password check on connect.
+#define BROKER_MAX_CLIENTS          16
+#define BROKER_SYS_INTERVAL_US      (10 * 1000000LL)
+#define BROKER_SYS_TOPIC            "$SYS/wican/broker"
+
+typedef struct
+{
+    const struct mosquitto *context;
+    char id[24];
+    uint16_t subscriptions;
+    uint32_t msgs_in;
+    uint32_t msgs_out;
+    uint32_t bytes_in;
+    uint32_t bytes_out;
+    uint32_t pending_bytes;     // accepted for delivery, not yet written to the socket
+    uint32_t pending_msgs;      // deliveries since the socket last caught up
+    uint32_t dropped;
+    bool subs_lost;             // a filter fit neither subscription table
+} broker_client_t;
+
+static portMUX_TYPE broker_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static broker_client_t broker_clients[BROKER_MAX_CLIENTS];
+static uint8_t broker_client_count = 0;
+static mqtt_broker_stats_t broker_stats;
+static uint32_t broker_last_msgs_out = 0;
+static esp_timer_handle_t broker_sys_timer = NULL;
+
+// Subscription registry for producers: the topic filters of all clients.
+// broker_sub_gen changes whenever the set changes, so producers only match
+// their topics again after a (un)subscribe or disconnect.
+#define BROKER_MAX_SUBS             32
+#define BROKER_SUB_FILTER_LEN       64
+
+typedef struct
+{
+    const struct mosquitto *context;
+    char filter[BROKER_SUB_FILTER_LEN];
+} broker_sub_t;
+
+// Filters that don't fit the registry are only remembered by hash, so they
+// can be removed again. While any exist, every topic counts as subscribed.
+typedef struct
+{
+    const struct mosquitto *context;
+    uint32_t hash;
+} broker_sub_untracked_t;
+
+static broker_sub_t broker_subs[BROKER_MAX_SUBS];
+static uint8_t broker_sub_count = 0;
+static broker_sub_untracked_t broker_subs_untracked[BROKER_MAX_SUBS];
+static uint8_t broker_subs_untracked_count = 0;
+static bool broker_subs_lost = false;           // by a client missing from broker_clients
+static bool broker_subs_overflow = false;
+static volatile uint32_t broker_sub_gen = 1;
+
+// Memory budget. Mosquitto's own queue limits can't be set through the port,
+// so deliveries are refused at the ACL check instead: a client over its
+// queue budget, or any client while free heap is below the reserve, misses
+// new messages until its socket catches up. Messages already queued are
+// still delivered, so it is the newest that are dropped.
+#define BROKER_PUBLISH_OVERHEAD     4
+#define BROKER_MAX_RETAINED         128
+
+static mqtt_broker_limits_t broker_limits = {
+    .max_clients = 8,
+    .max_queued_msgs = 100,
+    .max_queued_bytes = 32 * 1024,
+    .max_retained = 64,
+    .heap_reserve = 0,
+};
+static uint32_t broker_retained[BROKER_MAX_RETAINED];
+static uint16_t broker_retained_count = 0;
+
+int __real_mosquitto_acl_check(struct mosquitto *context, const char *topic, uint32_t payloadlen, void *payload, uint8_t qos, bool retain, int access);
+void __real_context__disconnect(struct mosquitto *context);
+int __real_mosquitto_unpwd_check(struct mosquitto *context);
+ssize_t __real_net__write(struct mosquitto *mosq, const void *buf, size_t count);
+void __real_plugin__handle_tick(void);
+static uint32_t broker_topic_hash(const char *topic);
+
+// Broker task only, the caller holds broker_stats_lock
+static broker_client_t *broker_client_find(const struct mosquitto *context, bool add)
+{
+    for (uint8_t i = 0; i < broker_client_count; i++) {
+        if (broker_clients[i].context == context) {
+            return &broker_clients[i];
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+    if (broker_client_count == BROKER_MAX_CLIENTS) {
+        // Still counted in the totals, just not listed
+        return NULL;
+    }
+
+    broker_client_t *client = &broker_clients[broker_client_count++];
+    const char *id = mosquitto_client_id(context);
+
+    memset(client, 0, sizeof(*client));
+    client->context = context;
+    strlcpy(client->id, (id != NULL) ? id : "", sizeof(client->id));
+    broker_stats.clients = broker_client_count;
+    return client;
+}
+
+// Caller holds broker_stats_lock
+static void broker_subs_recount(void)
+{
+    bool overflow = (broker_subs_untracked_count != 0) || broker_subs_lost;
+
+    for (uint8_t i = 0; i < broker_client_count && !overflow; i++) {
+        overflow = broker_clients[i].subs_lost;
+    }
+    broker_subs_overflow = overflow;
+}
+
+// Broker task only, the caller holds broker_stats_lock. Returns true if the filter was added.
+static bool broker_sub_add(const struct mosquitto *context, broker_client_t *client, const char *filter)
+{
+    uint32_t hash = broker_topic_hash(filter);
+
+    for (uint8_t i = 0; i < broker_sub_count; i++) {
+        if (broker_subs[i].context == context && strcmp(broker_subs[i].filter, filter) == 0) {
+            return false;
+        }
+    }
+    for (uint8_t i = 0; i < broker_subs_untracked_count; i++) {
+        if (broker_subs_untracked[i].context == context && broker_subs_untracked[i].hash == hash) {
+            return false;
+        }
+    }
+
+    if (broker_sub_count < BROKER_MAX_SUBS && strlen(filter) < BROKER_SUB_FILTER_LEN) {
+        broker_subs[broker_sub_count].context = context;
+        strcpy(broker_subs[broker_sub_count].filter, filter);
+        broker_sub_count++;
+    } else if (broker_subs_untracked_count < BROKER_MAX_SUBS) {
+        broker_subs_untracked[broker_subs_untracked_count].context = context;
+        broker_subs_untracked[broker_subs_untracked_count].hash = hash;
+        broker_subs_untracked_count++;
+    } else if (client != NULL) {
+        // Can't be removed by filter any more, only when the client goes
+        client->subs_lost = true;
+    } else {
+        broker_subs_lost = true;
+    }
+    broker_subs_recount();
+    broker_sub_gen++;
+    return true;
+}
+
+// Removes one filter of a client, or all of them when filter is NULL.
+// Returns the number removed.
+static uint8_t broker_sub_remove(const struct mosquitto *context, const char *filter)
+{
+    uint32_t hash = (filter != NULL) ? broker_topic_hash(filter) : 0;
+    uint8_t removed = 0;
+
+    for (uint8_t i = 0; i < broker_sub_count;) {
+        if (broker_subs[i].context == context && (filter == NULL || strcmp(broker_subs[i].filter, filter) == 0)) {
+            broker_subs[i] = broker_subs[--broker_sub_count];
+            removed++;
+        } else {
+            i++;
+        }
+    }
+    for (uint8_t i = 0; i < broker_subs_untracked_count;) {
+        if (broker_subs_untracked[i].context == context && (filter == NULL || broker_subs_untracked[i].hash == hash)) {
+            broker_subs_untracked[i] = broker_subs_untracked[--broker_subs_untracked_count];
+            removed++;
+        } else {
+            i++;
+        }
+    }
+    if (removed != 0) {
+        broker_subs_recount();
+        broker_sub_gen++;
+    }
+    return removed;
+}
+
+// MQTT topic filter matching, including $share/<group>/ shared subscriptions
+bool mqtt_broker_topic_matches(const char *filter, const char *topic)
+{
+    if (strncmp(filter, "$share/", 7) == 0) {
+        filter = strchr(filter + 7, '/');
+        if (filter == NULL) {
+            return false;
+        }
+        filter++;
+    }
+
+    // Wildcards do not match $SYS style topics
+    if (topic[0] == '$' && (filter[0] == '#' || filter[0] == '+')) {
+        return false;
+    }
+
+    while (*filter != '\0') {
+        if (*filter == '#') {
+            return true;
+        } else if (*filter == '+') {
+            while (*topic != '\0' && *topic != '/') {
+                topic++;
+            }
+            filter++;
+        } else {
+            while (*filter != '\0' && *filter != '/') {
+                if (*filter++ != *topic++) {
+                    return false;
+                }
+            }
+        }
+
+        if (*filter == '/') {
+            if (*topic != '/') {
+                // "a/#" also matches "a"
+                return (*topic == '\0' && strcmp(filter, "/#") == 0);
+            }
+            filter++;
+            topic++;
+        } else if (*topic != '\0') {
+            return false;
+        }
+    }
+    return (*topic == '\0');
+}
+
+static uint32_t broker_topic_hash(const char *topic)
+{
+    uint32_t h = 2166136261UL;
+
+    while (*topic != '\0') {
+        h = (h ^ (uint8_t)*topic++) * 16777619UL;
+    }
+    return h;
+}
+
+// Caller holds broker_stats_lock. Returns false if a new retained topic
+// would exceed the cap, an empty payload clears the topic.
+static bool broker_retained_update(const char *topic, uint32_t payloadlen)
+{
+    uint32_t h = broker_topic_hash(topic);
+    uint16_t max = (broker_limits.max_retained == 0 || broker_limits.max_retained > BROKER_MAX_RETAINED) ?
+                    BROKER_MAX_RETAINED : broker_limits.max_retained;
+
+    for (uint16_t i = 0; i < broker_retained_count; i++) {
+        if (broker_retained[i] == h) {
+            if (payloadlen == 0) {
+                broker_retained[i] = broker_retained[--broker_retained_count];
+            }
+            return true;
+        }
+    }
+
+    if (payloadlen == 0) {
+        return true;
+    }
+    if (broker_retained_count >= max) {
+        return false;
+    }
+    broker_retained[broker_retained_count++] = h;
+    return true;
+}
+
+// Caller holds broker_stats_lock
+static bool broker_delivery_allowed(const broker_client_t *client)
+{
+    if (broker_limits.heap_reserve != 0 && esp_get_free_heap_size() < broker_limits.heap_reserve) {
+        return false;
+    }
+    if (client == NULL) {
+        return true;
+    }
+    if (broker_limits.max_queued_msgs != 0 && client->pending_msgs >= broker_limits.max_queued_msgs) {
+        return false;
+    }
+    if (broker_limits.max_queued_bytes != 0 && client->pending_bytes >= broker_limits.max_queued_bytes) {
+        return false;
+    }
+    return true;
+}
+
+int __wrap_mosquitto_unpwd_check(struct mosquitto *context)
+{
+    uint8_t max_clients = (broker_limits.max_clients == 0 || broker_limits.max_clients > BROKER_MAX_CLIENTS) ?
+                            BROKER_MAX_CLIENTS : broker_limits.max_clients;
+    const char *id = mosquitto_client_id(context);
+    bool takeover = false;
+    bool refuse;
+
+    portENTER_CRITICAL(&broker_stats_lock);
+    // A client reconnecting before its old session timed out replaces it
+    for (uint8_t i = 0; id != NULL && i < broker_client_count; i++) {
+        if (strcmp(broker_clients[i].id, id) == 0) {
+            takeover = true;
+            break;
+        }
+    }
+    refuse = (broker_client_count >= max_clients && !takeover) ||
+            (broker_limits.heap_reserve != 0 && esp_get_free_heap_size() < broker_limits.heap_reserve);
+    if (refuse) {
+        broker_stats.refused_clients++;
+    }
+    portEXIT_CRITICAL(&broker_stats_lock);
+
+    if (refuse) {
+        // Answered with CONNACK "not authorized"
+        return MOSQ_ERR_AUTH;
+    }
+
+    int rc = __real_mosquitto_unpwd_check(context);
+
+    if (rc == MOSQ_ERR_SUCCESS) {
+        portENTER_CRITICAL(&broker_stats_lock);
+        broker_client_find(context, true);
+        portEXIT_CRITICAL(&broker_stats_lock);
+    }
+    return rc;
+}
+
+ssize_t __wrap_net__write(struct mosquitto *mosq, const void *buf, size_t count)
+{
+    ssize_t ret = __real_net__write(mosq, buf, count);
+
+    if (ret > 0) {
+        portENTER_CRITICAL(&broker_stats_lock);
+        broker_client_t *client = broker_client_find(mosq, false);
+        if (client != NULL) {
+            if ((uint32_t)ret >= client->pending_bytes) {
+                client->pending_bytes = 0;
+                client->pending_msgs = 0;
+            } else {
+                client->pending_bytes -= ret;
+            }
+        }
+        portEXIT_CRITICAL(&broker_stats_lock);
+    }
+    return ret;
+}
+
+int __wrap_mosquitto_acl_check(struct mosquitto *context, const char *topic, uint32_t payloadlen, void *payload, uint8_t qos, bool retain, int access)
+{
+    int rc = __real_mosquitto_acl_check(context, topic, payloadlen, payload, qos, retain, access);
+
+    if (rc != MOSQ_ERR_SUCCESS) {
+        return rc;
+    }
+
+    portENTER_CRITICAL(&broker_stats_lock);
+    broker_client_t *client = broker_client_find(context, true);
+    switch (access) {
+        case MOSQ_ACL_READ:
+            if (!broker_delivery_allowed(client)) {
+                broker_stats.dropped++;
+                if (client != NULL) {
+                    client->dropped++;
+                }
+                rc = MOSQ_ERR_ACL_DENIED;
+                break;
+            }
+            if (client != NULL) {
+                client->pending_bytes += payloadlen + strlen(topic) + BROKER_PUBLISH_OVERHEAD;
+                client->pending_msgs++;
+            }
+            broker_stats.msgs_out++;
+            broker_stats.bytes_out += payloadlen;
+            if (client != NULL) {
+                client->msgs_out++;
+                client->bytes_out += payloadlen;
+            }
+            break;
+        case MOSQ_ACL_WRITE:
+            if (retain && !broker_retained_update(topic, payloadlen)) {
+                broker_stats.dropped_retained++;
+                rc = MOSQ_ERR_ACL_DENIED;
+                break;
+            }
+            broker_stats.msgs_in++;
+            broker_stats.bytes_in += payloadlen;
+            if (client != NULL) {
+                client->msgs_in++;
+                client->bytes_in += payloadlen;
+            }
+            break;
+        case MOSQ_ACL_SUBSCRIBE:
+            // Counted before Mosquitto adds the subscription, it has
+            // already validated the filter. One it then fails to add
+            // stays counted until the client unsubscribes or disconnects.
+            if (broker_sub_add(context, client, topic)) {
+                broker_stats.subscriptions++;
+                if (client != NULL) {
+                    client->subscriptions++;
+                }
+            }
+            break;
+        case MOSQ_ACL_UNSUBSCRIBE:
+            if (broker_sub_remove(context, topic) != 0) {
+                broker_stats.subscriptions--;
+                if (client != NULL && client->subscriptions > 0) {
+                    client->subscriptions--;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+    portEXIT_CRITICAL(&broker_stats_lock);
+
+    if (access == MOSQ_ACL_SUBSCRIBE && broker_subscribe_cb != NULL) {
+        broker_subscribe_cb(mosquitto_client_id(context), topic);
+    }
+
+    return rc;
+}
+
+void __wrap_context__disconnect(struct mosquitto *context)
+{
+    portENTER_CRITICAL(&broker_stats_lock);
+    broker_client_t *client = broker_client_find(context, false);
+    broker_stats.subscriptions -= broker_sub_remove(context, NULL);
+    if (client != NULL) {
+        bool lost = client->subs_lost;
+
+        *client = broker_clients[--broker_client_count];
+        broker_stats.clients = broker_client_count;
+        if (lost) {
+            broker_subs_recount();
+            broker_sub_gen++;
+        }
+    }
+    portEXIT_CRITICAL(&broker_stats_lock);
+
+    __real_context__disconnect(context);
+}
+
+// Broker task, called by the Mosquitto loop on every pass. Messages queued by
+// mqtt_broker_publish are added to the plugin message list here, which the
+// loop drains at the start of its next pass.
+void __wrap_plugin__handle_tick(void)
+{
+    size_t size;
+    uint8_t *item;
+
+    while (broker_pub_ringbuf != NULL &&
+            (item = (uint8_t *)xRingbufferReceive(broker_pub_ringbuf, &size, 0)) != NULL) {
+        broker_pub_hdr_t hdr;
+        const char *topic = (const char *)item + sizeof(hdr);
+
+        memcpy(&hdr, item, sizeof(hdr));
+        const char *client_id = (hdr.client_len != 0) ? (topic + hdr.topic_len) : NULL;
+        const char *data = topic + hdr.topic_len + hdr.client_len;
+
+        if (mosquitto_broker_publish_copy(client_id, topic, hdr.len, data, hdr.qos, hdr.retain, NULL) != MOSQ_ERR_SUCCESS) {
+            ESP_LOGW(TAG, "Local publish to %s failed", topic);
+        }
+        vRingbufferReturnItem(broker_pub_ringbuf, item);
+    }
+
+    if (broker_tick_cb != NULL) {
+        broker_tick_cb();
+    }
+
+    __real_plugin__handle_tick();
+}
+
+// Drops messages queued for a broker that is gone
+static void broker_pub_discard(void)
+{
+    size_t size;
+    uint8_t *item;
+
+    while (broker_pub_ringbuf != NULL &&
+            (item = (uint8_t *)xRingbufferReceive(broker_pub_ringbuf, &size, 0)) != NULL) {
+        vRingbufferReturnItem(broker_pub_ringbuf, item);
+    }
+}
+
+// Publishes the per-client stats under $SYS, next to Mosquitto's own $SYS/broker tree
+static void mqtt_broker_sys_timer_cb(void *arg)
+{
+    static char json[1024];
+
+    portENTER_CRITICAL(&broker_stats_lock);
+    broker_stats.fanout_rate = (broker_stats.msgs_out - broker_last_msgs_out) / (BROKER_SYS_INTERVAL_US / 1000000);
+    broker_last_msgs_out = broker_stats.msgs_out;
+    portEXIT_CRITICAL(&broker_stats_lock);
+
+    int len = mqtt_broker_get_stats_json(json, sizeof(json));
+    if (len > 0) {
+        // Skipped this interval if the queue is full, the timer task must not wait
+        mqtt_broker_publish(BROKER_SYS_TOPIC, json, len, 0, true);
+    }
+}
+
+static void mqtt_broker_ready_timer_cb(void *arg)
+{
+    if (broker_running && broker_state_cb != NULL) {
+        broker_state_cb(true);
+    }
+}
+
+static void mqtt_broker_handle_message(char *client, char *topic, char *data, int len, int qos, int retain)
+{
+    if (broker_message_cb != NULL) {
+        broker_message_cb(topic, data, len);
+    }
+}
 
 /**
  * @brief MQTT Broker task
@@ -42,12 +594,25 @@ static void mqtt_broker_task(void *pvParameters)
     config.host = "0.0.0.0";
     config.port = broker_port;
     config.tls_cfg = NULL;  // No TLS for now (can be added later)
+    config.handle_message_cb = mqtt_broker_handle_message;
 
     ESP_LOGI(TAG, "Starting MQTT broker on port %d", broker_port);
 
+    portENTER_CRITICAL(&broker_stats_lock);
+    memset(&broker_stats, 0, sizeof(broker_stats));
+    broker_client_count = 0;
+    broker_sub_count = 0;
+    broker_subs_untracked_count = 0;
+    broker_subs_lost = false;
+    broker_subs_overflow = false;
+    broker_sub_gen++;
+    broker_retained_count = 0;
+    broker_last_msgs_out = 0;
+    portEXIT_CRITICAL(&broker_stats_lock);
     broker_running = true;
+    esp_timer_start_once(broker_ready_timer, BROKER_READY_DELAY_US);
 
-    // Run the broker (this blocks)
+    // Run the broker (this blocks until mosq_broker_stop())
     int ret = mosq_broker_run(&config);
 
     if (ret != 0) {
@@ -56,8 +621,17 @@ static void mqtt_broker_task(void *pvParameters)
         ESP_LOGI(TAG, "Broker stopped normally");
     }
 
+    broker_running = false;
+    esp_timer_stop(broker_ready_timer);
+    broker_pub_discard();
+    if (broker_state_cb != NULL) {
+        broker_state_cb(false);
+    }
+    portENTER_CRITICAL(&broker_stats_lock);
     broker_running = false;
     broker_task_handle = NULL;
+    portEXIT_CRITICAL(&broker_stats_lock);
+    xSemaphoreGive(broker_stopped_sem);
 
     vTaskDelete(NULL);
 }
@@ -71,11 +645,46 @@ int mqtt_broker_init(uint16_t port)
 
     broker_port = port;
 
-    // Create the broker task with sufficient stack (6KB as recommended by Espressif)
+    if (broker_stopped_sem == NULL) {
+        broker_stopped_sem = xSemaphoreCreateBinary();
+        if (broker_stopped_sem == NULL) {
+            return -1;
+        }
+    }
+
+    if (broker_pub_ringbuf == NULL) {
+        broker_pub_ringbuf = xRingbufferCreate(BROKER_PUB_RINGBUF_SIZE, RINGBUF_TYPE_NOSPLIT);
+        if (broker_pub_ringbuf == NULL) {
+            return -1;
+        }
+    }
+
+    if (broker_ready_timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = mqtt_broker_ready_timer_cb,
+            .name = "broker_ready",
+        };
+        if (esp_timer_create(&timer_args, &broker_ready_timer) != ESP_OK) {
+            return -1;
+        }
+    }
+
+    if (broker_sys_timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = mqtt_broker_sys_timer_cb,
+            .name = "broker_sys",
+        };
+        if (esp_timer_create(&timer_args, &broker_sys_timer) == ESP_OK) {
+            esp_timer_start_periodic(broker_sys_timer, BROKER_SYS_INTERVAL_US);
+        }
+    }
+
+    // Create the broker task with sufficient stack (6KB as recommended by Espressif,
+    // plus 2KB for the message callback, which decodes can/tx and runs commands)
     BaseType_t result = xTaskCreate(
         mqtt_broker_task,
         "mqtt_broker",
-        6144,  // 6KB stack size
+        8192,  // 8KB stack size
         NULL,
         5,     // Priority 5 (same as other network tasks)
         &broker_task_handle
@@ -83,6 +692,7 @@ int mqtt_broker_init(uint16_t port)
 
     if (result != pdPASS) {
         ESP_LOGE(TAG, "Failed to create broker task");
+        broker_task_handle = NULL;
         return -1;
     }
 
@@ -90,19 +700,45 @@ int mqtt_broker_init(uint16_t port)
     return 0;
 }
 
-void mqtt_broker_stop(void)
+int mqtt_broker_stop(void)
 {
-    if (broker_task_handle != NULL) {
-        ESP_LOGI(TAG, "Stopping MQTT broker");
+    if (broker_task_handle == NULL) {
+        return 0;
+    }
 
-        // Note: mosq_broker_run() doesn't have a clean shutdown API
-        // We'll need to delete the task (not ideal, but functional)
-        vTaskDelete(broker_task_handle);
-        broker_task_handle = NULL;
-        broker_running = false;
+    ESP_LOGI(TAG, "Stopping MQTT broker");
+    int64_t start = esp_timer_get_time();
+
+    // Stop local publishing first, then ask the broker loop to exit
+    broker_running = false;
+    xSemaphoreTake(broker_stopped_sem, 0);
+    mosq_broker_stop();
+
+    if (xSemaphoreTake(broker_stopped_sem, pdMS_TO_TICKS(BROKER_STOP_TIMEOUT_MS)) != pdTRUE) {
+        // Still inside Mosquitto, so it is reported as running until the
+        // task exits on its own. The task clears both under the same lock.
+        portENTER_CRITICAL(&broker_stats_lock);
+        broker_running = (broker_task_handle != NULL);
+        portEXIT_CRITICAL(&broker_stats_lock);
+        ESP_LOGE(TAG, "Broker did not stop within %d ms", BROKER_STOP_TIMEOUT_MS);
+        return -1;
+    }
+
+    ESP_LOGI(TAG, "MQTT broker stopped in %lu ms", (unsigned long)((esp_timer_get_time() - start) / 1000));
+    return 0;
+}
 
-        ESP_LOGI(TAG, "MQTT broker stopped");
+int mqtt_broker_restart(uint16_t port)
+{
+    if (mqtt_broker_stop() != 0) {
+        return -1;
     }
+    return mqtt_broker_init(port);
+}
+
+uint16_t mqtt_broker_get_port(void)
+{
+    return broker_port;
 }
 
 bool mqtt_broker_is_running(void)
@@ -110,10 +746,183 @@ bool mqtt_broker_is_running(void)
     return broker_running;
 }
 
+static int broker_publish_queue(const char *client_id, const char *topic, const char *data, int len, int qos, bool retain)
+{
+    broker_pub_hdr_t hdr = {.qos = qos, .retain = retain, .len = len};
+    void *item = NULL;
+    int ret = MQTT_BROKER_BUSY;
+
+    if (!broker_running || broker_task_handle == NULL || broker_pub_ringbuf == NULL || len < 0) {
+        return -1;
+    }
+
+    // Copied for the broker task, see __wrap_plugin__handle_tick
+    hdr.topic_len = strlen(topic) + 1;
+    hdr.client_len = (client_id != NULL) ? (strlen(client_id) + 1) : 0;
+    if (xRingbufferSendAcquire(broker_pub_ringbuf, &item, sizeof(hdr) + hdr.topic_len + hdr.client_len + hdr.len, 0) == pdTRUE) {
+        uint8_t *p = (uint8_t *)item + sizeof(hdr);
+
+        memcpy(item, &hdr, sizeof(hdr));
+        memcpy(p, topic, hdr.topic_len);
+        memcpy(p + hdr.topic_len, client_id, hdr.client_len);
+        memcpy(p + hdr.topic_len + hdr.client_len, data, hdr.len);
+        xRingbufferSendComplete(broker_pub_ringbuf, item);
+        ret = 0;
+    }
+
+    portENTER_CRITICAL(&broker_stats_lock);
+    if (ret == 0) {
+        broker_stats.local_msgs++;
+    } else if (ret == MQTT_BROKER_BUSY) {
+        broker_stats.local_busy++;
+    }
+    portEXIT_CRITICAL(&broker_stats_lock);
+
+    return ret;
+}
+
+int mqtt_broker_publish(const char *topic, const char *data, int len, int qos, bool retain)
+{
+    return broker_publish_queue(NULL, topic, data, len, qos, retain);
+}
+
+int mqtt_broker_publish_to(const char *client_id, const char *topic, const char *data, int len)
+{
+    if (client_id == NULL) {
+        return -1;
+    }
+    return broker_publish_queue(client_id, topic, data, len, 0, false);
+}
+
+void mqtt_broker_set_limits(const mqtt_broker_limits_t *limits)
+{
+    portENTER_CRITICAL(&broker_stats_lock);
+    broker_limits = *limits;
+    portEXIT_CRITICAL(&broker_stats_lock);
+}
+
+void mqtt_broker_set_message_cb(mqtt_broker_message_cb_t cb)
+{
+    broker_message_cb = cb;
+}
+
+void mqtt_broker_set_state_cb(mqtt_broker_state_cb_t cb)
+{
+    broker_state_cb = cb;
+}
+
+void mqtt_broker_set_subscribe_cb(mqtt_broker_subscribe_cb_t cb)
+{
+    broker_subscribe_cb = cb;
+}
+
+void mqtt_broker_set_tick_cb(mqtt_broker_tick_cb_t cb)
+{
+    broker_tick_cb = cb;
+}
+
 uint8_t mqtt_broker_get_client_count(void)
 {
-    // TODO: Implement client count tracking
-    // This would require modifications to the mosquitto broker library
-    // or maintaining our own client list
-    return 0;
+    return broker_client_count;
+}
+
+uint32_t mqtt_broker_sub_generation(void)
+{
+    return broker_sub_gen;
+}
+
+bool mqtt_broker_has_subscribers(const char *topic)
+{
+    bool found;
+
+    // Matching runs outside the lock, a change while it runs bumps the
+    // generation again and the caller checks once more
+    portENTER_CRITICAL(&broker_stats_lock);
+    uint8_t count = broker_sub_count;
+    found = broker_subs_overflow;
+    portEXIT_CRITICAL(&broker_stats_lock);
+
+    for (uint8_t i = 0; i < count && !found; i++) {
+        char filter[BROKER_SUB_FILTER_LEN];
+
+        portENTER_CRITICAL(&broker_stats_lock);
+        if (i < broker_sub_count) {
+            memcpy(filter, broker_subs[i].filter, sizeof(filter));
+        } else {
+            filter[0] = '\0';
+        }
+        portEXIT_CRITICAL(&broker_stats_lock);
+
+        found = (filter[0] != '\0' && mqtt_broker_topic_matches(filter, topic));
+    }
+    return found;
+}
+
+static void mqtt_broker_fill_heap(mqtt_broker_stats_t *stats)
+{
+    stats->retained = broker_retained_count;
+    stats->free_heap = esp_get_free_heap_size();
+    stats->min_free_heap = esp_get_minimum_free_heap_size();
+}
+
+void mqtt_broker_get_stats(mqtt_broker_stats_t *stats)
+{
+    portENTER_CRITICAL(&broker_stats_lock);
+    *stats = broker_stats;
+    portEXIT_CRITICAL(&broker_stats_lock);
+    mqtt_broker_fill_heap(stats);
+}
+
+int mqtt_broker_get_stats_json(char *buf, size_t size)
+{
+    broker_client_t clients[BROKER_MAX_CLIENTS];
+    mqtt_broker_stats_t stats;
+    wc_json_t w;
+    uint8_t count;
+    int len;
+
+    // Copy under the lock, format outside of it
+    portENTER_CRITICAL(&broker_stats_lock);
+    stats = broker_stats;
+    count = broker_client_count;
+    memcpy(clients, broker_clients, count * sizeof(broker_client_t));
+    portEXIT_CRITICAL(&broker_stats_lock);
+    mqtt_broker_fill_heap(&stats);
+
+    len = snprintf(buf, size, "{\"running\": %s, \"clients\": %u, \"subscriptions\": %" PRIu32 ", "
+                    "\"msgs_in\": %" PRIu32 ", \"msgs_out\": %" PRIu32 ", \"bytes_in\": %" PRIu64 ", \"bytes_out\": %" PRIu64 ", "
+                    "\"local_msgs\": %" PRIu32 ", \"local_busy\": %" PRIu32 ", \"fanout_rate\": %" PRIu32 ", "
+                    "\"dropped\": %" PRIu32 ", \"dropped_retained\": %" PRIu32 ", \"refused_clients\": %" PRIu32 ", \"retained\": %" PRIu32 ", "
+                    "\"free_heap\": %" PRIu32 ", \"min_free_heap\": %" PRIu32 ", \"client_list\": [",
+                    broker_running ? "true" : "false", count, stats.subscriptions,
+                    stats.msgs_in, stats.msgs_out, stats.bytes_in, stats.bytes_out,
+                    stats.local_msgs, stats.local_busy, stats.fanout_rate,
+                    stats.dropped, stats.dropped_retained, stats.refused_clients, stats.retained,
+                    stats.free_heap, stats.min_free_heap);
+
+    if (len < 0 || (size_t)len >= size) {
+        return -1;
+    }
+
+    // Client ids come from the clients, they are escaped
+    wc_json_init(&w, buf + len, size - len);
+    for (uint8_t i = 0; i < count; i++) {
+        const uint32_t values[] = {clients[i].subscriptions, clients[i].msgs_in, clients[i].msgs_out,
+                                    clients[i].bytes_in, clients[i].bytes_out, clients[i].pending_msgs,
+                                    clients[i].pending_bytes, clients[i].dropped};
+        static const char *const keys[] = {", \"subscriptions\": ", ", \"msgs_in\": ", ", \"msgs_out\": ",
+                                    ", \"bytes_in\": ", ", \"bytes_out\": ", ", \"queued\": ",
+                                    ", \"queued_bytes\": ", ", \"dropped\": "};
+
+        wc_json_str(&w, (i == 0) ? "{\"id\": " : ", {\"id\": ");
+        wc_json_quoted(&w, clients[i].id);
+        for (uint8_t k = 0; k < sizeof(values) / sizeof(values[0]); k++) {
+            wc_json_str(&w, keys[k]);
+            wc_json_uint(&w, values[k]);
+        }
+        wc_json_char(&w, '}');
+    }
+    wc_json_raw(&w, "]}", 2);
+
+    return w.overflow ? -1 : (int)(len + w.len);
 }
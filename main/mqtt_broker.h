@@ -23,6 +23,36 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+typedef struct
+{
+    uint8_t clients;
+    uint32_t subscriptions;         // filters that passed the ACL check, see mqtt_broker.c
+    uint32_t msgs_in;               // publishes received from clients
+    uint32_t msgs_out;              // deliveries to subscribers
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint32_t local_msgs;            // in-process publishes
+    uint32_t local_busy;            // in-process publishes retried because the queue was full
+    uint32_t fanout_rate;           // deliveries per second over the last 10 s
+    uint32_t dropped;               // deliveries refused by the memory budget
+    uint32_t dropped_retained;      // retained publishes refused by the retained cap
+    uint32_t refused_clients;       // connections refused by max_clients or the heap reserve
+    uint32_t retained;              // retained topics published by clients
+    uint32_t free_heap;
+    uint32_t min_free_heap;
+} mqtt_broker_stats_t;
+
+// Broker memory budget, 0 disables a limit
+typedef struct
+{
+    uint32_t max_clients;           // at most 16
+    uint32_t max_queued_msgs;       // per client, deliveries not yet written to its socket
+    uint32_t max_queued_bytes;      // per client
+    uint32_t max_retained;          // retained topics from clients, at most 128
+    uint32_t heap_reserve;          // below this free heap, deliveries and new clients are refused
+} mqtt_broker_limits_t;
 
 /**
  * @brief Initialize and start the MQTT broker
@@ -34,8 +64,31 @@ int mqtt_broker_init(uint16_t port);
 
 /**
  * @brief Stop the MQTT broker
+ *
+ * Closes all client connections and frees the broker's memory. Retained
+ * messages and subscriptions are lost.
+ *
+ * If the broker does not stop in time, it keeps being reported as running
+ * until its task exits, and a new one can't be started before that.
+ *
+ * @return 0 on success or if not running, -1 if the broker did not stop in time
+ */
+int mqtt_broker_stop(void);
+
+/**
+ * @brief Stop the MQTT broker and start it again
+ *
+ * @param port The port number to listen on
+ * @return 0 on success, -1 on failure
  */
-void mqtt_broker_stop(void);
+int mqtt_broker_restart(uint16_t port);
+
+/**
+ * @brief Get the port the broker listens on
+ *
+ * @return Port number
+ */
+uint16_t mqtt_broker_get_port(void);
 
 /**
  * @brief Check if the MQTT broker is running
@@ -51,4 +104,138 @@ bool mqtt_broker_is_running(void);
  */
 uint8_t mqtt_broker_get_client_count(void);
 
+/**
+ * @brief Get the subscription generation
+ *
+ * @return A counter that changes whenever a client subscribes, unsubscribes or disconnects
+ */
+uint32_t mqtt_broker_sub_generation(void);
+
+/**
+ * @brief Check if any client subscribed to a topic
+ *
+ * Matches the topic against every filter, callers should cache the result
+ * until mqtt_broker_sub_generation() changes.
+ *
+ * @param topic Topic name
+ * @return true if at least one subscription matches, or while a filter that
+ *         didn't fit the registry is subscribed
+ */
+bool mqtt_broker_has_subscribers(const char *topic);
+
+/**
+ * @brief Match a topic name against an MQTT topic filter
+ *
+ * @param filter Topic filter, may contain + and # wildcards or a $share/<group>/ prefix
+ * @param topic Topic name
+ * @return true if the filter matches
+ */
+bool mqtt_broker_topic_matches(const char *filter, const char *topic);
+
+/**
+ * @brief Get the broker traffic counters
+ *
+ * @param stats Filled with the current counters
+ */
+void mqtt_broker_get_stats(mqtt_broker_stats_t *stats);
+
+/**
+ * @brief Format the broker counters and the per-client list as JSON
+ *
+ * @param buf Output buffer
+ * @param size Buffer size
+ * @return Length written, -1 if the buffer is too small
+ */
+int mqtt_broker_get_stats_json(char *buf, size_t size);
+
+#define MQTT_BROKER_BUSY    -2
+
+/**
+ * @brief Callback for messages published to the broker by its clients
+ */
+typedef void (*mqtt_broker_message_cb_t)(const char *topic, const char *data, int len);
+
+// Broker state change callback: running is true once the broker accepts
+// clients and local publishes, false when it has stopped
+typedef void (*mqtt_broker_state_cb_t)(bool running);
+
+// Called for every subscription a client makes, before Mosquitto adds it
+typedef void (*mqtt_broker_subscribe_cb_t)(const char *client_id, const char *filter);
+
+// Called on every broker loop pass
+typedef void (*mqtt_broker_tick_cb_t)(void);
+
+/**
+ * @brief Publish a message straight into the broker's routing, without a client connection
+ *
+ * @param topic Topic to publish on
+ * @param data Payload, copied by the broker
+ * @param len Payload length
+ * @param qos QoS for the subscribers
+ * @param retain Retain flag
+ * The message is copied into a queue that the broker task drains once per
+ * loop pass, so this is safe from any task.
+ *
+ * @return 0 when queued, MQTT_BROKER_BUSY if the queue is full and the call should be retried, -1 on failure
+ */
+int mqtt_broker_publish(const char *topic, const char *data, int len, int qos, bool retain);
+
+/**
+ * @brief Publish a message to one client only, like mqtt_broker_publish()
+ *
+ * Delivered with QoS 0 and not retained, whether or not the client is
+ * subscribed to the topic.
+ *
+ * @param client_id Client to deliver to
+ * @param topic Topic to publish on
+ * @param data Payload, copied by the broker
+ * @param len Payload length
+ *
+ * @return 0 when queued, MQTT_BROKER_BUSY if the queue is full and the call should be retried, -1 on failure
+ */
+int mqtt_broker_publish_to(const char *client_id, const char *topic, const char *data, int len);
+
+/**
+ * @brief Set the broker memory budget
+ *
+ * @param limits Limits, applied to new deliveries and connections
+ */
+void mqtt_broker_set_limits(const mqtt_broker_limits_t *limits);
+
+/**
+ * @brief Set the callback for messages published by the broker's clients
+ *
+ * @param cb Callback, runs in the broker task. Must be set before mqtt_broker_init()
+ */
+void mqtt_broker_set_message_cb(mqtt_broker_message_cb_t cb);
+
+/**
+ * @brief Set the callback for broker start and stop
+ *
+ * @param cb Callback, runs in the esp_timer task on start and in the broker
+ *           task on stop. Must be set before mqtt_broker_init()
+ */
+void mqtt_broker_set_state_cb(mqtt_broker_state_cb_t cb);
+
+/**
+ * @brief Set the callback for new client subscriptions
+ *
+ * Messages published from the callback are delivered after the
+ * subscription is in place.
+ *
+ * @param cb Callback, runs in the broker task. Must be set before mqtt_broker_init()
+ */
+void mqtt_broker_set_subscribe_cb(mqtt_broker_subscribe_cb_t cb);
+
+/**
+ * @brief Set the callback for broker loop passes
+ *
+ * Lets work that depends on the subscription set, such as caching
+ * mqtt_broker_has_subscribers() results, run in the broker task instead
+ * of on the publishers' paths. The callback must not block.
+ *
+ * @param cb Callback, runs in the broker task. Must be set before mqtt_broker_init()
+ */
+void mqtt_broker_set_tick_cb(mqtt_broker_tick_cb_t cb);
+
 #endif /* __MQTT_BROKER_H__ */
@@ -0,0 +1,334 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "wc_json.h"
+#include "mqtt.h"
+#include "mqtt_lvc.h"
+
+#define TAG                     __func__
+
+// Last value cache: the latest decoded value of every signal, kept whether
+// or not it was published. A topic's cached values are served as one
+// snapshot message: to a new local subscriber right away, and retained at
+// most once per interval instead of retaining every live publish.
+#define LVC_MAX_ENTRIES         128     // power of two, open addressing
+#define LVC_NAME_ARENA          2048
+#define LVC_SNAPSHOT_SIZE       1024
+// The retain timer runs in the esp_timer task, which must not wait long
+#define LVC_TIMER_WAIT_MS       10
+
+typedef struct
+{
+    double value;
+    int16_t topic_id;           // -1 when free
+    uint16_t name;              // offset in lvc_names
+    uint16_t tag;               // upper hash bits, checked before the name
+    uint8_t format;
+    uint8_t reserved;
+} lvc_entry_t;
+
+static lvc_entry_t lvc_entries[LVC_MAX_ENTRIES];
+static char lvc_names[LVC_NAME_ARENA];
+static uint16_t lvc_names_used = 0;
+static uint16_t lvc_count = 0;
+static bool lvc_full_logged = false;
+
+// Topics with cached values, and those changed since their last retained snapshot
+static uint32_t lvc_known[(MQTT_MAX_TOPICS + 31) / 32];
+static uint32_t lvc_dirty[(MQTT_MAX_TOPICS + 31) / 32];
+
+static SemaphoreHandle_t lvc_mutex = NULL;
+static esp_timer_handle_t lvc_timer = NULL;
+static char lvc_buf[LVC_SNAPSHOT_SIZE];
+static uint32_t lvc_retained_writes = 0;
+
+static uint32_t mqtt_lvc_hash(int16_t topic_id, const char *name)
+{
+    uint32_t h = 2166136261UL ^ (uint16_t)topic_id;
+
+    while(*name != '\0')
+    {
+        h = (h ^ (uint8_t)*name++) * 16777619UL;
+    }
+    return h;
+}
+
+// Caller holds lvc_mutex
+static lvc_entry_t *mqtt_lvc_find(int16_t topic_id, const char *name, bool add)
+{
+    uint32_t h = mqtt_lvc_hash(topic_id, name);
+    uint16_t tag = h >> 16;
+
+    for(uint16_t n = 0; n < LVC_MAX_ENTRIES; n++)
+    {
+        lvc_entry_t *entry = &lvc_entries[(h + n) & (LVC_MAX_ENTRIES - 1)];
+
+        if(entry->topic_id < 0)
+        {
+            size_t len = strlen(name) + 1;
+
+            if(!add)
+            {
+                return NULL;
+            }
+            if(lvc_count >= LVC_MAX_ENTRIES - 1 || lvc_names_used + len > LVC_NAME_ARENA)
+            {
+                if(!lvc_full_logged)
+                {
+                    ESP_LOGW(TAG, "Last value cache full, %u signals cached", lvc_count);
+                    lvc_full_logged = true;
+                }
+                return NULL;
+            }
+            memcpy(&lvc_names[lvc_names_used], name, len);
+            entry->name = lvc_names_used;
+            entry->tag = tag;
+            entry->topic_id = topic_id;
+            entry->value = NAN;         // never equal, the first update marks the topic
+            lvc_names_used += len;
+            lvc_count++;
+            return entry;
+        }
+
+        if(entry->tag == tag && entry->topic_id == topic_id && strcmp(&lvc_names[entry->name], name) == 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void mqtt_lvc_update(int16_t topic_id, const char *name, double value, uint8_t format)
+{
+    lvc_entry_t *entry;
+
+    if(lvc_mutex == NULL || topic_id < 0 || topic_id >= MQTT_MAX_TOPICS || name == NULL ||
+        !isfinite(value) || value == FLT_MAX)
+    {
+        return;
+    }
+
+    xSemaphoreTake(lvc_mutex, portMAX_DELAY);
+    entry = mqtt_lvc_find(topic_id, name, true);
+    if(entry != NULL && (entry->value != value || entry->format != format))
+    {
+        entry->value = value;
+        entry->format = format;
+        lvc_known[topic_id / 32] |= (1UL << (topic_id % 32));
+        lvc_dirty[topic_id / 32] |= (1UL << (topic_id % 32));
+    }
+    xSemaphoreGive(lvc_mutex);
+}
+
+// Two decimals without trailing zeros, like the autopid payloads
+static void mqtt_lvc_number(wc_json_t *w, double value)
+{
+    char num[32];
+    int len = snprintf(num, sizeof(num), "%.2f", value);
+
+    while(len > 0 && num[len - 1] == '0')
+    {
+        len--;
+    }
+    if(len > 0 && num[len - 1] == '.')
+    {
+        len--;
+    }
+    wc_json_raw(w, num, len);
+}
+
+// Caller holds lvc_mutex. Returns the snapshot length, 0 if nothing is cached
+// for the topic. Entries that don't fit are left out.
+static int mqtt_lvc_build(int16_t topic_id, char *buf, size_t size)
+{
+    wc_json_t w;
+    bool empty = true;
+
+    wc_json_init(&w, buf, size - 1);
+    for(uint16_t i = 0; i < LVC_MAX_ENTRIES; i++)
+    {
+        const lvc_entry_t *entry = &lvc_entries[i];
+        size_t mark = w.len;
+
+        if(entry->topic_id != topic_id)
+        {
+            continue;
+        }
+
+        if(entry->format == MQTT_LVC_PLAIN)
+        {
+            wc_json_reset(&w);
+            mqtt_lvc_number(&w, entry->value);
+            return w.len;
+        }
+
+        wc_json_str(&w, empty ? "{\"" : ", \"");
+        wc_json_str(&w, &lvc_names[entry->name]);
+        wc_json_str(&w, "\": ");
+        if(entry->format == MQTT_LVC_BINARY)
+        {
+            wc_json_str(&w, (entry->value > 0) ? "\"on\"" : "\"off\"");
+        }
+        else
+        {
+            mqtt_lvc_number(&w, entry->value);
+        }
+
+        if(w.overflow)
+        {
+            w.len = mark;
+            w.buf[mark] = 0;
+            w.overflow = false;
+            break;
+        }
+        empty = false;
+    }
+
+    if(empty)
+    {
+        return 0;
+    }
+    w.size++;
+    wc_json_char(&w, '}');
+    return w.len;
+}
+
+int mqtt_lvc_snapshot(int16_t topic_id, char *buf, size_t size)
+{
+    int len;
+
+    if(lvc_mutex == NULL || size < 2)
+    {
+        return 0;
+    }
+    xSemaphoreTake(lvc_mutex, portMAX_DELAY);
+    len = mqtt_lvc_build(topic_id, buf, size);
+    xSemaphoreGive(lvc_mutex);
+    return len;
+}
+
+// Caller holds lvc_mutex. Returns 0 when published or nothing is cached,
+// -1 when the publish was dropped
+static int mqtt_lvc_retain(int16_t topic_id)
+{
+    int ret = 0;
+    int len = mqtt_lvc_build(topic_id, lvc_buf, sizeof(lvc_buf));
+
+    if(len > 0)
+    {
+        ret = mqtt_publish_id(topic_id, lvc_buf, len, 0, 1);
+        if(ret == 0)
+        {
+            lvc_retained_writes++;
+        }
+    }
+    return ret;
+}
+
+void mqtt_lvc_mark_all(void)
+{
+    if(lvc_mutex == NULL)
+    {
+        return;
+    }
+    xSemaphoreTake(lvc_mutex, portMAX_DELAY);
+    memcpy(lvc_dirty, lvc_known, sizeof(lvc_dirty));
+    xSemaphoreGive(lvc_mutex);
+}
+
+// Rewrites the retained snapshot of topics that changed. A dropped publish,
+// or a cache held by another task for too long, is retried on the next interval.
+static void mqtt_lvc_timer_cb(void *arg)
+{
+    for(int16_t t = 0; t < MQTT_MAX_TOPICS; t++)
+    {
+        uint32_t bit = 1UL << (t % 32);
+        int ret;
+
+        if(!(lvc_dirty[t / 32] & bit))
+        {
+            continue;
+        }
+        if(xSemaphoreTake(lvc_mutex, pdMS_TO_TICKS(LVC_TIMER_WAIT_MS)) != pdTRUE)
+        {
+            break;
+        }
+        ret = mqtt_lvc_retain(t);
+        if(ret == 0)
+        {
+            lvc_dirty[t / 32] &= ~bit;
+        }
+        xSemaphoreGive(lvc_mutex);
+        if(ret != 0)
+        {
+            break;
+        }
+    }
+}
+
+void mqtt_lvc_get_stats(uint32_t *entries, uint32_t *retained_writes)
+{
+    *entries = lvc_count;
+    *retained_writes = lvc_retained_writes;
+}
+
+esp_err_t mqtt_lvc_init(uint32_t retain_interval_s)
+{
+    if(lvc_mutex != NULL)
+    {
+        return ESP_OK;
+    }
+
+    for(uint16_t i = 0; i < LVC_MAX_ENTRIES; i++)
+    {
+        lvc_entries[i].topic_id = -1;
+    }
+
+    lvc_mutex = xSemaphoreCreateMutex();
+    if(lvc_mutex == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if(retain_interval_s != 0)
+    {
+        const esp_timer_create_args_t timer_args = {
+            .callback = mqtt_lvc_timer_cb,
+            .name = "mqtt_lvc",
+        };
+        if(esp_timer_create(&timer_args, &lvc_timer) != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+        esp_timer_start_periodic(lvc_timer, (uint64_t)retain_interval_s * 1000000);
+    }
+    ESP_LOGI(TAG, "Last value cache, retained snapshots every %lu s", retain_interval_s);
+
+    return ESP_OK;
+}
@@ -0,0 +1,42 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef __MQTT_LVC_H__
+#define __MQTT_LVC_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// How a cached value is written in a topic snapshot
+#define MQTT_LVC_NUMBER         0   // {"name": 12.5}
+#define MQTT_LVC_BINARY         1   // {"name": "on"}
+#define MQTT_LVC_PLAIN          2   // 12.50, the topic carries a single value
+
+esp_err_t mqtt_lvc_init(uint32_t retain_interval_s);
+void mqtt_lvc_update(int16_t topic_id, const char *name, double value, uint8_t format);
+int mqtt_lvc_snapshot(int16_t topic_id, char *buf, size_t size);
+void mqtt_lvc_mark_all(void);
+void mqtt_lvc_get_stats(uint32_t *entries, uint32_t *retained_writes);
+
+#endif
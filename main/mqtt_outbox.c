@@ -0,0 +1,388 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "hw_config.h"
+#include "mqtt_outbox.h"
+
+#define TAG                     __func__
+
+// The RAM ring is written out as one append-only segment when it fills up
+#define OUTBOX_RAM_RECORDS      128
+#define OUTBOX_SEG_BYTES        (OUTBOX_RAM_RECORDS * sizeof(mqtt_outbox_rec_t))
+#define OUTBOX_SEG_FMT          FS_MOUNT_POINT"/obs%05lu.bin"
+#define OUTBOX_SEG_SCAN         "obs%lu.bin"
+// Segments written before the record carried a boot and a topic hash
+#define OUTBOX_OLD_SEG_FMT      FS_MOUNT_POINT"/obx%05lu.bin"
+#define OUTBOX_OLD_SEG_SCAN     "obx%lu.bin"
+#define OUTBOX_BOOT_FILE        FS_MOUNT_POINT"/outbox.boot"
+
+static mqtt_outbox_rec_t *ram_ring = NULL;
+static uint32_t ram_head = 0;
+static uint32_t ram_count = 0;
+
+// Segments [seg_first, seg_next) are on flash, seg_offset records of the
+// first one have already been replayed
+static uint32_t seg_first = 0;
+static uint32_t seg_next = 0;
+static uint32_t seg_offset = 0;
+static uint32_t seg_first_records = 0;
+static uint32_t seg_pending = 0;
+static uint32_t seg_max = 0;
+
+static bool peek_from_seg = false;
+// Cleared when the peeked records are moved or dropped before being consumed
+static bool peek_valid = false;
+static uint32_t dropped = 0;
+static uint16_t boot_count = 0;
+
+static void outbox_seg_path(char *path, uint32_t seq)
+{
+    sprintf(path, OUTBOX_SEG_FMT, seq);
+}
+
+static uint32_t outbox_seg_records(uint32_t seq)
+{
+    char path[32];
+    struct stat st;
+
+    outbox_seg_path(path, seq);
+    if(stat(path, &st) != 0)
+    {
+        return 0;
+    }
+    return st.st_size / sizeof(mqtt_outbox_rec_t);
+}
+
+static void outbox_drop_first_segment(void)
+{
+    char path[32];
+    uint32_t remaining = outbox_seg_records(seg_first);
+
+    remaining = (remaining > seg_offset) ? (remaining - seg_offset) : 0;
+    outbox_seg_path(path, seg_first);
+    unlink(path);
+
+    seg_pending = (seg_pending > remaining) ? (seg_pending - remaining) : 0;
+    seg_first++;
+    seg_offset = 0;
+    seg_first_records = 0;
+    peek_from_seg = false;
+    peek_valid = false;
+}
+
+static void outbox_spill(void)
+{
+    char path[32];
+    FILE *f;
+    size_t written = 0;
+
+    if(seg_next - seg_first >= seg_max)
+    {
+        // Flash budget used up, the oldest data goes first
+        uint32_t remaining = outbox_seg_records(seg_first);
+        dropped += (remaining > seg_offset) ? (remaining - seg_offset) : 0;
+        outbox_drop_first_segment();
+    }
+
+    outbox_seg_path(path, seg_next);
+    f = fopen(path, "wb");
+    if(f != NULL)
+    {
+        // Oldest record first, the ring may wrap
+        uint32_t first = OUTBOX_RAM_RECORDS - ram_head;
+
+        if(first > ram_count)
+        {
+            first = ram_count;
+        }
+        written = fwrite(&ram_ring[ram_head], sizeof(mqtt_outbox_rec_t), first, f);
+        if(written == first && ram_count > first)
+        {
+            written += fwrite(&ram_ring[0], sizeof(mqtt_outbox_rec_t), ram_count - first, f);
+        }
+        fclose(f);
+    }
+
+    if(written == ram_count)
+    {
+        seg_next++;
+        seg_pending += ram_count;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Failed to write %s, dropping %lu records", path, ram_count);
+        unlink(path);
+        dropped += ram_count;
+    }
+
+    ram_head = 0;
+    ram_count = 0;
+    peek_valid = false;
+}
+
+// Counts boots in a small file next to the segments, so records left over
+// from a previous boot can be told apart from the current ones
+static void outbox_next_boot(void)
+{
+    FILE *f = fopen(OUTBOX_BOOT_FILE, "rb");
+
+    if(f != NULL)
+    {
+        if(fread(&boot_count, sizeof(boot_count), 1, f) != 1)
+        {
+            boot_count = 0;
+        }
+        fclose(f);
+    }
+    boot_count++;
+
+    f = fopen(OUTBOX_BOOT_FILE, "wb");
+    if(f == NULL || fwrite(&boot_count, sizeof(boot_count), 1, f) != 1)
+    {
+        ESP_LOGE(TAG, "Failed to write %s", OUTBOX_BOOT_FILE);
+    }
+    if(f != NULL)
+    {
+        fclose(f);
+    }
+}
+
+esp_err_t mqtt_outbox_init(uint32_t max_bytes)
+{
+    DIR *dir;
+    struct dirent *entry;
+    bool found = false;
+    uint32_t old_first = 0;
+    uint32_t old_next = 0;
+
+    if(ram_ring != NULL)
+    {
+        return ESP_OK;
+    }
+
+    ram_ring = (mqtt_outbox_rec_t *)malloc(OUTBOX_RAM_RECORDS * sizeof(mqtt_outbox_rec_t));
+    if(ram_ring == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate outbox");
+        return ESP_ERR_NO_MEM;
+    }
+
+    seg_max = max_bytes / OUTBOX_SEG_BYTES;
+    outbox_next_boot();
+
+    // Pick up segments left over from before a reboot
+    dir = opendir(FS_MOUNT_POINT);
+    if(dir != NULL)
+    {
+        while((entry = readdir(dir)) != NULL)
+        {
+            unsigned long seq;
+
+            if(sscanf(entry->d_name, OUTBOX_OLD_SEG_SCAN, &seq) == 1)
+            {
+                // Old record layout, can't be replayed
+                old_first = (old_next == 0 || seq < old_first) ? seq : old_first;
+                old_next = (seq >= old_next) ? (seq + 1) : old_next;
+                continue;
+            }
+
+            if(sscanf(entry->d_name, OUTBOX_SEG_SCAN, &seq) != 1)
+            {
+                continue;
+            }
+
+            if(!found || seq < seg_first)
+            {
+                seg_first = seq;
+            }
+            if(!found || seq >= seg_next)
+            {
+                seg_next = seq + 1;
+            }
+            found = true;
+        }
+        closedir(dir);
+    }
+
+    for(uint32_t seq = old_first; seq < old_next; seq++)
+    {
+        char path[32];
+
+        sprintf(path, OUTBOX_OLD_SEG_FMT, seq);
+        unlink(path);
+    }
+
+    for(uint32_t seq = seg_first; seq < seg_next; seq++)
+    {
+        seg_pending += outbox_seg_records(seq);
+    }
+
+    ESP_LOGI(TAG, "Outbox ready, boot %u, %lu segments max, %lu records pending", boot_count, seg_max, seg_pending);
+    return ESP_OK;
+}
+
+bool mqtt_outbox_enabled(void)
+{
+    return (ram_ring != NULL);
+}
+
+void mqtt_outbox_push(const mqtt_outbox_rec_t *rec)
+{
+    if(ram_ring == NULL)
+    {
+        return;
+    }
+
+    if(ram_count == OUTBOX_RAM_RECORDS)
+    {
+        if(seg_max != 0)
+        {
+            outbox_spill();
+        }
+        else
+        {
+            // RAM only, overwrite the oldest record
+            ram_head = (ram_head + 1) % OUTBOX_RAM_RECORDS;
+            ram_count--;
+            dropped++;
+            peek_valid = false;
+        }
+    }
+
+    ram_ring[(ram_head + ram_count) % OUTBOX_RAM_RECORDS] = *rec;
+    ram_count++;
+}
+
+uint32_t mqtt_outbox_pending(void)
+{
+    return seg_pending + ram_count;
+}
+
+uint32_t mqtt_outbox_dropped(void)
+{
+    return dropped;
+}
+
+uint16_t mqtt_outbox_boot(void)
+{
+    return boot_count;
+}
+
+// FNV-1a
+uint32_t mqtt_outbox_topic_hash(const char *topic)
+{
+    uint32_t hash = 2166136261UL;
+
+    while(*topic != 0)
+    {
+        hash ^= (uint8_t)*topic++;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+// Copies up to max of the oldest records, they stay in the outbox until
+// mqtt_outbox_consume is called. Records may be pushed in between.
+int mqtt_outbox_peek(mqtt_outbox_rec_t *recs, int max)
+{
+    if(ram_ring == NULL || max <= 0)
+    {
+        return 0;
+    }
+
+    while(seg_first != seg_next)
+    {
+        char path[32];
+        FILE *f;
+        int n = 0;
+
+        seg_first_records = outbox_seg_records(seg_first);
+        if(seg_offset < seg_first_records)
+        {
+            outbox_seg_path(path, seg_first);
+            f = fopen(path, "rb");
+            if(f != NULL)
+            {
+                if(fseek(f, seg_offset * sizeof(mqtt_outbox_rec_t), SEEK_SET) == 0)
+                {
+                    uint32_t left = seg_first_records - seg_offset;
+                    n = fread(recs, sizeof(mqtt_outbox_rec_t), ((uint32_t)max < left) ? (uint32_t)max : left, f);
+                }
+                fclose(f);
+            }
+        }
+
+        if(n > 0)
+        {
+            peek_from_seg = true;
+            peek_valid = true;
+            return n;
+        }
+
+        // Empty or unreadable segment
+        outbox_drop_first_segment();
+    }
+
+    peek_from_seg = false;
+    peek_valid = true;
+    for(int i = 0; i < max && (uint32_t)i < ram_count; i++)
+    {
+        recs[i] = ram_ring[(ram_head + i) % OUTBOX_RAM_RECORDS];
+    }
+    return ((uint32_t)max < ram_count) ? max : (int)ram_count;
+}
+
+// Removes count records of the last peek. Does nothing when they were moved
+// to flash or dropped since, they are then peeked and replayed again.
+void mqtt_outbox_consume(int count)
+{
+    if(ram_ring == NULL || count <= 0 || !peek_valid)
+    {
+        return;
+    }
+    peek_valid = false;
+
+    if(peek_from_seg)
+    {
+        seg_offset += count;
+        seg_pending = (seg_pending > (uint32_t)count) ? (seg_pending - count) : 0;
+        if(seg_offset >= seg_first_records)
+        {
+            outbox_drop_first_segment();
+        }
+        peek_from_seg = false;
+        return;
+    }
+
+    if((uint32_t)count > ram_count)
+    {
+        count = ram_count;
+    }
+    ram_head = (ram_head + count) % OUTBOX_RAM_RECORDS;
+    ram_count -= count;
+}
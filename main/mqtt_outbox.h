@@ -0,0 +1,72 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __MQTT_OUTBOX_H__
+#define __MQTT_OUTBOX_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define MQTT_OUTBOX_SIGNAL          0
+#define MQTT_OUTBOX_FRAME           1
+
+#define MQTT_OUTBOX_FLAG_EXTD       0x01
+#define MQTT_OUTBOX_FLAG_RTR        0x02
+
+// Fixed size record, written as is to the spill segments. Segments can
+// outlive a reboot or a filter change, so the topic is kept as a hash of
+// its name and the timestamp comes with the boot it is relative to.
+typedef struct
+{
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t boot;              // mqtt_outbox_boot() when recorded
+    uint32_t topic;             // mqtt_outbox_topic_hash() of the topic
+    uint32_t timestamp;         // ms since boot when recorded
+    union
+    {
+        struct
+        {
+            char name[32];
+            double value;
+        } signal;
+        struct
+        {
+            uint32_t id;
+            uint8_t flags;
+            uint8_t dlc;
+            uint8_t data[8];
+        } frame;
+    };
+} mqtt_outbox_rec_t;
+
+esp_err_t mqtt_outbox_init(uint32_t max_bytes);
+bool mqtt_outbox_enabled(void);
+void mqtt_outbox_push(const mqtt_outbox_rec_t *rec);
+uint32_t mqtt_outbox_pending(void);
+int mqtt_outbox_peek(mqtt_outbox_rec_t *recs, int max);
+void mqtt_outbox_consume(int count);
+uint32_t mqtt_outbox_dropped(void);
+uint16_t mqtt_outbox_boot(void);
+uint32_t mqtt_outbox_topic_hash(const char *topic);
+
+#endif
@@ -0,0 +1,384 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "mqtt_rawfwd.h"
+
+#define TAG                     __func__
+
+#define RAWFWD_MAX_RULES        32
+#define RAWFWD_TABLE_SIZE       256         // power of two
+#define RAWFWD_EMPTY            0xFFFFFFFFU
+#define RAWFWD_NO_RULE          0xFF
+#define RAWFWD_KEY_EXTD         (1UL << 31)
+#define RAWFWD_FLUSH_MAX        8           // held frames released per flush call
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t mask;
+    int8_t extd;                // -1 any, 0 standard, 1 extended
+    bool allow;
+    bool on_change;
+    uint32_t interval_ms;
+} rawfwd_rule_t;
+
+// Per CAN ID state. The CAN RX task checks frames, the MQTT task releases
+// held frames, both under rawfwd_lock.
+typedef struct
+{
+    uint32_t key;               // identifier | RAWFWD_KEY_EXTD
+    uint32_t last_ms;
+    uint8_t rule;
+    uint8_t dlc;
+    bool sent;
+    bool held;                  // a rate capped frame waits for its interval
+    uint8_t data[8];            // last forwarded
+    uint8_t held_dlc;
+    bool held_rtr;
+    uint32_t held_ms;           // when the held frame was received
+    uint8_t held_data[8];
+} rawfwd_entry_t;
+
+static rawfwd_rule_t rules[RAWFWD_MAX_RULES];
+static uint8_t rule_count = 0;
+static bool default_allow = true;
+static rawfwd_entry_t *table = NULL;
+static uint32_t table_used = 0;
+static volatile bool active = false;
+static mqtt_rawfwd_stats_t stats;
+static portMUX_TYPE rawfwd_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t held_count = 0;
+
+static inline uint32_t rawfwd_hash(uint32_t key)
+{
+    key ^= key >> 16;
+    key *= 0x45d9f3bU;
+    key ^= key >> 16;
+    return key & (RAWFWD_TABLE_SIZE - 1);
+}
+
+static uint8_t rawfwd_match(uint32_t id, bool extd)
+{
+    for(uint8_t i = 0; i < rule_count; i++)
+    {
+        if((rules[i].extd == -1 || rules[i].extd == extd) && ((id ^ rules[i].id) & rules[i].mask) == 0)
+        {
+            return i;
+        }
+    }
+    return RAWFWD_NO_RULE;
+}
+
+static rawfwd_entry_t *rawfwd_lookup(uint32_t key, bool extd)
+{
+    uint32_t slot = rawfwd_hash(key);
+
+    for(uint32_t n = 0; n < RAWFWD_TABLE_SIZE; n++)
+    {
+        rawfwd_entry_t *e = &table[slot];
+
+        if(e->key == key)
+        {
+            return e;
+        }
+        if(e->key == RAWFWD_EMPTY)
+        {
+            // Keep a quarter of the slots free so probes stay short
+            if(table_used >= RAWFWD_TABLE_SIZE * 3 / 4)
+            {
+                return NULL;
+            }
+            e->key = key;
+            e->rule = rawfwd_match(key & ~RAWFWD_KEY_EXTD, extd);
+            e->sent = false;
+            e->held = false;
+            table_used++;
+            return e;
+        }
+        slot = (slot + 1) & (RAWFWD_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+static uint32_t rawfwd_number(const cJSON *item, const char *key, uint32_t def)
+{
+    const cJSON *v = cJSON_GetObjectItem(item, key);
+
+    if(cJSON_IsNumber(v) && v->valuedouble >= 0)
+    {
+        return (uint32_t)v->valuedouble;
+    }
+    if(cJSON_IsString(v) && v->valuestring != NULL)
+    {
+        return strtoul(v->valuestring, NULL, 0);
+    }
+    return def;
+}
+
+void mqtt_rawfwd_load(const cJSON *cfg)
+{
+    const cJSON *default_item, *rule_ary, *item;
+
+    active = false;
+    rule_count = 0;
+    default_allow = true;
+
+    if(!cJSON_IsObject(cfg))
+    {
+        return;
+    }
+
+    rule_ary = cJSON_GetObjectItem(cfg, "rules");
+    cJSON_ArrayForEach(item, rule_ary)
+    {
+        rawfwd_rule_t *r = &rules[rule_count];
+        const cJSON *action = cJSON_GetObjectItem(item, "action");
+        const cJSON *extd = cJSON_GetObjectItem(item, "extd");
+        uint32_t rate_hz;
+
+        if(rule_count >= RAWFWD_MAX_RULES)
+        {
+            ESP_LOGW(TAG, "Only %d raw forwarding rules are supported", RAWFWD_MAX_RULES);
+            break;
+        }
+
+        r->id = rawfwd_number(item, "id", 0);
+        r->mask = rawfwd_number(item, "mask", TWAI_EXTD_ID_MASK);
+        r->extd = cJSON_IsBool(extd) ? cJSON_IsTrue(extd) : -1;
+        r->allow = !(cJSON_IsString(action) && strcmp(action->valuestring, "deny") == 0);
+        r->on_change = cJSON_IsTrue(cJSON_GetObjectItem(item, "on_change"));
+        rate_hz = rawfwd_number(item, "rate_hz", 0);
+        r->interval_ms = (rate_hz > 0) ? (1000 / rate_hz) : 0;
+        rule_count++;
+
+        ESP_LOGI(TAG, "Rule %u: id=0x%lx mask=0x%lx %s, %lu ms%s", rule_count, r->id, r->mask,
+                    r->allow ? "allow" : "deny", r->interval_ms, r->on_change ? ", on change" : "");
+    }
+
+    // With allow rules and no explicit default, everything else is denied
+    default_item = cJSON_GetObjectItem(cfg, "default");
+    if(cJSON_IsString(default_item))
+    {
+        default_allow = (strcmp(default_item->valuestring, "deny") != 0);
+    }
+    else
+    {
+        for(uint8_t i = 0; i < rule_count; i++)
+        {
+            if(rules[i].allow)
+            {
+                default_allow = false;
+                break;
+            }
+        }
+    }
+
+    if(table == NULL)
+    {
+        table = (rawfwd_entry_t *)malloc(RAWFWD_TABLE_SIZE * sizeof(rawfwd_entry_t));
+        if(table == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to allocate the ID table");
+            return;
+        }
+    }
+    memset(table, 0xFF, RAWFWD_TABLE_SIZE * sizeof(rawfwd_entry_t));
+    table_used = 0;
+    held_count = 0;
+    memset(&stats, 0, sizeof(stats));
+    active = true;
+}
+
+static bool rawfwd_check(const twai_message_t *frame, uint32_t now_ms)
+{
+    rawfwd_entry_t *e;
+    const rawfwd_rule_t *r;
+    uint8_t dlc = (frame->data_length_code > 8) ? 8 : frame->data_length_code;
+    uint8_t rule;
+
+    e = rawfwd_lookup(frame->identifier | (frame->extd ? RAWFWD_KEY_EXTD : 0), frame->extd);
+    if(e == NULL)
+    {
+        stats.table_full++;
+        rule = rawfwd_match(frame->identifier, frame->extd);
+    }
+    else
+    {
+        rule = e->rule;
+    }
+
+    if(rule == RAWFWD_NO_RULE)
+    {
+        if(!default_allow)
+        {
+            stats.denied++;
+            return false;
+        }
+        stats.passed++;
+        return true;
+    }
+
+    r = &rules[rule];
+    if(!r->allow)
+    {
+        stats.denied++;
+        return false;
+    }
+
+    if(e != NULL && e->sent)
+    {
+        bool unchanged = r->on_change && e->dlc == dlc && memcmp(e->data, frame->data, dlc) == 0;
+
+        // Decimation keeps the latest frame of each interval. It goes out
+        // with the next frame after the interval or from mqtt_rawfwd_flush.
+        if(r->interval_ms != 0 && (now_ms - e->last_ms) < r->interval_ms)
+        {
+            if(e->held && unchanged)
+            {
+                held_count--;
+            }
+            else if(!e->held && !unchanged)
+            {
+                held_count++;
+            }
+            e->held = !unchanged;
+            e->held_dlc = dlc;
+            e->held_rtr = frame->rtr;
+            e->held_ms = now_ms;
+            memcpy(e->held_data, frame->data, sizeof(e->held_data));
+            stats.rate_limited++;
+            return false;
+        }
+        if(unchanged)
+        {
+            stats.unchanged++;
+            return false;
+        }
+    }
+
+    if(e != NULL)
+    {
+        if(e->held)
+        {
+            // Superseded by this frame
+            e->held = false;
+            held_count--;
+        }
+        e->sent = true;
+        e->last_ms = now_ms;
+        e->dlc = dlc;
+        memcpy(e->data, frame->data, sizeof(e->data));
+    }
+    stats.passed++;
+    return true;
+}
+
+// Returns true when the frame should be forwarded on can/rx
+bool mqtt_rawfwd_check(const twai_message_t *frame, uint32_t now_ms)
+{
+    bool ret;
+
+    if(!active)
+    {
+        return true;
+    }
+
+    portENTER_CRITICAL(&rawfwd_lock);
+    ret = rawfwd_check(frame, now_ms);
+    portEXIT_CRITICAL(&rawfwd_lock);
+    return ret;
+}
+
+// Hands held frames whose interval has passed to release. Returns the ms
+// until the next held frame is due, 0 when more are due right away and
+// UINT32_MAX when nothing is held.
+uint32_t mqtt_rawfwd_flush(uint32_t now_ms, mqtt_rawfwd_release_t release, void *arg)
+{
+    twai_message_t frames[RAWFWD_FLUSH_MAX];
+    uint32_t times[RAWFWD_FLUSH_MAX];
+    uint32_t next = UINT32_MAX;
+    uint8_t count = 0;
+
+    if(!active || held_count == 0)
+    {
+        return UINT32_MAX;
+    }
+
+    portENTER_CRITICAL(&rawfwd_lock);
+    for(uint32_t i = 0; i < RAWFWD_TABLE_SIZE && held_count != 0; i++)
+    {
+        rawfwd_entry_t *e = &table[i];
+        uint32_t elapsed, interval;
+
+        if(e->key == RAWFWD_EMPTY || !e->held)
+        {
+            continue;
+        }
+
+        interval = rules[e->rule].interval_ms;
+        elapsed = now_ms - e->last_ms;
+        if(elapsed < interval)
+        {
+            next = ((interval - elapsed) < next) ? (interval - elapsed) : next;
+            continue;
+        }
+        if(count == RAWFWD_FLUSH_MAX)
+        {
+            next = 0;
+            break;
+        }
+
+        memset(&frames[count], 0, sizeof(frames[count]));
+        frames[count].identifier = e->key & ~RAWFWD_KEY_EXTD;
+        frames[count].extd = (e->key & RAWFWD_KEY_EXTD) ? 1 : 0;
+        frames[count].rtr = e->held_rtr;
+        frames[count].data_length_code = e->held_dlc;
+        memcpy(frames[count].data, e->held_data, sizeof(frames[count].data));
+        times[count] = e->held_ms;
+        count++;
+
+        e->held = false;
+        held_count--;
+        e->last_ms = now_ms;
+        e->dlc = e->held_dlc;
+        memcpy(e->data, e->held_data, sizeof(e->data));
+        stats.passed++;
+    }
+    portEXIT_CRITICAL(&rawfwd_lock);
+
+    for(uint8_t i = 0; i < count; i++)
+    {
+        release(&frames[i], times[i], arg);
+    }
+    return next;
+}
+
+void mqtt_rawfwd_get_stats(mqtt_rawfwd_stats_t *out)
+{
+    portENTER_CRITICAL(&rawfwd_lock);
+    *out = stats;
+    portEXIT_CRITICAL(&rawfwd_lock);
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef __MQTT_RAWFWD_H__
+#define __MQTT_RAWFWD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/twai.h"
+#include "cJSON.h"
+
+// Raw can/rx forwarding policy, the "raw_fwd" object of mqtt_canfilt.json:
+// {"default": "deny", "rules": [{"id": 2024, "mask": 2047, "action": "allow",
+//   "rate_hz": 5, "on_change": true}]}
+// The first matching rule wins. Rules are resolved once per CAN ID and
+// cached, so the RX path costs one hash lookup per frame. With rate_hz the
+// latest frame of each interval is held back and released at its end.
+typedef struct
+{
+    uint32_t passed;
+    uint32_t denied;
+    uint32_t rate_limited;
+    uint32_t unchanged;
+    uint32_t table_full;
+} mqtt_rawfwd_stats_t;
+
+typedef void (*mqtt_rawfwd_release_t)(const twai_message_t *frame, uint32_t timestamp, void *arg);
+
+void mqtt_rawfwd_load(const cJSON *cfg);
+bool mqtt_rawfwd_check(const twai_message_t *frame, uint32_t now_ms);
+uint32_t mqtt_rawfwd_flush(uint32_t now_ms, mqtt_rawfwd_release_t release, void *arg);
+void mqtt_rawfwd_get_stats(mqtt_rawfwd_stats_t *stats);
+
+#endif
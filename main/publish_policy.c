@@ -0,0 +1,127 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "publish_policy.h"
+
+// Config files carry numbers either as JSON numbers or as strings
+static double policy_number(const cJSON *item, const char *key)
+{
+    const cJSON *v = cJSON_GetObjectItem(item, key);
+
+    if(cJSON_IsNumber(v))
+    {
+        return v->valuedouble;
+    }
+    if(cJSON_IsString(v) && v->valuestring != NULL)
+    {
+        return atof(v->valuestring);
+    }
+    return 0;
+}
+
+static bool policy_flag(const cJSON *item, const char *key)
+{
+    const cJSON *v = cJSON_GetObjectItem(item, key);
+
+    if(cJSON_IsBool(v))
+    {
+        return cJSON_IsTrue(v);
+    }
+    if(cJSON_IsNumber(v))
+    {
+        return v->valuedouble != 0;
+    }
+    if(cJSON_IsString(v) && v->valuestring != NULL)
+    {
+        return (strcmp(v->valuestring, "true") == 0 || strcmp(v->valuestring, "enable") == 0);
+    }
+    return false;
+}
+
+void publish_policy_parse(publish_policy_t *policy, const cJSON *item)
+{
+    double v;
+
+    memset(policy, 0, sizeof(*policy));
+    policy->on_change = policy_flag(item, "on_change");
+    policy->deadband = fabs(policy_number(item, "deadband"));
+    policy->deadband_pct = fabs(policy_number(item, "deadband_pct"));
+    v = policy_number(item, "min_interval");
+    policy->min_interval = (v > 0) ? (uint32_t)v : 0;
+    v = policy_number(item, "heartbeat");
+    policy->heartbeat = (v > 0) ? (uint32_t)v : 0;
+}
+
+static bool policy_changed(const publish_policy_t *policy, double last, double value)
+{
+    double threshold = policy->deadband;
+    double delta;
+
+    if(isnan(last) || isnan(value))
+    {
+        return isnan(last) != isnan(value);
+    }
+
+    delta = fabs(value - last);
+    if(policy->deadband_pct > 0 && fabs(last) * policy->deadband_pct / 100.0 > threshold)
+    {
+        threshold = fabs(last) * policy->deadband_pct / 100.0;
+    }
+    return (threshold > 0) ? (delta > threshold) : (delta != 0);
+}
+
+// Returns true when value should be published now. The first value is
+// always published. Call publish_policy_commit once it was actually queued,
+// a value that never went out must not hold back the next one.
+bool publish_policy_check(const publish_policy_t *policy, const publish_state_t *state, double value, int64_t now)
+{
+    bool filtered = policy->on_change || policy->deadband > 0 || policy->deadband_pct > 0;
+
+    if(state->valid)
+    {
+        int64_t elapsed = now - state->time;
+
+        if(elapsed < (int64_t)policy->min_interval * 1000)
+        {
+            return false;
+        }
+
+        if(filtered && !policy_changed(policy, state->value, value) &&
+            (policy->heartbeat == 0 || elapsed < (int64_t)policy->heartbeat * 1000))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Records value as the last published one
+void publish_policy_commit(publish_state_t *state, double value, int64_t now)
+{
+    state->value = value;
+    state->time = now;
+    state->valid = true;
+}
@@ -0,0 +1,56 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef __PUBLISH_POLICY_H__
+#define __PUBLISH_POLICY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cJSON.h"
+
+// Per signal publish policy, read from the signal's JSON entry:
+//   "on_change"     publish only when the value differs from the last published one
+//   "deadband"      publish only when it moved by more than this
+//   "deadband_pct"  same, in percent of the last published value
+//   "min_interval"  ms, never publish more often than this
+//   "heartbeat"     ms, republish an unchanged value after this long
+typedef struct
+{
+    bool on_change;
+    float deadband;
+    float deadband_pct;
+    uint32_t min_interval;
+    uint32_t heartbeat;
+} publish_policy_t;
+
+typedef struct
+{
+    double value;
+    int64_t time;               // esp_timer us of the last publish
+    bool valid;
+} publish_state_t;
+
+void publish_policy_parse(publish_policy_t *policy, const cJSON *item);
+bool publish_policy_check(const publish_policy_t *policy, const publish_state_t *state, double value, int64_t now);
+void publish_policy_commit(publish_state_t *state, double value, int64_t now);
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "wc_json.h"
+
+void wc_json_init(wc_json_t *w, char *buf, size_t size)
+{
+    w->buf = buf;
+    w->size = size;
+    wc_json_reset(w);
+}
+
+void wc_json_reset(wc_json_t *w)
+{
+    w->len = 0;
+    w->overflow = false;
+    if(w->size != 0)
+    {
+        w->buf[0] = 0;
+    }
+}
+
+void wc_json_raw(wc_json_t *w, const char *str, size_t len)
+{
+    if(w->overflow || len > wc_json_space(w))
+    {
+        w->overflow = true;
+        return;
+    }
+    memcpy(&w->buf[w->len], str, len);
+    w->len += len;
+    w->buf[w->len] = 0;
+}
+
+// Appends a literal, the caller is responsible for quoting and escaping
+void wc_json_str(wc_json_t *w, const char *str)
+{
+    wc_json_raw(w, str, strlen(str));
+}
+
+// Appends str as a quoted JSON string, escaping quotes, backslashes and
+// control characters. For strings from outside, e.g. MQTT client ids.
+void wc_json_quoted(wc_json_t *w, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    wc_json_char(w, '"');
+    for(; *str != 0 && !w->overflow; str++)
+    {
+        uint8_t c = (uint8_t)*str;
+
+        if(c == '"' || c == '\\')
+        {
+            char esc[2] = {'\\', (char)c};
+            wc_json_raw(w, esc, 2);
+        }
+        else if(c < 0x20)
+        {
+            char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0x0F]};
+            wc_json_raw(w, esc, 6);
+        }
+        else
+        {
+            wc_json_char(w, (char)c);
+        }
+    }
+    wc_json_char(w, '"');
+}
+
+void wc_json_char(wc_json_t *w, char c)
+{
+    if(w->overflow || wc_json_space(w) == 0)
+    {
+        w->overflow = true;
+        return;
+    }
+    w->buf[w->len++] = c;
+    w->buf[w->len] = 0;
+}
+
+void wc_json_uint(wc_json_t *w, uint32_t value)
+{
+    char tmp[10];
+    uint8_t n = 0;
+
+    // Digits come out in reverse order
+    do
+    {
+        tmp[n++] = '0' + (value % 10);
+        value /= 10;
+    } while(value != 0);
+
+    if(w->overflow || n > wc_json_space(w))
+    {
+        w->overflow = true;
+        return;
+    }
+
+    while(n != 0)
+    {
+        w->buf[w->len++] = tmp[--n];
+    }
+    w->buf[w->len] = 0;
+}
+
+void wc_json_bool(wc_json_t *w, bool value)
+{
+    if(value)
+    {
+        wc_json_raw(w, "true", 4);
+    }
+    else
+    {
+        wc_json_raw(w, "false", 5);
+    }
+}
+
+// Drops a trailing separator, e.g. the ',' after the last array element
+void wc_json_unterminate(wc_json_t *w, char c)
+{
+    if(w->len != 0 && w->buf[w->len - 1] == c)
+    {
+        w->buf[--w->len] = 0;
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __WC_JSON_H__
+#define __WC_JSON_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Append-only JSON writer over a caller supplied buffer. Every call appends
+// at the cursor, the buffer is always NUL terminated and a write that does
+// not fit sets the overflow flag instead of truncating mid-token.
+typedef struct
+{
+    char *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+} wc_json_t;
+
+void wc_json_init(wc_json_t *w, char *buf, size_t size);
+void wc_json_reset(wc_json_t *w);
+void wc_json_raw(wc_json_t *w, const char *str, size_t len);
+void wc_json_str(wc_json_t *w, const char *str);
+void wc_json_quoted(wc_json_t *w, const char *str);
+void wc_json_char(wc_json_t *w, char c);
+void wc_json_uint(wc_json_t *w, uint32_t value);
+void wc_json_bool(wc_json_t *w, bool value);
+void wc_json_unterminate(wc_json_t *w, char c);
+
+static inline size_t wc_json_space(const wc_json_t *w)
+{
+    return w->size - w->len - 1;
+}
+
+#endif
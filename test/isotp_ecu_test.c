@@ -0,0 +1,438 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Runs isotp.c as the tester against scripted ECUs on a simulated bus.
+// An ECU is a second ISO-TP engine that answers every complete request
+// with the response from its script. Frames take FRAME_US on the bus and
+// all timers run off a virtual clock. Faulty ECUs are played by putting
+// raw frames on the bus.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "isotp.h"
+
+#define FRAME_US        250     // one 8 byte frame at 500 kbit/s
+#define BUS_MAX_FRAMES  1024
+#define MAX_NODES       4
+
+static int failures = 0;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+typedef struct
+{
+    uint32_t id;
+    bool extd;
+    uint8_t data[8];
+    int64_t at_us;
+} bus_frame_t;
+
+typedef struct node
+{
+    isotp_t isotp;
+    isotp_link_t *link;
+    uint8_t rx_buf[ISOTP_MAX_LEN];
+    // Received messages and the last error
+    int rx_done;
+    isotp_status_t rx_error;
+    // ECU script: the response to any complete request, none if rsp_len is 0
+    const uint8_t *rsp;
+    uint16_t rsp_len;
+} node_t;
+
+// Every frame sent, for checking flow control and timing
+static bus_frame_t bus_log[BUS_MAX_FRAMES];
+static int bus_count = 0;
+static int bus_next = 0;
+static int64_t bus_free_us = 0;
+static int64_t now_us = 0;
+
+static node_t *nodes[MAX_NODES];
+static int node_count = 0;
+
+static void bus_put(uint32_t id, bool extd, const uint8_t *data)
+{
+    bus_frame_t *f;
+
+    if (bus_count == BUS_MAX_FRAMES)
+    {
+        fprintf(stderr, "bus log full\n");
+        exit(1);
+    }
+    f = &bus_log[bus_count++];
+    f->id = id;
+    f->extd = extd;
+    memcpy(f->data, data, 8);
+    bus_free_us = ((bus_free_us > now_us) ? bus_free_us : now_us) + FRAME_US;
+    f->at_us = bus_free_us;
+}
+
+static int bus_send(uint32_t id, bool extd, const uint8_t *data, uint8_t len, void *ctx)
+{
+    (void)ctx;
+    CHECK(len == 8);
+    bus_put(id, extd, data);
+    return 0;
+}
+
+static void bus_reset(void)
+{
+    bus_count = 0;
+    bus_next = 0;
+    bus_free_us = now_us;
+    node_count = 0;
+}
+
+static node_t *node_add(uint32_t tx_id, uint32_t rx_id, bool extd)
+{
+    node_t *node = calloc(1, sizeof(node_t));
+
+    isotp_init(&node->isotp, bus_send, node);
+    node->link = isotp_open(&node->isotp, tx_id, rx_id, extd, node->rx_buf, sizeof(node->rx_buf));
+    nodes[node_count++] = node;
+    return node;
+}
+
+static void node_deliver(node_t *node, const bus_frame_t *f)
+{
+    isotp_link_t *link = isotp_find(&node->isotp, f->id, f->extd);
+    isotp_status_t status;
+
+    if (link == NULL)
+    {
+        return;
+    }
+    status = isotp_on_frame(&node->isotp, link, f->data, 8, now_us);
+    if (status == ISOTP_DONE && (f->data[0] >> 4) != 3)
+    {
+        node->rx_done++;
+        // Answered on the physical link, also a functional request
+        if (node->rsp_len != 0)
+        {
+            CHECK(isotp_send(&node->isotp, node->link, node->rsp, node->rsp_len, now_us) != ISOTP_ERR_SEND);
+        }
+    }
+    else if (status != ISOTP_OK && status != ISOTP_DONE && status != ISOTP_IGNORED)
+    {
+        node->rx_error = status;
+    }
+}
+
+// Delivers frames and runs the timers of every node until until_us
+static void bus_run(int64_t until_us)
+{
+    while (1)
+    {
+        int64_t next_us = ISOTP_NO_DEADLINE;
+
+        for (int n = 0; n < node_count; n++)
+        {
+            int64_t due_us = isotp_poll(&nodes[n]->isotp, now_us);
+
+            if (due_us < next_us)
+            {
+                next_us = due_us;
+            }
+        }
+        if (bus_next < bus_count && bus_log[bus_next].at_us < next_us)
+        {
+            next_us = bus_log[bus_next].at_us;
+        }
+        if (next_us > until_us)
+        {
+            now_us = until_us;
+            return;
+        }
+        if (next_us > now_us)
+        {
+            now_us = next_us;
+        }
+        while (bus_next < bus_count && bus_log[bus_next].at_us <= now_us)
+        {
+            const bus_frame_t *f = &bus_log[bus_next++];
+
+            for (int n = 0; n < node_count; n++)
+            {
+                node_deliver(nodes[n], f);
+            }
+        }
+    }
+}
+
+static void bus_cleanup(void)
+{
+    for (int n = 0; n < node_count; n++)
+    {
+        free(nodes[n]);
+    }
+    bus_reset();
+}
+
+static int count_frames(uint32_t id, uint8_t pci)
+{
+    int count = 0;
+
+    for (int i = 0; i < bus_count; i++)
+    {
+        if (bus_log[i].id == id && (bus_log[i].data[0] >> 4) == pci)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+static void fill(uint8_t *buf, uint16_t len, uint8_t seed)
+{
+    for (uint16_t i = 0; i < len; i++)
+    {
+        buf[i] = seed + i * 7;
+    }
+}
+
+static const uint8_t read_vin[] = {0x22, 0xF1, 0x90};
+
+// BMS cell voltages: 62 bytes in 8 consecutive frames, with block size 2
+// the tester sends a flow control after the first frame and every 2nd CF
+static void test_long_read(void)
+{
+    uint8_t cells[62];
+    node_t *tester = node_add(0x7E0, 0x7E8, false);
+    node_t *ecu = node_add(0x7E8, 0x7E0, false);
+
+    fill(cells, sizeof(cells), 0x62);
+    ecu->rsp = cells;
+    ecu->rsp_len = sizeof(cells);
+    tester->isotp.fc_bs = 2;
+
+    CHECK(isotp_send(&tester->isotp, tester->link, read_vin, sizeof(read_vin), now_us) == ISOTP_DONE);
+    bus_run(now_us + 100000);
+
+    CHECK(ecu->rx_done == 1);
+    CHECK(tester->rx_done == 1);
+    CHECK(tester->link->rx_len == sizeof(cells));
+    CHECK(memcmp(tester->rx_buf, cells, sizeof(cells)) == 0);
+    CHECK(count_frames(0x7E8, 2) == 8);
+    CHECK(count_frames(0x7E0, 3) == 4);
+    CHECK(!isotp_busy(&tester->isotp));
+    bus_cleanup();
+}
+
+// A 30 byte write to an ECU that wants blocks of 2 frames, 5 ms apart,
+// and asks the tester to wait once
+static void test_long_write(void)
+{
+    static const uint8_t ack[] = {0x6E, 0xF1, 0x90};
+    uint8_t req[30];
+    node_t *tester = node_add(0x7E0, 0x7E8, false);
+    node_t *ecu = node_add(0x7E8, 0x7E0, false);
+    int64_t last_cf_us = -1;
+    int cfs = 0;
+
+    fill(req, sizeof(req), 0x2E);
+    ecu->rsp = ack;
+    ecu->rsp_len = sizeof(ack);
+    ecu->isotp.fc_bs = 2;
+    ecu->isotp.fc_stmin = 5;
+
+    CHECK(isotp_send(&tester->isotp, tester->link, req, sizeof(req), now_us) == ISOTP_OK);
+    CHECK(isotp_send(&tester->isotp, tester->link, req, sizeof(req), now_us) == ISOTP_ERR_BUSY);
+    bus_run(now_us + 200000);
+
+    CHECK(tester->link->tx_status == ISOTP_DONE);
+    CHECK(ecu->rx_done == 1);
+    CHECK(memcmp(ecu->rx_buf, req, sizeof(req)) == 0);
+    CHECK(tester->rx_done == 1);
+    CHECK(memcmp(tester->rx_buf, ack, sizeof(ack)) == 0);
+    CHECK(count_frames(0x7E8, 3) == 2);
+
+    // STmin between the CFs of a block
+    for (int i = 0; i < bus_count; i++)
+    {
+        if (bus_log[i].id == 0x7E0 && (bus_log[i].data[0] >> 4) == 2)
+        {
+            if (cfs % 2 == 1)
+            {
+                CHECK(bus_log[i].at_us - last_cf_us >= 5000);
+            }
+            last_cf_us = bus_log[i].at_us;
+            cfs++;
+        }
+    }
+    CHECK(cfs == 4);
+    bus_cleanup();
+
+    // WAIT, then clear to send with no limits
+    static const uint8_t fc_wait[8] = {0x31, 0, 0, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA};
+    static const uint8_t fc_cts[8] = {0x30, 0, 0, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA};
+
+    tester = node_add(0x7E0, 0x7E8, false);
+    CHECK(isotp_send(&tester->isotp, tester->link, req, sizeof(req), now_us) == ISOTP_OK);
+    bus_put(0x7E8, false, fc_wait);
+    bus_run(now_us + 500000);
+    CHECK(tester->link->tx_state == ISOTP_TX_WAIT_FC);
+    bus_put(0x7E8, false, fc_cts);
+    bus_run(now_us + 10000);
+    CHECK(tester->link->tx_status == ISOTP_DONE);
+    CHECK(count_frames(0x7E0, 2) == 4);
+    bus_cleanup();
+}
+
+// Faulty ECUs: a CF out of sequence, one that stops sending, one that
+// never answers the first frame, and a response too long for the buffer
+static void test_faults(void)
+{
+    static const uint8_t ff[8] = {0x10, 20, 0x62, 0xF1, 0x90, 'W', 'V', 'W'};
+    static const uint8_t cf_bad[8] = {0x22, 'Z', 'Z', 'Z', '1', 'K', 'Z', 'A'};
+    static const uint8_t cf_1[8] = {0x21, 'Z', 'Z', 'Z', '1', 'K', 'Z', 'A'};
+    uint8_t req[20];
+    node_t *tester = node_add(0x7E0, 0x7E8, false);
+
+    bus_put(0x7E8, false, ff);
+    bus_put(0x7E8, false, cf_bad);
+    bus_put(0x7E8, false, cf_1);
+    bus_run(now_us + 10000);
+    CHECK(tester->rx_error == ISOTP_ERR_SEQ);
+    CHECK(tester->rx_done == 0);
+    CHECK(tester->link->rx_state == ISOTP_IDLE);
+
+    // N_Cr, 1 s by default
+    tester->rx_error = ISOTP_OK;
+    bus_put(0x7E8, false, ff);
+    bus_put(0x7E8, false, cf_1);
+    bus_run(now_us + 900000);
+    CHECK(tester->link->rx_state == ISOTP_RX_RECEIVING);
+    bus_run(now_us + 200000);
+    CHECK(tester->link->rx_status == ISOTP_ERR_TIMEOUT_CR);
+
+    // N_Bs, also 1 s
+    fill(req, sizeof(req), 0);
+    CHECK(isotp_send(&tester->isotp, tester->link, req, sizeof(req), now_us) == ISOTP_OK);
+    bus_run(now_us + 1100000);
+    CHECK(tester->link->tx_status == ISOTP_ERR_TIMEOUT_BS);
+    bus_cleanup();
+
+    // The tester refuses a response longer than its buffer with an
+    // overflow flow control, and the ECU gives up
+    uint8_t small[16];
+    uint8_t vin[20];
+    node_t *ecu = node_add(0x7E8, 0x7E0, false);
+
+    tester = node_add(0x7E0, 0x7E8, false);
+    tester->link = isotp_open(&tester->isotp, 0x7E0, 0x7E8, false, small, sizeof(small));
+    fill(vin, sizeof(vin), 0x57);
+    CHECK(isotp_send(&ecu->isotp, ecu->link, vin, sizeof(vin), now_us) == ISOTP_OK);
+    bus_run(now_us + 10000);
+    CHECK(tester->rx_error == ISOTP_ERR_OVERFLOW);
+    CHECK(ecu->link->tx_status == ISOTP_ERR_OVERFLOW);
+    CHECK(count_frames(0x7E8, 2) == 0);
+    bus_cleanup();
+}
+
+// A functional request on 29 bit IDs answered by two ECUs at once. Their
+// frames interleave on the bus, each ECU has its own link on the tester
+// and gets its flow control on its physical ID.
+static void test_concurrent_29bit(void)
+{
+    uint8_t rsp_a[40];
+    uint8_t rsp_b[27];
+    node_t *tester = node_add(0x18DB33F1, 0, true);
+    isotp_link_t *link_a = isotp_open(&tester->isotp, 0x18DA10F1, 0x18DAF110, true, tester->rx_buf, 2048);
+    isotp_link_t *link_b = isotp_open(&tester->isotp, 0x18DA18F1, 0x18DAF118, true, tester->rx_buf + 2048, 2047);
+    node_t *ecu_a = node_add(0x18DAF110, 0x18DA10F1, true);
+    node_t *ecu_b = node_add(0x18DAF118, 0x18DA18F1, true);
+
+    // The ECUs also listen on the functional ID
+    isotp_open(&ecu_a->isotp, 0x18DAF110, 0x18DB33F1, true, ecu_a->rx_buf, sizeof(ecu_a->rx_buf));
+    isotp_open(&ecu_b->isotp, 0x18DAF118, 0x18DB33F1, true, ecu_b->rx_buf, sizeof(ecu_b->rx_buf));
+    fill(rsp_a, sizeof(rsp_a), 0xA0);
+    fill(rsp_b, sizeof(rsp_b), 0xB0);
+    ecu_a->rsp = rsp_a;
+    ecu_a->rsp_len = sizeof(rsp_a);
+    ecu_b->rsp = rsp_b;
+    ecu_b->rsp_len = sizeof(rsp_b);
+
+    CHECK(link_a != link_b);
+    CHECK(isotp_find(&tester->isotp, 0x18DAF118, true) == link_b);
+    CHECK(isotp_find(&tester->isotp, 0x18DAF118, false) == NULL);
+
+    CHECK(isotp_send(&tester->isotp, tester->link, read_vin, sizeof(read_vin), now_us) == ISOTP_DONE);
+    bus_run(now_us + 100000);
+
+    CHECK(ecu_a->rx_done == 1 && ecu_b->rx_done == 1);
+    CHECK(tester->rx_done == 2);
+    CHECK(link_a->rx_len == sizeof(rsp_a));
+    CHECK(memcmp(tester->rx_buf, rsp_a, sizeof(rsp_a)) == 0);
+    CHECK(link_b->rx_len == sizeof(rsp_b));
+    CHECK(memcmp(tester->rx_buf + 2048, rsp_b, sizeof(rsp_b)) == 0);
+    CHECK(count_frames(0x18DA10F1, 3) == 1);
+    CHECK(count_frames(0x18DA18F1, 3) == 1);
+    CHECK(!isotp_busy(&tester->isotp));
+    bus_cleanup();
+}
+
+// The longest message without the escaped length, with no block limit
+static void test_max_len(void)
+{
+    static uint8_t big[ISOTP_MAX_LEN];
+    node_t *tester = node_add(0x7E0, 0x7E8, false);
+    node_t *ecu = node_add(0x7E8, 0x7E0, false);
+
+    fill(big, sizeof(big), 0x01);
+    ecu->rsp = big;
+    ecu->rsp_len = sizeof(big);
+
+    CHECK(isotp_send(&tester->isotp, tester->link, read_vin, sizeof(read_vin), now_us) == ISOTP_DONE);
+    bus_run(now_us + 2000000);
+
+    CHECK(tester->rx_done == 1);
+    CHECK(tester->link->rx_len == sizeof(big));
+    CHECK(memcmp(tester->rx_buf, big, sizeof(big)) == 0);
+    CHECK(count_frames(0x7E8, 2) == (ISOTP_MAX_LEN - 6 + 6) / 7);
+    CHECK(count_frames(0x7E0, 3) == 1);
+    bus_cleanup();
+}
+
+int main(void)
+{
+    test_long_read();
+    test_long_write();
+    test_faults();
+    test_concurrent_29bit();
+    test_max_len();
+
+    if (failures != 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("isotp ecu ok\n");
+    return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Runs mqtt_bridge.c against a local Linux mosquitto as the upstream broker
+// and reads the batches back with mosquitto_sub. Checks the batch topic,
+// the filters, and that batches queued while the upstream is down arrive
+// after it comes back. Skipped (exit 77) if mosquitto is not installed.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "config_server.h"
+#include "mosq_broker.h"
+#include "mosquitto_broker.h"
+#include "mqtt_bridge.h"
+#include "wifi_network.h"
+
+#define TEST_SKIP               77
+#define DEVICE_ID               "dev1"
+// Not a format string, %n and %d must come through unchanged
+#define BRIDGE_TOPIC            "fleet/%s/%n%d"
+#define BRIDGE_TOPIC_EXPANDED   "fleet/" DEVICE_ID "/%n%d"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+static int upstream_port;
+static pid_t upstream_pid = -1;
+
+// Configuration read by mqtt_bridge_init()
+static char cfg_url[] = "mqtt://127.0.0.1";
+static char cfg_empty[] = "";
+static char cfg_topics[] = "wican/+/can/rx, wican/+/autopid/#";
+static char cfg_topic[] = BRIDGE_TOPIC;
+
+char *config_server_get_mqtt_bridge_url(void) { return cfg_url; }
+int32_t config_server_get_mqtt_bridge_port(void) { return upstream_port; }
+char *config_server_get_mqtt_bridge_user(void) { return cfg_empty; }
+char *config_server_get_mqtt_bridge_pass(void) { return cfg_empty; }
+char *config_server_get_mqtt_bridge_topics(void) { return cfg_topics; }
+char *config_server_get_mqtt_bridge_topic(void) { return cfg_topic; }
+uint32_t config_server_get_mqtt_bridge_interval(void) { return 500; }
+uint32_t config_server_get_mqtt_bridge_queue_kb(void) { return 16; }
+
+bool wifi_network_is_connected(void)
+{
+    return true;
+}
+
+// mqtt_broker.c is linked for its topic matching only
+int mosq_broker_run(struct mosq_broker_config *config) { return 1; }
+void mosq_broker_stop(void) {}
+void __real_plugin__handle_tick(void) {}
+int mosquitto_broker_publish_copy(const char *clientid, const char *topic, int payloadlen,
+                                    const void *payload, int qos, bool retain, mosquitto_property *properties) { return 0; }
+const char *mosquitto_client_id(const struct mosquitto *client) { return ""; }
+int __real_mosquitto_acl_check(struct mosquitto *context, const char *topic, uint32_t payloadlen, void *payload, uint8_t qos, bool retain, int access) { return 0; }
+void __real_context__disconnect(struct mosquitto *context) {}
+int __real_mosquitto_unpwd_check(struct mosquitto *context) { return 0; }
+ssize_t __real_net__write(struct mosquitto *mosq, const void *buf, size_t count) { return count; }
+
+static bool upstream_reachable(void)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(upstream_port)};
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    bool ok;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ok = (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    close(sock);
+    return ok;
+}
+
+static bool upstream_start(void)
+{
+    char port[8];
+
+    snprintf(port, sizeof(port), "%d", upstream_port);
+    upstream_pid = fork();
+    if (upstream_pid == 0)
+    {
+        freopen("/dev/null", "w", stdout);
+        freopen("/dev/null", "w", stderr);
+        execlp("mosquitto", "mosquitto", "-p", port, (char *)NULL);
+        _exit(127);
+    }
+    for (int i = 0; i < 50; i++)
+    {
+        if (upstream_reachable())
+        {
+            return true;
+        }
+        usleep(100 * 1000);
+    }
+    return false;
+}
+
+static void upstream_stop(void)
+{
+    if (upstream_pid > 0)
+    {
+        kill(upstream_pid, SIGTERM);
+        waitpid(upstream_pid, NULL, 0);
+        upstream_pid = -1;
+    }
+}
+
+// Subscribes to the batch topic, reads one message with read_batch()
+static FILE *subscribe(void)
+{
+    char cmd[256];
+    FILE *sub;
+
+    snprintf(cmd, sizeof(cmd), "mosquitto_sub -h 127.0.0.1 -p %d -t '%s' -C 1 -W 30", upstream_port, BRIDGE_TOPIC_EXPANDED);
+    sub = popen(cmd, "r");
+    // Give it time to subscribe before anything is published
+    usleep(500 * 1000);
+    return sub;
+}
+
+static bool read_batch(FILE *sub, char *buf, size_t size)
+{
+    bool ok;
+
+    buf[0] = 0;
+    ok = (fgets(buf, size, sub) != NULL);
+
+    pclose(sub);
+    return ok;
+}
+
+static bool wait_connected(bool connected, int timeout_ms)
+{
+    mqtt_bridge_stats_t stats;
+
+    for (int i = 0; i < timeout_ms / 50; i++)
+    {
+        mqtt_bridge_get_stats(&stats);
+        if (stats.connected == connected)
+        {
+            return true;
+        }
+        usleep(50 * 1000);
+    }
+    return false;
+}
+
+static void offer(int16_t topic_id, const char *topic, const char *data)
+{
+    mqtt_bridge_offer(topic_id, topic, data, strlen(data));
+}
+
+int main(void)
+{
+    mqtt_bridge_stats_t stats;
+    char batch[1024];
+    FILE *sub;
+
+    if (system("command -v mosquitto >/dev/null && command -v mosquitto_sub >/dev/null") != 0)
+    {
+        printf("mosquitto or mosquitto_sub not found, skipped\n");
+        return TEST_SKIP;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    upstream_port = 20000 + getpid() % 20000;
+    if (!upstream_start())
+    {
+        fprintf(stderr, "mosquitto did not start on port %d\n", upstream_port);
+        upstream_stop();
+        return 1;
+    }
+
+    CHECK(mqtt_bridge_init(DEVICE_ID) == ESP_OK);
+    CHECK(mqtt_bridge_enabled());
+    CHECK(wait_connected(true, 3000));
+
+    // Only matching topics are bridged, the latest payload per topic, others
+    // than JSON base64 encoded
+    sub = subscribe();
+    offer(0, "wican/" DEVICE_ID "/can/rx", "{\"a\": 0}");
+    offer(0, "wican/" DEVICE_ID "/can/rx", "{\"a\": 1}");
+    offer(1, "wican/" DEVICE_ID "/can/status", "{\"status\": \"online\"}");
+    offer(2, "wican/" DEVICE_ID "/autopid/rpm", "not json");
+    CHECK(read_batch(sub, batch, sizeof(batch)));
+    CHECK(strstr(batch, "\"can/rx\": {\"a\": 1}") != NULL);
+    CHECK(strstr(batch, "{\"a\": 0}") == NULL);
+    CHECK(strstr(batch, "can/status") == NULL);
+    CHECK(strstr(batch, "\"autopid/rpm\": {\"b64\": \"bm90IGpzb24=\"}") != NULL);
+    mqtt_bridge_get_stats(&stats);
+    CHECK(stats.skipped == 0);
+    CHECK(stats.sent >= 1);
+
+    // Batches built while the upstream is down wait in the queue
+    upstream_stop();
+    CHECK(wait_connected(false, 3000));
+    offer(0, "wican/" DEVICE_ID "/can/rx", "{\"a\": 2}");
+    usleep(1500 * 1000);
+    mqtt_bridge_get_stats(&stats);
+    CHECK(stats.queued >= 1);
+
+    // and go out once it is back, the client retries every 10 s
+    CHECK(upstream_start());
+    sub = subscribe();
+    CHECK(read_batch(sub, batch, sizeof(batch)));
+    CHECK(strstr(batch, "\"can/rx\": {\"a\": 2}") != NULL);
+    mqtt_bridge_get_stats(&stats);
+    CHECK(stats.connected);
+    CHECK(stats.queued == 0);
+
+    upstream_stop();
+
+    if (failures != 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("mqtt_bridge upstream ok\n");
+    return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Starts, restarts and stops mqtt_broker.c against a Mosquitto stand-in
+// whose mosq_broker_run() loops until mosq_broker_stop(), like the port.
+// Also covers local publishing through the plugin tick and a broker that
+// does not stop in time.
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "esp_timer.h"
+#include "mosq_broker.h"
+#include "mosquitto_broker.h"
+#include "mqtt_broker.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+// Mosquitto stand-in. The real loop polls its sockets every 100 ms and
+// calls the plugin tick on every pass.
+static volatile bool mosq_stop_requested = false;
+static volatile bool mosq_ignore_stop = false;
+static volatile int mosq_port = -1;
+static volatile int mosq_runs = 0;
+static volatile int mosq_published = 0;
+static char mosq_last_topic[64];
+
+void __wrap_plugin__handle_tick(void);
+
+int mosq_broker_run(struct mosq_broker_config *config)
+{
+    if (mosq_port != -1)
+    {
+        return 1;       // port still in use
+    }
+    mosq_port = config->port;
+    mosq_runs++;
+    mosq_stop_requested = false;
+    while (!mosq_stop_requested || mosq_ignore_stop)
+    {
+        __wrap_plugin__handle_tick();
+        usleep(100 * 1000);
+    }
+    mosq_port = -1;
+    return 0;
+}
+
+void mosq_broker_stop(void)
+{
+    mosq_stop_requested = true;
+}
+
+void __real_plugin__handle_tick(void)
+{
+}
+
+int mosquitto_broker_publish_copy(const char *clientid, const char *topic, int payloadlen,
+                                    const void *payload, int qos, bool retain, mosquitto_property *properties)
+{
+    strncpy(mosq_last_topic, topic, sizeof(mosq_last_topic) - 1);
+    mosq_published++;
+    return MOSQ_ERR_SUCCESS;
+}
+
+const char *mosquitto_client_id(const struct mosquitto *client)
+{
+    return "client";
+}
+
+int __real_mosquitto_acl_check(struct mosquitto *context, const char *topic, uint32_t payloadlen, void *payload, uint8_t qos, bool retain, int access)
+{
+    return MOSQ_ERR_SUCCESS;
+}
+
+void __real_context__disconnect(struct mosquitto *context)
+{
+}
+
+int __real_mosquitto_unpwd_check(struct mosquitto *context)
+{
+    return MOSQ_ERR_SUCCESS;
+}
+
+ssize_t __real_net__write(struct mosquitto *mosq, const void *buf, size_t count)
+{
+    return count;
+}
+
+static volatile int state_up = 0;
+static volatile int state_down = 0;
+
+static void state_cb(bool running)
+{
+    if (running)
+    {
+        state_up++;
+    }
+    else
+    {
+        state_down++;
+    }
+}
+
+static bool wait_for(volatile int *value, int expected, int timeout_ms)
+{
+    for (int i = 0; i < timeout_ms / 10 && *value != expected; i++)
+    {
+        usleep(10 * 1000);
+    }
+    return *value == expected;
+}
+
+int main(void)
+{
+    int64_t start;
+
+    mqtt_broker_set_state_cb(state_cb);
+
+    // Start
+    CHECK(mqtt_broker_init(1883) == 0);
+    CHECK(wait_for(&mosq_port, 1883, 1000));
+    CHECK(mqtt_broker_is_running());
+    CHECK(mqtt_broker_init(1883) == -1);
+    CHECK(wait_for(&state_up, 1, 2000));
+
+    // Local publishes reach Mosquitto from the broker task
+    CHECK(mqtt_broker_publish("wican/test", "1", 1, 0, false) == 0);
+    CHECK(wait_for(&mosq_published, 1, 1000));
+    CHECK(strcmp(mosq_last_topic, "wican/test") == 0);
+
+    // Restart on a new port, the old listener is gone before the new one opens
+    start = esp_timer_get_time();
+    CHECK(mqtt_broker_restart(1884) == 0);
+    CHECK(esp_timer_get_time() - start < 1000 * 1000);
+    CHECK(state_down == 1);
+    CHECK(wait_for(&mosq_port, 1884, 1000));
+    CHECK(mosq_runs == 2);
+    CHECK(mqtt_broker_get_port() == 1884);
+    CHECK(wait_for(&state_up, 2, 2000));
+
+    // Stop, twice
+    CHECK(mqtt_broker_stop() == 0);
+    CHECK(!mqtt_broker_is_running());
+    CHECK(mosq_port == -1);
+    CHECK(state_down == 2);
+    CHECK(mqtt_broker_stop() == 0);
+    CHECK(mqtt_broker_publish("wican/test", "1", 1, 0, false) == -1);
+
+    // A broker that doesn't stop in time is still reported as running and
+    // blocks a new start until it exits
+    CHECK(mqtt_broker_init(1883) == 0);
+    CHECK(wait_for(&mosq_port, 1883, 1000));
+    mosq_ignore_stop = true;
+    CHECK(mqtt_broker_stop() == -1);
+    CHECK(mqtt_broker_is_running());
+    CHECK(mqtt_broker_init(1883) == -1);
+    mosq_ignore_stop = false;
+    CHECK(wait_for(&mosq_port, -1, 1000));
+    CHECK(wait_for(&state_down, 3, 1000));
+    usleep(50 * 1000);
+    CHECK(!mqtt_broker_is_running());
+    CHECK(mqtt_broker_init(1883) == 0);
+    CHECK(wait_for(&mosq_port, 1883, 1000));
+    CHECK(mqtt_broker_stop() == 0);
+
+    if (failures != 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("mqtt_broker lifecycle ok\n");
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __HOST_DRIVER_TWAI_H__
+#define __HOST_DRIVER_TWAI_H__
+
+#include <stdint.h>
+
+#define TWAI_FRAME_MAX_DLC      8
+
+typedef struct
+{
+    union
+    {
+        struct
+        {
+            uint32_t extd: 1;
+            uint32_t rtr: 1;
+            uint32_t ss: 1;
+            uint32_t self: 1;
+            uint32_t dlc_non_comp: 1;
+            uint32_t reserved: 27;
+        };
+        uint32_t flags;
+    };
+    uint32_t identifier;
+    uint8_t data_length_code;
+    uint8_t data[TWAI_FRAME_MAX_DLC];
+} twai_message_t;
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __HOST_ESP_SYSTEM_H__
+#define __HOST_ESP_SYSTEM_H__
+
+#include <stdint.h>
+
+// Set by the tests
+extern uint32_t host_free_heap;
+
+static inline uint32_t esp_get_free_heap_size(void)
+{
+    return host_free_heap;
+}
+
+static inline uint32_t esp_get_minimum_free_heap_size(void)
+{
+    return host_free_heap;
+}
+
+#endif
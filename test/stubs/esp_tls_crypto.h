@@ -0,0 +1,4 @@
+#ifndef __HOST_ESP_TLS_CRYPTO_H__
+#define __HOST_ESP_TLS_CRYPTO_H__
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef __HOST_QUEUE_H__
+#define __HOST_QUEUE_H__
+
+#include "freertos/FreeRTOS.h"
+
+// Declared only, for prototypes that take a queue
+typedef struct host_queue *QueueHandle_t;
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef __HOST_RINGBUF_H__
+#define __HOST_RINGBUF_H__
+
+#include "freertos/FreeRTOS.h"
+
+// Only RINGBUF_TYPE_NOSPLIT, items are kept whole like on the target
+typedef enum
+{
+    RINGBUF_TYPE_NOSPLIT = 0,
+} RingbufferType_t;
+
+typedef struct host_ringbuf *RingbufHandle_t;
+
+RingbufHandle_t xRingbufferCreate(size_t size, RingbufferType_t type);
+BaseType_t xRingbufferSend(RingbufHandle_t rb, const void *data, size_t size, TickType_t ticks);
+BaseType_t xRingbufferSendAcquire(RingbufHandle_t rb, void **item, size_t size, TickType_t ticks);
+BaseType_t xRingbufferSendComplete(RingbufHandle_t rb, void *item);
+void *xRingbufferReceive(RingbufHandle_t rb, size_t *size, TickType_t ticks);
+void vRingbufferReturnItem(RingbufHandle_t rb, void *item);
+
+#endif
@@ -0,0 +1,460 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// pthread implementation of the FreeRTOS, ring buffer and esp_timer calls
+// declared in test/stubs, enough to run firmware tasks on a Linux host.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/ringbuf.h"
+#include "esp_timer.h"
+
+uint32_t host_free_heap = 200 * 1024;
+
+static pthread_mutex_t host_critical_lock;
+static pthread_once_t host_critical_once = PTHREAD_ONCE_INIT;
+
+static void host_critical_init(void)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&host_critical_lock, &attr);
+}
+
+void host_critical_enter(void)
+{
+    pthread_once(&host_critical_once, host_critical_init);
+    pthread_mutex_lock(&host_critical_lock);
+}
+
+void host_critical_exit(void)
+{
+    pthread_mutex_unlock(&host_critical_lock);
+}
+
+#ifndef HAVE_STRLCPY
+size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t len = strlen(src);
+
+    if (size != 0)
+    {
+        size_t n = (len < size - 1) ? len : size - 1;
+
+        memcpy(dst, src, n);
+        dst[n] = 0;
+    }
+    return len;
+}
+#endif
+
+static struct timespec host_deadline(TickType_t ticks)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ticks / 1000;
+    ts.tv_nsec += (long)(ticks % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+// Tasks
+
+typedef struct
+{
+    TaskFunction_t task;
+    void *arg;
+} host_task_t;
+
+static void *host_task_run(void *p)
+{
+    host_task_t t = *(host_task_t *)p;
+
+    free(p);
+    t.task(t.arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack, void *arg,
+                        UBaseType_t prio, TaskHandle_t *handle)
+{
+    static int task_count = 0;
+    host_task_t *t = malloc(sizeof(*t));
+    pthread_t thread;
+
+    if (t == NULL)
+    {
+        return pdFAIL;
+    }
+    t->task = task;
+    t->arg = arg;
+
+    // Set before the task runs, as a higher priority task on the target could
+    if (handle != NULL)
+    {
+        host_critical_enter();
+        *handle = (TaskHandle_t)(intptr_t)++task_count;
+        host_critical_exit();
+    }
+    if (pthread_create(&thread, NULL, host_task_run, t) != 0)
+    {
+        free(t);
+        return pdFAIL;
+    }
+    pthread_detach(thread);
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == NULL)
+    {
+        pthread_exit(NULL);
+    }
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    usleep(ticks * 1000);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(esp_timer_get_time() / 1000);
+}
+
+// Semaphores
+
+struct host_sem
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int count;
+};
+
+static SemaphoreHandle_t host_sem_create(int count)
+{
+    SemaphoreHandle_t sem = calloc(1, sizeof(*sem));
+
+    if (sem != NULL)
+    {
+        pthread_mutex_init(&sem->lock, NULL);
+        pthread_cond_init(&sem->cond, NULL);
+        sem->count = count;
+    }
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return host_sem_create(0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return host_sem_create(1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    struct timespec deadline = host_deadline(ticks);
+    BaseType_t ret = pdTRUE;
+
+    pthread_mutex_lock(&sem->lock);
+    while (sem->count == 0)
+    {
+        if (ticks == 0)
+        {
+            ret = pdFALSE;
+            break;
+        }
+        if (ticks == portMAX_DELAY)
+        {
+            pthread_cond_wait(&sem->cond, &sem->lock);
+        }
+        else if (pthread_cond_timedwait(&sem->cond, &sem->lock, &deadline) == ETIMEDOUT)
+        {
+            ret = (sem->count != 0);
+            break;
+        }
+    }
+    if (ret == pdTRUE)
+    {
+        sem->count = 0;
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return ret;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    BaseType_t ret;
+
+    pthread_mutex_lock(&sem->lock);
+    ret = (sem->count == 0);
+    sem->count = 1;
+    pthread_cond_signal(&sem->cond);
+    pthread_mutex_unlock(&sem->lock);
+    return ret;
+}
+
+// Ring buffers: a FIFO of whole items, sized like the target's
+// (8 byte header per item, data rounded up to 4 bytes)
+
+typedef struct host_item
+{
+    struct host_item *next;
+    size_t size;
+    bool complete;
+    uint8_t data[];
+} host_item_t;
+
+struct host_ringbuf
+{
+    size_t size;
+    size_t used;
+    host_item_t *head;
+    host_item_t *tail;
+};
+
+#define HOST_ITEM_COST(size)    (8 + (((size) + 3) & ~(size_t)3))
+
+RingbufHandle_t xRingbufferCreate(size_t size, RingbufferType_t type)
+{
+    RingbufHandle_t rb = calloc(1, sizeof(*rb));
+
+    (void)type;
+    if (rb != NULL)
+    {
+        rb->size = size;
+    }
+    return rb;
+}
+
+BaseType_t xRingbufferSendAcquire(RingbufHandle_t rb, void **item, size_t size, TickType_t ticks)
+{
+    host_item_t *it;
+
+    (void)ticks;
+    host_critical_enter();
+    if (rb->used + HOST_ITEM_COST(size) > rb->size || (it = malloc(sizeof(*it) + size)) == NULL)
+    {
+        host_critical_exit();
+        return pdFALSE;
+    }
+    it->next = NULL;
+    it->size = size;
+    it->complete = false;
+    rb->used += HOST_ITEM_COST(size);
+    if (rb->tail != NULL)
+    {
+        rb->tail->next = it;
+    }
+    else
+    {
+        rb->head = it;
+    }
+    rb->tail = it;
+    host_critical_exit();
+
+    *item = it->data;
+    return pdTRUE;
+}
+
+BaseType_t xRingbufferSendComplete(RingbufHandle_t rb, void *item)
+{
+    host_critical_enter();
+    ((host_item_t *)((uint8_t *)item - offsetof(host_item_t, data)))->complete = true;
+    host_critical_exit();
+    return pdTRUE;
+}
+
+BaseType_t xRingbufferSend(RingbufHandle_t rb, const void *data, size_t size, TickType_t ticks)
+{
+    void *item;
+
+    if (xRingbufferSendAcquire(rb, &item, size, ticks) != pdTRUE)
+    {
+        return pdFALSE;
+    }
+    memcpy(item, data, size);
+    return xRingbufferSendComplete(rb, item);
+}
+
+void *xRingbufferReceive(RingbufHandle_t rb, size_t *size, TickType_t ticks)
+{
+    host_item_t *it;
+
+    (void)ticks;
+    host_critical_enter();
+    it = rb->head;
+    if (it == NULL || !it->complete)
+    {
+        host_critical_exit();
+        return NULL;
+    }
+    rb->head = it->next;
+    if (rb->head == NULL)
+    {
+        rb->tail = NULL;
+    }
+    host_critical_exit();
+
+    *size = it->size;
+    return it->data;
+}
+
+void vRingbufferReturnItem(RingbufHandle_t rb, void *item)
+{
+    host_item_t *it = (host_item_t *)((uint8_t *)item - offsetof(host_item_t, data));
+
+    host_critical_enter();
+    rb->used -= HOST_ITEM_COST(it->size);
+    host_critical_exit();
+    free(it);
+}
+
+// esp_timer
+
+struct host_timer
+{
+    esp_timer_create_args_t args;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t gen;               // bumped by every start and stop
+};
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+    esp_timer_handle_t timer = calloc(1, sizeof(*timer));
+
+    if (timer == NULL)
+    {
+        return ESP_FAIL;
+    }
+    timer->args = *args;
+    pthread_mutex_init(&timer->lock, NULL);
+    pthread_cond_init(&timer->cond, NULL);
+    *handle = timer;
+    return ESP_OK;
+}
+
+typedef struct
+{
+    esp_timer_handle_t timer;
+    uint32_t gen;
+    uint64_t timeout_us;
+} host_timer_shot_t;
+
+static void *host_timer_run(void *p)
+{
+    host_timer_shot_t shot = *(host_timer_shot_t *)p;
+    esp_timer_handle_t timer = shot.timer;
+    struct timespec deadline;
+    bool fire;
+
+    free(p);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += shot.timeout_us / 1000000;
+    deadline.tv_nsec += (long)(shot.timeout_us % 1000000) * 1000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&timer->lock);
+    while (timer->gen == shot.gen &&
+            pthread_cond_timedwait(&timer->cond, &timer->lock, &deadline) != ETIMEDOUT)
+    {
+    }
+    fire = (timer->gen == shot.gen);
+    pthread_mutex_unlock(&timer->lock);
+
+    if (fire)
+    {
+        timer->args.callback(timer->args.arg);
+    }
+    return NULL;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    host_timer_shot_t *shot = malloc(sizeof(*shot));
+    pthread_t thread;
+
+    if (shot == NULL)
+    {
+        return ESP_FAIL;
+    }
+    pthread_mutex_lock(&timer->lock);
+    shot->timer = timer;
+    shot->gen = ++timer->gen;
+    shot->timeout_us = timeout_us;
+    pthread_cond_broadcast(&timer->cond);
+    pthread_mutex_unlock(&timer->lock);
+
+    if (pthread_create(&thread, NULL, host_timer_run, shot) != 0)
+    {
+        free(shot);
+        return ESP_FAIL;
+    }
+    pthread_detach(thread);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    (void)timer;
+    (void)period_us;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    pthread_mutex_lock(&timer->lock);
+    timer->gen++;
+    pthread_cond_broadcast(&timer->cond);
+    pthread_mutex_unlock(&timer->lock);
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
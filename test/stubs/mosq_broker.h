@@ -0,0 +1,16 @@
+#ifndef __HOST_MOSQ_BROKER_H__
+#define __HOST_MOSQ_BROKER_H__
+
+// The subset of the espressif/mosquitto port API used by mqtt_broker.c
+struct mosq_broker_config
+{
+    const char *host;
+    int port;
+    void *tls_cfg;
+    void (*handle_message_cb)(char *client, char *topic, char *data, int len, int qos, int retain);
+};
+
+int mosq_broker_run(struct mosq_broker_config *config);
+void mosq_broker_stop(void);
+
+#endif
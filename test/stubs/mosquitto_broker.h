@@ -0,0 +1,24 @@
+#ifndef __HOST_MOSQUITTO_BROKER_H__
+#define __HOST_MOSQUITTO_BROKER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct mosquitto;
+typedef struct mqtt5__property mosquitto_property;
+
+#define MOSQ_ERR_SUCCESS        0
+#define MOSQ_ERR_AUTH           11
+#define MOSQ_ERR_ACL_DENIED     12
+
+#define MOSQ_ACL_NONE           0x00
+#define MOSQ_ACL_READ           0x01
+#define MOSQ_ACL_WRITE          0x02
+#define MOSQ_ACL_SUBSCRIBE      0x04
+#define MOSQ_ACL_UNSUBSCRIBE    0x08
+
+const char *mosquitto_client_id(const struct mosquitto *client);
+int mosquitto_broker_publish_copy(const char *clientid, const char *topic, int payloadlen,
+                                    const void *payload, int qos, bool retain, mosquitto_property *properties);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef __HOST_MOSQUITTO_PLUGIN_H__
+#define __HOST_MOSQUITTO_PLUGIN_H__
+
+#include "mosquitto_broker.h"
+
+#endif
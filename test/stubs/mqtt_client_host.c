@@ -0,0 +1,350 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Minimal esp-mqtt client for host tests: MQTT 3.1.1 over plain TCP,
+// publishing only. Like esp-mqtt it reconnects after reconnect_timeout_ms
+// and reports MQTT_EVENT_CONNECTED / MQTT_EVENT_DISCONNECTED. QoS 1
+// messages are written once and not kept for a resend.
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "mqtt_client.h"
+
+#define MQTT_HOST_BUF_SIZE      (16 * 1024)
+
+struct esp_mqtt_client
+{
+    char host[128];
+    char port[8];
+    char *username;
+    char *password;
+    int keepalive;
+    int reconnect_ms;
+    esp_event_handler_t handler;
+    void *handler_arg;
+    pthread_mutex_t lock;
+    int sock;
+    uint16_t msg_id;
+    uint8_t buf[MQTT_HOST_BUF_SIZE];
+};
+
+static size_t mqtt_put_len(uint8_t *p, size_t len)
+{
+    size_t n = 0;
+
+    do
+    {
+        uint8_t b = len % 128;
+
+        len /= 128;
+        p[n++] = b | ((len != 0) ? 0x80 : 0);
+    } while (len != 0);
+    return n;
+}
+
+static size_t mqtt_put_str(uint8_t *p, const char *s, size_t len)
+{
+    p[0] = len >> 8;
+    p[1] = len & 0xff;
+    memcpy(p + 2, s, len);
+    return len + 2;
+}
+
+// Fixed header in front of a body built at buf + 5
+static size_t mqtt_frame(uint8_t *buf, uint8_t type, size_t body_len)
+{
+    uint8_t hdr[5];
+    size_t n;
+
+    hdr[0] = type;
+    n = 1 + mqtt_put_len(hdr + 1, body_len);
+    memmove(buf + n, buf + 5, body_len);
+    memcpy(buf, hdr, n);
+    return n + body_len;
+}
+
+static bool mqtt_send_all(int sock, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+
+        if (n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool mqtt_recv_all(int sock, uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = recv(sock, data, len, 0);
+
+        if (n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void mqtt_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t id)
+{
+    esp_mqtt_event_t event = {.event_id = id, .client = client};
+
+    if (client->handler != NULL)
+    {
+        client->handler(client->handler_arg, "MQTT_EVENTS", id, &event);
+    }
+}
+
+static int mqtt_connect(esp_mqtt_client_handle_t client)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    uint8_t pkt[512];
+    uint8_t *p = pkt + 5;
+    uint8_t flags = 0x02;       // clean session
+    int sock = -1;
+
+    if (getaddrinfo(client->host, client->port, &hints, &res) != 0)
+    {
+        return -1;
+    }
+    for (struct addrinfo *ai = res; ai != NULL && sock < 0; ai = ai->ai_next)
+    {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen) != 0)
+        {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (sock < 0)
+    {
+        return -1;
+    }
+
+    if (client->username != NULL)
+    {
+        flags |= 0x80;
+    }
+    if (client->password != NULL)
+    {
+        flags |= 0x40;
+    }
+    p += mqtt_put_str(p, "MQTT", 4);
+    *p++ = 4;                   // 3.1.1
+    *p++ = flags;
+    *p++ = client->keepalive >> 8;
+    *p++ = client->keepalive & 0xff;
+    p += mqtt_put_str(p, "wican_host_test", 15);
+    if (client->username != NULL)
+    {
+        p += mqtt_put_str(p, client->username, strlen(client->username));
+    }
+    if (client->password != NULL)
+    {
+        p += mqtt_put_str(p, client->password, strlen(client->password));
+    }
+
+    size_t len = mqtt_frame(pkt, 0x10, p - (pkt + 5));
+    uint8_t connack[4];
+
+    if (!mqtt_send_all(sock, pkt, len) || !mqtt_recv_all(sock, connack, sizeof(connack)) ||
+        connack[0] != 0x20 || connack[3] != 0)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Reads until the connection drops, acks are not tracked
+static void mqtt_read_loop(int sock)
+{
+    uint8_t hdr;
+
+    while (mqtt_recv_all(sock, &hdr, 1))
+    {
+        size_t len = 0;
+        size_t mult = 1;
+        uint8_t b;
+        uint8_t skip[256];
+
+        do
+        {
+            if (!mqtt_recv_all(sock, &b, 1))
+            {
+                return;
+            }
+            len += (b & 0x7f) * mult;
+            mult *= 128;
+        } while (b & 0x80);
+
+        while (len > 0)
+        {
+            size_t n = (len < sizeof(skip)) ? len : sizeof(skip);
+
+            if (!mqtt_recv_all(sock, skip, n))
+            {
+                return;
+            }
+            len -= n;
+        }
+    }
+}
+
+static void *mqtt_client_run(void *arg)
+{
+    esp_mqtt_client_handle_t client = arg;
+
+    while (1)
+    {
+        int sock = mqtt_connect(client);
+
+        if (sock >= 0)
+        {
+            pthread_mutex_lock(&client->lock);
+            client->sock = sock;
+            pthread_mutex_unlock(&client->lock);
+            mqtt_event(client, MQTT_EVENT_CONNECTED);
+
+            mqtt_read_loop(sock);
+
+            pthread_mutex_lock(&client->lock);
+            client->sock = -1;
+            pthread_mutex_unlock(&client->lock);
+            close(sock);
+            mqtt_event(client, MQTT_EVENT_DISCONNECTED);
+        }
+        usleep(client->reconnect_ms * 1000);
+    }
+    return NULL;
+}
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config)
+{
+    esp_mqtt_client_handle_t client = calloc(1, sizeof(*client));
+    const char *host = config->broker.address.uri;
+    const char *end;
+
+    if (client == NULL)
+    {
+        return NULL;
+    }
+    if (strncmp(host, "mqtt://", 7) == 0)
+    {
+        host += 7;
+    }
+    end = strchr(host, ':');
+    if (end == NULL)
+    {
+        end = host + strlen(host);
+    }
+    snprintf(client->host, sizeof(client->host), "%.*s", (int)(end - host), host);
+    snprintf(client->port, sizeof(client->port), "%u", (*end == ':') ? (unsigned)atoi(end + 1) :
+                (config->broker.address.port != 0) ? (unsigned)config->broker.address.port : 1883U);
+    client->username = (config->credentials.username != NULL) ? strdup(config->credentials.username) : NULL;
+    client->password = (config->credentials.authentication.password != NULL) ?
+                        strdup(config->credentials.authentication.password) : NULL;
+    client->keepalive = (config->session.keepalive != 0) ? config->session.keepalive : 120;
+    client->reconnect_ms = (config->network.reconnect_timeout_ms != 0) ? config->network.reconnect_timeout_ms : 10000;
+    client->sock = -1;
+    pthread_mutex_init(&client->lock, NULL);
+    return client;
+}
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event,
+                                        esp_event_handler_t handler, void *arg)
+{
+    (void)event;
+    client->handler = handler;
+    client->handler_arg = arg;
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, mqtt_client_run, client) != 0)
+    {
+        return ESP_FAIL;
+    }
+    pthread_detach(thread);
+    return ESP_OK;
+}
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+                            int len, int qos, int retain)
+{
+    size_t topic_len = strlen(topic);
+    uint8_t *p;
+    int msg_id = 0;
+    int ret = -1;
+
+    if (len == 0 && data != NULL)
+    {
+        len = strlen(data);
+    }
+
+    pthread_mutex_lock(&client->lock);
+    if (client->sock >= 0 && 5 + 2 + topic_len + 2 + (size_t)len <= sizeof(client->buf))
+    {
+        p = client->buf + 5;
+        p += mqtt_put_str(p, topic, topic_len);
+        if (qos > 0)
+        {
+            msg_id = ++client->msg_id;
+            if (msg_id == 0)
+            {
+                msg_id = client->msg_id = 1;
+            }
+            *p++ = msg_id >> 8;
+            *p++ = msg_id & 0xff;
+        }
+        memcpy(p, data, len);
+        p += len;
+
+        size_t n = mqtt_frame(client->buf, 0x30 | ((qos > 0) ? 0x02 : 0) | (retain ? 0x01 : 0), p - (client->buf + 5));
+
+        if (mqtt_send_all(client->sock, client->buf, n))
+        {
+            ret = msg_id;
+        }
+    }
+    pthread_mutex_unlock(&client->lock);
+    return ret;
+}
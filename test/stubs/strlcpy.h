@@ -0,0 +1,9 @@
+#ifndef __HOST_STRLCPY_H__
+#define __HOST_STRLCPY_H__
+
+// newlib has it, glibc only from 2.38
+#include <stddef.h>
+
+size_t strlcpy(char *dst, const char *src, size_t size);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Encodes raw CAN frame batches in the can/rx JSON layout with wc_json and
+// with the sprintf/strcat/strlen loop it replaced, and prints frames per
+// second for both. Usage: wc_json_bench [frames]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "wc_json.h"
+
+#define BATCH_SIZE_SMALL        2048    // the former JSON_BUF_SIZE
+#define BATCH_SIZE_LARGE        8192    // a batch spanning the MQTT buffer
+#define JSON_FRAME_MAX          96
+
+typedef struct
+{
+    uint32_t identifier;
+    uint8_t data_length_code;
+    bool rtr;
+    bool extd;
+    uint8_t data[8];
+} frame_t;
+
+static frame_t frames[256];
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_frames(void)
+{
+    srand(1);
+    for (int i = 0; i < 256; i++)
+    {
+        frames[i].extd = (i % 4) == 0;
+        frames[i].identifier = frames[i].extd ? (0x18DAF100 + i) : (0x100 + i * 3);
+        frames[i].data_length_code = 8;
+        frames[i].rtr = false;
+        for (int b = 0; b < 8; b++)
+        {
+            frames[i].data[b] = rand() & 0xFF;
+        }
+    }
+}
+
+// Returns the number of frames in the batch
+static uint32_t encode_sprintf(char *buf, size_t size, uint32_t first, uint32_t left)
+{
+    char tmp[150];
+    uint32_t n = 0;
+
+    sprintf(buf, "{\"bus\":\"0\",\"type\":\"rx\",\"ts\":%u,\"frame\":[", 12345u);
+    while (n < left)
+    {
+        const frame_t *f = &frames[(first + n) & 0xFF];
+
+        sprintf(tmp, "{\"id\":%u,\"dlc\":%u,\"rtr\":%s,\"extd\":%s,\"data\":[%u,%u,%u,%u,%u,%u,%u,%u]},",
+                f->identifier, f->data_length_code, f->rtr ? "true" : "false", f->extd ? "true" : "false",
+                f->data[0], f->data[1], f->data[2], f->data[3], f->data[4], f->data[5], f->data[6], f->data[7]);
+        strcat(buf, tmp);
+        n++;
+        if (strlen(buf) > (size - 100))
+        {
+            break;
+        }
+    }
+    buf[strlen(buf) - 1] = 0;
+    strcat(buf, "]}");
+    return n;
+}
+
+static uint32_t encode_wc_json(char *buf, size_t size, uint32_t first, uint32_t left)
+{
+    wc_json_t w;
+    uint32_t n = 0;
+
+    wc_json_init(&w, buf, size);
+    wc_json_raw(&w, "{\"bus\":\"0\",\"type\":\"rx\",\"ts\":", 29);
+    wc_json_uint(&w, 12345);
+    wc_json_raw(&w, ",\"frame\":[", 10);
+    while (n < left && wc_json_space(&w) >= JSON_FRAME_MAX + 2)
+    {
+        const frame_t *f = &frames[(first + n) & 0xFF];
+
+        wc_json_raw(&w, "{\"id\":", 6);
+        wc_json_uint(&w, f->identifier);
+        wc_json_raw(&w, ",\"dlc\":", 7);
+        wc_json_uint(&w, f->data_length_code);
+        wc_json_raw(&w, ",\"rtr\":", 7);
+        wc_json_bool(&w, f->rtr);
+        wc_json_raw(&w, ",\"extd\":", 8);
+        wc_json_bool(&w, f->extd);
+        wc_json_raw(&w, ",\"data\":[", 9);
+        for (int i = 0; i < 8; i++)
+        {
+            wc_json_uint(&w, f->data[i]);
+            wc_json_char(&w, (i < 7) ? ',' : ']');
+        }
+        wc_json_raw(&w, "},", 2);
+        n++;
+    }
+    wc_json_unterminate(&w, ',');
+    wc_json_raw(&w, "]}", 2);
+    return w.overflow ? 0 : n;
+}
+
+typedef uint32_t (*encode_t)(char *buf, size_t size, uint32_t first, uint32_t left);
+
+static double run(const char *name, encode_t encode, size_t size, uint32_t total, char *check)
+{
+    static char buf[BATCH_SIZE_LARGE];
+    uint32_t done = 0;
+    uint32_t batches = 0;
+    double start = now_s();
+
+    while (done < total)
+    {
+        uint32_t n = encode(buf, size, done, total - done);
+
+        if (n == 0)
+        {
+            fprintf(stderr, "%s: batch overflow\n", name);
+            exit(1);
+        }
+        if (batches == 0 && check != NULL)
+        {
+            strcpy(check, buf);
+        }
+        done += n;
+        batches++;
+    }
+
+    double rate = total / (now_s() - start);
+    printf("%-26s %5zu B batches: %10.0f frames/s, %u batches\n", name, size, rate, batches);
+    return rate;
+}
+
+int main(int argc, char **argv)
+{
+    static char old_json[BATCH_SIZE_SMALL];
+    static char new_json[BATCH_SIZE_SMALL];
+    uint32_t total = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : 1000000;
+
+    make_frames();
+
+    run("sprintf/strcat/strlen", encode_sprintf, BATCH_SIZE_SMALL, total, old_json);
+    run("wc_json", encode_wc_json, BATCH_SIZE_SMALL, total, new_json);
+    run("sprintf/strcat/strlen", encode_sprintf, BATCH_SIZE_LARGE, total, NULL);
+    run("wc_json", encode_wc_json, BATCH_SIZE_LARGE, total, NULL);
+
+    // Both encoders have to produce the same JSON for the same frames. The
+    // old loop stops later, so only compare the frames both batches hold.
+    size_t common = strlen(new_json) - 2;
+    if (strncmp(old_json, new_json, common) != 0)
+    {
+        fprintf(stderr, "encodings differ:\n%s\n%s\n", old_json, new_json);
+        return 1;
+    }
+    return 0;
+}